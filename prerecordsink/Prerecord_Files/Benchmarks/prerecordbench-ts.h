@@ -0,0 +1,187 @@
+/* GStreamer
+ *
+ * prerecordbench-ts.h: synthetic MPEG-TS stream and timing helpers for the
+ * prerecordsink benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __PRERECORD_BENCH_TS_H__
+#define __PRERECORD_BENCH_TS_H__
+
+#include <string.h>
+#include <time.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define BENCH_TS_PACKET_SIZE 188
+#define BENCH_TS_VIDEO_PID 0x100
+
+/* Generates what mpegtsmux pushes for an H.264 stream: one buffer per TS
+ * packet, a PES with an SPS/IDR (or non-IDR slice) NAL unit at the start of
+ * every frame, random access and no DELTA_UNIT flag on the first packet of
+ * each GOP. */
+typedef struct _BenchTsGen {
+  guint bitrate;
+  guint fps;
+  guint gop_size;
+  guint packets_per_list;
+
+  guint packets_per_frame;
+  guint packet_in_frame;
+  guint64 frame;
+  guint8 cc;
+} BenchTsGen;
+
+static inline void
+bench_ts_gen_init(BenchTsGen *gen, guint bitrate, guint fps, guint gop_size,
+          guint packets_per_list)
+{
+  memset(gen, 0, sizeof(BenchTsGen));
+  gen->bitrate = bitrate;
+  gen->fps = MAX(fps, 1);
+  gen->gop_size = MAX(gop_size, 1);
+  gen->packets_per_list = MAX(packets_per_list, 1);
+  gen->packets_per_frame =
+    MAX(bitrate / 8 / gen->fps / BENCH_TS_PACKET_SIZE, 1);
+}
+
+static inline GstClockTime
+bench_ts_gen_time(BenchTsGen *gen)
+{
+  return gst_util_uint64_scale(gen->frame, GST_SECOND, gen->fps);
+}
+
+static inline void
+bench_ts_write_packet(BenchTsGen *gen, guint8 *packet, gboolean pes_start,
+            gboolean keyframe, GstClockTime pts)
+{
+  guint8 *payload;
+
+  memset(packet, 0xff, BENCH_TS_PACKET_SIZE);
+  packet[0] = 0x47;
+  packet[1] = (pes_start ? 0x40 : 0x00) | ((BENCH_TS_VIDEO_PID >> 8) & 0x1f);
+  packet[2] = BENCH_TS_VIDEO_PID & 0xff;
+
+  if (pes_start && keyframe)
+  {
+    /* adaptation field with only the random_access_indicator set */
+    packet[3] = 0x30 | (gen->cc & 0xf);
+    packet[4] = 1;
+    packet[5] = 0x40;
+    payload = packet + 6;
+  }
+  else
+  {
+    packet[3] = 0x10 | (gen->cc & 0xf);
+    payload = packet + 4;
+  }
+  gen->cc = (gen->cc + 1) & 0xf;
+
+  if (pes_start)
+  {
+    guint64 pts90 = gst_util_uint64_scale(pts, 90000, GST_SECOND);
+
+    payload[0] = 0x00;
+    payload[1] = 0x00;
+    payload[2] = 0x01;
+    payload[3] = 0xe0;
+    payload[4] = payload[5] = 0x00;
+    payload[6] = 0x80;
+    payload[7] = 0x80;
+    payload[8] = 5;
+    payload[9] = 0x21 | ((pts90 >> 29) & 0x0e);
+    payload[10] = (pts90 >> 22) & 0xff;
+    payload[11] = ((pts90 >> 14) & 0xfe) | 0x01;
+    payload[12] = (pts90 >> 7) & 0xff;
+    payload[13] = ((pts90 << 1) & 0xfe) | 0x01;
+    payload[14] = payload[15] = payload[16] = 0x00;
+    payload[17] = 0x01;
+    payload[18] = keyframe ? 0x67 : 0x41;
+  }
+}
+
+/* Returns the next list of packets_per_list packets */
+static inline GstBufferList *
+bench_ts_gen_next_list(BenchTsGen *gen)
+{
+  GstBufferList *list = gst_buffer_list_new_sized(gen->packets_per_list);
+  guint i;
+
+  for (i = 0; i < gen->packets_per_list; i++)
+  {
+    gboolean pes_start = gen->packet_in_frame == 0;
+    gboolean keyframe = (gen->frame % gen->gop_size) == 0;
+    GstClockTime pts = bench_ts_gen_time(gen);
+    GstBuffer *buffer;
+    GstMapInfo map;
+
+    buffer = gst_buffer_new_allocate(NULL, BENCH_TS_PACKET_SIZE, NULL);
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    bench_ts_write_packet(gen, map.data, pes_start, keyframe, pts);
+    gst_buffer_unmap(buffer, &map);
+
+    GST_BUFFER_PTS(buffer) = pts;
+    GST_BUFFER_DTS(buffer) = pts;
+    if (!(pes_start && keyframe))
+      GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    gst_buffer_list_add(list, buffer);
+
+    if (++gen->packet_in_frame == gen->packets_per_frame)
+    {
+      gen->packet_in_frame = 0;
+      gen->frame++;
+    }
+  }
+
+  return list;
+}
+
+static inline guint64
+bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (guint64)ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static inline gint
+bench_compare_latency(gconstpointer a, gconstpointer b)
+{
+  guint64 la = *(const guint64 *)a, lb = *(const guint64 *)b;
+
+  return la < lb ? -1 : la > lb;
+}
+
+/* Value at @percent of the sorted guint64 @latencies, 0 if empty */
+static inline guint64
+bench_percentile(GArray *latencies, gdouble percent)
+{
+  guint i;
+
+  if (latencies->len == 0)
+    return 0;
+
+  i = MIN((guint)(latencies->len * percent / 100.0), latencies->len - 1);
+  return g_array_index(latencies, guint64, i);
+}
+
+G_END_DECLS
+
+#endif /* __PRERECORD_BENCH_TS_H__ */
@@ -0,0 +1,315 @@
+/* GStreamer
+ *
+ * prerecordfifo-bench.c: micro-benchmark of the FIFO of a prerecordsink
+ * against the linked list it replaced
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Both containers hold a window of -n nodes the way the sink does while
+ * pre-recording, one node per pushed list at 30 lists per second. The
+ * linked list is the one the sink used before gstprerecordfifo.h, a malloc
+ * per push and walks for the length, the nth node and a running time. All
+ * nodes share one buffer list so only the container is measured, it is
+ * reffed on push and unreffed on pop by both. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gst/gst.h>
+
+#include "prerecordbench-ts.h"
+#include "../Code_Files/gstprerecordfifo.h"
+
+static gint window = 30000;
+static gint iterations = 1000000;
+static gint queries = 10000;
+
+static GOptionEntry entries[] = {
+  {"nodes", 'n', 0, G_OPTION_ARG_INT, &window,
+   "Nodes held in the window", "N"},
+  {"iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+   "Push and pop pairs timed", "N"},
+  {"queries", 'q', 0, G_OPTION_ARG_INT, &queries,
+   "Length, nth node and running time queries timed", "N"},
+  {NULL}
+};
+
+#define BENCH_LIST_INTERVAL (GST_SECOND / 30)
+
+/* The linked list as it was */
+typedef struct _ListNode {
+  GstBufferList *buffer_list;
+  GstClockTime pts;
+  GstClockTime dts;
+  GstClockTime duration;
+  GstClockTime running_time;
+  gsize size;
+  gboolean keyframe;
+  struct _ListNode *next;
+} ListNode;
+
+typedef struct _ListFIFO {
+  ListNode *front;
+  ListNode *rear;
+  guint n_keyframes;
+  guint64 bytes;
+} ListFIFO;
+
+static ListNode *
+list_push(ListFIFO *fifo, GstBufferList *buffer_list)
+{
+  ListNode *node = malloc(sizeof(ListNode));
+
+  if (node == NULL)
+    abort();
+
+  node->buffer_list = buffer_list;
+  node->pts = node->dts = node->duration = node->running_time =
+      GST_CLOCK_TIME_NONE;
+  node->size = 0;
+  node->keyframe = FALSE;
+  node->next = NULL;
+
+  if (fifo->front == NULL)
+    fifo->front = fifo->rear = node;
+  else
+  {
+    fifo->rear->next = node;
+    fifo->rear = node;
+  }
+
+  return node;
+}
+
+static GstBufferList *
+list_pop(ListFIFO *fifo)
+{
+  ListNode *node = fifo->front;
+  GstBufferList *buffer_list;
+
+  if (node == NULL)
+    return NULL;
+
+  buffer_list = node->buffer_list;
+  fifo->front = node->next;
+  if (fifo->front == NULL)
+    fifo->rear = NULL;
+  free(node);
+
+  return buffer_list;
+}
+
+static guint
+list_length(ListFIFO *fifo)
+{
+  ListNode *node;
+  guint length = 0;
+
+  for (node = fifo->front; node != NULL; node = node->next)
+    length++;
+
+  return length;
+}
+
+static ListNode *
+list_nth(ListFIFO *fifo, guint n)
+{
+  ListNode *node = fifo->front;
+
+  while (node != NULL && n-- > 0)
+    node = node->next;
+
+  return node;
+}
+
+static gint
+list_search(ListFIFO *fifo, GstClockTime running_time)
+{
+  ListNode *node;
+  gint i = 0, found = -1;
+
+  for (node = fifo->front; node != NULL && node->running_time <= running_time;
+       node = node->next)
+    found = i++;
+
+  return found;
+}
+
+static void
+bench_fill(BufferListNode *node, GstBufferList *buffer_list, guint64 i)
+{
+  node->buffer_list = gst_buffer_list_ref(buffer_list);
+  node->pts = node->dts = node->running_time = i * BENCH_LIST_INTERVAL;
+  node->duration = BENCH_LIST_INTERVAL;
+  node->size = 7 * 188;
+  node->keyframe = i % 30 == 0;
+}
+
+static void
+bench_list_push(ListFIFO *fifo, GstBufferList *buffer_list, guint64 i)
+{
+  ListNode *node = list_push(fifo, gst_buffer_list_ref(buffer_list));
+
+  node->pts = node->dts = node->running_time = i * BENCH_LIST_INTERVAL;
+  node->duration = BENCH_LIST_INTERVAL;
+  node->size = 7 * 188;
+  node->keyframe = i % 30 == 0;
+  fifo->bytes += node->size;
+  if (node->keyframe)
+    fifo->n_keyframes++;
+}
+
+static void
+bench_list_pop(ListFIFO *fifo)
+{
+  ListNode *front = fifo->front;
+
+  fifo->bytes -= front->size;
+  if (front->keyframe)
+    fifo->n_keyframes--;
+  gst_buffer_list_unref(list_pop(fifo));
+}
+
+static void
+bench_print(const gchar *what, guint64 list_ns, guint64 fifo_ns, guint n)
+{
+  gdouble list_op = (gdouble)list_ns / n, fifo_op = (gdouble)fifo_ns / n;
+
+  g_print("  %-20s list %10.1f ns/op   fifo %8.1f ns/op   %7.1fx\n", what,
+          list_op, fifo_op, fifo_op > 0 ? list_op / fifo_op : 0.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  GstBufferList *buffer_list;
+  ListFIFO list = {NULL, NULL, 0, 0};
+  BufferListFIFO *fifo;
+  BufferListNode node;
+  guint64 start, list_ns, fifo_ns, i, next = 0;
+  volatile guint64 sink = 0;
+
+  ctx = g_option_context_new("- prerecordsink FIFO micro-benchmark");
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  g_option_context_add_group(ctx, gst_init_get_option_group());
+  if (!g_option_context_parse(ctx, &argc, &argv, &err))
+  {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+  g_option_context_free(ctx);
+
+  if (window < 1 || iterations < 1 || queries < 1)
+  {
+    g_printerr("the node, iteration and query counts have to be positive\n");
+    return 1;
+  }
+
+  buffer_list = gst_buffer_list_new();
+  fifo = prerecord_fifo_new(PRERECORD_FIFO_DEFAULT_NODES);
+
+  g_print("window of %d nodes, %d push/pop pairs, %d queries\n", window,
+          iterations, queries);
+
+  /* filling the window, the FIFO grows its slab on the way */
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)window; i++)
+    bench_list_push(&list, buffer_list, i);
+  list_ns = bench_now_ns() - start;
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)window; i++)
+  {
+    bench_fill(&node, buffer_list, i);
+    prerecord_fifo_push(fifo, &node);
+  }
+  fifo_ns = bench_now_ns() - start;
+  next = window;
+  bench_print("fill", list_ns, fifo_ns, window);
+
+  /* a pre-record window that has settled, every push evicts the oldest */
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)iterations; i++)
+  {
+    bench_list_push(&list, buffer_list, next + i);
+    bench_list_pop(&list);
+  }
+  list_ns = bench_now_ns() - start;
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)iterations; i++)
+  {
+    bench_fill(&node, buffer_list, next + i);
+    prerecord_fifo_push(fifo, &node);
+    gst_buffer_list_unref(prerecord_fifo_pop(fifo));
+  }
+  fifo_ns = bench_now_ns() - start;
+  next += iterations;
+  bench_print("push+pop", list_ns, fifo_ns, iterations);
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)queries; i++)
+    sink += list_length(&list);
+  list_ns = bench_now_ns() - start;
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)queries; i++)
+    sink += prerecord_fifo_length(fifo);
+  fifo_ns = bench_now_ns() - start;
+  bench_print("length", list_ns, fifo_ns, queries);
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)queries; i++)
+    sink += list_nth(&list, g_random_int_range(0, window))->size;
+  list_ns = bench_now_ns() - start;
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)queries; i++)
+    sink += prerecord_fifo_peek_nth(fifo, g_random_int_range(0, window))->size;
+  fifo_ns = bench_now_ns() - start;
+  bench_print("nth node", list_ns, fifo_ns, queries);
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)queries; i++)
+    sink += list_search(&list, (next - g_random_int_range(1, window + 1)) *
+                                   BENCH_LIST_INTERVAL);
+  list_ns = bench_now_ns() - start;
+
+  start = bench_now_ns();
+  for (i = 0; i < (guint64)queries; i++)
+    sink += prerecord_fifo_search(fifo, (next - g_random_int_range(1, window + 1)) *
+                                            BENCH_LIST_INTERVAL);
+  fifo_ns = bench_now_ns() - start;
+  bench_print("running time lookup", list_ns, fifo_ns, queries);
+
+  if (prerecord_fifo_length(fifo) != list_length(&list) ||
+      fifo->bytes != list.bytes || fifo->n_keyframes != list.n_keyframes ||
+      prerecord_fifo_search(fifo, (next - 1) * BENCH_LIST_INTERVAL) !=
+          list_search(&list, (next - 1) * BENCH_LIST_INTERVAL))
+  {
+    g_printerr("the FIFO and the list disagree\n");
+    return 1;
+  }
+
+  while (list.front != NULL)
+    bench_list_pop(&list);
+  prerecord_fifo_free(fifo);
+  gst_buffer_list_unref(buffer_list);
+
+  return 0;
+}
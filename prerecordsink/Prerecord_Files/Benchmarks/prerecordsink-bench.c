@@ -0,0 +1,316 @@
+/* GStreamer
+ *
+ * prerecordsink-bench.c: throughput and latency of a single prerecordsink
+ * for every buffer-mode
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* The sink is driven through a GstHarness so that every push returns once
+ * the sink is done with the list and can be timed on its own. Every mode
+ * pre-records two thirds of the stream, is triggered with start-recording,
+ * records for two seconds and post-records until the sink ends the stream.
+ * Peak RSS and the syscall counts come from /proc, the peak is reset
+ * before every run. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/check/gstharness.h>
+
+#include "prerecordbench-ts.h"
+
+static gint media_seconds = 60;
+static gint pre_record = 10;
+static gint post_record = 5;
+static gint bitrate = 16 * 1000 * 1000;
+static gint gop_size = 30;
+static gint packets_per_list = 7;
+static gchar *modes = NULL;
+static gchar *output_dir = NULL;
+static gchar *io_engine = NULL;
+static gchar *ring_storage = NULL;
+static gboolean async_write = FALSE;
+
+static GOptionEntry entries[] = {
+  {"seconds", 's', 0, G_OPTION_ARG_INT, &media_seconds,
+   "Seconds of media pushed in every run", "S"},
+  {"pre-record", 'p', 0, G_OPTION_ARG_INT, &pre_record,
+   "pre-record window in seconds", "S"},
+  {"post-record", 'P', 0, G_OPTION_ARG_INT, &post_record,
+   "post-record window in seconds", "S"},
+  {"bitrate", 'b', 0, G_OPTION_ARG_INT, &bitrate,
+   "Bitrate of the synthetic stream in bits per second", "BPS"},
+  {"gop", 'g', 0, G_OPTION_ARG_INT, &gop_size,
+   "GOP size in frames at 30 fps", "FRAMES"},
+  {"packets", 'k', 0, G_OPTION_ARG_INT, &packets_per_list,
+   "TS packets per pushed buffer list", "K"},
+  {"modes", 'm', 0, G_OPTION_ARG_STRING, &modes,
+   "Comma separated buffer-modes to run", "MODES"},
+  {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+   "Directory the clips are written to", "DIR"},
+  {"io-engine", 'e', 0, G_OPTION_ARG_STRING, &io_engine,
+   "io-engine of the sink (writev, io-uring)", "ENGINE"},
+  {"ring-storage", 'r', 0, G_OPTION_ARG_STRING, &ring_storage,
+   "ring-storage of the sink (refs, arena, mmap, memfd, journal)", "STORAGE"},
+  {"async-write", 'a', 0, G_OPTION_ARG_NONE, &async_write,
+   "Enable async-write on the sink", NULL},
+  {NULL}
+};
+
+typedef struct _BenchResult {
+  guint64 bytes;
+  guint64 prerecord_buffers;
+  guint64 prerecord_ns;
+  guint64 drain_ns;
+  guint64 peak_rss;
+  guint64 syscalls;
+  GArray *latencies;
+  gboolean failed;
+} BenchResult;
+
+/* Value of @key in a "key: value" file under /proc/self, 0 if unknown */
+static guint64
+bench_proc_value(const gchar *file, const gchar *key)
+{
+  gchar *contents = NULL;
+  guint64 value = 0;
+  gchar *line;
+
+  if (!g_file_get_contents(file, &contents, NULL, NULL))
+    return 0;
+
+  line = strstr(contents, key);
+  if (line != NULL)
+    value = g_ascii_strtoull(line + strlen(key), NULL, 10);
+  g_free(contents);
+
+  return value;
+}
+
+/* Read and write syscalls of the process so far */
+static guint64
+bench_syscalls(void)
+{
+  return bench_proc_value("/proc/self/io", "syscr:") +
+         bench_proc_value("/proc/self/io", "syscw:");
+}
+
+/* Starts a new peak RSS measurement, needs Linux 4.0 */
+static void
+bench_reset_peak_rss(void)
+{
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+
+  if (f == NULL)
+    return;
+  fputs("5", f);
+  fclose(f);
+}
+
+static guint64
+bench_ring_bytes(GstElement *sink)
+{
+  GstStructure *stats = NULL;
+  guint64 bytes = 0;
+
+  g_object_get(sink, "stats", &stats, NULL);
+  if (stats)
+  {
+    gst_structure_get_uint64(stats, "ring-bytes", &bytes);
+    gst_structure_free(stats);
+  }
+
+  return bytes;
+}
+
+static void
+bench_run(const gchar *mode, BenchResult *result)
+{
+  GstElement *sink;
+  GstHarness *h;
+  BenchTsGen gen;
+  GstClockTime end = (GstClockTime)media_seconds * GST_SECOND;
+  GstClockTime trigger = end / 3 * 2;
+  GstClockTime post = trigger + 2 * GST_SECOND;
+  gchar *location;
+  gint buffering = -1;
+  gboolean draining = FALSE;
+  guint64 syscalls;
+
+  memset(result, 0, sizeof(BenchResult));
+  result->latencies = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+  location = g_strdup_printf("%s/prerecordsink-bench-%s.ts", output_dir, mode);
+
+  bench_reset_peak_rss();
+  syscalls = bench_syscalls();
+
+  /* the location has to be set before the harness starts the sink */
+  sink = gst_element_factory_make("prerecordsink", NULL);
+  if (sink == NULL)
+  {
+    g_printerr("prerecordsink not found, check GST_PLUGIN_PATH\n");
+    exit(1);
+  }
+  g_object_set(sink, "location", location, "pre-record", pre_record,
+               "post-record", post_record, "async-write", async_write, NULL);
+  gst_util_set_object_arg(G_OBJECT(sink), "buffer-mode", mode);
+  gst_util_set_object_arg(G_OBJECT(sink), "io-engine", io_engine);
+  gst_util_set_object_arg(G_OBJECT(sink), "ring-storage", ring_storage);
+
+  h = gst_harness_new_with_element(sink, "sink", NULL);
+  gst_object_unref(sink);
+  gst_harness_set_src_caps_str(h, "video/mpegts, systemstream=(boolean)true, "
+                                  "packetsize=(int)188");
+
+  bench_ts_gen_init(&gen, bitrate, 30, gop_size, packets_per_list);
+
+  while (bench_ts_gen_time(&gen) < end)
+  {
+    GstBufferList *list;
+    GstFlowReturn flow;
+    guint64 start, latency;
+    guint n;
+
+    if (buffering == -1 && bench_ts_gen_time(&gen) >= trigger)
+    {
+      gboolean accepted;
+
+      buffering = 0;
+      draining = TRUE;
+      g_signal_emit_by_name(h->element, "start-recording", GST_CLOCK_TIME_NONE,
+                            &accepted);
+    }
+    else if (buffering == 0 && bench_ts_gen_time(&gen) >= post)
+    {
+      gboolean accepted;
+
+      buffering = 1;
+      g_signal_emit_by_name(h->element, "stop-recording", GST_CLOCK_TIME_NONE,
+                            &accepted);
+    }
+
+    list = bench_ts_gen_next_list(&gen);
+    n = gst_buffer_list_length(list);
+    result->bytes += gst_buffer_list_calculate_size(list);
+
+    start = bench_now_ns();
+    flow = gst_pad_push_list(h->srcpad, list);
+    latency = bench_now_ns() - start;
+
+    g_array_append_val(result->latencies, latency);
+    if (buffering == -1)
+    {
+      result->prerecord_buffers += n;
+      result->prerecord_ns += latency;
+    }
+    /* the ring is written out by whichever push flushes first after the
+     * trigger */
+    if (draining)
+    {
+      result->drain_ns = MAX(result->drain_ns, latency);
+      draining = bench_ring_bytes(h->element) > 0;
+    }
+
+    if (flow == GST_FLOW_EOS)
+      break;
+    if (flow != GST_FLOW_OK)
+    {
+      g_printerr("%s: push failed: %s\n", mode, gst_flow_get_name(flow));
+      result->failed = TRUE;
+      break;
+    }
+  }
+
+  gst_harness_teardown(h);
+
+  result->syscalls = bench_syscalls() - syscalls;
+  result->peak_rss = bench_proc_value("/proc/self/status", "VmHWM:") * 1024;
+  g_array_sort(result->latencies, bench_compare_latency);
+
+  g_unlink(location);
+  g_free(location);
+}
+
+int
+main(int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gchar **mode_list;
+  gboolean ok = TRUE;
+  guint i;
+
+  ctx = g_option_context_new("- prerecordsink benchmark");
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  g_option_context_add_group(ctx, gst_init_get_option_group());
+  if (!g_option_context_parse(ctx, &argc, &argv, &err))
+  {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+  g_option_context_free(ctx);
+
+  if (output_dir == NULL)
+    output_dir = g_strdup(g_get_tmp_dir());
+  if (io_engine == NULL)
+    io_engine = g_strdup("writev");
+  if (ring_storage == NULL)
+    ring_storage = g_strdup("refs");
+  if (modes == NULL)
+    modes = g_strdup("default,full,unbuffered");
+
+  g_print("%d s of %d bit/s TS, GOP %d, %d packets per list, pre-record %d s, "
+          "%s, %s ring%s\n",
+          media_seconds, bitrate, gop_size, packets_per_list, pre_record,
+          io_engine, ring_storage, async_write ? ", writer thread" : "");
+
+  mode_list = g_strsplit(modes, ",", -1);
+  for (i = 0; mode_list[i] != NULL; i++)
+  {
+    BenchResult result;
+    gdouble mb;
+
+    bench_run(mode_list[i], &result);
+    mb = result.bytes / 1e6;
+
+    g_print("  %-10s %6.0f ns/buffer pre-recording, drain %7.2f ms, "
+            "peak RSS %6.1f MB, %6.1f syscalls/MB, "
+            "render p50 %6.1f us p99 %7.1f us p99.9 %8.1f us%s\n",
+            mode_list[i],
+            result.prerecord_buffers ? (gdouble)result.prerecord_ns / result.prerecord_buffers : 0.0,
+            result.drain_ns / 1e6, result.peak_rss / 1e6, result.syscalls / mb,
+            bench_percentile(result.latencies, 50) / 1e3,
+            bench_percentile(result.latencies, 99) / 1e3,
+            bench_percentile(result.latencies, 99.9) / 1e3,
+            result.failed ? ", FAILED" : "");
+
+    if (result.failed)
+      ok = FALSE;
+    g_array_free(result.latencies, TRUE);
+  }
+  g_strfreev(mode_list);
+
+  g_free(modes);
+  g_free(output_dir);
+  g_free(io_engine);
+  g_free(ring_storage);
+
+  return ok ? 0 : 1;
+}
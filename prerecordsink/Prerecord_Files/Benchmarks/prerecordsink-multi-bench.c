@@ -0,0 +1,324 @@
+/* GStreamer
+ *
+ * prerecordsink-multi-bench.c: run several prerecordsink instances in one
+ * process and report how the throughput scales
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Every instance runs "appsrc ! prerecordsink" from its own thread, like the
+ * separate gstd pipelines on the device. Each one pre-records, is triggered
+ * two thirds into the stream, records for two seconds and then post-records
+ * until the sink returns EOS.
+ * The run is done once with a single instance and once with all of them so
+ * the aggregate throughput can be compared, and every clip is checked to
+ * start on a keyframe. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+
+#include "prerecordbench-ts.h"
+
+static gint n_instances = 4;
+static gint media_seconds = 60;
+static gint pre_record = 10;
+static gint post_record = 5;
+static gint bitrate = 16 * 1000 * 1000;
+static gint packets_per_list = 7;
+static gchar *output_dir = NULL;
+static gchar *io_engine = NULL;
+static gboolean async_write = FALSE;
+
+static GOptionEntry entries[] = {
+  {"instances", 'n', 0, G_OPTION_ARG_INT, &n_instances,
+   "Number of concurrent prerecordsink instances", "N"},
+  {"seconds", 's', 0, G_OPTION_ARG_INT, &media_seconds,
+   "Seconds of media pushed into every instance", "S"},
+  {"pre-record", 'p', 0, G_OPTION_ARG_INT, &pre_record,
+   "pre-record window in seconds", "S"},
+  {"post-record", 'P', 0, G_OPTION_ARG_INT, &post_record,
+   "post-record window in seconds", "S"},
+  {"bitrate", 'b', 0, G_OPTION_ARG_INT, &bitrate,
+   "Bitrate of the synthetic stream in bits per second", "BPS"},
+  {"packets", 'k', 0, G_OPTION_ARG_INT, &packets_per_list,
+   "TS packets per pushed buffer list", "K"},
+  {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+   "Directory the clips are written to", "DIR"},
+  {"io-engine", 'e', 0, G_OPTION_ARG_STRING, &io_engine,
+   "io-engine of the sinks (writev, io-uring)", "ENGINE"},
+  {"async-write", 'a', 0, G_OPTION_ARG_NONE, &async_write,
+   "Enable async-write on the sinks", NULL},
+  {NULL}
+};
+
+typedef struct _BenchInstance {
+  guint index;
+  gchar *location;
+  GstElement *pipeline;
+  GstElement *src;
+  GstElement *sink;
+  GThread *thread;
+
+  guint64 bytes_pushed;
+  gint64 elapsed_us;
+  gboolean failed;
+} BenchInstance;
+
+static gboolean
+bench_instance_wait(BenchInstance *inst)
+{
+  GstBus *bus = gst_element_get_bus(inst->pipeline);
+  GstMessage *msg;
+  gboolean ret = FALSE;
+
+  msg = gst_bus_timed_pop_filtered(bus, 60 * GST_SECOND,
+                                   GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (msg == NULL)
+  {
+    g_printerr("instance %u: timed out waiting for EOS\n", inst->index);
+  }
+  else if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR)
+  {
+    GError *err = NULL;
+
+    gst_message_parse_error(msg, &err, NULL);
+    g_printerr("instance %u: %s\n", inst->index, err->message);
+    g_clear_error(&err);
+  }
+  else
+  {
+    ret = TRUE;
+  }
+
+  if (msg)
+    gst_message_unref(msg);
+  gst_object_unref(bus);
+
+  return ret;
+}
+
+static gpointer
+bench_instance_run(gpointer data)
+{
+  BenchInstance *inst = data;
+  BenchTsGen gen;
+  GstClockTime end = (GstClockTime)media_seconds * GST_SECOND;
+  GstClockTime trigger = end / 3 * 2;
+  GstClockTime post = trigger + 2 * GST_SECOND;
+  gint buffering = -1;
+  gint64 start;
+
+  bench_ts_gen_init(&gen, bitrate, 30, 30, packets_per_list);
+
+  start = g_get_monotonic_time();
+
+  while (bench_ts_gen_time(&gen) < end)
+  {
+    GstBufferList *list;
+    GstFlowReturn flow;
+
+    /* the application triggers recording, then arms the post-record
+     * window a little later, as the device does on a short event */
+    if (buffering == -1 && bench_ts_gen_time(&gen) >= trigger)
+    {
+      buffering = 0;
+      g_object_set(inst->sink, "buffering", buffering, NULL);
+    }
+    else if (buffering == 0 && bench_ts_gen_time(&gen) >= post)
+    {
+      buffering = 1;
+      g_object_set(inst->sink, "buffering", buffering, NULL);
+    }
+
+    list = bench_ts_gen_next_list(&gen);
+    inst->bytes_pushed += gst_buffer_list_calculate_size(list);
+
+    flow = gst_app_src_push_buffer_list(GST_APP_SRC(inst->src), list);
+    if (flow != GST_FLOW_OK)
+      break;
+  }
+
+  gst_app_src_end_of_stream(GST_APP_SRC(inst->src));
+  inst->failed = !bench_instance_wait(inst);
+  inst->elapsed_us = g_get_monotonic_time() - start;
+
+  return NULL;
+}
+
+/* The sink writes the first lists it gets straight to the prerecord, before
+ * it starts pre-recording. The stream starts on a keyframe, so only what
+ * follows them tells whether the pre-record window starts on one. */
+#define BENCH_FIRST_LISTS 2
+
+static gboolean
+bench_clip_starts_on_keyframe(const gchar *location)
+{
+  guint8 packet[BENCH_TS_PACKET_SIZE];
+  guint64 skip = (guint64)BENCH_FIRST_LISTS * MAX(packets_per_list, 1);
+  gboolean ret = FALSE;
+  FILE *f;
+
+  f = fopen(location, "rb");
+  if (f == NULL)
+    return FALSE;
+
+  /* first video packet of the pre-record window has to start a PES with
+   * the random access indicator */
+  while (fread(packet, 1, sizeof(packet), f) == sizeof(packet))
+  {
+    if (packet[0] != 0x47)
+      break;
+    if (skip > 0)
+    {
+      skip--;
+      continue;
+    }
+    if ((((packet[1] & 0x1f) << 8) | packet[2]) != BENCH_TS_VIDEO_PID)
+      continue;
+    ret = (packet[1] & 0x40) && (packet[3] & 0x20) && packet[4] > 0 &&
+          (packet[5] & 0x40);
+    break;
+  }
+
+  fclose(f);
+  return ret;
+}
+
+static gboolean
+bench_run(guint n, gdouble *throughput)
+{
+  BenchInstance *instances = g_new0(BenchInstance, n);
+  guint64 total_bytes = 0;
+  gint64 start, elapsed;
+  struct rusage usage_start, usage_end;
+  gdouble cpu;
+  gboolean ret = TRUE;
+  guint i;
+
+  for (i = 0; i < n; i++)
+  {
+    BenchInstance *inst = &instances[i];
+    gchar *desc;
+    GError *err = NULL;
+
+    inst->index = i;
+    inst->location = g_strdup_printf("%s/prerecord-bench-%u.ts", output_dir, i);
+    desc = g_strdup_printf("appsrc name=src format=time block=true "
+                           "max-bytes=4194304 ! prerecordsink name=sink "
+                           "buffering=-1 pre_record=%d post_record=%d "
+                           "io-engine=%s async-write=%s location=\"%s\"",
+                           pre_record, post_record, io_engine,
+                           async_write ? "true" : "false", inst->location);
+    inst->pipeline = gst_parse_launch(desc, &err);
+    g_free(desc);
+    if (inst->pipeline == NULL)
+    {
+      g_printerr("could not create pipeline: %s\n", err->message);
+      g_clear_error(&err);
+      exit(1);
+    }
+    inst->src = gst_bin_get_by_name(GST_BIN(inst->pipeline), "src");
+    inst->sink = gst_bin_get_by_name(GST_BIN(inst->pipeline), "sink");
+    gst_element_set_state(inst->pipeline, GST_STATE_PLAYING);
+  }
+
+  getrusage(RUSAGE_SELF, &usage_start);
+  start = g_get_monotonic_time();
+  for (i = 0; i < n; i++)
+    instances[i].thread = g_thread_new("bench", bench_instance_run,
+                                       &instances[i]);
+  for (i = 0; i < n; i++)
+    g_thread_join(instances[i].thread);
+  elapsed = g_get_monotonic_time() - start;
+  getrusage(RUSAGE_SELF, &usage_end);
+
+  cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+        (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+        ((usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) +
+         (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec)) / 1e6;
+
+  for (i = 0; i < n; i++)
+  {
+    BenchInstance *inst = &instances[i];
+    gboolean keyframe;
+
+    gst_element_set_state(inst->pipeline, GST_STATE_NULL);
+
+    keyframe = bench_clip_starts_on_keyframe(inst->location);
+    g_print("  instance %u: %.1f MB in %.3f s, clip %s%s\n", i,
+            inst->bytes_pushed / 1e6, inst->elapsed_us / 1e6,
+            keyframe ? "starts on a keyframe" : "DOES NOT start on a keyframe",
+            inst->failed ? ", FAILED" : "");
+    if (inst->failed || !keyframe)
+      ret = FALSE;
+
+    total_bytes += inst->bytes_pushed;
+    gst_object_unref(inst->src);
+    gst_object_unref(inst->sink);
+    gst_object_unref(inst->pipeline);
+    g_free(inst->location);
+  }
+  g_free(instances);
+
+  *throughput = total_bytes / (elapsed / 1e6) / 1e6;
+  g_print("  %u instance(s): %.1f MB/s aggregate, %.2f ms CPU per MB\n", n,
+          *throughput, cpu * 1e3 / (total_bytes / 1e6));
+
+  return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gdouble single, multi;
+  gboolean ok;
+
+  ctx = g_option_context_new("- prerecordsink multi-instance benchmark");
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  g_option_context_add_group(ctx, gst_init_get_option_group());
+  if (!g_option_context_parse(ctx, &argc, &argv, &err))
+  {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+  g_option_context_free(ctx);
+
+  if (output_dir == NULL)
+    output_dir = g_strdup(g_get_tmp_dir());
+  if (io_engine == NULL)
+    io_engine = g_strdup("writev");
+  n_instances = MAX(n_instances, 1);
+
+  g_print("%d s of %d bit/s TS, pre-record %d s, post-record %d s, %s%s\n",
+          media_seconds, bitrate, pre_record, post_record, io_engine,
+          async_write ? " from a writer thread" : "");
+
+  ok = bench_run(1, &single);
+  ok &= bench_run(n_instances, &multi);
+
+  g_print("scaling: %.2fx over %d instances (%.0f%% of linear)\n",
+          multi / single, n_instances, 100.0 * multi / single / n_instances);
+
+  g_free(output_dir);
+  g_free(io_engine);
+
+  return ok ? 0 : 1;
+}
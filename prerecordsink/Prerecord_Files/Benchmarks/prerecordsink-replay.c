@@ -0,0 +1,350 @@
+/* GStreamer
+ *
+ * prerecordsink-replay.c: replays a buffer arrival trace recorded with the
+ * trace-location of prerecordsink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Every list of the trace is pushed into a prerecordsink through a
+ * GstHarness at the time it arrived on the device, scaled by the speed,
+ * with the sizes, flags and timestamps it had. The payload is made of TS
+ * packets that the sink takes for the same keyframes. Buffering requests
+ * are replayed with the start-recording and stop-recording actions at the
+ * time they were made. A push is late when it takes longer than the gap to
+ * the next list of the trace, which on the device would have backed up
+ * the pipeline. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/check/gstharness.h>
+
+#include "prerecordbench-ts.h"
+#include "../Code_Files/gstprerecordtrace.h"
+
+static gdouble speed = 1.0;
+static gint pre_record = 10;
+static gint post_record = 5;
+static gchar *mode = NULL;
+static gchar *output_dir = NULL;
+static gchar *io_engine = NULL;
+static gchar *ring_storage = NULL;
+static gboolean async_write = FALSE;
+
+static GOptionEntry entries[] = {
+  {"speed", 'x', 0, G_OPTION_ARG_DOUBLE, &speed,
+   "Replay speed, 2 for twice as fast, 0 for as fast as possible", "X"},
+  {"pre-record", 'p', 0, G_OPTION_ARG_INT, &pre_record,
+   "pre-record window in seconds", "S"},
+  {"post-record", 'P', 0, G_OPTION_ARG_INT, &post_record,
+   "post-record window in seconds", "S"},
+  {"mode", 'm', 0, G_OPTION_ARG_STRING, &mode,
+   "buffer-mode of the sink", "MODE"},
+  {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+   "Directory the clips are written to", "DIR"},
+  {"io-engine", 'e', 0, G_OPTION_ARG_STRING, &io_engine,
+   "io-engine of the sink (writev, io-uring)", "ENGINE"},
+  {"ring-storage", 'r', 0, G_OPTION_ARG_STRING, &ring_storage,
+   "ring-storage of the sink (refs, arena, mmap, memfd, journal)", "STORAGE"},
+  {"async-write", 'a', 0, G_OPTION_ARG_NONE, &async_write,
+   "Enable async-write on the sink", NULL},
+  {NULL}
+};
+
+typedef struct _ReplayResult {
+  guint64 lists;
+  guint64 buffers;
+  guint64 bytes;
+  guint triggers;
+  guint64 late;
+  guint64 behind_ns;
+  guint64 wall_ns;
+  GArray *latencies;
+  gboolean failed;
+} ReplayResult;
+
+/* Reads the next event of @f, FALSE at the end of the trace */
+static gboolean
+replay_read_event(FILE *f, PrerecordTraceEvent *event)
+{
+  guint8 data[PRERECORD_TRACE_EVENT_SIZE];
+
+  if (fread(data, sizeof(data), 1, f) != 1)
+    return FALSE;
+  prerecord_trace_read_event(data, event);
+
+  return TRUE;
+}
+
+/* A buffer the sink sees like the traced one: the first packet of a
+ * keyframe starts a random access PES with an SPS, all other packets
+ * continue a PES. What does not fill a whole packet is stuffing. */
+static GstBuffer *
+replay_buffer(BenchTsGen *gen, const PrerecordTraceBuffer *record)
+{
+  GstBuffer *buffer = gst_buffer_new_allocate(NULL, record->size, NULL);
+  gboolean keyframe = (record->flags & PRERECORD_TRACE_KEYFRAME) != 0;
+  GstMapInfo map;
+  gsize pos;
+
+  gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+  memset(map.data, 0xff, map.size);
+  for (pos = 0; pos + BENCH_TS_PACKET_SIZE <= map.size; pos += BENCH_TS_PACKET_SIZE)
+    bench_ts_write_packet(gen, map.data + pos, keyframe && pos == 0, keyframe, record->pts);
+  gst_buffer_unmap(buffer, &map);
+
+  GST_BUFFER_FLAGS(buffer) = record->flags & ~PRERECORD_TRACE_KEYFRAME;
+  GST_BUFFER_PTS(buffer) = record->pts;
+  GST_BUFFER_DTS(buffer) = record->dts;
+  GST_BUFFER_DURATION(buffer) = record->duration;
+
+  return buffer;
+}
+
+/* Reads the @count buffer records of a list event */
+static GstBufferList *
+replay_read_list(FILE *f, BenchTsGen *gen, guint count, guint64 *bytes)
+{
+  GstBufferList *list = gst_buffer_list_new_sized(count);
+  guint8 data[PRERECORD_TRACE_BUFFER_SIZE];
+  guint i;
+
+  for (i = 0; i < count; i++)
+  {
+    PrerecordTraceBuffer record;
+
+    if (fread(data, sizeof(data), 1, f) != 1)
+    {
+      gst_buffer_list_unref(list);
+      return NULL;
+    }
+    prerecord_trace_read_buffer(data, &record);
+    *bytes += record.size;
+    gst_buffer_list_add(list, replay_buffer(gen, &record));
+  }
+
+  return list;
+}
+
+static void
+replay_trigger(GstElement *sink, const PrerecordTraceEvent *event)
+{
+  gint buffering = (gint)event->count;
+  gboolean accepted;
+
+  if (buffering == 0)
+    g_signal_emit_by_name(sink, "start-recording", event->running_time, &accepted);
+  else if (buffering == 1)
+    g_signal_emit_by_name(sink, "stop-recording", event->running_time, &accepted);
+  else
+    g_object_set(sink, "buffering", buffering, NULL);
+}
+
+/* Sleeps until @time of the trace, as scaled by the speed */
+static void
+replay_wait(guint64 start, guint64 time)
+{
+  guint64 target, now;
+
+  if (speed <= 0)
+    return;
+
+  target = start + (guint64)(time / speed);
+  now = bench_now_ns();
+  if (target > now)
+    g_usleep((target - now) / 1000);
+}
+
+static void
+replay_run(FILE *f, const gchar *trace, ReplayResult *result)
+{
+  GstElement *sink;
+  GstHarness *h;
+  BenchTsGen gen;
+  PrerecordTraceEvent event, next;
+  gboolean have_next;
+  gchar *location, *base;
+  guint64 start;
+
+  memset(result, 0, sizeof(ReplayResult));
+  result->latencies = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+  base = g_path_get_basename(trace);
+  location = g_strdup_printf("%s/prerecordsink-replay-%s.ts", output_dir, base);
+  g_free(base);
+
+  /* the location has to be set before the harness starts the sink */
+  sink = gst_element_factory_make("prerecordsink", NULL);
+  if (sink == NULL)
+  {
+    g_printerr("prerecordsink not found, check GST_PLUGIN_PATH\n");
+    exit(1);
+  }
+  g_object_set(sink, "location", location, "pre-record", pre_record,
+               "post-record", post_record, "async-write", async_write, NULL);
+  gst_util_set_object_arg(G_OBJECT(sink), "buffer-mode", mode);
+  gst_util_set_object_arg(G_OBJECT(sink), "io-engine", io_engine);
+  gst_util_set_object_arg(G_OBJECT(sink), "ring-storage", ring_storage);
+
+  h = gst_harness_new_with_element(sink, "sink", NULL);
+  gst_object_unref(sink);
+  gst_harness_set_src_caps_str(h, "video/mpegts, systemstream=(boolean)true, "
+                                  "packetsize=(int)188");
+
+  /* one generator keeps the continuity counters going */
+  bench_ts_gen_init(&gen, 0, 30, 30, 1);
+
+  start = bench_now_ns();
+  have_next = replay_read_event(f, &next);
+  while (have_next)
+  {
+    GstBufferList *list;
+    GstFlowReturn flow;
+    guint64 push, latency;
+
+    event = next;
+    replay_wait(start, event.time);
+
+    if (event.type == PRERECORD_TRACE_TRIGGER)
+    {
+      replay_trigger(h->element, &event);
+      result->triggers++;
+      have_next = replay_read_event(f, &next);
+      continue;
+    }
+    if (event.type != PRERECORD_TRACE_LIST)
+    {
+      g_printerr("%s: unknown event type %u\n", trace, event.type);
+      result->failed = TRUE;
+      break;
+    }
+
+    list = replay_read_list(f, &gen, event.count, &result->bytes);
+    if (list == NULL)
+      break;
+    result->lists++;
+    result->buffers += event.count;
+
+    push = bench_now_ns();
+    flow = gst_pad_push_list(h->srcpad, list);
+    latency = bench_now_ns() - push;
+    g_array_append_val(result->latencies, latency);
+
+    /* the next arrival decides whether the push held up the source */
+    have_next = replay_read_event(f, &next);
+    if (have_next && speed > 0 && latency > (next.time - MIN(next.time, event.time)) / speed)
+      result->late++;
+    if (speed > 0 && push + latency > start + (guint64)(event.time / speed))
+      result->behind_ns = MAX(result->behind_ns,
+                              push + latency - start - (guint64)(event.time / speed));
+
+    if (flow == GST_FLOW_EOS)
+      break;
+    if (flow != GST_FLOW_OK)
+    {
+      g_printerr("%s: push failed: %s\n", trace, gst_flow_get_name(flow));
+      result->failed = TRUE;
+      break;
+    }
+  }
+  result->wall_ns = bench_now_ns() - start;
+
+  gst_harness_teardown(h);
+
+  g_array_sort(result->latencies, bench_compare_latency);
+
+  g_unlink(location);
+  g_free(location);
+}
+
+int
+main(int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  ReplayResult result;
+  guint8 header[PRERECORD_TRACE_HEADER_SIZE];
+  FILE *f;
+  gdouble mb;
+
+  ctx = g_option_context_new("TRACE - replay a prerecordsink trace");
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  g_option_context_add_group(ctx, gst_init_get_option_group());
+  if (!g_option_context_parse(ctx, &argc, &argv, &err))
+  {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+  g_option_context_free(ctx);
+
+  if (argc != 2)
+  {
+    g_printerr("usage: %s [OPTION...] TRACE\n", argv[0]);
+    return 1;
+  }
+
+  f = g_fopen(argv[1], "rb");
+  if (f == NULL)
+  {
+    g_printerr("could not open %s\n", argv[1]);
+    return 1;
+  }
+  if (fread(header, sizeof(header), 1, f) != 1 || !prerecord_trace_check_header(header))
+  {
+    g_printerr("%s is not a prerecordsink trace\n", argv[1]);
+    fclose(f);
+    return 1;
+  }
+
+  if (output_dir == NULL)
+    output_dir = g_strdup(g_get_tmp_dir());
+  if (io_engine == NULL)
+    io_engine = g_strdup("writev");
+  if (ring_storage == NULL)
+    ring_storage = g_strdup("refs");
+  if (mode == NULL)
+    mode = g_strdup("default");
+
+  replay_run(f, argv[1], &result);
+  fclose(f);
+
+  mb = result.bytes / 1e6;
+  g_print("%s at %gx: %" G_GUINT64_FORMAT " lists, %" G_GUINT64_FORMAT " buffers, "
+          "%.1f MB, %u buffering requests in %.2f s\n",
+          argv[1], speed, result.lists, result.buffers, mb, result.triggers,
+          result.wall_ns / 1e9);
+  g_print("  %s, %s, %s ring%s: push p50 %6.1f us p99 %7.1f us p99.9 %8.1f us "
+          "max %8.1f us, %" G_GUINT64_FORMAT " late (%.2f %%), at most %.2f ms "
+          "behind the trace%s\n",
+          mode, io_engine, ring_storage, async_write ? ", writer thread" : "",
+          bench_percentile(result.latencies, 50) / 1e3,
+          bench_percentile(result.latencies, 99) / 1e3,
+          bench_percentile(result.latencies, 99.9) / 1e3,
+          bench_percentile(result.latencies, 100) / 1e3,
+          result.late, result.lists ? 100.0 * result.late / result.lists : 0.0,
+          result.behind_ns / 1e6, result.failed ? ", FAILED" : "");
+
+  g_array_free(result.latencies, TRUE);
+  g_free(mode);
+  g_free(output_dir);
+  g_free(io_engine);
+  g_free(ring_storage);
+
+  return result.failed ? 1 : 0;
+}
@@ -37,6 +37,7 @@ GST_ELEMENT_REGISTER_DECLARE (fdsink);
 #endif
 GST_ELEMENT_REGISTER_DECLARE (filesink);
 GST_ELEMENT_REGISTER_DECLARE (prerecordsink);
+GST_ELEMENT_REGISTER_DECLARE (prerecordqueue);
 GST_ELEMENT_REGISTER_DECLARE (filesrc);
 GST_ELEMENT_REGISTER_DECLARE (funnel);
 GST_ELEMENT_REGISTER_DECLARE (identity);
@@ -59,6 +59,7 @@ plugin_init (GstPlugin * plugin)
   ret |= GST_ELEMENT_REGISTER (queue2, plugin);
   ret |= GST_ELEMENT_REGISTER (filesink, plugin);
   ret |= GST_ELEMENT_REGISTER (prerecordsink, plugin);
+  ret |= GST_ELEMENT_REGISTER (prerecordqueue, plugin);
   ret |= GST_ELEMENT_REGISTER (tee, plugin);
   ret |= GST_ELEMENT_REGISTER (typefind, plugin);
   ret |= GST_ELEMENT_REGISTER (multiqueue, plugin);
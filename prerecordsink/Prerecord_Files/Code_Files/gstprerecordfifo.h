@@ -0,0 +1,377 @@
+/* GStreamer
+ *
+ * gstprerecordfifo.h: FIFO of the buffer lists held by a prerecordsink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_PRERECORD_FIFO_H__
+#define __GST_PRERECORD_FIFO_H__
+
+#include <string.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* The nodes live by value in one slab used as a ring, @head is the index
+ * of the oldest node and the slab size is a power of two so the index of
+ * the nth node is a mask away. The slab doubles when it is full and never
+ * shrinks, a pre-record window settles on its size after the first few
+ * GOPs and pushing no longer allocates. The byte and duration totals are
+ * kept up to date on push and pop. */
+#define PRERECORD_FIFO_DEFAULT_NODES 256
+
+/* Timestamps are kept here as side metadata so the buffers held by the
+ * FIFO can stay shared with upstream instead of being copied to be
+ * modified. Lists are split so that @keyframe nodes start a GOP. */
+typedef struct _BufferListNode {
+  GstBufferList *buffer_list;
+  GstClockTime pts;
+  GstClockTime dts;
+  GstClockTime duration;
+  GstClockTime running_time;
+  gsize size;
+  gboolean keyframe;
+} BufferListNode;
+
+/* Positions of the keyframes held, counted in pushes since the start so
+ * they stay valid when the nodes move. The GOP after the oldest one is
+ * found without walking the nodes in between. Same kind of slab ring as
+ * the nodes. */
+typedef struct _PrerecordKeyframes {
+  guint *positions;
+  guint mask;
+  guint head;
+  guint length;
+} PrerecordKeyframes;
+
+typedef struct _BufferListFIFO {
+  BufferListNode *nodes;
+  guint mask;
+  guint head;
+  guint length;
+  guint n_keyframes;
+  guint64 bytes;
+  GstClockTime duration;
+  /* position of the next node pushed */
+  guint pushed;
+  PrerecordKeyframes keyframes;
+} BufferListFIFO;
+
+/*** KEYFRAMES ***************************************************************/
+
+static inline void
+prerecord_keyframes_init(PrerecordKeyframes *keyframes, guint size)
+{
+  guint n = 1;
+
+  while (n < MAX(size, 1))
+    n <<= 1;
+
+  keyframes->positions = g_new(guint, n);
+  keyframes->mask = n - 1;
+  keyframes->head = keyframes->length = 0;
+}
+
+static inline void
+prerecord_keyframes_free(PrerecordKeyframes *keyframes)
+{
+  g_free(keyframes->positions);
+  keyframes->positions = NULL;
+}
+
+static inline void
+prerecord_keyframes_push(PrerecordKeyframes *keyframes, guint position)
+{
+  if (keyframes->length > keyframes->mask)
+  {
+    guint size = (keyframes->mask + 1) * 2;
+    guint *positions = g_new(guint, size);
+    guint first = MIN(keyframes->length, keyframes->mask + 1 - keyframes->head);
+
+    memcpy(positions, keyframes->positions + keyframes->head, first * sizeof(guint));
+    memcpy(positions + first, keyframes->positions,
+           (keyframes->length - first) * sizeof(guint));
+
+    g_free(keyframes->positions);
+    keyframes->positions = positions;
+    keyframes->mask = size - 1;
+    keyframes->head = 0;
+  }
+
+  keyframes->positions[(keyframes->head + keyframes->length) & keyframes->mask] = position;
+  keyframes->length++;
+}
+
+static inline void
+prerecord_keyframes_pop(PrerecordKeyframes *keyframes)
+{
+  if (keyframes->length == 0)
+    return;
+
+  keyframes->head = (keyframes->head + 1) & keyframes->mask;
+  keyframes->length--;
+}
+
+static inline void
+prerecord_keyframes_clear(PrerecordKeyframes *keyframes)
+{
+  keyframes->head = keyframes->length = 0;
+}
+
+/* Offset from @first, the position of the oldest entry held, of the entry
+ * starting the GOP after the oldest one. That is the second entry when
+ * there are no keyframes. -1 when it is not in the @length entries held. */
+static inline gint
+prerecord_keyframes_next_gop(const PrerecordKeyframes *keyframes, guint first,
+                             guint length)
+{
+  guint offset = 1;
+
+  if (keyframes->length > 0)
+  {
+    offset = keyframes->positions[keyframes->head] - first;
+    if (offset == 0)
+    {
+      if (keyframes->length < 2)
+        return -1;
+      offset = keyframes->positions[(keyframes->head + 1) & keyframes->mask] - first;
+    }
+  }
+
+  return offset < length ? (gint)offset : -1;
+}
+
+/* Offset from @first of the keyframe starting the GOP that holds the entry
+ * at offset @n, found with a binary search. The oldest keyframe when @n
+ * precedes it, @n when there are no keyframes. */
+static inline guint
+prerecord_keyframes_gop_start(const PrerecordKeyframes *keyframes, guint first, guint n)
+{
+  guint low = 0, high = keyframes->length;
+
+  if (keyframes->length == 0)
+    return n;
+
+  /* the first keyframe past @n */
+  while (low < high)
+  {
+    guint mid = low + (high - low) / 2;
+
+    if (keyframes->positions[(keyframes->head + mid) & keyframes->mask] - first <= n)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return keyframes->positions[(keyframes->head + (low > 0 ? low - 1 : 0)) & keyframes->mask] -
+         first;
+}
+
+/*** FIFO ********************************************************************/
+
+/* A FIFO with room for at least @n_nodes before it has to grow */
+static inline BufferListFIFO *
+prerecord_fifo_new(guint n_nodes)
+{
+  BufferListFIFO *fifo = g_new0(BufferListFIFO, 1);
+  guint size = 1;
+
+  while (size < MAX(n_nodes, 1))
+    size <<= 1;
+
+  fifo->nodes = g_new(BufferListNode, size);
+  fifo->mask = size - 1;
+  prerecord_keyframes_init(&fifo->keyframes, size);
+  return fifo;
+}
+
+static inline guint
+prerecord_fifo_length(const BufferListFIFO *fifo)
+{
+  return fifo->length;
+}
+
+static inline gboolean
+prerecord_fifo_is_empty(const BufferListFIFO *fifo)
+{
+  return fifo->length == 0;
+}
+
+/* The @n th oldest node, NULL past the end. Only valid until the next
+ * push or pop. */
+static inline BufferListNode *
+prerecord_fifo_peek_nth(const BufferListFIFO *fifo, guint n)
+{
+  if (n >= fifo->length)
+    return NULL;
+
+  return &fifo->nodes[(fifo->head + n) & fifo->mask];
+}
+
+static inline BufferListNode *
+prerecord_fifo_peek(const BufferListFIFO *fifo)
+{
+  return prerecord_fifo_peek_nth(fifo, 0);
+}
+
+/* Moves the ring to a slab twice the size, unwrapped so the oldest node
+ * is first again */
+static inline void
+prerecord_fifo_grow(BufferListFIFO *fifo)
+{
+  guint size = (fifo->mask + 1) * 2;
+  BufferListNode *nodes = g_new(BufferListNode, size);
+  guint first = MIN(fifo->length, fifo->mask + 1 - fifo->head);
+
+  memcpy(nodes, fifo->nodes + fifo->head, first * sizeof(BufferListNode));
+  memcpy(nodes + first, fifo->nodes,
+         (fifo->length - first) * sizeof(BufferListNode));
+
+  g_free(fifo->nodes);
+  fifo->nodes = nodes;
+  fifo->mask = size - 1;
+  fifo->head = 0;
+}
+
+/* Appends a copy of @node, the FIFO takes over its buffer list reference */
+static inline void
+prerecord_fifo_push(BufferListFIFO *fifo, const BufferListNode *node)
+{
+  if (fifo->length > fifo->mask)
+    prerecord_fifo_grow(fifo);
+
+  fifo->nodes[(fifo->head + fifo->length) & fifo->mask] = *node;
+  fifo->length++;
+
+  fifo->bytes += node->size;
+  if (node->keyframe)
+  {
+    prerecord_keyframes_push(&fifo->keyframes, fifo->pushed);
+    fifo->n_keyframes++;
+  }
+  fifo->pushed++;
+  if (GST_CLOCK_TIME_IS_VALID(node->duration))
+    fifo->duration += node->duration;
+}
+
+/* Removes the oldest node and returns its buffer list, the caller owns
+ * the reference. NULL if the FIFO is empty. */
+static inline GstBufferList *
+prerecord_fifo_pop(BufferListFIFO *fifo)
+{
+  BufferListNode *node;
+
+  if (fifo->length == 0)
+    return NULL;
+
+  node = &fifo->nodes[fifo->head];
+  fifo->head = (fifo->head + 1) & fifo->mask;
+  fifo->length--;
+
+  fifo->bytes -= node->size;
+  if (node->keyframe)
+  {
+    prerecord_keyframes_pop(&fifo->keyframes);
+    fifo->n_keyframes--;
+  }
+  if (GST_CLOCK_TIME_IS_VALID(node->duration))
+    fifo->duration -= node->duration;
+
+  return node->buffer_list;
+}
+
+/* Index of the node starting the GOP after the oldest one, or of the
+ * second node when there are no keyframes. -1 if there is none. */
+static inline gint
+prerecord_fifo_next_gop(const BufferListFIFO *fifo)
+{
+  return prerecord_keyframes_next_gop(&fifo->keyframes, fifo->pushed - fifo->length,
+                                      fifo->length);
+}
+
+/* Index of the node starting the GOP that holds the @n th node */
+static inline guint
+prerecord_fifo_gop_start(const BufferListFIFO *fifo, guint n)
+{
+  return prerecord_keyframes_gop_start(&fifo->keyframes, fifo->pushed - fifo->length, n);
+}
+
+/* Index of the newest node with a running time at or before
+ * @running_time, -1 if there is none. Running times only go forward in
+ * the FIFO, nodes without one are never returned. */
+static inline gint
+prerecord_fifo_search(const BufferListFIFO *fifo, GstClockTime running_time)
+{
+  gint low = 0, high = (gint)fifo->length - 1, found = -1;
+
+  while (low <= high)
+  {
+    gint mid = low + (high - low) / 2;
+    gint probe = mid;
+    GstClockTime ts;
+
+    /* settle on a node with a running time, below mid if need be */
+    while (probe >= low &&
+           !GST_CLOCK_TIME_IS_VALID(ts = prerecord_fifo_peek_nth(fifo, probe)->running_time))
+      probe--;
+
+    if (probe < low)
+    {
+      low = mid + 1;
+      continue;
+    }
+
+    if (ts <= running_time)
+    {
+      found = probe;
+      low = mid + 1;
+    }
+    else
+    {
+      high = probe - 1;
+    }
+  }
+
+  return found;
+}
+
+/* Drops every node and the references they hold */
+static inline void
+prerecord_fifo_clear(BufferListFIFO *fifo)
+{
+  GstBufferList *buffer_list;
+
+  while ((buffer_list = prerecord_fifo_pop(fifo)) != NULL)
+    gst_buffer_list_unref(buffer_list);
+
+  fifo->head = 0;
+  fifo->duration = 0;
+}
+
+static inline void
+prerecord_fifo_free(BufferListFIFO *fifo)
+{
+  prerecord_fifo_clear(fifo);
+  prerecord_keyframes_free(&fifo->keyframes);
+  g_free(fifo->nodes);
+  g_free(fifo);
+}
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_FIFO_H__ */
@@ -0,0 +1,120 @@
+/* GStreamer
+ *
+ * gstprerecordindex.h: keyframe seek index written next to a prerecord
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_PRERECORD_INDEX_H__
+#define __GST_PRERECORD_INDEX_H__
+
+#include <string.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The index of "clip.mp4" is "clip.mp4.idx". It starts with a header of
+ * the magic "PRIX", a 32 bit version and 8 reserved bytes, followed by
+ * one record per keyframe in the order they were written: the time in ns
+ * since the first keyframe of the prerecord and the byte offset the
+ * keyframe starts at, both 64 bit. Everything is little endian. Records
+ * are only ever appended, a partial record at the end is left over from
+ * a prerecord that was not closed and is ignored. */
+#define PRERECORD_INDEX_SUFFIX ".idx"
+#define PRERECORD_INDEX_MAGIC "PRIX"
+#define PRERECORD_INDEX_VERSION 1
+#define PRERECORD_INDEX_HEADER_SIZE 16
+#define PRERECORD_INDEX_RECORD_SIZE 16
+
+static inline void
+prerecord_index_write64(guint8 *data, guint64 value)
+{
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    data[i] = value >> (8 * i);
+}
+
+static inline guint64
+prerecord_index_read64(const guint8 *data)
+{
+  guint64 value = 0;
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    value |= (guint64)data[i] << (8 * i);
+
+  return value;
+}
+
+static inline void
+prerecord_index_write_header(guint8 *header)
+{
+  memset(header, 0, PRERECORD_INDEX_HEADER_SIZE);
+  memcpy(header, PRERECORD_INDEX_MAGIC, 4);
+  header[4] = PRERECORD_INDEX_VERSION;
+}
+
+static inline void
+prerecord_index_write_record(guint8 *record, guint64 time, guint64 offset)
+{
+  prerecord_index_write64(record, time);
+  prerecord_index_write64(record + 8, offset);
+}
+
+/* Returns the number of records in the @size bytes of index at @data, -1
+ * when it is not an index this reader understands */
+static inline gssize
+prerecord_index_n_records(const guint8 *data, gsize size)
+{
+  if (size < PRERECORD_INDEX_HEADER_SIZE ||
+      memcmp(data, PRERECORD_INDEX_MAGIC, 4) != 0 ||
+      data[4] != PRERECORD_INDEX_VERSION)
+    return -1;
+
+  return (size - PRERECORD_INDEX_HEADER_SIZE) / PRERECORD_INDEX_RECORD_SIZE;
+}
+
+static inline const guint8 *
+prerecord_index_record(const guint8 *data, gsize i)
+{
+  return data + PRERECORD_INDEX_HEADER_SIZE + i * PRERECORD_INDEX_RECORD_SIZE;
+}
+
+/* Binary search for the last keyframe at or before @time, returns its
+ * record number or -1 when @time is before the first keyframe */
+static inline gssize
+prerecord_index_lookup(const guint8 *data, gsize n_records, guint64 time)
+{
+  gsize low = 0, high = n_records;
+
+  while (low < high)
+  {
+    gsize mid = low + (high - low) / 2;
+
+    if (prerecord_index_read64(prerecord_index_record(data, mid)) <= time)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return (gssize)low - 1;
+}
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_INDEX_H__ */
@@ -0,0 +1,542 @@
+/* GStreamer
+ *
+ * gstprerecordmp4.h: fragmented MP4 helpers shared by prerecordsink and
+ * prerecordqueue
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_PRERECORD_MP4_H__
+#define __GST_PRERECORD_MP4_H__
+
+#include <string.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* With fragmented MP4 from mp4mux the ftyp and moov header is kept aside
+ * and put in front of every prerecord, the moof of each fragment is where
+ * a GOP can start */
+#define PRERECORD_MP4_FTYP GST_MAKE_FOURCC('f', 't', 'y', 'p')
+#define PRERECORD_MP4_MOOV GST_MAKE_FOURCC('m', 'o', 'o', 'v')
+#define PRERECORD_MP4_MOOF GST_MAKE_FOURCC('m', 'o', 'o', 'f')
+
+/* sample_is_non_sync_sample of the sample flags (ISO/IEC 14496-12 8.8.3) */
+#define PRERECORD_MP4_SAMPLE_NON_SYNC 0x00010000
+#define PRERECORD_MP4_MAX_TRACKS 8
+
+typedef struct _PrerecordMp4Track {
+  guint32 track_id;
+  guint32 timescale;
+  guint32 default_sample_duration;
+  guint32 default_sample_flags;
+} PrerecordMp4Track;
+
+/* The tracks of the moov, @video_track is the id of the first video track
+ * and 0 until a moov with one was seen. @avcc is a copy of its avcC when it
+ * is H.264. */
+typedef struct _PrerecordMp4Info {
+  PrerecordMp4Track tracks[PRERECORD_MP4_MAX_TRACKS];
+  guint n_tracks;
+  guint32 video_track;
+  GBytes *avcc;
+} PrerecordMp4Info;
+
+/* Type of the box @buffer starts with, 0 when it does not start one */
+static inline guint32
+prerecord_mp4_box_type(GstBuffer *buffer)
+{
+  guint8 head[8];
+
+  if (gst_buffer_extract(buffer, 0, head, sizeof(head)) != sizeof(head))
+    return 0;
+  if (GST_READ_UINT32_BE(head) != 1 && GST_READ_UINT32_BE(head) < 8)
+    return 0;
+
+  return GST_READ_UINT32_LE(head + 4);
+}
+
+/* First child box of @type in the @size bytes of boxes at @data, returns
+ * its payload */
+static inline const guint8 *
+prerecord_mp4_find(const guint8 *data, gsize size, guint32 type, gsize *payload_size)
+{
+  gsize pos = 0;
+
+  if (data == NULL)
+    return NULL;
+
+  while (pos + 8 <= size)
+  {
+    gsize box_size = GST_READ_UINT32_BE(data + pos);
+
+    if (box_size < 8 || pos + box_size > size)
+      return NULL;
+
+    if (GST_READ_UINT32_LE(data + pos + 4) == type)
+    {
+      *payload_size = box_size - 8;
+      return data + pos + 8;
+    }
+    pos += box_size;
+  }
+
+  return NULL;
+}
+
+static inline PrerecordMp4Track *
+prerecord_mp4_track(PrerecordMp4Info *info, guint32 track_id)
+{
+  guint i;
+
+  for (i = 0; i < info->n_tracks; i++)
+  {
+    if (info->tracks[i].track_id == track_id)
+      return &info->tracks[i];
+  }
+
+  return NULL;
+}
+
+static inline void
+prerecord_mp4_info_clear(PrerecordMp4Info *info)
+{
+  if (info->avcc)
+    g_bytes_unref(info->avcc);
+  memset(info, 0, sizeof(PrerecordMp4Info));
+}
+
+/* The avcC of the first sample entry of the @mdia payload of a trak, NULL
+ * when it is not H.264 */
+static inline const guint8 *
+prerecord_mp4_mdia_avcc(const guint8 *mdia, gsize mdia_size, gsize *avcc_size)
+{
+  const guint8 *minf, *stbl, *stsd, *entry;
+  gsize minf_size, stbl_size, stsd_size, entry_size;
+  guint32 entry_type;
+
+  minf = prerecord_mp4_find(mdia, mdia_size, GST_MAKE_FOURCC('m', 'i', 'n', 'f'), &minf_size);
+  stbl = prerecord_mp4_find(minf, minf_size, GST_MAKE_FOURCC('s', 't', 'b', 'l'), &stbl_size);
+  stsd = prerecord_mp4_find(stbl, stbl_size, GST_MAKE_FOURCC('s', 't', 's', 'd'), &stsd_size);
+  if (stsd == NULL || stsd_size < 16)
+    return NULL;
+
+  /* its boxes follow the 78 bytes of the visual sample entry */
+  entry = stsd + 8;
+  entry_size = GST_READ_UINT32_BE(entry);
+  entry_type = GST_READ_UINT32_LE(entry + 4);
+  if ((entry_type != GST_MAKE_FOURCC('a', 'v', 'c', '1') &&
+       entry_type != GST_MAKE_FOURCC('a', 'v', 'c', '3')) ||
+      entry_size < 86 || entry_size > stsd_size - 8)
+    return NULL;
+
+  return prerecord_mp4_find(entry + 86, entry_size - 86,
+                            GST_MAKE_FOURCC('a', 'v', 'c', 'C'), avcc_size);
+}
+
+/* Reads the track ids, handlers and media timescales of the traks, the
+ * avcC of the video track and the default sample durations and flags of
+ * the trex boxes from the payload of a moov */
+static inline void
+prerecord_mp4_parse_moov(PrerecordMp4Info *info, const guint8 *moov, gsize moov_size)
+{
+  const guint8 *mvex;
+  gsize pos, box_size, mvex_size;
+
+  prerecord_mp4_info_clear(info);
+
+  for (pos = 0; pos + 8 <= moov_size; pos += box_size)
+  {
+    const guint8 *trak = moov + pos + 8;
+    const guint8 *tkhd, *mdia, *mdhd, *hdlr;
+    gsize trak_size, tkhd_size, mdia_size, mdhd_size, hdlr_size;
+    PrerecordMp4Track *track;
+
+    box_size = GST_READ_UINT32_BE(moov + pos);
+    if (box_size < 8 || pos + box_size > moov_size)
+      break;
+    if (GST_READ_UINT32_LE(moov + pos + 4) != GST_MAKE_FOURCC('t', 'r', 'a', 'k') ||
+        info->n_tracks == PRERECORD_MP4_MAX_TRACKS)
+      continue;
+    trak_size = box_size - 8;
+
+    tkhd = prerecord_mp4_find(trak, trak_size, GST_MAKE_FOURCC('t', 'k', 'h', 'd'), &tkhd_size);
+    mdia = prerecord_mp4_find(trak, trak_size, GST_MAKE_FOURCC('m', 'd', 'i', 'a'), &mdia_size);
+    mdhd = prerecord_mp4_find(mdia, mdia_size, GST_MAKE_FOURCC('m', 'd', 'h', 'd'), &mdhd_size);
+    hdlr = prerecord_mp4_find(mdia, mdia_size, GST_MAKE_FOURCC('h', 'd', 'l', 'r'), &hdlr_size);
+    if (tkhd == NULL || tkhd_size < 24 || mdhd == NULL || mdhd_size < 24)
+      continue;
+
+    track = &info->tracks[info->n_tracks++];
+    track->track_id = GST_READ_UINT32_BE(tkhd + (tkhd[0] == 1 ? 20 : 12));
+    track->timescale = GST_READ_UINT32_BE(mdhd + (mdhd[0] == 1 ? 20 : 12));
+    track->default_sample_duration = 0;
+    track->default_sample_flags = 0;
+
+    if (info->video_track == 0 && hdlr != NULL && hdlr_size >= 12 &&
+        GST_READ_UINT32_LE(hdlr + 8) == GST_MAKE_FOURCC('v', 'i', 'd', 'e'))
+    {
+      const guint8 *avcc;
+      gsize avcc_size;
+
+      info->video_track = track->track_id;
+      avcc = prerecord_mp4_mdia_avcc(mdia, mdia_size, &avcc_size);
+      if (avcc)
+        info->avcc = g_bytes_new(avcc, avcc_size);
+    }
+  }
+
+  mvex = prerecord_mp4_find(moov, moov_size, GST_MAKE_FOURCC('m', 'v', 'e', 'x'), &mvex_size);
+  for (pos = 0; mvex != NULL && pos + 8 <= mvex_size; pos += box_size)
+  {
+    PrerecordMp4Track *track;
+
+    box_size = GST_READ_UINT32_BE(mvex + pos);
+    if (box_size < 8 || pos + box_size > mvex_size)
+      break;
+    if (GST_READ_UINT32_LE(mvex + pos + 4) != GST_MAKE_FOURCC('t', 'r', 'e', 'x') ||
+        box_size < 32)
+      continue;
+
+    track = prerecord_mp4_track(info, GST_READ_UINT32_BE(mvex + pos + 12));
+    if (track)
+    {
+      track->default_sample_duration = GST_READ_UINT32_BE(mvex + pos + 20);
+      track->default_sample_flags = GST_READ_UINT32_BE(mvex + pos + 28);
+    }
+  }
+}
+
+/* Flags of the first sample of the traf with the payload @traf, from the
+ * trun, the tfhd or the trex in that order. Returns FALSE when it has no
+ * samples. */
+static inline gboolean
+prerecord_mp4_traf_first_flags(PrerecordMp4Info *info, const guint8 *traf, gsize traf_size,
+                               guint32 *track_id, guint32 *sample_flags)
+{
+  const guint8 *tfhd, *trun, *field, *end;
+  gsize tfhd_size, trun_size;
+  PrerecordMp4Track *track;
+  guint32 flags;
+
+  tfhd = prerecord_mp4_find(traf, traf_size, GST_MAKE_FOURCC('t', 'f', 'h', 'd'), &tfhd_size);
+  trun = prerecord_mp4_find(traf, traf_size, GST_MAKE_FOURCC('t', 'r', 'u', 'n'), &trun_size);
+  if (tfhd == NULL || tfhd_size < 8 || trun == NULL || trun_size < 8 ||
+      GST_READ_UINT32_BE(trun + 4) == 0)
+    return FALSE;
+
+  *track_id = GST_READ_UINT32_BE(tfhd + 4);
+  track = prerecord_mp4_track(info, *track_id);
+  *sample_flags = track ? track->default_sample_flags : 0;
+
+  /* default-sample-flags of the tfhd, after the optional base data offset,
+   * sample description index, duration and size */
+  flags = GST_READ_UINT32_BE(tfhd) & 0xffffff;
+  field = tfhd + 8 + (flags & 0x000001 ? 8 : 0) + (flags & 0x000002 ? 4 : 0) +
+          (flags & 0x000008 ? 4 : 0) + (flags & 0x000010 ? 4 : 0);
+  if ((flags & 0x000020) && field + 4 <= tfhd + tfhd_size)
+    *sample_flags = GST_READ_UINT32_BE(field);
+
+  /* first-sample-flags of the trun or the flags of its first sample */
+  flags = GST_READ_UINT32_BE(trun) & 0xffffff;
+  field = trun + 8 + (flags & 0x000001 ? 4 : 0);
+  end = trun + trun_size;
+  if (flags & 0x000004)
+  {
+    if (field + 4 <= end)
+      *sample_flags = GST_READ_UINT32_BE(field);
+    return TRUE;
+  }
+  field += (flags & 0x000100 ? 4 : 0) + (flags & 0x000200 ? 4 : 0);
+  if ((flags & 0x000400) && field + 4 <= end)
+    *sample_flags = GST_READ_UINT32_BE(field);
+
+  return TRUE;
+}
+
+/* First sync sample of the traf with the payload @traf, its 1-based
+ * @trun_number and @sample_number and the @time_offset it is decoded at
+ * after the start of the traf. Returns FALSE when the traf has none. */
+static inline gboolean
+prerecord_mp4_traf_sync_sample(PrerecordMp4Info *info, const guint8 *traf, gsize traf_size,
+                               guint32 *trun_number, guint32 *sample_number,
+                               guint64 *time_offset)
+{
+  const guint8 *tfhd, *field;
+  gsize tfhd_size, pos, box_size;
+  PrerecordMp4Track *track;
+  guint32 flags, default_duration, default_flags;
+
+  tfhd = prerecord_mp4_find(traf, traf_size, GST_MAKE_FOURCC('t', 'f', 'h', 'd'), &tfhd_size);
+  if (tfhd == NULL || tfhd_size < 8)
+    return FALSE;
+
+  track = prerecord_mp4_track(info, GST_READ_UINT32_BE(tfhd + 4));
+  default_duration = track ? track->default_sample_duration : 0;
+  default_flags = track ? track->default_sample_flags : 0;
+
+  /* default-sample-duration and -flags of the tfhd, see
+   * prerecord_mp4_traf_first_flags() */
+  flags = GST_READ_UINT32_BE(tfhd) & 0xffffff;
+  field = tfhd + 8 + (flags & 0x000001 ? 8 : 0) + (flags & 0x000002 ? 4 : 0);
+  if ((flags & 0x000008) && field + 4 <= tfhd + tfhd_size)
+    default_duration = GST_READ_UINT32_BE(field);
+  field += (flags & 0x000008 ? 4 : 0) + (flags & 0x000010 ? 4 : 0);
+  if ((flags & 0x000020) && field + 4 <= tfhd + tfhd_size)
+    default_flags = GST_READ_UINT32_BE(field);
+
+  *trun_number = 0;
+  *time_offset = 0;
+
+  for (pos = 0; pos + 8 <= traf_size; pos += box_size)
+  {
+    const guint8 *trun = traf + pos + 8, *end;
+    guint32 i, count, first_flags = default_flags;
+    gsize stride;
+
+    box_size = GST_READ_UINT32_BE(traf + pos);
+    if (box_size < 8 || pos + box_size > traf_size)
+      break;
+    if (GST_READ_UINT32_LE(traf + pos + 4) != GST_MAKE_FOURCC('t', 'r', 'u', 'n') ||
+        box_size < 16)
+      continue;
+
+    (*trun_number)++;
+    end = traf + pos + box_size;
+    flags = GST_READ_UINT32_BE(trun) & 0xffffff;
+    count = GST_READ_UINT32_BE(trun + 4);
+    field = trun + 8 + (flags & 0x000001 ? 4 : 0);
+    if (flags & 0x000004)
+    {
+      if (field + 4 > end)
+        return FALSE;
+      first_flags = GST_READ_UINT32_BE(field);
+      field += 4;
+    }
+
+    /* duration, size, flags and composition offset of every sample */
+    stride = (flags & 0x000100 ? 4 : 0) + (flags & 0x000200 ? 4 : 0) +
+             (flags & 0x000400 ? 4 : 0) + (flags & 0x000800 ? 4 : 0);
+    /* without them every sample after the first has the same flags */
+    if (stride == 0)
+      count = MIN(count, 2);
+
+    for (i = 0; i < count; i++, field += stride)
+    {
+      guint32 duration = default_duration, sample_flags = default_flags;
+
+      if (field + stride > end)
+        return FALSE;
+      if (flags & 0x000100)
+        duration = GST_READ_UINT32_BE(field);
+      if (flags & 0x000400)
+        sample_flags = GST_READ_UINT32_BE(field + (flags & 0x000100 ? 4 : 0) +
+                                          (flags & 0x000200 ? 4 : 0));
+      if (i == 0 && (flags & 0x000004))
+        sample_flags = first_flags;
+
+      if (!(sample_flags & PRERECORD_MP4_SAMPLE_NON_SYNC))
+      {
+        *sample_number = i + 1;
+        return TRUE;
+      }
+      *time_offset += duration;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Whether the moof in the @size bytes at @data has video, @keyframe is set
+ * when the traf of the video track starts with a sync sample. Until the
+ * moov is known every traf counts as video. */
+static inline gboolean
+prerecord_mp4_moof_video(PrerecordMp4Info *info, const guint8 *data, gsize size,
+                         gboolean *keyframe)
+{
+  gsize pos, box_size;
+
+  *keyframe = FALSE;
+
+  size = MIN(size, GST_READ_UINT32_BE(data));
+
+  for (pos = 8; pos + 8 <= size; pos += box_size)
+  {
+    guint32 track_id, sample_flags;
+
+    box_size = GST_READ_UINT32_BE(data + pos);
+    if (box_size < 8 || pos + box_size > size)
+      break;
+    if (GST_READ_UINT32_LE(data + pos + 4) != GST_MAKE_FOURCC('t', 'r', 'a', 'f') ||
+        !prerecord_mp4_traf_first_flags(info, data + pos + 8, box_size - 8, &track_id,
+                                        &sample_flags))
+      continue;
+
+    if (info->video_track != 0 && track_id != info->video_track)
+      continue;
+
+    *keyframe = !(sample_flags & PRERECORD_MP4_SAMPLE_NON_SYNC);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Whether the moof in the @size bytes at @data starts a GOP, moofs without
+ * video do not */
+static inline gboolean
+prerecord_mp4_moof_is_keyframe(PrerecordMp4Info *info, const guint8 *data, gsize size)
+{
+  gboolean keyframe;
+
+  return prerecord_mp4_moof_video(info, data, size, &keyframe) && keyframe;
+}
+
+/* Whether @buffer starts a moof with video, see prerecord_mp4_moof_video() */
+static inline gboolean
+prerecord_mp4_buffer_video(PrerecordMp4Info *info, GstBuffer *buffer, gboolean *keyframe)
+{
+  GstMapInfo map;
+  gboolean video;
+
+  *keyframe = FALSE;
+  if (prerecord_mp4_box_type(buffer) != PRERECORD_MP4_MOOF ||
+      !gst_buffer_map(buffer, &map, GST_MAP_READ))
+    return FALSE;
+
+  video = prerecord_mp4_moof_video(info, map.data, map.size, keyframe);
+  gst_buffer_unmap(buffer, &map);
+
+  return video;
+}
+
+static inline gboolean
+prerecord_mp4_is_keyframe(PrerecordMp4Info *info, GstBuffer *buffer)
+{
+  gboolean keyframe;
+
+  return prerecord_mp4_buffer_video(info, buffer, &keyframe) && keyframe;
+}
+
+static inline gboolean
+prerecord_mp4_is_header(GstBuffer *buffer)
+{
+  guint32 type;
+
+  if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
+    return TRUE;
+
+  type = prerecord_mp4_box_type(buffer);
+  return type == PRERECORD_MP4_FTYP || type == PRERECORD_MP4_MOOV;
+}
+
+/* Adds @buffer to the header in @header, a new ftyp starts a new one. The
+ * tracks of a moov are read into @info. */
+static inline void
+prerecord_mp4_header_add(GstBufferList **header, PrerecordMp4Info *info, GstBuffer *buffer)
+{
+  guint32 type = prerecord_mp4_box_type(buffer);
+
+  if (*header == NULL || type == PRERECORD_MP4_FTYP)
+  {
+    if (*header)
+      gst_buffer_list_unref(*header);
+    *header = gst_buffer_list_new();
+  }
+
+  *header = gst_buffer_list_make_writable(*header);
+  gst_buffer_list_add(*header, gst_buffer_ref(buffer));
+
+  if (type == PRERECORD_MP4_MOOV)
+  {
+    GstMapInfo map;
+
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ))
+    {
+      gsize size = GST_READ_UINT32_BE(map.data);
+
+      if (size >= 8)
+        prerecord_mp4_parse_moov(info, map.data + 8, MIN(size, map.size) - 8);
+      gst_buffer_unmap(buffer, &map);
+    }
+  }
+}
+
+static inline gboolean
+prerecord_mp4_has_header(GstBufferList *buffer_list)
+{
+  guint i, num_buffers = gst_buffer_list_length(buffer_list);
+
+  for (i = 0; i < num_buffers; i++)
+  {
+    if (prerecord_mp4_is_header(gst_buffer_list_get(buffer_list, i)))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* Moves the header buffers of @buffer_list to @header, returns the rest */
+static inline GstBufferList *
+prerecord_mp4_take_header(GstBufferList **header, PrerecordMp4Info *info,
+                          GstBufferList *buffer_list)
+{
+  guint i, num_buffers = gst_buffer_list_length(buffer_list);
+  GstBufferList *media = gst_buffer_list_new_sized(num_buffers);
+
+  for (i = 0; i < num_buffers; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+
+    if (prerecord_mp4_is_header(buffer))
+      prerecord_mp4_header_add(header, info, buffer);
+    else
+      gst_buffer_list_add(media, gst_buffer_ref(buffer));
+  }
+
+  return media;
+}
+
+/* Whether @caps are fragmented MP4, the streamheader they carry is added
+ * to @header */
+static inline gboolean
+prerecord_mp4_set_caps(GstBufferList **header, PrerecordMp4Info *info, GstCaps *caps)
+{
+  GstStructure *s = gst_caps_get_structure(caps, 0);
+  const GValue *streamheader;
+  guint i;
+
+  if (!gst_structure_has_name(s, "video/quicktime"))
+    return FALSE;
+
+  streamheader = gst_structure_get_value(s, "streamheader");
+  if (streamheader == NULL || !GST_VALUE_HOLDS_ARRAY(streamheader))
+    return TRUE;
+
+  for (i = 0; i < gst_value_array_get_size(streamheader); i++)
+  {
+    const GValue *value = gst_value_array_get_value(streamheader, i);
+
+    if (GST_VALUE_HOLDS_BUFFER(value))
+      prerecord_mp4_header_add(header, info, gst_value_get_buffer(value));
+  }
+
+  return TRUE;
+}
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_MP4_H__ */
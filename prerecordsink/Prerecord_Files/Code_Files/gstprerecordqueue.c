@@ -0,0 +1,747 @@
+/* GStreamer
+ *
+ * gstprerecordqueue.c: pre-record ring in front of any sink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * SECTION:element-prerecordqueue
+ * @title: prerecordqueue
+ * @see_also: #GstPrerecordSink
+ *
+ * The pre-record ring of prerecordsink as a filter. While pre-recording
+ * it holds references to the last #GstPrerecordQueue:pre-record seconds
+ * of whole GOPs and pushes nothing. Once recording starts the window is
+ * pushed downstream from its oldest keyframe on, followed by the live
+ * data. Only buffers of upstream pools with a bounded number of buffers
+ * are copied into the ring. After stop-recording the live data is passed
+ * on for #GstPrerecordQueue:post-record seconds and the stream ends. GOPs
+ * start at MPEG-TS keyframes, at buffers that are not delta units, or at
+ * the moofs of fragmented MP4 whose video starts with a sync sample. The
+ * ftyp and moov header of fragmented MP4 is kept aside and pushed in
+ * front of the window.
+ *
+ * The pre-recorded data is pushed with its original timestamps, so the
+ * sink should not sync against the clock.
+ *
+ * ## Example launch line
+ * |[
+ * gst-launch-1.0 v4l2src ! x264enc ! mpegtsmux ! prerecordqueue pre-record=10 ! splitmuxsink location=clip%02d.ts
+ * ]|
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "gstprerecordqueue.h"
+#include "gstcoreelementselements.h"
+
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE("sink",
+                                                                   GST_PAD_SINK,
+                                                                   GST_PAD_ALWAYS,
+                                                                   GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE("src",
+                                                                  GST_PAD_SRC,
+                                                                  GST_PAD_ALWAYS,
+                                                                  GST_STATIC_CAPS_ANY);
+
+#define GST_TYPE_PRERECORD_QUEUE_BUFFERING (gst_prerecord_queue_buffering_get_type())
+
+static GType
+gst_prerecord_queue_buffering_get_type(void)
+{
+  static GType buffering_type = 0;
+  static const GEnumValue buffering[] = {
+      {GST_PRERECORD_QUEUE_BUFFERING_PRERECORD, "Prerecording", "default"},
+      {GST_PRERECORD_QUEUE_BUFFERING_RECORDING, "Recording", "Recording/SinglePress"},
+      {GST_PRERECORD_QUEUE_BUFFERING_POSTRECORD, "Postrecording", "PostRecord/DoublePress"},
+      {0, NULL, NULL},
+  };
+
+  if (!buffering_type)
+  {
+    buffering_type =
+        g_enum_register_static("GstPrerecordQueueBuffering", buffering);
+  }
+  return buffering_type;
+}
+
+GST_DEBUG_CATEGORY_STATIC(gst_prerecord_queue_debug);
+#define GST_CAT_DEFAULT gst_prerecord_queue_debug
+
+#define DEFAULT_PRE_RECORD 30
+#define DEFAULT_POST_RECORD 30
+#define DEFAULT_BUFFERING GST_PRERECORD_QUEUE_BUFFERING_PRERECORD
+#define DEFAULT_MEMORY_LIMIT 0
+
+enum
+{
+  PROP_0,
+  PROP_PRE_RECORD,
+  PROP_POST_RECORD,
+  PROP_BUFFERING,
+  PROP_MEMORY_LIMIT,
+  PROP_CURRENT_LEVEL_BYTES,
+  PROP_CURRENT_LEVEL_TIME
+};
+
+enum
+{
+  SIGNAL_START_RECORDING,
+  SIGNAL_STOP_RECORDING,
+  LAST_SIGNAL
+};
+
+static guint gst_prerecord_queue_signals[LAST_SIGNAL] = {0};
+
+static void gst_prerecord_queue_finalize(GObject *object);
+static void gst_prerecord_queue_set_property(GObject *object, guint prop_id,
+                                             const GValue *value, GParamSpec *pspec);
+static void gst_prerecord_queue_get_property(GObject *object, guint prop_id,
+                                             GValue *value, GParamSpec *pspec);
+static GstStateChangeReturn gst_prerecord_queue_change_state(GstElement *element,
+                                                             GstStateChange transition);
+
+static GstFlowReturn gst_prerecord_queue_chain(GstPad *pad, GstObject *parent,
+                                               GstBuffer *buffer);
+static GstFlowReturn gst_prerecord_queue_chain_list(GstPad *pad, GstObject *parent,
+                                                    GstBufferList *buffer_list);
+static gboolean gst_prerecord_queue_sink_event(GstPad *pad, GstObject *parent,
+                                               GstEvent *event);
+
+static gboolean gst_prerecord_queue_start_recording(GstPrerecordQueue *queue,
+                                                    guint64 running_time);
+static gboolean gst_prerecord_queue_stop_recording(GstPrerecordQueue *queue,
+                                                   guint64 running_time);
+static void gst_prerecord_queue_trigger_set(GstPrerecordQueue *queue, gint buffering,
+                                            GstClockTime running_time);
+static void gst_prerecord_queue_update_levels(GstPrerecordQueue *queue);
+
+#define _do_init \
+  GST_DEBUG_CATEGORY_INIT(gst_prerecord_queue_debug, "prerecordqueue", 0, "prerecordqueue element");
+#define gst_prerecord_queue_parent_class parent_class
+G_DEFINE_TYPE_WITH_CODE(GstPrerecordQueue, gst_prerecord_queue, GST_TYPE_ELEMENT,
+                        _do_init);
+GST_ELEMENT_REGISTER_DEFINE(prerecordqueue, "prerecordqueue", GST_RANK_NONE,
+                            GST_TYPE_PRERECORD_QUEUE);
+
+static void
+gst_prerecord_queue_class_init(GstPrerecordQueueClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS(klass);
+
+  gobject_class->finalize = gst_prerecord_queue_finalize;
+  gobject_class->set_property = gst_prerecord_queue_set_property;
+  gobject_class->get_property = gst_prerecord_queue_get_property;
+
+  g_object_class_install_property(gobject_class, PROP_PRE_RECORD,
+                                  g_param_spec_int("pre-record", "Pre record",
+                                                   "Time in seconds for Prerecording", 0, G_MAXINT, DEFAULT_PRE_RECORD,
+                                                   G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_POST_RECORD,
+                                  g_param_spec_int("post-record", "Post record",
+                                                   "Time in seconds for Postrecording", 0, G_MAXINT, DEFAULT_POST_RECORD,
+                                                   G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordQueue:buffering
+   *
+   * Pre-recording, recording or post-recording. Setting it is applied by
+   * the streaming thread to the next buffer it gets, like the
+   * #GstPrerecordQueue::start-recording and
+   * #GstPrerecordQueue::stop-recording actions without a running time.
+   */
+  g_object_class_install_property(gobject_class, PROP_BUFFERING,
+                                  g_param_spec_enum("buffering", "Buffering",
+                                                    "Precord / Record /Postrecord", GST_TYPE_PRERECORD_QUEUE_BUFFERING,
+                                                    DEFAULT_BUFFERING, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordQueue:memory-limit
+   *
+   * Most bytes the pre-record ring may hold, the oldest GOPs are evicted
+   * to stay below it and the pre-record window shrinks to what fits. 0 for
+   * no limit.
+   */
+  g_object_class_install_property(gobject_class, PROP_MEMORY_LIMIT,
+                                  g_param_spec_uint64("memory-limit", "Memory limit",
+                                                      "Most bytes held by the pre-record ring (0 = no limit)",
+                                                      0, G_MAXUINT64, DEFAULT_MEMORY_LIMIT,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_CURRENT_LEVEL_BYTES,
+                                  g_param_spec_uint64("current-level-bytes", "Current level (bytes)",
+                                                      "Bytes held by the pre-record ring", 0, G_MAXUINT64, 0,
+                                                      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_CURRENT_LEVEL_TIME,
+                                  g_param_spec_uint64("current-level-time", "Current level (ns)",
+                                                      "Duration of media held by the pre-record ring", 0, G_MAXUINT64, 0,
+                                                      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordQueue::start-recording:
+   * @queue: the prerecordqueue
+   * @running_time: running time to start recording at, or
+   *   GST_CLOCK_TIME_NONE to start with the next buffer
+   *
+   * Pushes the pre-recorded window and passes the data from the first
+   * buffer at or after @running_time on. A "GstPrerecordSinkTrigger"
+   * element message like the one of prerecordsink is posted once the
+   * state changed.
+   *
+   * Returns: %FALSE when the queue already records
+   */
+  gst_prerecord_queue_signals[SIGNAL_START_RECORDING] =
+      g_signal_new("start-recording", G_TYPE_FROM_CLASS(klass),
+                   G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                   G_STRUCT_OFFSET(GstPrerecordQueueClass, start_recording),
+                   NULL, NULL, NULL, G_TYPE_BOOLEAN, 1, G_TYPE_UINT64);
+
+  /**
+   * GstPrerecordQueue::stop-recording:
+   * @queue: the prerecordqueue
+   * @running_time: running time to stop recording at, or
+   *   GST_CLOCK_TIME_NONE to stop with the next buffer
+   *
+   * Starts post-recording at the first buffer at or after @running_time,
+   * the queue pushes EOS #GstPrerecordQueue:post-record seconds later.
+   *
+   * Returns: %FALSE when the queue does not record
+   */
+  gst_prerecord_queue_signals[SIGNAL_STOP_RECORDING] =
+      g_signal_new("stop-recording", G_TYPE_FROM_CLASS(klass),
+                   G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                   G_STRUCT_OFFSET(GstPrerecordQueueClass, stop_recording),
+                   NULL, NULL, NULL, G_TYPE_BOOLEAN, 1, G_TYPE_UINT64);
+
+  klass->start_recording = gst_prerecord_queue_start_recording;
+  klass->stop_recording = gst_prerecord_queue_stop_recording;
+
+  gst_element_class_set_static_metadata(gstelement_class,
+                                        "Prerecord Queue",
+                                        "Generic/Prerecord", "Hold a pre-record window and pass it on when recording",
+                                        "Mayur Dongre@latest <mdongre at phoenix dot tech>");
+  gst_element_class_add_static_pad_template(gstelement_class, &sinktemplate);
+  gst_element_class_add_static_pad_template(gstelement_class, &srctemplate);
+
+  gstelement_class->change_state = GST_DEBUG_FUNCPTR(gst_prerecord_queue_change_state);
+
+  gst_type_mark_as_plugin_api(GST_TYPE_PRERECORD_QUEUE_BUFFERING, 0);
+}
+
+static void
+gst_prerecord_queue_init(GstPrerecordQueue *queue)
+{
+  queue->sinkpad = gst_pad_new_from_static_template(&sinktemplate, "sink");
+  gst_pad_set_chain_function(queue->sinkpad,
+                             GST_DEBUG_FUNCPTR(gst_prerecord_queue_chain));
+  gst_pad_set_chain_list_function(queue->sinkpad,
+                                  GST_DEBUG_FUNCPTR(gst_prerecord_queue_chain_list));
+  gst_pad_set_event_function(queue->sinkpad,
+                             GST_DEBUG_FUNCPTR(gst_prerecord_queue_sink_event));
+  /* allocation is not proxied, the ring would starve a downstream pool */
+  GST_PAD_SET_PROXY_CAPS(queue->sinkpad);
+  gst_element_add_pad(GST_ELEMENT_CAST(queue), queue->sinkpad);
+
+  queue->srcpad = gst_pad_new_from_static_template(&srctemplate, "src");
+  GST_PAD_SET_PROXY_CAPS(queue->srcpad);
+  gst_element_add_pad(GST_ELEMENT_CAST(queue), queue->srcpad);
+
+  queue->pre_record = DEFAULT_PRE_RECORD;
+  queue->post_record = DEFAULT_POST_RECORD;
+  queue->buffering = DEFAULT_BUFFERING;
+  queue->memory_limit = DEFAULT_MEMORY_LIMIT;
+  prerecord_trigger_init(&queue->trigger);
+  queue->post_record_start = GST_CLOCK_TIME_NONE;
+  gst_segment_init(&queue->segment, GST_FORMAT_UNDEFINED);
+  prerecord_ring_init(&queue->ring);
+}
+
+static void
+gst_prerecord_queue_finalize(GObject *object)
+{
+  GstPrerecordQueue *queue = GST_PRERECORD_QUEUE(object);
+
+  prerecord_ring_free(&queue->ring);
+  if (queue->mp4_header)
+    gst_buffer_list_unref(queue->mp4_header);
+
+  G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+static void
+gst_prerecord_queue_set_property(GObject *object, guint prop_id,
+                                 const GValue *value, GParamSpec *pspec)
+{
+  GstPrerecordQueue *queue = GST_PRERECORD_QUEUE(object);
+
+  switch (prop_id)
+  {
+  case PROP_PRE_RECORD:
+    queue->pre_record = g_value_get_int(value);
+    break;
+  case PROP_POST_RECORD:
+    queue->post_record = g_value_get_int(value);
+    break;
+  case PROP_BUFFERING:
+    gst_prerecord_queue_trigger_set(queue, g_value_get_enum(value), GST_CLOCK_TIME_NONE);
+    break;
+  case PROP_MEMORY_LIMIT:
+    queue->memory_limit = g_value_get_uint64(value);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_prerecord_queue_get_property(GObject *object, guint prop_id, GValue *value,
+                                 GParamSpec *pspec)
+{
+  GstPrerecordQueue *queue = GST_PRERECORD_QUEUE(object);
+
+  switch (prop_id)
+  {
+  case PROP_PRE_RECORD:
+    g_value_set_int(value, queue->pre_record);
+    break;
+  case PROP_POST_RECORD:
+    g_value_set_int(value, queue->post_record);
+    break;
+  case PROP_BUFFERING:
+    GST_OBJECT_LOCK(queue);
+    g_value_set_enum(value, queue->buffering);
+    GST_OBJECT_UNLOCK(queue);
+    break;
+  case PROP_MEMORY_LIMIT:
+    g_value_set_uint64(value, queue->memory_limit);
+    break;
+  case PROP_CURRENT_LEVEL_BYTES:
+    GST_OBJECT_LOCK(queue);
+    g_value_set_uint64(value, queue->level_bytes);
+    GST_OBJECT_UNLOCK(queue);
+    break;
+  case PROP_CURRENT_LEVEL_TIME:
+    GST_OBJECT_LOCK(queue);
+    g_value_set_uint64(value, queue->level_time);
+    GST_OBJECT_UNLOCK(queue);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    break;
+  }
+}
+
+static GstStateChangeReturn
+gst_prerecord_queue_change_state(GstElement *element, GstStateChange transition)
+{
+  GstPrerecordQueue *queue = GST_PRERECORD_QUEUE(element);
+  GstStateChangeReturn ret;
+
+  switch (transition)
+  {
+  case GST_STATE_CHANGE_READY_TO_PAUSED:
+    gst_segment_init(&queue->segment, GST_FORMAT_UNDEFINED);
+    queue->post_record_start = GST_CLOCK_TIME_NONE;
+    break;
+  default:
+    break;
+  }
+
+  ret = GST_ELEMENT_CLASS(parent_class)->change_state(element, transition);
+
+  switch (transition)
+  {
+  case GST_STATE_CHANGE_PAUSED_TO_READY:
+    /* the streaming thread is stopped by now */
+    prerecord_ring_clear(&queue->ring, TRUE);
+    gst_prerecord_queue_update_levels(queue);
+    if (queue->mp4_header)
+    {
+      gst_buffer_list_unref(queue->mp4_header);
+      queue->mp4_header = NULL;
+    }
+    prerecord_mp4_info_clear(&queue->mp4_info);
+    queue->mp4 = FALSE;
+    break;
+  default:
+    break;
+  }
+
+  return ret;
+}
+
+/*** RING ********************************************************************/
+
+/* Fragmented MP4 starts a GOP with a moof whose video starts with a sync
+ * sample, see gstprerecordring.h for the rest */
+static gboolean
+gst_prerecord_queue_ring_is_keyframe(GstBuffer *buffer, gpointer user_data)
+{
+  GstPrerecordQueue *queue = user_data;
+
+  if (queue->mp4)
+    return prerecord_mp4_is_keyframe(&queue->mp4_info, buffer);
+
+  return prerecord_buffer_is_keyframe(buffer);
+}
+
+static void
+gst_prerecord_queue_ring_push_range(GstBufferList *buffer_list, guint first, guint last,
+                                    gboolean keyframe, gpointer user_data)
+{
+  GstPrerecordQueue *queue = user_data;
+
+  prerecord_ring_push_range(&queue->ring, GST_ELEMENT_CAST(queue), &queue->segment,
+                            buffer_list, first, last, keyframe);
+}
+
+/* Takes a new list of the buffers @first to @last - 1 of @buffer_list, or
+ * a reference to it when that is all of it */
+static GstBufferList *
+gst_prerecord_queue_sub_list(GstBufferList *buffer_list, guint first, guint last)
+{
+  GstBufferList *sub_list;
+  guint i;
+
+  if (first == 0 && last == gst_buffer_list_length(buffer_list))
+    return gst_buffer_list_ref(buffer_list);
+
+  sub_list = gst_buffer_list_new_sized(last - first);
+  for (i = first; i < last; i++)
+    gst_buffer_list_add(sub_list, gst_buffer_ref(gst_buffer_list_get(buffer_list, i)));
+
+  return sub_list;
+}
+
+static void
+gst_prerecord_queue_update_levels(GstPrerecordQueue *queue)
+{
+  GstClockTime time = prerecord_ring_duration(&queue->ring);
+
+  GST_OBJECT_LOCK(queue);
+  queue->level_bytes = queue->ring.fifo->bytes;
+  queue->level_time = time;
+  GST_OBJECT_UNLOCK(queue);
+}
+
+/* Holds the buffers @first to @last - 1 of @buffer_list, the MP4 header is
+ * kept aside. Then drops whole GOPs from the front of the ring as long as
+ * what remains still covers the pre-record window and the memory-limit
+ * is kept. */
+static void
+gst_prerecord_queue_ring_push(GstPrerecordQueue *queue, GstBufferList *buffer_list,
+                              guint first, guint last)
+{
+  GstClockTime window = (GstClockTime)MAX(queue->pre_record, 0) * GST_SECOND;
+  guint evicted;
+
+  if (queue->mp4 && prerecord_mp4_has_header(buffer_list))
+  {
+    GstBufferList *media = gst_prerecord_queue_sub_list(buffer_list, first, last);
+
+    buffer_list = prerecord_mp4_take_header(&queue->mp4_header, &queue->mp4_info, media);
+    gst_buffer_list_unref(media);
+    first = 0;
+    last = gst_buffer_list_length(buffer_list);
+  }
+  else
+  {
+    gst_buffer_list_ref(buffer_list);
+  }
+
+  prerecord_list_split_gops(buffer_list, first, last, gst_prerecord_queue_ring_is_keyframe,
+                            gst_prerecord_queue_ring_push_range, queue);
+  gst_buffer_list_unref(buffer_list);
+
+  evicted = prerecord_ring_trim_window(&queue->ring, window, queue->memory_limit, NULL);
+  if (evicted > 0)
+    GST_LOG_OBJECT(queue, "evicted %u GOPs", evicted);
+
+  gst_prerecord_queue_update_levels(queue);
+}
+
+static void
+gst_prerecord_queue_ring_clear(GstPrerecordQueue *queue)
+{
+  prerecord_ring_clear(&queue->ring, FALSE);
+  gst_prerecord_queue_update_levels(queue);
+}
+
+/* Pushes the ring downstream from its oldest keyframe on, the lists go
+ * out as they were held after the MP4 header. The first buffer of the
+ * window is marked as a discontinuity. */
+static GstFlowReturn
+gst_prerecord_queue_ring_drain(GstPrerecordQueue *queue)
+{
+  GstFlowReturn flow = GST_FLOW_OK;
+  GstBufferList *buffer_list;
+  gboolean first = TRUE;
+
+  prerecord_ring_trim_to_keyframe(&queue->ring);
+
+  GST_DEBUG_OBJECT(queue, "pushing %u pre-recorded lists, %" G_GUINT64_FORMAT " bytes",
+                   prerecord_fifo_length(queue->ring.fifo), queue->ring.fifo->bytes);
+
+  if (queue->mp4 && queue->mp4_header)
+    flow = gst_pad_push_list(queue->srcpad, gst_buffer_list_ref(queue->mp4_header));
+
+  while (flow == GST_FLOW_OK && (buffer_list = prerecord_fifo_pop(queue->ring.fifo)) != NULL)
+  {
+    if (first)
+    {
+      buffer_list = gst_buffer_list_make_writable(buffer_list);
+      GST_BUFFER_FLAG_SET(gst_buffer_list_get_writable(buffer_list, 0),
+                          GST_BUFFER_FLAG_DISCONT);
+      first = FALSE;
+    }
+
+    flow = gst_pad_push_list(queue->srcpad, buffer_list);
+  }
+
+  if (flow != GST_FLOW_OK)
+    GST_DEBUG_OBJECT(queue, "pushing the pre-record window stopped: %s",
+                     gst_flow_get_name(flow));
+
+  gst_prerecord_queue_ring_clear(queue);
+
+  return flow;
+}
+
+/*** TRIGGER *****************************************************************/
+
+/* Queues a switch to @buffering at @running_time, replacing one that is
+ * still pending */
+static void
+gst_prerecord_queue_trigger_set(GstPrerecordQueue *queue, gint buffering,
+                                GstClockTime running_time)
+{
+  if (prerecord_trigger_set(GST_OBJECT_CAST(queue), &queue->trigger, buffering, running_time))
+    GST_DEBUG_OBJECT(queue, "replaced a pending trigger");
+
+  GST_DEBUG_OBJECT(queue, "buffering %d requested at %" GST_TIME_FORMAT, buffering,
+                   GST_TIME_ARGS(running_time));
+}
+
+/* Queues @buffering unless the queue is or will be in it already, or
+ * @from is set and it is not in that */
+static gboolean
+gst_prerecord_queue_trigger_request(GstPrerecordQueue *queue, gint buffering,
+                                    const gint *from, GstClockTime running_time)
+{
+  gint current = prerecord_trigger_target(GST_OBJECT_CAST(queue), &queue->trigger,
+                                          &queue->buffering);
+
+  if (current == buffering || (from != NULL && current != *from))
+    return FALSE;
+
+  gst_prerecord_queue_trigger_set(queue, buffering, running_time);
+
+  return TRUE;
+}
+
+static gboolean
+gst_prerecord_queue_start_recording(GstPrerecordQueue *queue, guint64 running_time)
+{
+  return gst_prerecord_queue_trigger_request(queue, GST_PRERECORD_QUEUE_BUFFERING_RECORDING,
+                                             NULL, running_time);
+}
+
+static gboolean
+gst_prerecord_queue_stop_recording(GstPrerecordQueue *queue, guint64 running_time)
+{
+  const gint recording = GST_PRERECORD_QUEUE_BUFFERING_RECORDING;
+
+  return gst_prerecord_queue_trigger_request(queue, GST_PRERECORD_QUEUE_BUFFERING_POSTRECORD,
+                                             &recording, running_time);
+}
+
+/* Switches to the pending buffering state before the buffer at
+ * @running_time, leaving pre-recording pushes the ring */
+static GstFlowReturn
+gst_prerecord_queue_trigger_apply(GstPrerecordQueue *queue, GstClockTime running_time)
+{
+  GstFlowReturn flow = GST_FLOW_OK;
+  GstClockTime requested_time;
+  gint64 requested;
+  gint buffering, previous;
+
+  buffering = prerecord_trigger_take(GST_OBJECT_CAST(queue), &queue->trigger,
+                                     &requested_time, &requested);
+  previous = queue->buffering;
+
+  if (previous == GST_PRERECORD_QUEUE_BUFFERING_PRERECORD &&
+      buffering != GST_PRERECORD_QUEUE_BUFFERING_PRERECORD)
+    flow = gst_prerecord_queue_ring_drain(queue);
+  if (buffering == GST_PRERECORD_QUEUE_BUFFERING_POSTRECORD)
+    queue->post_record_start = running_time;
+
+  GST_OBJECT_LOCK(queue);
+  queue->buffering = buffering;
+  GST_OBJECT_UNLOCK(queue);
+
+  GST_INFO_OBJECT(queue, "buffering %d at %" GST_TIME_FORMAT ", %" G_GINT64_FORMAT
+                         " us after the request",
+                  buffering, GST_TIME_ARGS(running_time), g_get_monotonic_time() - requested);
+
+  prerecord_trigger_post(GST_ELEMENT_CAST(queue), buffering, requested_time, running_time,
+                         requested);
+
+  return flow;
+}
+
+/*** STREAMING ***************************************************************/
+
+/* Passes on the buffers @first to @last - 1 of @buffer_list until the
+ * post-record window is over, then ends the stream */
+static GstFlowReturn
+gst_prerecord_queue_post_record(GstPrerecordQueue *queue, GstBufferList *buffer_list,
+                                guint first, guint last)
+{
+  GstClockTime end = queue->post_record_start +
+                     (GstClockTime)MAX(queue->post_record, 0) * GST_SECOND;
+  GstFlowReturn flow = GST_FLOW_OK;
+  guint i;
+
+  for (i = first; i < last; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+
+    if (prerecord_running_time(GST_ELEMENT_CAST(queue), &queue->segment,
+                               GST_BUFFER_DTS_OR_PTS(buffer)) >= end)
+      break;
+  }
+
+  if (i > first)
+    flow = gst_pad_push_list(queue->srcpad, gst_prerecord_queue_sub_list(buffer_list, first, i));
+  if (flow != GST_FLOW_OK || i == last)
+    return flow;
+
+  GST_DEBUG_OBJECT(queue, "post-record of %d s done", queue->post_record);
+  gst_pad_push_event(queue->srcpad, gst_event_new_eos());
+
+  return GST_FLOW_EOS;
+}
+
+/* Handles the buffers @first to @last - 1 of @buffer_list in the current
+ * buffering state */
+static GstFlowReturn
+gst_prerecord_queue_handle(GstPrerecordQueue *queue, GstBufferList *buffer_list,
+                           guint first, guint last)
+{
+  switch (queue->buffering)
+  {
+  case GST_PRERECORD_QUEUE_BUFFERING_PRERECORD:
+    gst_prerecord_queue_ring_push(queue, buffer_list, first, last);
+    return GST_FLOW_OK;
+  case GST_PRERECORD_QUEUE_BUFFERING_POSTRECORD:
+    return gst_prerecord_queue_post_record(queue, buffer_list, first, last);
+  default:
+    return gst_pad_push_list(queue->srcpad, gst_prerecord_queue_sub_list(buffer_list, first, last));
+  }
+}
+
+static GstFlowReturn
+gst_prerecord_queue_chain_list(GstPad *pad, GstObject *parent, GstBufferList *buffer_list)
+{
+  GstPrerecordQueue *queue = GST_PRERECORD_QUEUE(parent);
+  guint first = 0, num_buffers = gst_buffer_list_length(buffer_list);
+  GstFlowReturn flow = GST_FLOW_OK;
+
+  while (first < num_buffers)
+  {
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    guint i = prerecord_trigger_find(GST_ELEMENT_CAST(queue), &queue->trigger, &queue->segment,
+                                     buffer_list, first, &running_time);
+
+    if (i > first)
+      flow = gst_prerecord_queue_handle(queue, buffer_list, first, i);
+    if (flow != GST_FLOW_OK || i == num_buffers)
+      break;
+
+    flow = gst_prerecord_queue_trigger_apply(queue, running_time);
+    if (flow != GST_FLOW_OK)
+      break;
+    first = i;
+  }
+
+  gst_buffer_list_unref(buffer_list);
+
+  return flow;
+}
+
+static GstFlowReturn
+gst_prerecord_queue_chain(GstPad *pad, GstObject *parent, GstBuffer *buffer)
+{
+  GstBufferList *buffer_list = gst_buffer_list_new_sized(1);
+
+  gst_buffer_list_add(buffer_list, buffer);
+
+  return gst_prerecord_queue_chain_list(pad, parent, buffer_list);
+}
+
+static gboolean
+gst_prerecord_queue_sink_event(GstPad *pad, GstObject *parent, GstEvent *event)
+{
+  GstPrerecordQueue *queue = GST_PRERECORD_QUEUE(parent);
+
+  switch (GST_EVENT_TYPE(event))
+  {
+  case GST_EVENT_CAPS:
+  {
+    GstCaps *caps;
+
+    gst_event_parse_caps(event, &caps);
+    queue->mp4 = prerecord_mp4_set_caps(&queue->mp4_header, &queue->mp4_info, caps);
+    break;
+  }
+  case GST_EVENT_SEGMENT:
+    gst_event_copy_segment(event, &queue->segment);
+    break;
+  case GST_EVENT_FLUSH_STOP:
+    gst_prerecord_queue_ring_clear(queue);
+    gst_segment_init(&queue->segment, GST_FORMAT_UNDEFINED);
+    break;
+  case GST_EVENT_CUSTOM_DOWNSTREAM:
+    if (gst_event_has_name(event, GST_PRERECORD_QUEUE_TRIGGER))
+    {
+      GstClockTime running_time;
+      gint buffering;
+
+      /* the trigger is for this queue, not for what is downstream */
+      if (prerecord_trigger_parse_event(event, &buffering, &running_time))
+        gst_prerecord_queue_trigger_set(queue, buffering, running_time);
+      else
+        GST_WARNING_OBJECT(queue, "trigger event without buffering: %" GST_PTR_FORMAT, event);
+      gst_event_unref(event);
+      return TRUE;
+    }
+    break;
+  default:
+    break;
+  }
+
+  return gst_pad_event_default(pad, parent, event);
+}
@@ -0,0 +1,115 @@
+/* GStreamer
+ *
+ * gstprerecordqueue.h: pre-record ring in front of any sink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __GST_PRERECORD_QUEUE_H__
+#define __GST_PRERECORD_QUEUE_H__
+
+#include <gst/gst.h>
+
+#include "gstprerecordmp4.h"
+#include "gstprerecordring.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_PRERECORD_QUEUE \
+  (gst_prerecord_queue_get_type())
+#define GST_PRERECORD_QUEUE(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_PRERECORD_QUEUE,GstPrerecordQueue))
+#define GST_PRERECORD_QUEUE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_PRERECORD_QUEUE,GstPrerecordQueueClass))
+#define GST_IS_PRERECORD_QUEUE(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_PRERECORD_QUEUE))
+#define GST_IS_PRERECORD_QUEUE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_PRERECORD_QUEUE))
+#define GST_PRERECORD_QUEUE_CAST(obj) ((GstPrerecordQueue *)(obj))
+
+typedef struct _GstPrerecordQueue GstPrerecordQueue;
+typedef struct _GstPrerecordQueueClass GstPrerecordQueueClass;
+
+/* The queue takes the same trigger event as prerecordsink and posts the
+ * same element message once it switched */
+#define GST_PRERECORD_QUEUE_TRIGGER PRERECORD_TRIGGER_NAME
+
+/**
+ * GstPrerecordQueueBuffering:
+ * @GST_PRERECORD_QUEUE_BUFFERING_PRERECORD: Hold the pre-record window
+ * @GST_PRERECORD_QUEUE_BUFFERING_RECORDING: Pass the data downstream
+ * @GST_PRERECORD_QUEUE_BUFFERING_POSTRECORD: Pass the data downstream
+ *   for post-record seconds, then end the stream
+ *
+ * Same values as the buffering of prerecordsink.
+ */
+typedef enum {
+  GST_PRERECORD_QUEUE_BUFFERING_PRERECORD = -1,
+  GST_PRERECORD_QUEUE_BUFFERING_RECORDING = 0,
+  GST_PRERECORD_QUEUE_BUFFERING_POSTRECORD = 1
+} GstPrerecordQueueBuffering;
+
+/**
+ * GstPrerecordQueue:
+ *
+ * Opaque #GstPrerecordQueue structure.
+ */
+struct _GstPrerecordQueue {
+  GstElement parent;
+
+  /*< private >*/
+  GstPad *sinkpad;
+  GstPad *srcpad;
+
+  gint pre_record;
+  gint post_record;
+  guint64 memory_limit;
+  /* protected by the object lock, only written by the streaming thread */
+  gint buffering;
+
+  /* Pending change of @buffering, applied like in prerecordsink */
+  PrerecordTrigger trigger;
+
+  /* Streaming thread state: the ring of the pre-recorded lists and when
+   * post-recording began. With fragmented MP4 @mp4_header is the ftyp and
+   * moov that is pushed in front of the window. */
+  GstSegment segment;
+  PrerecordRing ring;
+  GstClockTime post_record_start;
+  gboolean mp4;
+  GstBufferList *mp4_header;
+  PrerecordMp4Info mp4_info;
+
+  /* Fill of the ring for the current-level properties, protected by the
+   * object lock */
+  guint64 level_bytes;
+  GstClockTime level_time;
+};
+
+struct _GstPrerecordQueueClass {
+  GstElementClass parent_class;
+
+  /* actions */
+  gboolean (*start_recording) (GstPrerecordQueue *queue, guint64 running_time);
+  gboolean (*stop_recording) (GstPrerecordQueue *queue, guint64 running_time);
+};
+
+G_GNUC_INTERNAL GType gst_prerecord_queue_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_QUEUE_H__ */
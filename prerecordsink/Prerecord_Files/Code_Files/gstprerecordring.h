@@ -0,0 +1,568 @@
+/* GStreamer
+ *
+ * gstprerecordring.h: pre-record ring and trigger shared by prerecordsink
+ * and prerecordqueue
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_PRERECORD_RING_H__
+#define __GST_PRERECORD_RING_H__
+
+#include <gst/gst.h>
+
+#include "gstprerecordfifo.h"
+#include "gstprerecordts.h"
+
+G_BEGIN_DECLS
+
+/* Name of the custom downstream event that requests a buffering switch and
+ * of the element message posted once it was applied */
+#define PRERECORD_TRIGGER_NAME "GstPrerecordSinkTrigger"
+
+/* Whether @buffer starts a GOP */
+typedef gboolean (*PrerecordKeyframeFunc) (GstBuffer *buffer, gpointer user_data);
+/* Takes the buffers @first to @last - 1 of @buffer_list, @keyframe when
+ * they start a GOP */
+typedef void (*PrerecordRangeFunc) (GstBufferList *buffer_list, guint first,
+                                    guint last, gboolean keyframe, gpointer user_data);
+
+/* Ring of references to the pre-recorded lists, split so that every GOP
+ * starts a node. @end is the running time the newest data ends at, with
+ * the oldest node this gives the buffered duration in O(1). Buffers of
+ * @last_pool are copied when it has a bounded number of buffers. Only
+ * touched by the streaming thread. */
+typedef struct _PrerecordRing {
+  BufferListFIFO *fifo;
+  GstClockTime end;
+  GstBufferPool *last_pool;
+  gboolean last_pool_limited;
+} PrerecordRing;
+
+/* Pending change of the buffering state from a property, an action signal
+ * or a trigger event. The streaming thread applies it to the first buffer
+ * at or after @time, GST_CLOCK_TIME_NONE for the next buffer. @requested
+ * is the monotonic time it was requested at. All of it is protected by the
+ * object lock of the element, @pending is also read atomically to keep
+ * the lock off the streaming path. */
+typedef struct _PrerecordTrigger {
+  gint pending;
+  gint buffering;
+  GstClockTime time;
+  gint64 requested;
+} PrerecordTrigger;
+
+/*** TIMING ******************************************************************/
+
+/* Running time of @ts in @segment. Data without timestamps falls back to
+ * the time it arrived at. */
+static inline GstClockTime
+prerecord_running_time(GstElement *element, const GstSegment *segment,
+                       GstClockTime ts)
+{
+  GstClockTime running_time = GST_CLOCK_TIME_NONE;
+
+  if (ts != GST_CLOCK_TIME_NONE)
+  {
+    if (segment->format != GST_FORMAT_TIME)
+      return ts;
+    running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, ts);
+  }
+
+  if (running_time == GST_CLOCK_TIME_NONE)
+    running_time = gst_element_get_current_running_time(element);
+  if (running_time == GST_CLOCK_TIME_NONE)
+    running_time = g_get_monotonic_time() * GST_USECOND;
+
+  return running_time;
+}
+
+/* Collects the side metadata of the buffers @first to @last - 1: timestamps
+ * of the first buffer, the first DTS or PTS in @ts, total duration, size in
+ * bytes and the flags of the first buffer. */
+static inline void
+prerecord_list_meta(GstBufferList *buffer_list, guint first, guint last,
+                    GstClockTime *pts, GstClockTime *dts, GstClockTime *ts,
+                    GstClockTime *duration, gsize *size, guint *flags)
+{
+  GstClockTime first_ts = GST_CLOCK_TIME_NONE;
+  GstClockTime last_ts = GST_CLOCK_TIME_NONE;
+  GstClockTime total = 0;
+  gboolean have_durations = TRUE;
+  guint i;
+
+  *pts = *dts = *duration = GST_CLOCK_TIME_NONE;
+  *size = 0;
+  *flags = 0;
+
+  for (i = first; i < last; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+    GstClockTime buffer_ts = GST_BUFFER_DTS_OR_PTS(buffer);
+
+    if (i == first)
+      *flags = GST_BUFFER_FLAGS(buffer);
+    if (*pts == GST_CLOCK_TIME_NONE)
+      *pts = GST_BUFFER_PTS(buffer);
+    if (*dts == GST_CLOCK_TIME_NONE)
+      *dts = GST_BUFFER_DTS(buffer);
+
+    if (buffer_ts != GST_CLOCK_TIME_NONE)
+    {
+      if (first_ts == GST_CLOCK_TIME_NONE)
+        first_ts = buffer_ts;
+      last_ts = buffer_ts;
+    }
+
+    if (GST_BUFFER_DURATION(buffer) != GST_CLOCK_TIME_NONE)
+      total += GST_BUFFER_DURATION(buffer);
+    else
+      have_durations = FALSE;
+
+    *size += gst_buffer_get_size(buffer);
+  }
+
+  if (have_durations)
+    *duration = total;
+  else if (first_ts != GST_CLOCK_TIME_NONE)
+    *duration = last_ts - first_ts;
+  *ts = first_ts;
+}
+
+/* Delta units and headers can never start a GOP, everything else is
+ * checked in the MPEG-TS payload when there is one */
+static inline gboolean
+prerecord_buffer_is_keyframe(GstBuffer *buffer)
+{
+  GstMapInfo map;
+  gboolean keyframe;
+
+  if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) ||
+      GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
+    return FALSE;
+
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+    return FALSE;
+
+  if (map.size >= PRERECORD_TS_PACKET_SIZE && map.data[0] == PRERECORD_TS_SYNC_BYTE)
+    keyframe = prerecord_ts_is_keyframe(map.data, map.size);
+  else
+    keyframe = TRUE;
+
+  gst_buffer_unmap(buffer, &map);
+
+  return keyframe;
+}
+
+/* Hands the buffers @first to @last - 1 of @buffer_list to @range split at
+ * every keyframe, so each GOP starts a range of its own. Returns TRUE if a
+ * new GOP started in them. */
+static inline gboolean
+prerecord_list_split_gops(GstBufferList *buffer_list, guint first, guint last,
+                          PrerecordKeyframeFunc is_keyframe, PrerecordRangeFunc range,
+                          gpointer user_data)
+{
+  gboolean keyframe = FALSE, have_keyframe = FALSE;
+  guint i;
+
+  for (i = first; i < last; i++)
+  {
+    if (!is_keyframe(gst_buffer_list_get(buffer_list, i), user_data))
+      continue;
+
+    if (i > first)
+      range(buffer_list, first, i, keyframe, user_data);
+    first = i;
+    keyframe = have_keyframe = TRUE;
+  }
+
+  if (last > first)
+    range(buffer_list, first, last, keyframe, user_data);
+
+  return have_keyframe;
+}
+
+/*** RING ********************************************************************/
+
+static inline void
+prerecord_ring_init(PrerecordRing *ring)
+{
+  ring->fifo = prerecord_fifo_new(PRERECORD_FIFO_DEFAULT_NODES);
+  ring->end = GST_CLOCK_TIME_NONE;
+  ring->last_pool = NULL;
+  ring->last_pool_limited = FALSE;
+}
+
+/* Drops every node, the pool seen last is forgotten with @pool */
+static inline void
+prerecord_ring_clear(PrerecordRing *ring, gboolean pool)
+{
+  prerecord_fifo_clear(ring->fifo);
+  ring->end = GST_CLOCK_TIME_NONE;
+
+  if (pool && ring->last_pool)
+  {
+    gst_object_unref(ring->last_pool);
+    ring->last_pool = NULL;
+  }
+}
+
+static inline void
+prerecord_ring_free(PrerecordRing *ring)
+{
+  prerecord_ring_clear(ring, TRUE);
+  prerecord_fifo_free(ring->fifo);
+  ring->fifo = NULL;
+}
+
+/* Bounded pools (v4l2, hardware encoders) only have a handful of buffers,
+ * holding them for the whole pre-record window would starve upstream. */
+static inline gboolean
+prerecord_ring_pool_is_limited(PrerecordRing *ring, GstBufferPool *pool)
+{
+  GstStructure *config;
+  guint max_buffers = 0;
+
+  if (pool == ring->last_pool)
+    return ring->last_pool_limited;
+
+  config = gst_buffer_pool_get_config(pool);
+  if (!gst_buffer_pool_config_get_params(config, NULL, NULL, NULL, &max_buffers))
+    max_buffers = 0;
+  gst_structure_free(config);
+
+  if (ring->last_pool)
+    gst_object_unref(ring->last_pool);
+  ring->last_pool = gst_object_ref(pool);
+  ring->last_pool_limited = (max_buffers != 0);
+
+  return ring->last_pool_limited;
+}
+
+/* Takes a new list holding references to the buffers @first to @last - 1 of
+ * @buffer_list, only buffers owned by a limited pool are copied. */
+static inline GstBufferList *
+prerecord_ring_ref_list(PrerecordRing *ring, GstBufferList *buffer_list,
+                        guint first, guint last)
+{
+  GstBufferList *ref_list = gst_buffer_list_new_sized(last - first);
+  guint i;
+
+  for (i = first; i < last; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+
+    if (buffer->pool != NULL && prerecord_ring_pool_is_limited(ring, buffer->pool))
+      buffer = gst_buffer_copy_deep(buffer);
+    else
+      buffer = gst_buffer_ref(buffer);
+
+    gst_buffer_list_add(ref_list, buffer);
+  }
+
+  return ref_list;
+}
+
+/* Moves @end to where data at @running_time lasting @duration ends */
+static inline void
+prerecord_ring_extend(PrerecordRing *ring, GstClockTime running_time,
+                      GstClockTime duration)
+{
+  GstClockTime end = running_time;
+
+  if (duration != GST_CLOCK_TIME_NONE)
+    end += duration;
+
+  if (ring->end == GST_CLOCK_TIME_NONE || end > ring->end)
+    ring->end = end;
+}
+
+/* Appends the buffers @first to @last - 1 of @buffer_list as one node,
+ * their running times are taken in @segment */
+static inline void
+prerecord_ring_push_range(PrerecordRing *ring, GstElement *element,
+                          const GstSegment *segment, GstBufferList *buffer_list,
+                          guint first, guint last, gboolean keyframe)
+{
+  BufferListNode node;
+  GstClockTime ts;
+  guint flags;
+
+  node.buffer_list = prerecord_ring_ref_list(ring, buffer_list, first, last);
+  node.keyframe = keyframe;
+  prerecord_list_meta(buffer_list, first, last, &node.pts, &node.dts, &ts,
+                      &node.duration, &node.size, &flags);
+  node.running_time = prerecord_running_time(element, segment, ts);
+  prerecord_ring_extend(ring, node.running_time, node.duration);
+
+  prerecord_fifo_push(ring->fifo, &node);
+}
+
+static inline void
+prerecord_ring_pop(PrerecordRing *ring)
+{
+  GstBufferList *buffer_list = prerecord_fifo_pop(ring->fifo);
+
+  if (buffer_list != NULL)
+    gst_buffer_list_unref(buffer_list);
+}
+
+static inline gboolean
+prerecord_ring_head_is_keyframe(const PrerecordRing *ring)
+{
+  return !prerecord_fifo_is_empty(ring->fifo) && prerecord_fifo_peek(ring->fifo)->keyframe;
+}
+
+/* Drops whatever precedes the oldest keyframe */
+static inline void
+prerecord_ring_trim_to_keyframe(PrerecordRing *ring)
+{
+  while (ring->fifo->n_keyframes > 0 && !prerecord_ring_head_is_keyframe(ring))
+    prerecord_ring_pop(ring);
+}
+
+/* Drops the oldest GOP. Streams without any detected keyframe drop a single
+ * node instead. */
+static inline void
+prerecord_ring_evict_gop(PrerecordRing *ring)
+{
+  do
+  {
+    prerecord_ring_pop(ring);
+  } while (ring->fifo->n_keyframes > 0 && !prerecord_ring_head_is_keyframe(ring));
+}
+
+/* Running time the GOP after the oldest one starts at, or the second node
+ * when there are no keyframes */
+static inline GstClockTime
+prerecord_ring_next_gop_start(const PrerecordRing *ring)
+{
+  gint next = prerecord_fifo_next_gop(ring->fifo);
+
+  if (next < 0)
+    return GST_CLOCK_TIME_NONE;
+
+  return prerecord_fifo_peek_nth(ring->fifo, next)->running_time;
+}
+
+/* Duration of media held, from the oldest node to @end */
+static inline GstClockTime
+prerecord_ring_duration(const PrerecordRing *ring)
+{
+  BufferListNode *head = prerecord_fifo_peek(ring->fifo);
+
+  if (head == NULL || head->running_time == GST_CLOCK_TIME_NONE ||
+      ring->end == GST_CLOCK_TIME_NONE || ring->end < head->running_time)
+    return 0;
+
+  return ring->end - head->running_time;
+}
+
+/* Drops whole GOPs from the front as long as what remains still covers
+ * @window, and then as long as more than @max_bytes are held when that is
+ * not 0. Returns the number of GOPs dropped, @limited is set when
+ * @max_bytes dropped some. */
+static inline guint
+prerecord_ring_trim_window(PrerecordRing *ring, GstClockTime window,
+                           guint64 max_bytes, gboolean *limited)
+{
+  guint evicted = 0;
+
+  for (;;)
+  {
+    GstClockTime next = prerecord_ring_next_gop_start(ring);
+
+    if (next == GST_CLOCK_TIME_NONE || ring->end < next + window)
+      break;
+
+    prerecord_ring_evict_gop(ring);
+    evicted++;
+  }
+
+  while (max_bytes > 0 && ring->fifo->bytes > max_bytes &&
+         prerecord_ring_next_gop_start(ring) != GST_CLOCK_TIME_NONE)
+  {
+    prerecord_ring_evict_gop(ring);
+    evicted++;
+    if (limited)
+      *limited = TRUE;
+  }
+
+  return evicted;
+}
+
+/*** TRIGGER *****************************************************************/
+
+static inline void
+prerecord_trigger_init(PrerecordTrigger *trigger)
+{
+  trigger->pending = FALSE;
+  trigger->buffering = 0;
+  trigger->time = GST_CLOCK_TIME_NONE;
+  trigger->requested = 0;
+}
+
+/* Queues a switch to @buffering at @running_time, replacing one that is
+ * still pending. Returns whether one was replaced. */
+static inline gboolean
+prerecord_trigger_set(GstObject *owner, PrerecordTrigger *trigger, gint buffering,
+                      GstClockTime running_time)
+{
+  gboolean replaced;
+
+  GST_OBJECT_LOCK(owner);
+  replaced = trigger->pending;
+  trigger->buffering = buffering;
+  trigger->time = running_time;
+  trigger->requested = g_get_monotonic_time();
+  g_atomic_int_set(&trigger->pending, TRUE);
+  GST_OBJECT_UNLOCK(owner);
+
+  return replaced;
+}
+
+/* Buffering state @owner is or will be in, @buffering is its current one.
+ * Takes the object lock. */
+static inline gint
+prerecord_trigger_target(GstObject *owner, const PrerecordTrigger *trigger,
+                         const gint *buffering)
+{
+  gint target;
+
+  GST_OBJECT_LOCK(owner);
+  target = trigger->pending ? trigger->buffering : *buffering;
+  GST_OBJECT_UNLOCK(owner);
+
+  return target;
+}
+
+/* Running time the pending trigger applies at, FALSE when there is none */
+static inline gboolean
+prerecord_trigger_pending(GstObject *owner, PrerecordTrigger *trigger,
+                          GstClockTime *time)
+{
+  gboolean pending;
+
+  if (!g_atomic_int_get(&trigger->pending))
+    return FALSE;
+
+  GST_OBJECT_LOCK(owner);
+  pending = trigger->pending;
+  *time = trigger->time;
+  GST_OBJECT_UNLOCK(owner);
+
+  return pending;
+}
+
+/* Index of the first buffer from @first on that the pending trigger applies
+ * to, its running time in @segment is returned in @running_time. The
+ * length of @buffer_list when there is none. */
+static inline guint
+prerecord_trigger_find(GstElement *element, PrerecordTrigger *trigger,
+                       const GstSegment *segment, GstBufferList *buffer_list,
+                       guint first, GstClockTime *running_time)
+{
+  guint i, num_buffers = gst_buffer_list_length(buffer_list);
+  GstClockTime time;
+
+  if (!prerecord_trigger_pending(GST_OBJECT_CAST(element), trigger, &time))
+    return num_buffers;
+
+  /* the running time may need the object lock for the clock */
+  for (i = first; i < num_buffers; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+
+    *running_time = prerecord_running_time(element, segment, GST_BUFFER_DTS_OR_PTS(buffer));
+    if (time == GST_CLOCK_TIME_NONE || *running_time >= time)
+      break;
+  }
+
+  return i;
+}
+
+/* Whether the pending trigger applies to @buffer, its running time in
+ * @segment is returned in @running_time */
+static inline gboolean
+prerecord_trigger_due(GstElement *element, PrerecordTrigger *trigger,
+                      const GstSegment *segment, GstBuffer *buffer,
+                      GstClockTime *running_time)
+{
+  GstClockTime time;
+
+  if (!prerecord_trigger_pending(GST_OBJECT_CAST(element), trigger, &time))
+    return FALSE;
+
+  *running_time = prerecord_running_time(element, segment, GST_BUFFER_DTS_OR_PTS(buffer));
+
+  return time == GST_CLOCK_TIME_NONE || *running_time >= time;
+}
+
+/* Takes the pending trigger to apply it, the time it was requested for
+ * and at are returned in @requested_time and @requested */
+static inline gint
+prerecord_trigger_take(GstObject *owner, PrerecordTrigger *trigger,
+                       GstClockTime *requested_time, gint64 *requested)
+{
+  gint buffering;
+
+  GST_OBJECT_LOCK(owner);
+  buffering = trigger->buffering;
+  *requested_time = trigger->time;
+  *requested = trigger->requested;
+  g_atomic_int_set(&trigger->pending, FALSE);
+  GST_OBJECT_UNLOCK(owner);
+
+  return buffering;
+}
+
+/* Posts the element message of a switch to @buffering at @running_time */
+static inline void
+prerecord_trigger_post(GstElement *element, gint buffering,
+                       GstClockTime requested_time, GstClockTime running_time,
+                       gint64 requested)
+{
+  gst_element_post_message(element,
+                           gst_message_new_element(GST_OBJECT_CAST(element),
+                                                   gst_structure_new(PRERECORD_TRIGGER_NAME,
+                                                                     "buffering", G_TYPE_INT, buffering,
+                                                                     "requested-time", G_TYPE_UINT64, requested_time,
+                                                                     "running-time", G_TYPE_UINT64, running_time,
+                                                                     "latency", G_TYPE_UINT64,
+                                                                     (guint64)(g_get_monotonic_time() - requested) * GST_USECOND,
+                                                                     NULL)));
+}
+
+/* Reads a trigger event, FALSE when it has no buffering */
+static inline gboolean
+prerecord_trigger_parse_event(GstEvent *event, gint *buffering,
+                              GstClockTime *running_time)
+{
+  const GstStructure *s = gst_event_get_structure(event);
+  guint64 time = GST_CLOCK_TIME_NONE;
+
+  if (!gst_structure_get_int(s, "buffering", buffering))
+    return FALSE;
+
+  gst_structure_get_uint64(s, "running-time", &time);
+  *running_time = time;
+
+  return TRUE;
+}
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_RING_H__ */
@@ -41,9 +41,23 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+/* io-engine=io-uring is only built when the build system found liburing
+ * and links against it, see README.txt */
+#ifdef HAVE_LIBURING
+#include <sys/uio.h>
+#include <liburing.h>
+#endif
 
 #include "gstelements_private.h"
 #include "gstprerecordsink.h"
+#include "gstprerecordindex.h"
+#include "gstprerecordtrace.h"
 #include "gstcoreelementselements.h"
 
 #define GST_BUFFER_DURATION(buf) (GST_BUFFER_CAST(buf)->duration)
@@ -57,6 +71,9 @@ static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE("sink",
 
 #define GST_TYPE_PRERECORD_SINK_BUFFER_MODE (gst_prerecord_sink_buffer_mode_get_type())
 #define GST_TYPE_PRERECORD_SINK_BUFFERING (gst_prerecord_sink_buffering_get_type())
+#define GST_TYPE_PRERECORD_SINK_RING_STORAGE (gst_prerecord_sink_ring_storage_get_type())
+#define GST_TYPE_PRERECORD_SINK_IO_ENGINE (gst_prerecord_sink_io_engine_get_type())
+#define GST_TYPE_PRERECORD_SINK_OVERFLOW_POLICY (gst_prerecord_sink_overflow_policy_get_type())
 
 
 static GType
@@ -101,6 +118,64 @@ gst_prerecord_sink_buffer_mode_get_type(void)
   return buffer_mode_type;
 }
 
+static GType
+gst_prerecord_sink_ring_storage_get_type(void)
+{
+  static GType ring_storage_type = 0;
+  static const GEnumValue ring_storage[] = {
+      {GST_PRERECORD_SINK_RING_STORAGE_REFS, "Buffer references", "refs"},
+      {GST_PRERECORD_SINK_RING_STORAGE_ARENA, "Preallocated byte arena", "arena"},
+      {GST_PRERECORD_SINK_RING_STORAGE_MMAP, "Memory mapped file in temp-location", "mmap"},
+      {GST_PRERECORD_SINK_RING_STORAGE_MEMFD, "Memory file capped by max-bytes", "memfd"},
+      {GST_PRERECORD_SINK_RING_STORAGE_JOURNAL, "Journaled file in temp-location, recovered after a crash", "journal"},
+      {0, NULL, NULL},
+  };
+
+  if (!ring_storage_type)
+  {
+    ring_storage_type =
+        g_enum_register_static("GstPrerecordSinkRingStorage", ring_storage);
+  }
+  return ring_storage_type;
+}
+
+static GType
+gst_prerecord_sink_io_engine_get_type(void)
+{
+  static GType io_engine_type = 0;
+  static const GEnumValue io_engine[] = {
+      {GST_PRERECORD_SINK_IO_ENGINE_WRITEV, "Blocking writev", "writev"},
+      {GST_PRERECORD_SINK_IO_ENGINE_IO_URING, "io_uring, writev if unavailable", "io-uring"},
+      {0, NULL, NULL},
+  };
+
+  if (!io_engine_type)
+  {
+    io_engine_type =
+        g_enum_register_static("GstPrerecordSinkIoEngine", io_engine);
+  }
+  return io_engine_type;
+}
+
+static GType
+gst_prerecord_sink_overflow_policy_get_type(void)
+{
+  static GType overflow_policy_type = 0;
+  static const GEnumValue overflow_policy[] = {
+      {GST_PRERECORD_SINK_OVERFLOW_BLOCK, "Wait for the writer", "block"},
+      {GST_PRERECORD_SINK_OVERFLOW_DROP_NON_REFERENCE, "Drop non-reference frames", "drop-non-reference"},
+      {GST_PRERECORD_SINK_OVERFLOW_DROP_GOP, "Drop the rest of the GOP", "drop-gop"},
+      {0, NULL, NULL},
+  };
+
+  if (!overflow_policy_type)
+  {
+    overflow_policy_type =
+        g_enum_register_static("GstPrerecordSinkOverflowPolicy", overflow_policy);
+  }
+  return overflow_policy_type;
+}
+
 GST_DEBUG_CATEGORY_STATIC(gst_prerecord_sink_debug);
 #define GST_CAT_DEFAULT gst_prerecord_sink_debug
 
@@ -114,6 +189,60 @@ GST_DEBUG_CATEGORY_STATIC(gst_prerecord_sink_debug);
 #define DEFAULT_PRE_RECORD 30
 #define DEFAULT_POST_RECORD 30
 #define DEFAULT_BUFFERING GST_PRERECORD_SINK_BUFFERING_PRERECORD
+#define DEFAULT_RING_STORAGE GST_PRERECORD_SINK_RING_STORAGE_REFS
+#define DEFAULT_MAX_BYTES 0
+#define DEFAULT_MAX_TIME 0
+#define DEFAULT_ASYNC_WRITE FALSE
+#define DEFAULT_IO_ENGINE GST_PRERECORD_SINK_IO_ENGINE_WRITEV
+#define DEFAULT_DIRECT_IO FALSE
+#define DEFAULT_RECORD_DURATION 0
+#define DEFAULT_TEMP_LOCATION NULL
+#define DEFAULT_SYNC_INTERVAL 1000
+#define DEFAULT_MAX_SEGMENT_TIME 0
+#define DEFAULT_MAX_SEGMENT_BYTES 0
+#define DEFAULT_MAX_FILES 0
+#define DEFAULT_REBASE_TIMESTAMPS TRUE
+#define DEFAULT_SEEK_INDEX FALSE
+#define DEFAULT_THUMBNAIL FALSE
+#define DEFAULT_MAX_CLIPS 0
+#define DEFAULT_CLIP_LOCATION NULL
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_TRACE_LOCATION NULL
+#define DEFAULT_OVERFLOW_BUDGET 0
+#define DEFAULT_OVERFLOW_POLICY GST_PRERECORD_SINK_OVERFLOW_BLOCK
+#define DEFAULT_WRITEBACK_BYTES 0
+#define DEFAULT_WRITEBACK_INTERVAL 0
+#define DEFAULT_BURST_SIZE 0
+#define DEFAULT_BURST_TIME 5000
+#define DEFAULT_MEMORY_LIMIT 0
+#define DEFAULT_MEMORY_PRESSURE 0.0
+#define DEFAULT_MIN_PRE_RECORD 2
+#define DEFAULT_PRESSURE_LOCATION NULL
+
+/* Bitrate the arena is sized for when only a duration is known, the
+ * 16 Mbit/s recording pipeline plus headroom for rate control peaks */
+#define ARENA_SIZING_BITRATE (20 * 1000 * 1000)
+/* Smallest list we expect from mpegtsmux, bounds the arena index */
+#define ARENA_MIN_ENTRY_SIZE (7 * 188)
+/* Lists per second the arena index is sized for at first, a video frame
+ * and the audio frames muxed with it arrive as about three lists. The
+ * index doubles when a stream pushes more. */
+#define ARENA_SIZING_LISTS 100
+/* File backed arenas are handed back to the kernel in chunks of this size
+ * once written, they are only read again on a trigger */
+#define ARENA_ADVISE_CHUNK (8 * 1024 * 1024)
+
+/* How often in ms the memory pressure is read, and how much the
+ * pre-record window grows back every time it is low */
+#define PRESSURE_POLL_INTERVAL 1000
+#define PRESSURE_GROW_STEP GST_SECOND
+
+/* GLib only has 32 bit and pointer sized atomics, the 64 bit statistics
+ * use the compiler builtins it is implemented with */
+#define STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_SUB(counter, value) __atomic_fetch_sub(&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_SET(counter, value) __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
 
 enum
 {
@@ -127,11 +256,52 @@ enum
   PROP_LAST,
   PROP_PRE_RECORD,
   PROP_POST_RECORD,
-  PROP_BUFFERING
+  PROP_BUFFERING,
+  PROP_RING_STORAGE,
+  PROP_MAX_BYTES,
+  PROP_MAX_TIME,
+  PROP_ASYNC_WRITE,
+  PROP_IO_ENGINE,
+  PROP_DIRECT_IO,
+  PROP_RECORD_DURATION,
+  PROP_TEMP_LOCATION,
+  PROP_SYNC_INTERVAL,
+  PROP_MAX_SEGMENT_TIME,
+  PROP_MAX_SEGMENT_BYTES,
+  PROP_MAX_FILES,
+  PROP_REBASE_TIMESTAMPS,
+  PROP_SEEK_INDEX,
+  PROP_THUMBNAIL,
+  PROP_MAX_CLIPS,
+  PROP_CLIP_LOCATION,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_TRACE_LOCATION,
+  PROP_OVERFLOW_BUDGET,
+  PROP_OVERFLOW_POLICY,
+  PROP_WRITEBACK_BYTES,
+  PROP_WRITEBACK_INTERVAL,
+  PROP_BURST_SIZE,
+  PROP_BURST_TIME,
+  PROP_MEMORY_LIMIT,
+  PROP_MEMORY_PRESSURE,
+  PROP_MIN_PRE_RECORD,
+  PROP_PRESSURE_LOCATION
+};
+
+enum
+{
+  SIGNAL_START_RECORDING,
+  SIGNAL_STOP_RECORDING,
+  SIGNAL_SAVE_CLIP,
+  LAST_SIGNAL
 };
 
+static guint gst_prerecord_sink_signals[LAST_SIGNAL] = {0};
+
 static FILE *
-gst_fopen(const gchar *prerecordname, const gchar *mode, gboolean o_sync)
+gst_fopen(const gchar *prerecordname, const gchar *mode, gboolean o_sync,
+          gboolean direct)
 {
   FILE *retval;
 #ifdef G_OS_WIN32
@@ -151,8 +321,22 @@ gst_fopen(const gchar *prerecordname, const gchar *mode, gboolean o_sync)
   if (o_sync)
     flags |= O_SYNC;
 
+#ifdef O_DIRECT
+  /* filesystems without direct I/O refuse the flag */
+  if (direct)
+  {
+    fd = open(prerecordname, flags | O_DIRECT, 0666);
+    if (fd >= 0 || errno != EINVAL)
+      goto opened;
+  }
+#endif
+
   fd = open(prerecordname, flags, 0666);
 
+#ifdef O_DIRECT
+opened:
+#endif
+
   if (fd < 0)
     return NULL;
 
@@ -162,6 +346,7 @@ gst_fopen(const gchar *prerecordname, const gchar *mode, gboolean o_sync)
 }
 
 static void gst_prerecord_sink_dispose(GObject *object);
+static void gst_prerecord_sink_finalize(GObject *object);
 
 static void gst_prerecord_sink_set_property(GObject *object, guint prop_id,
                                             const GValue *value, GParamSpec *pspec);
@@ -174,6 +359,7 @@ static void gst_prerecord_sink_close_prerecord(GstPrerecordSink *sink);
 static gboolean gst_prerecord_sink_start(GstBaseSink *sink);
 static gboolean gst_prerecord_sink_stop(GstBaseSink *sink);
 static gboolean gst_prerecord_sink_event(GstBaseSink *sink, GstEvent *event);
+static gboolean gst_prerecord_sink_set_caps(GstBaseSink *sink, GstCaps *caps);
 static GstFlowReturn gst_prerecord_sink_render(GstBaseSink *sink,
                                                GstBuffer *buffer);
 static GstFlowReturn gst_prerecord_sink_render_list(GstBaseSink *sink,
@@ -192,6 +378,51 @@ static void gst_prerecord_sink_uri_handler_init(gpointer g_iface,
                                                 gpointer iface_data);
 
 static GstFlowReturn gst_prerecord_sink_flush_buffer(GstPrerecordSink *prerecordsink);
+static void gst_prerecord_sink_writer_stop(GstPrerecordSink *sink);
+static void gst_prerecord_sink_uring_close(GstPrerecordSink *sink);
+static GstFlowReturn gst_prerecord_sink_direct_stop(GstPrerecordSink *sink);
+static GstFlowReturn gst_prerecord_sink_segment_switch(GstPrerecordSink *sink,
+                                                       FILE *next, const gchar *location);
+static void gst_prerecord_sink_segment_stop(GstPrerecordSink *sink);
+static gboolean gst_prerecord_sink_segmenting(GstPrerecordSink *sink);
+static gchar *gst_prerecord_sink_segment_name(GstPrerecordSink *sink, guint index);
+static gchar *gst_prerecord_sink_expand_name(GstPrerecordSink *sink, const gchar *template,
+                                             guint index);
+static gboolean gst_prerecord_sink_is_segment_marker(GstMiniObject *obj);
+static void gst_prerecord_sink_mp4_finish(GstPrerecordSink *sink, const gchar *location);
+static void gst_prerecord_sink_mp4_set_caps(GstPrerecordSink *sink, GstCaps *caps);
+static void gst_prerecord_sink_rebase_reset(GstPrerecordSink *sink);
+static void gst_prerecord_sink_index_open(GstPrerecordSink *sink, const gchar *location);
+static void gst_prerecord_sink_index_close(GstPrerecordSink *sink);
+static void gst_prerecord_sink_thumbnail_start(GstPrerecordSink *sink, const gchar *location);
+static void gst_prerecord_sink_thumbnail_stop(GstPrerecordSink *sink);
+static gboolean gst_prerecord_sink_start_recording(GstPrerecordSink *sink,
+                                                   guint64 running_time);
+static gboolean gst_prerecord_sink_stop_recording(GstPrerecordSink *sink,
+                                                  guint64 running_time);
+static void gst_prerecord_sink_trigger_set(GstPrerecordSink *sink, gint buffering,
+                                           GstClockTime running_time);
+static gchar *gst_prerecord_sink_save_clip(GstPrerecordSink *sink);
+static void gst_prerecord_sink_stats_write(GstPrerecordSink *sink, guint64 bytes,
+                                           gint64 start);
+static void gst_prerecord_sink_stats_update(GstPrerecordSink *sink);
+static GstStructure *gst_prerecord_sink_create_stats(GstPrerecordSink *sink);
+static void gst_prerecord_sink_clip_feed(GstPrerecordSink *sink, GstBufferList *buffer_list);
+static void gst_prerecord_sink_clip_keep(GstPrerecordSink *sink, GstBufferList *buffer_list);
+static void gst_prerecord_sink_clip_stop(GstPrerecordSink *sink);
+static void gst_prerecord_sink_trace_open(GstPrerecordSink *sink);
+static void gst_prerecord_sink_pressure_open(GstPrerecordSink *sink);
+static void gst_prerecord_sink_pressure_close(GstPrerecordSink *sink);
+static void gst_prerecord_sink_pressure_poll(GstPrerecordSink *sink);
+static GstFlowReturn gst_prerecord_sink_overflow_render_list(GstPrerecordSink *sink,
+                                                             GstBufferList *buffer_list);
+static void gst_prerecord_sink_overflow_stalled(GstPrerecordSink *sink, gint64 stall);
+static void gst_prerecord_sink_trace_close(GstPrerecordSink *sink);
+static guint64 gst_prerecord_sink_position(GstPrerecordSink *sink);
+static void gst_prerecord_sink_trace_list(GstPrerecordSink *sink, GstBufferList *buffer_list);
+static void gst_prerecord_sink_trace_buffer(GstPrerecordSink *sink, GstBuffer *buffer);
+static void gst_prerecord_sink_trace_trigger(GstPrerecordSink *sink, gint buffering,
+                                             GstClockTime running_time);
 
 #define _do_init                                                                    \
   G_IMPLEMENT_INTERFACE(GST_TYPE_URI_HANDLER, gst_prerecord_sink_uri_handler_init); \
@@ -210,6 +441,7 @@ gst_prerecord_sink_class_init(GstPrerecordSinkClass *klass)
   GstBaseSinkClass *gstbasesink_class = GST_BASE_SINK_CLASS(klass);
 
   gobject_class->dispose = gst_prerecord_sink_dispose;
+  gobject_class->finalize = gst_prerecord_sink_finalize;
 
   gobject_class->set_property = gst_prerecord_sink_set_property;
   gobject_class->get_property = gst_prerecord_sink_get_property;
@@ -255,11 +487,436 @@ gst_prerecord_sink_class_init(GstPrerecordSinkClass *klass)
                                                    "Time in seconds for Postrecording", G_MININT, G_MAXINT, DEFAULT_POST_RECORD,
                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * GstPrerecordSink:buffering
+   *
+   * Pre-recording, recording or post-recording. Setting it is applied by
+   * the streaming thread to the next buffer it gets, like the
+   * #GstPrerecordSink::start-recording and
+   * #GstPrerecordSink::stop-recording actions without a running time.
+   */
   g_object_class_install_property(gobject_class, PROP_BUFFERING,
                                   g_param_spec_enum("buffering", "Buffering",
                                                        "Precord / Record /Postrecord", GST_TYPE_PRERECORD_SINK_BUFFERING,
                                                        DEFAULT_BUFFERING,G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * GstPrerecordSink:ring-storage
+   *
+   * Keep the pre-recorded data as references to the upstream buffers or
+   * copy it into an arena that is allocated once when the sink starts.
+   */
+  g_object_class_install_property(gobject_class, PROP_RING_STORAGE,
+                                  g_param_spec_enum("ring-storage", "Ring storage",
+                                                    "Storage used for the pre-recorded data", GST_TYPE_PRERECORD_SINK_RING_STORAGE,
+                                                    DEFAULT_RING_STORAGE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:max-bytes
+   *
+   * Size of the pre-record arena in bytes. When 0 the arena is sized from
+   * #GstPrerecordSink:max-time. Set it to cap the RAM used by a memfd ring.
+   */
+  g_object_class_install_property(gobject_class, PROP_MAX_BYTES,
+                                  g_param_spec_uint64("max-bytes", "Max bytes",
+                                                      "Size of the pre-record arena in bytes (0 = from max-time)", 0,
+                                                      G_MAXSIZE, DEFAULT_MAX_BYTES,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:max-time
+   *
+   * Duration in nanoseconds the pre-record arena is sized for, assuming the
+   * recording bitrate. When 0 the pre-record time is used.
+   */
+  g_object_class_install_property(gobject_class, PROP_MAX_TIME,
+                                  g_param_spec_uint64("max-time", "Max time",
+                                                      "Duration in ns the pre-record arena is sized for (0 = pre-record)", 0,
+                                                      G_MAXUINT64, DEFAULT_MAX_TIME,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:temp-location
+   *
+   * Directory the mmap and journal ring files are created in, the
+   * temporary directory when not set. The mmap file is removed as soon as
+   * it is mapped, the journal file is kept so it can be recovered.
+   */
+  g_object_class_install_property(gobject_class, PROP_TEMP_LOCATION,
+                                  g_param_spec_string("temp-location", "Temp location",
+                                                      "Directory for the ring file of ring-storage=mmap or journal", DEFAULT_TEMP_LOCATION,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:sync-interval
+   *
+   * Interval in milliseconds the journal ring is flushed to the disk at
+   * while pre-recording, which bounds how much of it is lost on power
+   * failure. When 0 it is only flushed when recording starts and when the
+   * sink stops.
+   */
+  g_object_class_install_property(gobject_class, PROP_SYNC_INTERVAL,
+                                  g_param_spec_int("sync-interval", "Sync interval",
+                                                   "Interval in ms the journal ring is flushed to disk at (0 = only on trigger)",
+                                                   0, G_MAXINT, DEFAULT_SYNC_INTERVAL,
+                                                   G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:async-write
+   *
+   * Write to the prerecord from a separate thread so that a slow card does
+   * not block the streaming thread. Takes effect when the sink is started.
+   */
+  g_object_class_install_property(gobject_class, PROP_ASYNC_WRITE,
+                                  g_param_spec_boolean("async-write", "Asynchronous write",
+                                                       "Write from a separate writer thread", DEFAULT_ASYNC_WRITE,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:overflow-budget
+   *
+   * Bytes of recorded data that may wait for the writer thread while the
+   * card stalls, on top of the pre-recorded window written at a trigger.
+   * Once the budget is used up the #GstPrerecordSink:overflow-policy
+   * applies. A budget starts the writer thread even without async-write,
+   * 0 only limits the writer to its fixed number of queued lists.
+   */
+  g_object_class_install_property(gobject_class, PROP_OVERFLOW_BUDGET,
+                                  g_param_spec_uint64("overflow-budget", "Overflow budget",
+                                                      "Bytes queued for the writer before the overflow policy applies (0 = no limit)",
+                                                      0, G_MAXUINT64, DEFAULT_OVERFLOW_BUDGET,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:overflow-policy
+   *
+   * What to do with recorded data when the writer is that far behind. The
+   * default blocks the streaming thread and posts a
+   * "GstPrerecordSinkOverflow" element message with the "queued-bytes"
+   * and the "stall" time once the data is queued. The drop policies post a
+   * QoS message for every list they drop buffers from instead. Dropping
+   * non-reference frames only applies to H.264 in MPEG-TS and waits for
+   * reference frames. Dropping GOPs drops up to the next keyframe that
+   * fits.
+   */
+  g_object_class_install_property(gobject_class, PROP_OVERFLOW_POLICY,
+                                  g_param_spec_enum("overflow-policy", "Overflow policy",
+                                                    "What to do with data that does not fit in the overflow budget",
+                                                    GST_TYPE_PRERECORD_SINK_OVERFLOW_POLICY, DEFAULT_OVERFLOW_POLICY,
+                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:writeback-bytes
+   *
+   * Hand every that many bytes written to the kernel for writeback right
+   * away, wait for the previous range to reach the card and drop it from
+   * the page cache. This keeps at most two ranges of dirty data around
+   * instead of letting the kernel flush hundreds of MB at once, without
+   * the cost of o-sync on every write. 0 leaves writeback to the kernel.
+   * Needs sync_file_range(), not used with direct-io.
+   */
+  g_object_class_install_property(gobject_class, PROP_WRITEBACK_BYTES,
+                                  g_param_spec_uint64("writeback-bytes", "Writeback bytes",
+                                                      "Start writeback every that many bytes (0 = kernel default)",
+                                                      0, G_MAXUINT64, DEFAULT_WRITEBACK_BYTES,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:writeback-interval
+   *
+   * Like #GstPrerecordSink:writeback-bytes, every that many ms of writing.
+   * Both can be combined, whichever comes first starts the writeback.
+   */
+  g_object_class_install_property(gobject_class, PROP_WRITEBACK_INTERVAL,
+                                  g_param_spec_uint("writeback-interval", "Writeback interval",
+                                                    "Start writeback every that many ms (0 = kernel default)",
+                                                    0, G_MAXUINT, DEFAULT_WRITEBACK_INTERVAL,
+                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:burst-size
+   *
+   * Collect that many bytes in the writer thread and write them in one
+   * burst followed by their writeback, so that the card can go idle in
+   * between and save power. Data is held for at most
+   * #GstPrerecordSink:burst-time and written right away when the sink
+   * waits for it. Starts the writer thread even without async-write,
+   * 0 writes the data as it comes.
+   */
+  g_object_class_install_property(gobject_class, PROP_BURST_SIZE,
+                                  g_param_spec_uint64("burst-size", "Burst size",
+                                                      "Bytes written in one burst (0 = no bursts)",
+                                                      0, G_MAXUINT64, DEFAULT_BURST_SIZE,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:burst-time
+   *
+   * Longest time in ms data is held back for a burst, which bounds how
+   * much is lost on power failure.
+   */
+  g_object_class_install_property(gobject_class, PROP_BURST_TIME,
+                                  g_param_spec_uint("burst-time", "Burst time",
+                                                    "Longest time in ms data is held for a burst",
+                                                    0, G_MAXUINT, DEFAULT_BURST_TIME,
+                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:memory-limit
+   *
+   * Most bytes the pre-record ring may hold, the oldest GOPs are evicted
+   * to stay below it and the pre-record window shrinks to what fits. An
+   * arena ring-storage keeps its size but gives the pages of what was
+   * evicted back to the system, which needs mmap. 0 for no limit.
+   */
+  g_object_class_install_property(gobject_class, PROP_MEMORY_LIMIT,
+                                  g_param_spec_uint64("memory-limit", "Memory limit",
+                                                      "Most bytes held by the pre-record ring (0 = no limit)",
+                                                      0, G_MAXUINT64, DEFAULT_MEMORY_LIMIT,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:memory-pressure
+   *
+   * Memory pressure, the PSI "some avg10" percentage of the time tasks
+   * stalled on memory, at which the pre-record window is halved every
+   * second down to #GstPrerecordSink:min-pre-record, evicting the oldest
+   * GOPs. Once the pressure is below half of it the window grows back by
+   * a second every second. A "GstPrerecordSinkWindow" element message
+   * with the effective "window", the configured "pre-record", both in ns,
+   * and the "pressure" (-1 when not known) is posted whenever the window
+   * changes. Needs Linux 4.20 with PSI, 0 does not watch the pressure.
+   */
+  g_object_class_install_property(gobject_class, PROP_MEMORY_PRESSURE,
+                                  g_param_spec_double("memory-pressure", "Memory pressure",
+                                                      "PSI some avg10 percentage the pre-record window shrinks at (0 = off)",
+                                                      0.0, 100.0, DEFAULT_MEMORY_PRESSURE,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:min-pre-record
+   *
+   * Time in seconds the pre-record window is never cut below by the
+   * memory pressure. The memory-limit still applies.
+   */
+  g_object_class_install_property(gobject_class, PROP_MIN_PRE_RECORD,
+                                  g_param_spec_int("min-pre-record", "Min pre record",
+                                                   "Shortest pre-record window in seconds under memory pressure",
+                                                   0, G_MAXINT, DEFAULT_MIN_PRE_RECORD,
+                                                   G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:pressure-location
+   *
+   * PSI file the memory pressure is read from. When not set it is the
+   * memory.pressure of the cgroup v2 the process runs in, or the system
+   * wide /proc/pressure/memory.
+   */
+  g_object_class_install_property(gobject_class, PROP_PRESSURE_LOCATION,
+                                  g_param_spec_string("pressure-location", "Pressure location",
+                                                      "PSI file the memory pressure is read from",
+                                                      DEFAULT_PRESSURE_LOCATION,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:io-engine
+   *
+   * How the data is written to the prerecord. io-uring keeps several
+   * batched writes in flight and falls back to writev when the kernel or
+   * the build has no io_uring support. Takes effect when the sink is
+   * started.
+   */
+  g_object_class_install_property(gobject_class, PROP_IO_ENGINE,
+                                  g_param_spec_enum("io-engine", "I/O engine",
+                                                    "Interface used to write to the prerecord", GST_TYPE_PRERECORD_SINK_IO_ENGINE,
+                                                    DEFAULT_IO_ENGINE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:direct-io
+   *
+   * Open the prerecord with O_DIRECT and write aligned chunks from a staging
+   * buffer, bypassing the page cache. Not used when appending and replaces
+   * the io-uring engine. Takes effect when the sink is started.
+   */
+  g_object_class_install_property(gobject_class, PROP_DIRECT_IO,
+                                  g_param_spec_boolean("direct-io", "Direct I/O",
+                                                       "Open the prerecord with O_DIRECT", DEFAULT_DIRECT_IO,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:record-duration
+   *
+   * Expected recording time in seconds between pre- and post-recording.
+   * When recording starts the clip is preallocated for pre-record +
+   * record-duration + post-record seconds at the bitrate seen in the
+   * pre-recorded data, and cut back to its real size when closed.
+   */
+  g_object_class_install_property(gobject_class, PROP_RECORD_DURATION,
+                                  g_param_spec_int("record-duration", "Record duration",
+                                                   "Expected recording time in seconds used to preallocate the clip (0 = no preallocation)",
+                                                   0, G_MAXINT, DEFAULT_RECORD_DURATION,
+                                                   G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:max-segment-time
+   *
+   * Start a new file once the recording has gone on for this many
+   * nanoseconds of running time. The split is made at the next keyframe
+   * and #GstPrerecordSink:location is used as a template for the file
+   * names: a printf conversion with a width like %05d takes the segment
+   * index, everything else is expanded like strftime with the local time
+   * the segment starts at. Only used with the default buffer-mode and
+   * not when appending.
+   */
+  g_object_class_install_property(gobject_class, PROP_MAX_SEGMENT_TIME,
+                                  g_param_spec_uint64("max-segment-time", "Max segment time",
+                                                      "Split the recording into files of this many ns (0 = no limit)", 0,
+                                                      G_MAXUINT64, DEFAULT_MAX_SEGMENT_TIME,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:max-segment-bytes
+   *
+   * Start a new file at the next keyframe once the current one holds this
+   * many bytes, see #GstPrerecordSink:max-segment-time.
+   */
+  g_object_class_install_property(gobject_class, PROP_MAX_SEGMENT_BYTES,
+                                  g_param_spec_uint64("max-segment-bytes", "Max segment bytes",
+                                                      "Split the recording into files of this many bytes (0 = no limit)", 0,
+                                                      G_MAXUINT64, DEFAULT_MAX_SEGMENT_BYTES,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:max-files
+   *
+   * Loop recording, the oldest segments written by this sink are deleted
+   * so that at most this many are kept on disk.
+   */
+  g_object_class_install_property(gobject_class, PROP_MAX_FILES,
+                                  g_param_spec_uint("max-files", "Max files",
+                                                    "Number of segments to keep on disk (0 = keep all)", 0,
+                                                    G_MAXUINT, DEFAULT_MAX_FILES,
+                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:rebase-timestamps
+   *
+   * Rewrite the PCR, PTS and DTS of MPEG-TS and the decode times of
+   * fragmented MP4 so that every prerecord starts at zero, playback can
+   * then seek without parsing the whole file first. All fMP4 tracks are
+   * moved by the same time so audio and video stay in sync. MPEG-TS starts
+   * at the lead of the PTS over the PCR instead, so audio muxed ahead of
+   * the first keyframe keeps its timestamps. Not done when appending.
+   */
+  g_object_class_install_property(gobject_class, PROP_REBASE_TIMESTAMPS,
+                                  g_param_spec_boolean("rebase-timestamps", "Rebase timestamps",
+                                                       "Start the timestamps of every prerecord at zero",
+                                                       DEFAULT_REBASE_TIMESTAMPS,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:seek-index
+   *
+   * Write the time and byte offset of every keyframe to a sidecar file
+   * named after the prerecord with ".idx" appended, so that playback can
+   * find where to start reading without parsing the prerecord. The format
+   * is described in gstprerecordindex.h. Only used with the default
+   * buffer-mode and not when appending.
+   */
+  g_object_class_install_property(gobject_class, PROP_SEEK_INDEX,
+                                  g_param_spec_boolean("seek-index", "Seek index",
+                                                       "Write a keyframe index next to every prerecord",
+                                                       DEFAULT_SEEK_INDEX,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:thumbnail
+   *
+   * Save the first H.264 keyframe of every prerecord next to it with
+   * ".thumb.h264" appended, as an Annex B stream with its SPS and PPS that
+   * decodes to a single picture. A "GstPrerecordSinkThumbnail" element
+   * message with the "location" of the thumbnail and the "prerecord" it
+   * belongs to is posted once it is written. Only used with the default
+   * buffer-mode.
+   */
+  g_object_class_install_property(gobject_class, PROP_THUMBNAIL,
+                                  g_param_spec_boolean("thumbnail", "Thumbnail",
+                                                       "Save the first keyframe of every prerecord next to it",
+                                                       DEFAULT_THUMBNAIL,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:max-clips
+   *
+   * Number of clips #GstPrerecordSink::save-clip can write at the same
+   * time, 0 disables the action. While it is enabled the pre-record ring
+   * keeps filling during recording and post-recording so that every clip
+   * gets the full pre-record window.
+   */
+  g_object_class_install_property(gobject_class, PROP_MAX_CLIPS,
+                                  g_param_spec_uint("max-clips", "Max clips",
+                                                    "Clips that can be saved at the same time (0 = disabled)",
+                                                    0, G_MAXUINT, DEFAULT_MAX_CLIPS,
+                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:clip-location
+   *
+   * Template of the clip file names, expanded like the location of
+   * segments with the clip number starting at 1. When not set "-clip" is
+   * added before the extension of the location.
+   */
+  g_object_class_install_property(gobject_class, PROP_CLIP_LOCATION,
+                                  g_param_spec_string("clip-location", "Clip location",
+                                                      "Template of the clip file names", DEFAULT_CLIP_LOCATION,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:stats
+   *
+   * Statistics of the sink: the #GstBaseSink stats plus "ring-bytes",
+   * "ring-duration", "ring-gops" and "ring-lists" held by the pre-record
+   * ring, the GOPs it "evicted", the "bytes-written" and "writes" to the prerecord, the
+   * "write-latency-p50", "-p95" and "-p99" percentiles and the longest
+   * single write as "max-stall", the "queued-bytes" waiting for the writer
+   * thread, the "dropped-bytes" and "dropped-buffers" of the overflow
+   * policy and the "overflow-stalls" the streaming thread waited for the
+   * writer, all times in ns. Latencies are measured
+   * on the streaming thread, with async-write they are the time it took
+   * to hand the data to the writer.
+   */
+  g_object_class_install_property(gobject_class, PROP_STATS,
+                                  g_param_spec_boxed("stats", "Statistics",
+                                                     "Sink and pre-record ring statistics", GST_TYPE_STRUCTURE,
+                                                     G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:stats-interval
+   *
+   * Post the #GstPrerecordSink:stats as a "GstPrerecordSinkStats" element
+   * message every that many ms while data flows, 0 to never post them.
+   */
+  g_object_class_install_property(gobject_class, PROP_STATS_INTERVAL,
+                                  g_param_spec_uint("stats-interval", "Stats interval",
+                                                    "Interval in ms of the stats messages (0 = disabled)",
+                                                    0, G_MAXUINT, DEFAULT_STATS_INTERVAL,
+                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstPrerecordSink:trace-location
+   *
+   * File the arrival time, size, flags and timestamps of every buffer and
+   * the buffering requests are traced to while the sink runs, so that the
+   * pattern of a real device can be replayed with prerecordsink-replay.
+   * The format is described in gstprerecordtrace.h. Nothing is traced when
+   * not set.
+   */
+  g_object_class_install_property(gobject_class, PROP_TRACE_LOCATION,
+                                  g_param_spec_string("trace-location", "Trace location",
+                                                      "File the buffer arrival trace is written to",
+                                                      DEFAULT_TRACE_LOCATION,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_property(gobject_class,
                                   PROP_MAX_TRANSIENT_ERROR_TIMEOUT,
                                   g_param_spec_int("max-transient-error-timeout",
@@ -268,6 +925,70 @@ gst_prerecord_sink_class_init(GstPrerecordSinkClass *klass)
                                                    G_MAXINT, DEFAULT_MAX_TRANSIENT_ERROR_TIMEOUT,
                                                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * GstPrerecordSink::start-recording:
+   * @sink: the prerecordsink
+   * @running_time: running time to start recording at, or
+   *   GST_CLOCK_TIME_NONE to start with the next buffer
+   *
+   * Writes the pre-recorded window and records from the first buffer at or
+   * after @running_time on. Everything before it stays in the pre-record
+   * window. A "GstPrerecordSinkTrigger" element message with the
+   * "buffering" state, the "requested-time", the "running-time" it was
+   * applied at and the "latency" in ns from the request is posted once
+   * the state changed.
+   *
+   * Returns: %FALSE when the sink already records
+   */
+  gst_prerecord_sink_signals[SIGNAL_START_RECORDING] =
+      g_signal_new("start-recording", G_TYPE_FROM_CLASS(klass),
+                   G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                   G_STRUCT_OFFSET(GstPrerecordSinkClass, start_recording),
+                   NULL, NULL, NULL, G_TYPE_BOOLEAN, 1, G_TYPE_UINT64);
+
+  /**
+   * GstPrerecordSink::stop-recording:
+   * @sink: the prerecordsink
+   * @running_time: running time to stop recording at, or
+   *   GST_CLOCK_TIME_NONE to stop with the next buffer
+   *
+   * Starts post-recording at the first buffer at or after @running_time,
+   * the sink goes EOS #GstPrerecordSink:post-record seconds later.
+   *
+   * Returns: %FALSE when the sink does not record
+   */
+  gst_prerecord_sink_signals[SIGNAL_STOP_RECORDING] =
+      g_signal_new("stop-recording", G_TYPE_FROM_CLASS(klass),
+                   G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                   G_STRUCT_OFFSET(GstPrerecordSinkClass, stop_recording),
+                   NULL, NULL, NULL, G_TYPE_BOOLEAN, 1, G_TYPE_UINT64);
+
+  /**
+   * GstPrerecordSink::save-clip:
+   * @sink: the prerecordsink
+   *
+   * Saves a clip of its own from the next buffer on: the pre-record window
+   * in the ring followed by #GstPrerecordSink:post-record seconds of live
+   * data. Clips share the ring and the live buffers by reference and are
+   * written by their own thread, independent of the prerecord and of each
+   * other, so one can be saved while others are still being written. A
+   * "GstPrerecordSinkClip" element message with the "location", the
+   * "bytes" written and whether it was "truncated" because its thread fell
+   * too far behind is posted once a clip is closed.
+   *
+   * Returns: the location of the clip, %NULL when #GstPrerecordSink:max-clips
+   *   clips are being written already
+   */
+  gst_prerecord_sink_signals[SIGNAL_SAVE_CLIP] =
+      g_signal_new("save-clip", G_TYPE_FROM_CLASS(klass),
+                   G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                   G_STRUCT_OFFSET(GstPrerecordSinkClass, save_clip),
+                   NULL, NULL, NULL, G_TYPE_STRING, 0);
+
+  klass->start_recording = gst_prerecord_sink_start_recording;
+  klass->stop_recording = gst_prerecord_sink_stop_recording;
+  klass->save_clip = gst_prerecord_sink_save_clip;
+
   gst_element_class_set_static_metadata(gstelement_class,
                                         "Prerecord Sink",
                                         "Sink/Prerecord", "Write stream to a prerecord",
@@ -281,6 +1002,7 @@ gst_prerecord_sink_class_init(GstPrerecordSinkClass *klass)
   gstbasesink_class->render_list =
       GST_DEBUG_FUNCPTR(gst_prerecord_sink_render_list);
   gstbasesink_class->event = GST_DEBUG_FUNCPTR(gst_prerecord_sink_event);
+  gstbasesink_class->set_caps = GST_DEBUG_FUNCPTR(gst_prerecord_sink_set_caps);
   gstbasesink_class->unlock = GST_DEBUG_FUNCPTR(gst_prerecord_sink_unlock);
   gstbasesink_class->unlock_stop =
       GST_DEBUG_FUNCPTR(gst_prerecord_sink_unlock_stop);
@@ -292,6 +1014,9 @@ gst_prerecord_sink_class_init(GstPrerecordSinkClass *klass)
   }
 
   gst_type_mark_as_plugin_api(GST_TYPE_PRERECORD_SINK_BUFFER_MODE, 0);
+  gst_type_mark_as_plugin_api(GST_TYPE_PRERECORD_SINK_RING_STORAGE, 0);
+  gst_type_mark_as_plugin_api(GST_TYPE_PRERECORD_SINK_IO_ENGINE, 0);
+  gst_type_mark_as_plugin_api(GST_TYPE_PRERECORD_SINK_OVERFLOW_POLICY, 0);
 }
 
 static void
@@ -306,6 +1031,48 @@ gst_prerecord_sink_init(GstPrerecordSink *prerecordsink)
   prerecordsink->post_record = DEFAULT_POST_RECORD;
   prerecordsink->buffering = DEFAULT_BUFFERING;
   prerecordsink->append = FALSE;
+  prerecordsink->ring_storage = DEFAULT_RING_STORAGE;
+  prerecordsink->max_bytes = DEFAULT_MAX_BYTES;
+  prerecordsink->max_time = DEFAULT_MAX_TIME;
+  prerecord_ring_init(&prerecordsink->ring);
+  prerecord_trigger_init(&prerecordsink->trigger);
+  prerecordsink->arena.fd = -1;
+  prerecordsink->async_write = DEFAULT_ASYNC_WRITE;
+  prerecordsink->overflow_budget = DEFAULT_OVERFLOW_BUDGET;
+  prerecordsink->overflow_policy = DEFAULT_OVERFLOW_POLICY;
+  prerecordsink->writeback_bytes = DEFAULT_WRITEBACK_BYTES;
+  prerecordsink->writeback_interval = DEFAULT_WRITEBACK_INTERVAL;
+  prerecordsink->burst_size = DEFAULT_BURST_SIZE;
+  prerecordsink->burst_time = DEFAULT_BURST_TIME;
+  prerecordsink->memory_limit = DEFAULT_MEMORY_LIMIT;
+  prerecordsink->memory_pressure = DEFAULT_MEMORY_PRESSURE;
+  prerecordsink->min_pre_record = DEFAULT_MIN_PRE_RECORD;
+  prerecordsink->pressure_location = DEFAULT_PRESSURE_LOCATION;
+  prerecordsink->pre_record_window = GST_CLOCK_TIME_NONE;
+  prerecordsink->io_engine = DEFAULT_IO_ENGINE;
+  prerecordsink->direct_io = DEFAULT_DIRECT_IO;
+  prerecordsink->record_duration = DEFAULT_RECORD_DURATION;
+  prerecordsink->sync_interval = DEFAULT_SYNC_INTERVAL;
+  prerecordsink->max_segment_time = DEFAULT_MAX_SEGMENT_TIME;
+  prerecordsink->max_segment_bytes = DEFAULT_MAX_SEGMENT_BYTES;
+  prerecordsink->max_files = DEFAULT_MAX_FILES;
+  prerecordsink->rebase_timestamps = DEFAULT_REBASE_TIMESTAMPS;
+  prerecordsink->rebase_ts_base = G_MAXUINT64;
+  prerecordsink->rebase_ts_pcr = G_MAXUINT64;
+  prerecordsink->rebase_ts_lead = G_MAXUINT64;
+  prerecordsink->rebase_mp4_base = GST_CLOCK_TIME_NONE;
+  prerecordsink->seek_index = DEFAULT_SEEK_INDEX;
+  prerecordsink->index_start = GST_CLOCK_TIME_NONE;
+  prerecordsink->thumbnail = DEFAULT_THUMBNAIL;
+  prerecordsink->thumbnail_data = g_byte_array_new();
+  prerecordsink->max_clips = DEFAULT_MAX_CLIPS;
+  prerecordsink->stats_interval = DEFAULT_STATS_INTERVAL;
+  g_queue_init(&prerecordsink->segment_files);
+  g_mutex_init(&prerecordsink->async_lock);
+  g_cond_init(&prerecordsink->async_cond);
+  g_mutex_init(&prerecordsink->pin_lock);
+  g_cond_init(&prerecordsink->pin_cond);
+  g_mutex_init(&prerecordsink->segment_lock);
 
   gst_base_sink_set_sync(GST_BASE_SINK(prerecordsink), FALSE);
 }
@@ -321,6 +1088,31 @@ gst_prerecord_sink_dispose(GObject *object)
   sink->uri = NULL;
   g_free(sink->prerecordname);
   sink->prerecordname = NULL;
+  g_free(sink->temp_location);
+  sink->temp_location = NULL;
+  g_free(sink->clip_location);
+  sink->clip_location = NULL;
+  g_free(sink->trace_location);
+  sink->trace_location = NULL;
+  g_free(sink->pressure_location);
+  sink->pressure_location = NULL;
+  g_queue_clear_full(&sink->segment_files, g_free);
+}
+
+static void
+gst_prerecord_sink_finalize(GObject *object)
+{
+  GstPrerecordSink *sink = GST_PRERECORD_SINK(object);
+
+  g_mutex_clear(&sink->async_lock);
+  g_cond_clear(&sink->async_cond);
+  g_mutex_clear(&sink->pin_lock);
+  g_cond_clear(&sink->pin_cond);
+  g_mutex_clear(&sink->segment_lock);
+  prerecord_ring_free(&sink->ring);
+  g_byte_array_unref(sink->thumbnail_data);
+
+  G_OBJECT_CLASS(parent_class)->finalize(object);
 }
 
 static gboolean
@@ -393,11 +1185,105 @@ gst_prerecord_sink_set_property(GObject *object, guint prop_id,
     break;
   case PROP_PRE_RECORD:
     sink->pre_record = g_value_get_int(value);
+    break;
   case PROP_POST_RECORD:
     sink->post_record = g_value_get_int(value);
     break;
   case PROP_BUFFERING:
-    sink->buffering = g_value_get_enum(value);
+    gst_prerecord_sink_trigger_set(sink, g_value_get_enum(value), GST_CLOCK_TIME_NONE);
+    break;
+  case PROP_RING_STORAGE:
+    sink->ring_storage = g_value_get_enum(value);
+    break;
+  case PROP_MAX_BYTES:
+    sink->max_bytes = g_value_get_uint64(value);
+    break;
+  case PROP_MAX_TIME:
+    sink->max_time = g_value_get_uint64(value);
+    break;
+  case PROP_ASYNC_WRITE:
+    sink->async_write = g_value_get_boolean(value);
+    break;
+  case PROP_OVERFLOW_BUDGET:
+    sink->overflow_budget = g_value_get_uint64(value);
+    break;
+  case PROP_OVERFLOW_POLICY:
+    sink->overflow_policy = g_value_get_enum(value);
+    break;
+  case PROP_WRITEBACK_BYTES:
+    sink->writeback_bytes = g_value_get_uint64(value);
+    break;
+  case PROP_WRITEBACK_INTERVAL:
+    sink->writeback_interval = g_value_get_uint(value);
+    break;
+  case PROP_BURST_SIZE:
+    sink->burst_size = g_value_get_uint64(value);
+    break;
+  case PROP_BURST_TIME:
+    sink->burst_time = g_value_get_uint(value);
+    break;
+  case PROP_MEMORY_LIMIT:
+    sink->memory_limit = g_value_get_uint64(value);
+    break;
+  case PROP_MEMORY_PRESSURE:
+    sink->memory_pressure = g_value_get_double(value);
+    break;
+  case PROP_MIN_PRE_RECORD:
+    sink->min_pre_record = g_value_get_int(value);
+    break;
+  case PROP_PRESSURE_LOCATION:
+    g_free(sink->pressure_location);
+    sink->pressure_location = g_value_dup_string(value);
+    break;
+  case PROP_IO_ENGINE:
+    sink->io_engine = g_value_get_enum(value);
+    break;
+  case PROP_DIRECT_IO:
+    sink->direct_io = g_value_get_boolean(value);
+    break;
+  case PROP_RECORD_DURATION:
+    sink->record_duration = g_value_get_int(value);
+    break;
+  case PROP_TEMP_LOCATION:
+    g_free(sink->temp_location);
+    sink->temp_location = g_value_dup_string(value);
+    break;
+  case PROP_SYNC_INTERVAL:
+    sink->sync_interval = g_value_get_int(value);
+    break;
+  case PROP_MAX_SEGMENT_TIME:
+    sink->max_segment_time = g_value_get_uint64(value);
+    break;
+  case PROP_MAX_SEGMENT_BYTES:
+    sink->max_segment_bytes = g_value_get_uint64(value);
+    break;
+  case PROP_MAX_FILES:
+    sink->max_files = g_value_get_uint(value);
+    break;
+  case PROP_REBASE_TIMESTAMPS:
+    sink->rebase_timestamps = g_value_get_boolean(value);
+    break;
+  case PROP_SEEK_INDEX:
+    sink->seek_index = g_value_get_boolean(value);
+    break;
+  case PROP_THUMBNAIL:
+    sink->thumbnail = g_value_get_boolean(value);
+    break;
+  case PROP_MAX_CLIPS:
+    sink->max_clips = g_value_get_uint(value);
+    break;
+  case PROP_CLIP_LOCATION:
+    GST_OBJECT_LOCK(sink);
+    g_free(sink->clip_location);
+    sink->clip_location = g_value_dup_string(value);
+    GST_OBJECT_UNLOCK(sink);
+    break;
+  case PROP_STATS_INTERVAL:
+    sink->stats_interval = g_value_get_uint(value);
+    break;
+  case PROP_TRACE_LOCATION:
+    g_free(sink->trace_location);
+    sink->trace_location = g_value_dup_string(value);
     break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
@@ -438,29 +1324,136 @@ gst_prerecord_sink_get_property(GObject *object, guint prop_id, GValue *value,
     g_value_set_int(value, sink->post_record);
     break;
   case PROP_BUFFERING:
-    g_value_set_enum(value, sink->buffering);
+    g_value_set_enum(value, prerecord_trigger_target(GST_OBJECT_CAST(sink),
+                                                     &sink->trigger, &sink->buffering));
     break;
-  default:
-    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+  case PROP_RING_STORAGE:
+    g_value_set_enum(value, sink->ring_storage);
     break;
-  }
-}
-
-static gboolean
-gst_prerecord_sink_open_prerecord(GstPrerecordSink *sink)
-{
-  /* open the prerecord */
-  if (sink->prerecordname == NULL || sink->prerecordname[0] == '\0')
-    goto no_prerecordname;
-
+  case PROP_MAX_BYTES:
+    g_value_set_uint64(value, sink->max_bytes);
+    break;
+  case PROP_MAX_TIME:
+    g_value_set_uint64(value, sink->max_time);
+    break;
+  case PROP_ASYNC_WRITE:
+    g_value_set_boolean(value, sink->async_write);
+    break;
+  case PROP_OVERFLOW_BUDGET:
+    g_value_set_uint64(value, sink->overflow_budget);
+    break;
+  case PROP_OVERFLOW_POLICY:
+    g_value_set_enum(value, sink->overflow_policy);
+    break;
+  case PROP_WRITEBACK_BYTES:
+    g_value_set_uint64(value, sink->writeback_bytes);
+    break;
+  case PROP_WRITEBACK_INTERVAL:
+    g_value_set_uint(value, sink->writeback_interval);
+    break;
+  case PROP_BURST_SIZE:
+    g_value_set_uint64(value, sink->burst_size);
+    break;
+  case PROP_BURST_TIME:
+    g_value_set_uint(value, sink->burst_time);
+    break;
+  case PROP_MEMORY_LIMIT:
+    g_value_set_uint64(value, sink->memory_limit);
+    break;
+  case PROP_MEMORY_PRESSURE:
+    g_value_set_double(value, sink->memory_pressure);
+    break;
+  case PROP_MIN_PRE_RECORD:
+    g_value_set_int(value, sink->min_pre_record);
+    break;
+  case PROP_PRESSURE_LOCATION:
+    g_value_set_string(value, sink->pressure_location);
+    break;
+  case PROP_IO_ENGINE:
+    g_value_set_enum(value, sink->io_engine);
+    break;
+  case PROP_DIRECT_IO:
+    g_value_set_boolean(value, sink->direct_io);
+    break;
+  case PROP_RECORD_DURATION:
+    g_value_set_int(value, sink->record_duration);
+    break;
+  case PROP_TEMP_LOCATION:
+    g_value_set_string(value, sink->temp_location);
+    break;
+  case PROP_SYNC_INTERVAL:
+    g_value_set_int(value, sink->sync_interval);
+    break;
+  case PROP_MAX_SEGMENT_TIME:
+    g_value_set_uint64(value, sink->max_segment_time);
+    break;
+  case PROP_MAX_SEGMENT_BYTES:
+    g_value_set_uint64(value, sink->max_segment_bytes);
+    break;
+  case PROP_MAX_FILES:
+    g_value_set_uint(value, sink->max_files);
+    break;
+  case PROP_REBASE_TIMESTAMPS:
+    g_value_set_boolean(value, sink->rebase_timestamps);
+    break;
+  case PROP_SEEK_INDEX:
+    g_value_set_boolean(value, sink->seek_index);
+    break;
+  case PROP_THUMBNAIL:
+    g_value_set_boolean(value, sink->thumbnail);
+    break;
+  case PROP_MAX_CLIPS:
+    g_value_set_uint(value, sink->max_clips);
+    break;
+  case PROP_CLIP_LOCATION:
+    GST_OBJECT_LOCK(sink);
+    g_value_set_string(value, sink->clip_location);
+    GST_OBJECT_UNLOCK(sink);
+    break;
+  case PROP_STATS:
+    g_value_take_boxed(value, gst_prerecord_sink_create_stats(sink));
+    break;
+  case PROP_STATS_INTERVAL:
+    g_value_set_uint(value, sink->stats_interval);
+    break;
+  case PROP_TRACE_LOCATION:
+    g_value_set_string(value, sink->trace_location);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    break;
+  }
+}
+
+static gboolean
+gst_prerecord_sink_open_prerecord(GstPrerecordSink *sink)
+{
+  /* open the prerecord */
+  if (sink->prerecordname == NULL || sink->prerecordname[0] == '\0')
+    goto no_prerecordname;
+
+  /* the location is a template of the segment names when segmenting */
+  g_free(sink->segment_location);
+  sink->segment_index = 0;
+  if (gst_prerecord_sink_segmenting(sink))
+    sink->segment_location = gst_prerecord_sink_segment_name(sink, 0);
+  else
+    sink->segment_location = g_strdup(sink->prerecordname);
+
   if (sink->append)
-    sink->prerecord = gst_fopen(sink->prerecordname, "ab", sink->o_sync);
+    sink->prerecord = gst_fopen(sink->segment_location, "ab", sink->o_sync, FALSE);
   else
-    sink->prerecord = gst_fopen(sink->prerecordname, "wb", sink->o_sync);
+    sink->prerecord = gst_fopen(sink->segment_location, "wb", sink->o_sync,
+                                sink->direct_io);
   if (sink->prerecord == NULL)
     goto open_failed;
 
   sink->current_pos = 0;
+  sink->preallocated = FALSE;
+  sink->mp4_header_written = FALSE;
+  gst_prerecord_sink_rebase_reset(sink);
+  gst_prerecord_sink_index_open(sink, sink->segment_location);
+  gst_prerecord_sink_thumbnail_start(sink, sink->segment_location);
   /* try to seek in the prerecord to figure out if it is seekable */
   sink->seekable = gst_prerecord_sink_do_seek(sink, 0);
 
@@ -492,7 +1485,7 @@ gst_prerecord_sink_open_prerecord(GstPrerecordSink *sink)
   }
 
   GST_DEBUG_OBJECT(sink, "opened prerecord %s, seekable %d",
-                   sink->prerecordname, sink->seekable);
+                   sink->segment_location, sink->seekable);
 
   return TRUE;
 
@@ -506,7 +1499,7 @@ no_prerecordname:
 open_failed:
 {
   GST_ELEMENT_ERROR(sink, RESOURCE, OPEN_WRITE,
-                    (_("Could not open prerecord \"%s\" for writing."), sink->prerecordname),
+                    (_("Could not open prerecord \"%s\" for writing."), sink->segment_location),
                     GST_ERROR_SYSTEM);
   return FALSE;
 }
@@ -521,13 +1514,31 @@ gst_prerecord_sink_close_prerecord(GstPrerecordSink *sink)
       GST_ELEMENT_ERROR(sink, RESOURCE, CLOSE,
                         (_("Error closing prerecord \"%s\"."), sink->prerecordname), NULL);
 
+    gst_prerecord_sink_writer_stop(sink);
+    gst_prerecord_sink_segment_stop(sink);
+    gst_prerecord_sink_uring_close(sink);
+    if (gst_prerecord_sink_direct_stop(sink) != GST_FLOW_OK)
+      GST_ELEMENT_ERROR(sink, RESOURCE, CLOSE,
+                        (_("Error closing prerecord \"%s\"."), sink->prerecordname), NULL);
+
+    /* give back what was preallocated and not used */
+    if (sink->preallocated && ftruncate(fileno(sink->prerecord), sink->current_pos))
+      GST_DEBUG_OBJECT(sink, "truncating failed: %s", g_strerror(errno));
+
     if (fclose(sink->prerecord) != 0)
       GST_ELEMENT_ERROR(sink, RESOURCE, CLOSE,
                         (_("Error closing prerecord \"%s\"."), sink->prerecordname), GST_ERROR_SYSTEM);
 
     GST_DEBUG_OBJECT(sink, "closed prerecord");
     sink->prerecord = NULL;
+    gst_prerecord_sink_index_close(sink);
+    gst_prerecord_sink_thumbnail_stop(sink);
+
+    if (sink->mp4 && !sink->append)
+      gst_prerecord_sink_mp4_finish(sink, sink->segment_location);
   }
+  g_free(sink->segment_location);
+  sink->segment_location = NULL;
 
   if (sink->buffer)
   {
@@ -563,7 +1574,7 @@ gst_prerecord_sink_query(GstBaseSink *bsink, GstQuery *query)
     case GST_FORMAT_DEFAULT:
     case GST_FORMAT_BYTES:
       gst_query_set_position(query, GST_FORMAT_BYTES,
-                             self->current_pos + self->current_buffer_size);
+                             gst_prerecord_sink_position(self) + self->current_buffer_size);
       res = TRUE;
       break;
     default:
@@ -602,784 +1613,6704 @@ gst_prerecord_sink_query(GstBaseSink *bsink, GstQuery *query)
   return res;
 }
 
-#ifdef HAVE_FSEEKO
-#define __GST_STDIO_SEEK_FUNCTION "fseeko"
-#elif defined(G_OS_UNIX) || defined(G_OS_WIN32)
-#define __GST_STDIO_SEEK_FUNCTION "lseek"
-#else
-#define __GST_STDIO_SEEK_FUNCTION "fseek"
-#endif
+static GstFlowReturn
+gst_prerecord_sink_write_error(GstPrerecordSink *sink)
+{
+  if (errno == ENOSPC)
+    GST_ELEMENT_ERROR(sink, RESOURCE, NO_SPACE_LEFT, (NULL), (NULL));
+  else
+    GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                      (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                      ("%s", g_strerror(errno)));
+  return GST_FLOW_ERROR;
+}
 
 static gboolean
-gst_prerecord_sink_do_seek(GstPrerecordSink *prerecordsink, guint64 new_offset)
+gst_prerecord_sink_write_all(gint fd, const guint8 *data, gsize size)
 {
-  GST_DEBUG_OBJECT(prerecordsink, "Seeking to offset %" G_GUINT64_FORMAT " using " __GST_STDIO_SEEK_FUNCTION, new_offset);
-
-  if (gst_prerecord_sink_flush_buffer(prerecordsink) != GST_FLOW_OK)
-    goto flush_buffer_failed;
+  while (size > 0)
+  {
+    ssize_t ret = write(fd, data, size);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return FALSE;
+    data += ret;
+    size -= ret;
+  }
+  return TRUE;
+}
 
-#ifdef HAVE_FSEEKO
-  if (fseeko(prerecordsink->prerecord, (off_t)new_offset, SEEK_SET) != 0)
-    goto seek_failed;
-#elif defined(G_OS_UNIX) || defined(G_OS_WIN32)
-  if (lseek(fileno(prerecordsink->prerecord), (off_t)new_offset,
-            SEEK_SET) == (off_t)-1)
-    goto seek_failed;
-#else
-  if (fseek(prerecordsink->prerecord, (long)new_offset, SEEK_SET) != 0)
-    goto seek_failed;
-#endif
+/*** IO_URING ENGINE *********************************************************/
+
+#ifdef HAVE_LIBURING
+
+/* Writes in flight at the same time and buffers batched into one writev,
+ * a default list of 64 KiB of TS packets fits in a single write */
+#define URING_QUEUE_DEPTH 8
+#define URING_MAX_IOVECS 512
+
+/* One submitted or pending writev, the buffers stay mapped and referenced
+ * until the kernel has completed it */
+typedef struct _PrerecordUringWrite {
+  struct iovec iov[URING_MAX_IOVECS];
+  GstMapInfo map[URING_MAX_IOVECS];
+  GstBuffer *buffers[URING_MAX_IOVECS];
+  guint n_iov;
+  guint64 offset;
+  gsize size;
+} PrerecordUringWrite;
+
+typedef struct _PrerecordUring {
+  struct io_uring ring;
+  PrerecordUringWrite *writes;
+  guint free_slots[URING_QUEUE_DEPTH];
+  guint n_free;
+  /* write being filled, not queued yet */
+  PrerecordUringWrite *pending;
+  /* only submit when the queue is full or the batch is over */
+  gboolean batch;
+  gboolean arena_registered;
+} PrerecordUring;
 
-  /* adjust position reporting after seek;
-   * presumably this should basically yield new_offset */
-  gst_prerecord_sink_get_current_offset(prerecordsink, &prerecordsink->current_pos);
+static void
+gst_prerecord_sink_uring_release(PrerecordUring *uring, PrerecordUringWrite *w)
+{
+  guint i;
 
-  return TRUE;
+  for (i = 0; i < w->n_iov; i++)
+  {
+    if (w->buffers[i] == NULL)
+      continue;
+    gst_buffer_unmap(w->buffers[i], &w->map[i]);
+    gst_buffer_unref(w->buffers[i]);
+    w->buffers[i] = NULL;
+  }
+  w->n_iov = 0;
+  w->size = 0;
 
-  /* ERRORS */
-flush_buffer_failed:
-{
-  GST_DEBUG_OBJECT(prerecordsink, "Flushing buffer failed");
-  return FALSE;
-}
-seek_failed:
-{
-  GST_DEBUG_OBJECT(prerecordsink, "Seeking failed: %s", g_strerror(errno));
-  return FALSE;
-}
+  uring->free_slots[uring->n_free++] = w - uring->writes;
 }
 
-/* handle events (search) */
-static gboolean
-gst_prerecord_sink_event(GstBaseSink *sink, GstEvent *event)
+/* Finishes a completed write, the rare short write is completed with
+ * blocking pwritev calls */
+static GstFlowReturn
+gst_prerecord_sink_uring_complete(GstPrerecordSink *sink, PrerecordUringWrite *w,
+                                  gint res)
 {
-  GstEventType type;
-  GstPrerecordSink *prerecordsink;
+  struct iovec *iov = w->iov;
+  guint n_iov = w->n_iov;
+  guint64 offset = w->offset;
+  gsize skip;
 
-  prerecordsink = GST_PRERECORD_SINK(sink);
+  if (res < 0)
+  {
+    errno = -res;
+    goto write_error;
+  }
 
-  type = GST_EVENT_TYPE(event);
+  skip = res;
+  offset += res;
 
-  switch (type)
-  {
-  case GST_EVENT_SEGMENT:
+  for (;;)
   {
-    const GstSegment *segment;
-
-    gst_event_parse_segment(event, &segment);
+    gssize written;
 
-    if (segment->format == GST_FORMAT_BYTES)
-    {
-      /* only try to seek and fail when we are going to a different
-       * position */
-      if (prerecordsink->current_pos + prerecordsink->current_buffer_size !=
-          segment->start)
-      {
-        /* FIXME, the seek should be performed on the pos field, start/stop are
-         * just boundaries for valid bytes offsets. We should also fill the prerecord
-         * with zeroes if the new position extends the current EOF (sparse streams
-         * and segment accumulation). */
-        if (!gst_prerecord_sink_do_seek(prerecordsink, (guint64)segment->start))
-          goto seek_failed;
-      }
-      else
-      {
-        GST_DEBUG_OBJECT(prerecordsink, "Ignored SEGMENT, no seek needed");
-      }
-    }
-    else
+    while (n_iov > 0 && skip >= iov->iov_len)
     {
-      GST_DEBUG_OBJECT(prerecordsink,
-                       "Ignored SEGMENT event of format %u (%s)", (guint)segment->format,
-                       gst_format_get_name(segment->format));
+      skip -= iov->iov_len;
+      iov++;
+      n_iov--;
     }
-    break;
-  }
-  case GST_EVENT_FLUSH_STOP:
-    if (prerecordsink->current_pos != 0 && prerecordsink->seekable)
+    if (n_iov == 0)
+      break;
+
+    iov->iov_base = (guint8 *)iov->iov_base + skip;
+    iov->iov_len -= skip;
+
+    GST_DEBUG_OBJECT(sink, "short write, %u buffers left at offset %" G_GUINT64_FORMAT,
+                     n_iov, offset);
+
+    written = pwritev(fileno(sink->prerecord), iov, n_iov, offset);
+    if (written < 0 && errno == EINTR)
     {
-      gst_prerecord_sink_do_seek(prerecordsink, 0);
-      if (ftruncate(fileno(prerecordsink->prerecord), 0))
-        goto truncate_failed;
+      skip = 0;
+      continue;
     }
-    if (prerecordsink->buffer_list)
+    if (written <= 0)
     {
-      gst_buffer_list_unref(prerecordsink->buffer_list);
-      prerecordsink->buffer_list = gst_buffer_list_new();
+      if (written == 0)
+        errno = ENOSPC;
+      goto write_error;
     }
-    prerecordsink->current_buffer_size = 0;
-    break;
-  case GST_EVENT_EOS:
-    if (gst_prerecord_sink_flush_buffer(prerecordsink) != GST_FLOW_OK)
-      goto flush_buffer_failed;
-    break;
-  default:
-    break;
+
+    skip = written;
+    offset += written;
   }
 
-  return GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
+  return GST_FLOW_OK;
 
   /* ERRORS */
-seek_failed:
-{
-  GST_ELEMENT_ERROR(prerecordsink, RESOURCE, SEEK,
-                    (_("Error while seeking in prerecord \"%s\"."), prerecordsink->prerecordname),
-                    GST_ERROR_SYSTEM);
-  gst_event_unref(event);
-  return FALSE;
-}
-flush_buffer_failed:
-{
-  GST_ELEMENT_ERROR(prerecordsink, RESOURCE, WRITE,
-                    (_("Error while writing to prerecord \"%s\"."), prerecordsink->prerecordname), NULL);
-  gst_event_unref(event);
-  return FALSE;
-}
-truncate_failed:
+write_error:
 {
-  GST_ELEMENT_ERROR(prerecordsink, RESOURCE, WRITE,
-                    (_("Error while writing to prerecord \"%s\"."), prerecordsink->prerecordname),
-                    GST_ERROR_SYSTEM);
-  gst_event_unref(event);
-  return FALSE;
+  return gst_prerecord_sink_write_error(sink);
 }
 }
 
+/* Handles the completions that are ready without blocking */
 static GstFlowReturn
-render_buffer(GstPrerecordSink *prerecordsink, GstBuffer *buffer)
+gst_prerecord_sink_uring_reap(GstPrerecordSink *sink)
 {
-  GstFlowReturn flow;
-  guint64 bytes_written = 0;
-  guint64 skip = 0;
+  PrerecordUring *uring = sink->uring;
+  GstFlowReturn flow = GST_FLOW_OK;
+  struct io_uring_cqe *cqe;
 
-  for (;;)
+  while (io_uring_peek_cqe(&uring->ring, &cqe) == 0)
   {
-    flow =
-        gst_writev_buffer(GST_OBJECT_CAST(prerecordsink),
-                          fileno(prerecordsink->prerecord), NULL, buffer, &bytes_written, skip,
-                          prerecordsink->max_transient_error_timeout, prerecordsink->current_pos,
-                          &prerecordsink->flushing);
+    PrerecordUringWrite *w = io_uring_cqe_get_data(cqe);
 
-    prerecordsink->current_pos += bytes_written;
-    skip += bytes_written;
+    if (flow == GST_FLOW_OK)
+      flow = gst_prerecord_sink_uring_complete(sink, w, cqe->res);
+    io_uring_cqe_seen(&uring->ring, cqe);
+    gst_prerecord_sink_uring_release(uring, w);
+  }
 
-    if (flow != GST_FLOW_FLUSHING)
-      break;
+  return flow;
+}
 
-    flow = gst_base_sink_wait_preroll(GST_BASE_SINK(prerecordsink));
+/* Queues the pending write in the submission queue */
+static void
+gst_prerecord_sink_uring_queue(GstPrerecordSink *sink)
+{
+  PrerecordUring *uring = sink->uring;
+  PrerecordUringWrite *w = uring->pending;
+  struct io_uring_sqe *sqe;
 
-    if (flow != GST_FLOW_OK)
-      break;
-  }
+  if (w == NULL)
+    return;
+  uring->pending = NULL;
 
-  return flow;
+  /* there are as many entries as write slots */
+  sqe = io_uring_get_sqe(&uring->ring);
+  g_assert(sqe != NULL);
+
+  io_uring_prep_writev(sqe, fileno(sink->prerecord), w->iov, w->n_iov, w->offset);
+  io_uring_sqe_set_data(sqe, w);
 }
 
-static gboolean
-gst_prerecord_sink_get_current_offset(GstPrerecordSink *prerecordsink, guint64 *p_pos)
+/* Submits everything queued and, when @wait is set, waits for at least
+ * one write to complete */
+static GstFlowReturn
+gst_prerecord_sink_uring_submit(GstPrerecordSink *sink, gboolean wait)
 {
-  off_t ret = -1;
+  gint ret;
 
-  /* no need to flush internal buffer here as this is only called right
-   * after a seek. If this changes then the buffer should be flushed here
-   * too
-   */
+  gst_prerecord_sink_uring_queue(sink);
 
-#ifdef HAVE_FTELLO
-  ret = ftello(prerecordsink->prerecord);
-#elif defined(G_OS_UNIX) || defined(G_OS_WIN32)
-  ret = lseek(fileno(prerecordsink->prerecord), 0, SEEK_CUR);
-#else
-  ret = (off_t)ftell(prerecordsink->prerecord);
-#endif
+  do
+  {
+    ret = io_uring_submit_and_wait(&sink->uring->ring, wait ? 1 : 0);
+  } while (ret == -EINTR);
+  if (ret < 0)
+    goto submit_failed;
 
-  if (ret != (off_t)-1)
-    *p_pos = (guint64)ret;
+  return gst_prerecord_sink_uring_reap(sink);
 
-  return (ret != (off_t)-1);
+  /* ERRORS */
+submit_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                    ("io_uring_enter: %s", g_strerror(-ret)));
+  return GST_FLOW_ERROR;
+}
 }
 
+/* Returns the write to add buffers to, waiting for a free slot if all of
+ * them are in flight */
 static GstFlowReturn
-gst_file_sink_render_list_internal(GstPrerecordSink *sink,
-                                   GstBufferList *buffer_list)
+gst_prerecord_sink_uring_get_write(GstPrerecordSink *sink, PrerecordUringWrite **write)
 {
-  GstFlowReturn flow;
-  guint num_buffers;
-  guint64 skip = 0;
+  PrerecordUring *uring = sink->uring;
+  GstFlowReturn flow = GST_FLOW_OK;
 
-  num_buffers = gst_buffer_list_length(buffer_list);
-  if (num_buffers == 0)
-    goto no_data;
+  if (uring->pending && uring->pending->n_iov == URING_MAX_IOVECS)
+  {
+    gst_prerecord_sink_uring_queue(sink);
+    if (!uring->batch)
+      flow = gst_prerecord_sink_uring_submit(sink, FALSE);
+  }
 
-  GST_DEBUG_OBJECT(sink,
-                   "writing %u buffers at position %" G_GUINT64_FORMAT, num_buffers,
-                   sink->current_pos);
+  /* all slots in flight, this is where a slow card pushes back */
+  while (flow == GST_FLOW_OK && uring->pending == NULL && uring->n_free == 0)
+    flow = gst_prerecord_sink_uring_submit(sink, TRUE);
 
-  for (;;)
+  if (flow != GST_FLOW_OK)
+    return flow;
+
+  if (uring->pending == NULL)
   {
-    guint64 bytes_written = 0;
+    uring->pending = &uring->writes[uring->free_slots[--uring->n_free]];
+    uring->pending->offset = sink->current_pos;
+  }
 
-    flow =
-        gst_writev_buffer_list(GST_OBJECT_CAST(sink), fileno(sink->prerecord),
-                               NULL, buffer_list, &bytes_written, skip,
-                               sink->max_transient_error_timeout, sink->current_pos, &sink->flushing);
+  *write = uring->pending;
 
-    sink->current_pos += bytes_written;
-    skip += bytes_written;
+  return GST_FLOW_OK;
+}
 
-    if (flow != GST_FLOW_FLUSHING)
-      break;
+static GstFlowReturn
+gst_prerecord_sink_uring_add_buffer(GstPrerecordSink *sink, GstBuffer *buffer)
+{
+  PrerecordUringWrite *w;
+  GstFlowReturn flow;
+  guint i;
 
-    flow = gst_base_sink_wait_preroll(GST_BASE_SINK(sink));
+  if (gst_buffer_get_size(buffer) == 0)
+    return GST_FLOW_OK;
 
-    if (flow != GST_FLOW_OK)
-      return flow;
-  }
+  flow = gst_prerecord_sink_uring_get_write(sink, &w);
+  if (flow != GST_FLOW_OK)
+    return flow;
 
-  return flow;
+  i = w->n_iov;
+  if (!gst_buffer_map(buffer, &w->map[i], GST_MAP_READ))
+    goto map_failed;
+
+  w->buffers[i] = gst_buffer_ref(buffer);
+  w->iov[i].iov_base = w->map[i].data;
+  w->iov[i].iov_len = w->map[i].size;
+  w->n_iov++;
+  w->size += w->map[i].size;
+  sink->current_pos += w->map[i].size;
 
-no_data:
-{
-  GST_LOG_OBJECT(sink, "empty buffer list");
   return GST_FLOW_OK;
+
+  /* ERRORS */
+map_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                    ("Failed to map buffer"));
+  return GST_FLOW_ERROR;
 }
 }
 
+/* Adds a buffer or the buffers of a list to the current write */
+static GstFlowReturn
+gst_prerecord_sink_uring_write(GstPrerecordSink *sink, GstMiniObject *obj)
+{
+  GstFlowReturn flow = GST_FLOW_OK;
+
+  if (GST_IS_BUFFER_LIST(obj))
+  {
+    GstBufferList *buffer_list = GST_BUFFER_LIST_CAST(obj);
+    guint i, len = gst_buffer_list_length(buffer_list);
+
+    for (i = 0; i < len && flow == GST_FLOW_OK; i++)
+      flow = gst_prerecord_sink_uring_add_buffer(sink,
+                                                 gst_buffer_list_get(buffer_list, i));
+  }
+  else
+  {
+    flow = gst_prerecord_sink_uring_add_buffer(sink, GST_BUFFER_CAST(obj));
+  }
+
+  if (flow == GST_FLOW_OK && !sink->uring->batch)
+    flow = gst_prerecord_sink_uring_submit(sink, FALSE);
 
+  return flow;
+}
 
+/* Waits for all writes, the file offset is moved past them so that
+ * seeking and other writers continue at the right position */
 static GstFlowReturn
-gst_prerecord_sink_render_list_internal(GstPrerecordSink *sink,
-                                        GstBufferList *buffer_list)
+gst_prerecord_sink_uring_drain(GstPrerecordSink *sink)
 {
-  static gboolean first_buffers_written = FALSE; // Flag to track if the first buffer has been written directly
-  static gint num=0;
+  PrerecordUring *uring = sink->uring;
   GstFlowReturn flow = GST_FLOW_OK;
-  static double elapsed_time_seconds = 0;
-  static double elapsed_time_seconds2 = 0;
-  static gboolean timecaptured = FALSE;
-  static gint cal=FALSE;
-  static gboolean timecaptured2 = FALSE;
-  static GstClockTime start_time; 
-  static GstClockTime start_time2; 
- 
- /* if (cal == 0)
-    {
-      cal = sink->pre_record;
-    }
-    */
-   GstClock *clocks = gst_system_clock_obtain();
-  if (clocks == NULL) {
-    printf("Failed to obtain system clock.\n");
-    return GST_FLOW_ERROR;
-  }
+  gint res;
 
-  if (!GST_IS_BUFFER_LIST(buffer_list))
+  if (uring == NULL)
+    return GST_FLOW_OK;
+
+  gst_prerecord_sink_uring_queue(sink);
+
+  /* completion errors do not stop the wait, every buffer has to be
+   * released before the ring can be reused */
+  while (uring->n_free < URING_QUEUE_DEPTH)
   {
-    // It's not a valid GstBufferList
-    printf("Buffer list is not a valid GstBufferList.\n");
-    return GST_FLOW_ERROR;
+    GstFlowReturn ret;
+
+    res = io_uring_submit_and_wait(&uring->ring, 1);
+    if (res < 0 && res != -EINTR)
+      goto submit_failed;
+
+    ret = gst_prerecord_sink_uring_reap(sink);
+    if (flow == GST_FLOW_OK)
+      flow = ret;
   }
 
-  printf("Buffer list type before pushing: GstBufferList\n");
+  if (lseek(fileno(sink->prerecord), (off_t)sink->current_pos, SEEK_SET) == (off_t)-1)
+    GST_DEBUG_OBJECT(sink, "Seeking failed: %s", g_strerror(errno));
 
-    
-  if (sink->buffering==0)
-    {
-      // Buffering disabled
-      // Process each buffered GstBufferList
+  return flow;
 
-      printf("Processing buffered GstBufferLists.\n");
-      while (sink->fifo != NULL && !is_fifo_empty(sink->fifo))
-      {
-        //printf("Entering POP.\n");
-        GstBufferList *poppedBufferList = pop(sink->fifo);
+  /* ERRORS */
+submit_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                    ("io_uring_enter: %s", g_strerror(-res)));
+  return GST_FLOW_ERROR;
+}
+}
 
-        if (poppedBufferList != NULL && GST_IS_BUFFER_LIST(poppedBufferList))
-        {
-          printf("Copying Prerecorded Data\n");
-          // Do something with poppedBufferList
+/* Memory handed to this is reused right away, so the write is waited for.
+ * Arena data goes through the registered buffer to skip the page pinning
+ * on every write. */
+static GstFlowReturn
+gst_prerecord_sink_uring_write_mem(GstPrerecordSink *sink, const guint8 *data, gsize size)
+{
+  PrerecordUring *uring = sink->uring;
+  PrerecordUringWrite *w;
+  struct io_uring_sqe *sqe;
+  GstFlowReturn flow;
 
-          flow = gst_file_sink_render_list_internal(sink, poppedBufferList);
+  gst_prerecord_sink_uring_queue(sink);
 
-          if (flow != GST_FLOW_OK)
-          {
-            printf("Failed to write a buffered GstBufferList to the file.\n");
+  flow = gst_prerecord_sink_uring_get_write(sink, &w);
+  if (flow != GST_FLOW_OK)
+    return flow;
+  uring->pending = NULL;
 
-            return flow;
-          }
-        }
-        else
-        {
-          printf("Popped BufferList is either NULL or not a GstBufferList\n");
-          // Handle accordingly
-        }
-      }
+  /* nothing to unmap on completion, the iovec is only for short writes */
+  w->iov[0].iov_base = (guint8 *)data;
+  w->iov[0].iov_len = size;
+  w->buffers[0] = NULL;
+  w->n_iov = 1;
+  w->size = size;
 
-      printf("Recording in Process\n");
+  sqe = io_uring_get_sqe(&uring->ring);
+  g_assert(sqe != NULL);
 
-      
-      flow = gst_file_sink_render_list_internal(sink, buffer_list);
-        
-    }
-    else if (sink->buffering==1)
-    {
-        if ((sink->post_record) > 0)
-      {
-        // Get the current time
-          
-          if(!timecaptured)
-          {
-          start_time = gst_clock_get_time(clocks);
-          timecaptured=TRUE;
-          }
+  if (uring->arena_registered && data >= sink->arena.data &&
+      data + size <= sink->arena.data + sink->arena.size)
+    io_uring_prep_write_fixed(sqe, fileno(sink->prerecord), data, size,
+                              w->offset, 0);
+  else
+    io_uring_prep_writev(sqe, fileno(sink->prerecord), w->iov, 1, w->offset);
+  io_uring_sqe_set_data(sqe, w);
 
-          flow = gst_file_sink_render_list_internal(sink, buffer_list);
-          
-          double elapsed_time_seconds = (double)(gst_clock_get_time(clocks) - start_time) / GST_SECOND;
+  sink->current_pos += size;
 
-          printf("Postrecording Time: %.2f seconds\n", elapsed_time_seconds);
+  return gst_prerecord_sink_uring_drain(sink);
+}
 
-          
-          if (elapsed_time_seconds >= sink->post_record)
-          {
-            printf("PostRecording Done\n");
-            printf("Total Postrecording Time: %.2f seconds\n", elapsed_time_seconds);
-            gst_object_unref(clocks); // Don't forget to unref the clock
-            return GST_FLOW_EOS;     // Exit the function
-          }
-          first_buffers_written=FALSE;
-          num=0;
-      }
-    }
-    else
-    {
-    
-    
-      if (!first_buffers_written)
-  {
-	num++;
-	
-    GstBufferList *first_buffer_list = gst_buffer_list_copy_deep(buffer_list);
-    
-    guint num_buffers = gst_buffer_list_length(first_buffer_list);
+/* Only to be called from the thread that writes */
+static void
+gst_prerecord_sink_uring_set_batch(GstPrerecordSink *sink, gboolean batch)
+{
+  if (sink->uring == NULL)
+    return;
 
-    // Iterate through each buffer in the list
-    for (guint i = 0; i < num_buffers; i++)
-    {
-        GstBuffer *buffer = gst_buffer_list_get(first_buffer_list, i);
-        // Set PTS and DTS to GST_CLOCK_TIME_NONE
-        GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
-        GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
-    }
+  sink->uring->batch = batch;
+  if (!batch)
+    gst_prerecord_sink_uring_submit(sink, FALSE);
+}
 
-    // Write each buffer list individually
-    flow = gst_file_sink_render_list_internal(sink, first_buffer_list);
-    if(num > 1)
-    {
-    first_buffers_written = TRUE; // Update the flag after writing the first 10 buffer lists
-    timecaptured = FALSE;
-    timecaptured2 = FALSE;
-  }
+static void
+gst_prerecord_sink_uring_close(GstPrerecordSink *sink)
+{
+  PrerecordUring *uring = sink->uring;
+
+  if (uring == NULL)
+    return;
+
+  gst_prerecord_sink_uring_drain(sink);
+  io_uring_queue_exit(&uring->ring);
+  g_free(uring->writes);
+  g_free(uring);
+  sink->uring = NULL;
+}
+
+static void
+gst_prerecord_sink_uring_open(GstPrerecordSink *sink)
+{
+  PrerecordUring *uring;
+  gint ret;
+  guint i;
+
+  if (sink->append)
+  {
+    /* O_APPEND ignores the offsets the writes are ordered by */
+    GST_INFO_OBJECT(sink, "not using io_uring when appending");
+    return;
   }
-  else
+
+  uring = g_new0(PrerecordUring, 1);
+
+  ret = io_uring_queue_init(URING_QUEUE_DEPTH, &uring->ring, 0);
+  if (ret < 0)
   {
-  
-   
-      if (sink->fifo == NULL)
-      {
-        sink->fifo = initializeFIFO();  
-        if (sink->fifo == NULL)
-        {
-          printf("Failed to initialize FIFO.\n");
-          return GST_FLOW_ERROR;
-        }
-      }
-      
-      
-      if(!timecaptured2)
-          {
-          start_time2 = gst_clock_get_time(clocks);
-          timecaptured2=TRUE;
-          }
+    GST_WARNING_OBJECT(sink, "io_uring not available (%s), using writev",
+                       g_strerror(-ret));
+    g_free(uring);
+    return;
+  }
 
-  
-     
-      if (cal==TRUE)
-      {
-        printf("Entering.\n");
-        
+  uring->writes = g_new0(PrerecordUringWrite, URING_QUEUE_DEPTH);
+  for (i = 0; i < URING_QUEUE_DEPTH; i++)
+    uring->free_slots[i] = i;
+  uring->n_free = URING_QUEUE_DEPTH;
 
-        GstBufferList *removedBufferList = pop(sink->fifo);
+  if (sink->arena.data)
+  {
+    struct iovec iov = {sink->arena.data, sink->arena.size};
 
-        GstBufferList *copyBufferList_remove = NULL;
-        if (removedBufferList != NULL)
-        {
-            copyBufferList_remove = gst_buffer_list_copy_deep(removedBufferList);
-            printf("Removing the Oldest BufferList from the FIFO.\n");
-        }
+    ret = io_uring_register_buffers(&uring->ring, &iov, 1);
+    uring->arena_registered = (ret == 0);
+    if (ret < 0)
+      GST_DEBUG_OBJECT(sink, "could not register the arena: %s", g_strerror(-ret));
+  }
 
-        if (copyBufferList_remove != NULL)
-        {
-        
-            g_clear_pointer(&copyBufferList_remove, gst_buffer_list_unref);
-            g_clear_pointer(&removedBufferList, gst_buffer_list_unref);
-      
-        }
-        cal=FALSE;
-        printf("Cal False\n");
-      }
-      
-      if(cal==FALSE)
-      {
-      double elapsed_time_seconds2 = (double)(gst_clock_get_time(clocks) - start_time2) / GST_SECOND;
-      printf(" Before Elapsed2222 time Adding: %.6f seconds\n", elapsed_time_seconds2);
-      
-      if(elapsed_time_seconds2 > sink->pre_record)
-      {
-      cal=TRUE;
-      printf("Cal True\n");
-      }// Push the incoming buffer_list to the FIFO
-      }
-      GstBufferList *copyBufferList = gst_buffer_list_copy_deep(buffer_list);
-      
-    guint num_buffers_s = gst_buffer_list_length(copyBufferList);
+  sink->uring = uring;
+  GST_DEBUG_OBJECT(sink, "writing with io_uring");
+}
 
-    // Iterate through each buffer in the list
-    for (guint i = 0; i < num_buffers_s; i++)
-    {
-        GstBuffer *buffers = gst_buffer_list_get(copyBufferList, i);
-        // Set PTS and DTS to GST_CLOCK_TIME_NONE
-        GST_BUFFER_PTS(buffers) = GST_CLOCK_TIME_NONE;
-        GST_BUFFER_DTS(buffers) = GST_CLOCK_TIME_NONE;
-    }
-    
-      push(sink->fifo, copyBufferList);
-     printf("Pushed\n");
-    //  double bufferListDuration = BufferListduration(copyBufferList);
+#else /* !HAVE_LIBURING */
 
-     // g_clear_pointer(&copyBufferList, gst_buffer_list_unref);
-  }
-    }
- 
-  return flow;
+static GstFlowReturn
+gst_prerecord_sink_uring_write(GstPrerecordSink *sink, GstMiniObject *obj)
+{
+  g_assert_not_reached();
+  return GST_FLOW_ERROR;
 }
 
 static GstFlowReturn
-gst_prerecord_sink_flush_buffer(GstPrerecordSink *prerecordsink)
+gst_prerecord_sink_uring_write_mem(GstPrerecordSink *sink, const guint8 *data, gsize size)
 {
-  GstFlowReturn flow_ret = GST_FLOW_OK;
+  g_assert_not_reached();
+  return GST_FLOW_ERROR;
+}
 
-  // printf("Flushing out buffer of size %" G_GSIZE_FORMAT "\n", prerecordsink->current_buffer_size);
+static GstFlowReturn
+gst_prerecord_sink_uring_drain(GstPrerecordSink *sink)
+{
+  return GST_FLOW_OK;
+}
 
-  if (prerecordsink->buffer && prerecordsink->current_buffer_size)
-  {
-    guint64 skip = 0;
+static void
+gst_prerecord_sink_uring_set_batch(GstPrerecordSink *sink, gboolean batch)
+{
+}
 
-    for (;;)
-    {
-      guint64 bytes_written = 0;
+static void
+gst_prerecord_sink_uring_close(GstPrerecordSink *sink)
+{
+}
 
-      flow_ret =
-          gst_writev_mem(GST_OBJECT_CAST(prerecordsink), fileno(prerecordsink->prerecord),
-                         NULL, prerecordsink->buffer, prerecordsink->current_buffer_size, &bytes_written,
-                         skip, prerecordsink->max_transient_error_timeout, prerecordsink->current_pos,
-                         &prerecordsink->flushing);
+static void
+gst_prerecord_sink_uring_open(GstPrerecordSink *sink)
+{
+  GST_WARNING_OBJECT(sink, "built without io_uring support, using writev");
+}
 
-      prerecordsink->current_pos += bytes_written;
-      skip += bytes_written;
+#endif /* HAVE_LIBURING */
 
-      if (flow_ret != GST_FLOW_FLUSHING)
-        break;
+/*** DIRECT I/O **************************************************************/
 
-      flow_ret = gst_base_sink_wait_preroll(GST_BASE_SINK(prerecordsink));
-      if (flow_ret != GST_FLOW_OK)
-        break;
+#ifdef O_DIRECT
+
+/* Alignment of offsets, sizes and memory for O_DIRECT, the page size
+ * covers the logical block size of any card */
+#define DIRECT_IO_ALIGN 4096
+/* Size of the aligned staging buffer written in one go */
+#define DIRECT_IO_CHUNK (512 * 1024)
+
+static GstFlowReturn
+gst_prerecord_sink_direct_pwrite(GstPrerecordSink *sink, gsize size)
+{
+  gsize done = 0;
+
+  while (done < size)
+  {
+    gssize written;
+
+    written = pwrite(fileno(sink->prerecord), sink->direct_buf + done,
+                     size - done, sink->direct_offset + done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+    {
+      if (written == 0)
+        errno = ENOSPC;
+      return gst_prerecord_sink_write_error(sink);
     }
+    done += written;
   }
-  else if (prerecordsink->buffer_list && prerecordsink->current_buffer_size)
-  {
-    guint length;
 
-    length = gst_buffer_list_length(prerecordsink->buffer_list);
+  return GST_FLOW_OK;
+}
+
+/* Copies into the staging buffer and writes every full chunk */
+static GstFlowReturn
+gst_prerecord_sink_direct_stage(GstPrerecordSink *sink, const guint8 *data, gsize size)
+{
+  while (size > 0)
+  {
+    gsize n = MIN(size, DIRECT_IO_CHUNK - sink->direct_fill);
 
-    printf("Length of BufferList %u\n", length);
+    memcpy(sink->direct_buf + sink->direct_fill, data, n);
+    sink->direct_fill += n;
+    sink->current_pos += n;
+    data += n;
+    size -= n;
 
-    if (length > 0)
+    if (sink->direct_fill == DIRECT_IO_CHUNK)
     {
-      flow_ret =
-          gst_prerecord_sink_render_list_internal(prerecordsink, prerecordsink->buffer_list);
-      /* Remove all buffers from the list but keep the list. This ensures that
-       * we don't re-allocate the array storing the buffers all the time */
-      gst_buffer_list_remove(prerecordsink->buffer_list, 0, length);
+      GstFlowReturn flow = gst_prerecord_sink_direct_pwrite(sink, DIRECT_IO_CHUNK);
+
+      if (flow != GST_FLOW_OK)
+        return flow;
+      sink->direct_offset += DIRECT_IO_CHUNK;
+      sink->direct_fill = 0;
     }
   }
 
-  prerecordsink->current_buffer_size = 0;
-
-  return flow_ret;
+  return GST_FLOW_OK;
 }
 
-static gboolean
-has_sync_after_buffer(GstBuffer **buffer, guint idx, gpointer user_data)
+static GstFlowReturn
+gst_prerecord_sink_direct_write(GstPrerecordSink *sink, GstMiniObject *obj)
 {
-  if (GST_BUFFER_FLAG_IS_SET(*buffer, GST_BUFFER_FLAG_SYNC_AFTER))
+  GstFlowReturn flow = GST_FLOW_OK;
+  GstBuffer *buffer;
+  GstMapInfo map;
+  guint i, len = 1;
+
+  if (GST_IS_BUFFER_LIST(obj))
+    len = gst_buffer_list_length(GST_BUFFER_LIST_CAST(obj));
+
+  for (i = 0; i < len && flow == GST_FLOW_OK; i++)
   {
-    gboolean *sync_after = user_data;
+    if (GST_IS_BUFFER_LIST(obj))
+      buffer = gst_buffer_list_get(GST_BUFFER_LIST_CAST(obj), i);
+    else
+      buffer = GST_BUFFER_CAST(obj);
 
-    *sync_after = TRUE;
-    return FALSE;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+      goto map_failed;
+    flow = gst_prerecord_sink_direct_stage(sink, map.data, map.size);
+    gst_buffer_unmap(buffer, &map);
   }
 
-  return TRUE;
+  return flow;
+
+  /* ERRORS */
+map_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                    ("Failed to map buffer"));
+  return GST_FLOW_ERROR;
+}
 }
 
-static gboolean
-accumulate_size(GstBuffer **buffer, guint idx, gpointer user_data)
+/* Puts the staged tail on disk as a zero padded block and cuts the file
+ * back to its real size. The tail stays staged, later data overwrites the
+ * padding in place. */
+static GstFlowReturn
+gst_prerecord_sink_direct_sync(GstPrerecordSink *sink)
 {
-  guint *size = user_data;
+  GstFlowReturn flow;
+  gsize padded;
 
-  *size += gst_buffer_get_size(*buffer);
+  if (sink->direct_buf == NULL || sink->direct_fill == 0)
+    return GST_FLOW_OK;
 
-  return TRUE;
+  padded = GST_ROUND_UP_N(sink->direct_fill, DIRECT_IO_ALIGN);
+  memset(sink->direct_buf + sink->direct_fill, 0, padded - sink->direct_fill);
+
+  flow = gst_prerecord_sink_direct_pwrite(sink, padded);
+  if (flow != GST_FLOW_OK)
+    return flow;
+
+  if (ftruncate(fileno(sink->prerecord), sink->direct_offset + sink->direct_fill))
+    return gst_prerecord_sink_write_error(sink);
+
+  return GST_FLOW_OK;
 }
 
+/* Writes what is staged and continues with normal writes, used before
+ * seeking and closing */
 static GstFlowReturn
-gst_prerecord_sink_render_list(GstBaseSink *bsink, GstBufferList *buffer_list)
+gst_prerecord_sink_direct_stop(GstPrerecordSink *sink)
 {
   GstFlowReturn flow;
-  GstPrerecordSink *sink;
-  guint i, num_buffers;
-  gboolean sync_after = FALSE;
-  gint fsync_ret;
+  gint fd;
 
-  sink = GST_PRERECORD_SINK_CAST(bsink);
-  // printf("Inside Render List");
-  num_buffers = gst_buffer_list_length(buffer_list);
-  if (num_buffers == 0)
-    goto no_data;
+  if (sink->direct_buf == NULL)
+    return GST_FLOW_OK;
 
-  gst_buffer_list_foreach(buffer_list, has_sync_after_buffer, &sync_after);
+  flow = gst_prerecord_sink_direct_sync(sink);
 
-  if (sync_after || (!sink->buffer && !sink->buffer_list))
-  {
-    flow = gst_prerecord_sink_flush_buffer(sink);
-    if (flow == GST_FLOW_OK)
-      flow = gst_prerecord_sink_render_list_internal(sink, buffer_list);
-  }
-  else
-  {
-    guint size = 0;
-    gst_buffer_list_foreach(buffer_list, accumulate_size, &size);
+  fd = fileno(sink->prerecord);
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) < 0)
+    GST_DEBUG_OBJECT(sink, "could not clear O_DIRECT: %s", g_strerror(errno));
+  if (lseek(fd, (off_t)sink->current_pos, SEEK_SET) == (off_t)-1)
+    GST_DEBUG_OBJECT(sink, "Seeking failed: %s", g_strerror(errno));
 
-    // printf( "Queueing buffer list of %u bytes (%u buffers) at offset %" G_GUINT64_FORMAT, size, num_buffers,
-    //                sink->current_pos + sink->current_buffer_size);
+  free(sink->direct_buf);
+  sink->direct_buf = NULL;
+  sink->direct_fill = 0;
 
-    if (sink->buffer)
-    {
-      flow = GST_FLOW_OK;
-      for (i = 0; i < num_buffers && flow == GST_FLOW_OK; i++)
-      {
-        GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
-        gsize buffer_size = gst_buffer_get_size(buffer);
-
-        if (sink->current_buffer_size + buffer_size >
-            sink->allocated_buffer_size)
-        {
-          flow = gst_prerecord_sink_flush_buffer(sink);
-          if (flow != GST_FLOW_OK)
-            return flow;
-        }
-
-        if (buffer_size > sink->allocated_buffer_size)
-        {
-          printf(
-              "writing buffer ( %" G_GSIZE_FORMAT
-              " bytes) at position %" G_GUINT64_FORMAT,
-              buffer_size, sink->current_pos);
+  return flow;
+}
 
-          flow = render_buffer(sink, buffer);
-        }
-        else
-        {
-          sink->current_buffer_size +=
-              gst_buffer_extract(buffer, 0,
-                                 sink->buffer + sink->current_buffer_size, buffer_size);
-          flow = GST_FLOW_OK;
-        }
-      }
-    }
-    else
-    {
-      for (i = 0; i < num_buffers; ++i)
-        gst_buffer_list_add(sink->buffer_list,
-                            gst_buffer_ref(gst_buffer_list_get(buffer_list, i)));
-      sink->current_buffer_size += size;
+static void
+gst_prerecord_sink_direct_start(GstPrerecordSink *sink)
+{
+  gint fd = fileno(sink->prerecord);
 
-      if (sink->current_buffer_size > sink->buffer_size)
-        flow = gst_prerecord_sink_flush_buffer(sink);
-      else
-        flow = GST_FLOW_OK;
-    }
+  if (!(fcntl(fd, F_GETFL) & O_DIRECT))
+  {
+    GST_WARNING_OBJECT(sink, "direct I/O not supported for %s, using the page cache",
+                       sink->prerecordname);
+    return;
   }
 
-  if (flow == GST_FLOW_OK && sync_after)
+  if (posix_memalign((void **)&sink->direct_buf, DIRECT_IO_ALIGN, DIRECT_IO_CHUNK) != 0)
   {
-    do
-    {
-      fsync_ret = fsync(fileno(sink->prerecord));
-    } while (fsync_ret < 0 && errno == EINTR);
-    if (fsync_ret)
-    {
-      GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
-                        (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
-                        ("%s", g_strerror(errno)));
-      flow = GST_FLOW_ERROR;
-    }
+    GST_WARNING_OBJECT(sink, "could not allocate the staging buffer");
+    sink->direct_buf = NULL;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    return;
   }
 
-  return flow;
+  sink->direct_fill = 0;
+  sink->direct_offset = 0;
+  GST_DEBUG_OBJECT(sink, "writing with O_DIRECT");
+}
 
-no_data:
+#else /* !O_DIRECT */
+
+static GstFlowReturn
+gst_prerecord_sink_direct_write(GstPrerecordSink *sink, GstMiniObject *obj)
+{
+  g_assert_not_reached();
+  return GST_FLOW_ERROR;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_direct_stage(GstPrerecordSink *sink, const guint8 *data, gsize size)
+{
+  g_assert_not_reached();
+  return GST_FLOW_ERROR;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_direct_sync(GstPrerecordSink *sink)
+{
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_direct_stop(GstPrerecordSink *sink)
 {
-  GST_LOG_OBJECT(sink, "empty buffer list");
   return GST_FLOW_OK;
 }
+
+static void
+gst_prerecord_sink_direct_start(GstPrerecordSink *sink)
+{
+  GST_WARNING_OBJECT(sink, "direct I/O not supported on this platform");
+}
+
+#endif /* O_DIRECT */
+
+/*** WRITEBACK PACING ********************************************************/
+
+/* Starts pacing from the current position, after the prerecord was opened,
+ * seeked or switched */
+static void
+gst_prerecord_sink_writeback_reset(GstPrerecordSink *sink)
+{
+  sink->writeback_pos = sink->current_pos;
+  sink->writeback_prev_size = 0;
+  sink->writeback_time = g_get_monotonic_time();
 }
 
+/* Called after data was written. Once enough was written since the last
+ * time, or with @force, the new range is handed to the kernel and the one
+ * before waited for. Waiting one range behind keeps the card busy while
+ * bounding the dirty data to two ranges. A range that could not be
+ * written out is a write error. */
 static GstFlowReturn
-gst_prerecord_sink_render(GstBaseSink *sink, GstBuffer *buffer)
+gst_prerecord_sink_writeback(GstPrerecordSink *sink, gboolean force)
+{
+  gint64 now;
+  gint fd;
+
+  if ((sink->writeback_bytes == 0 && sink->writeback_interval == 0 && !force) ||
+      sink->direct_buf || sink->prerecord == NULL)
+    return GST_FLOW_OK;
+
+  if (sink->current_pos < sink->writeback_pos)
+    gst_prerecord_sink_writeback_reset(sink);
+  if (sink->current_pos == sink->writeback_pos)
+    return GST_FLOW_OK;
+
+  now = g_get_monotonic_time();
+  if (!force &&
+      (sink->writeback_bytes == 0 || sink->current_pos - sink->writeback_pos < sink->writeback_bytes) &&
+      (sink->writeback_interval == 0 ||
+       now - sink->writeback_time < (gint64)sink->writeback_interval * 1000))
+    return GST_FLOW_OK;
+
+  fd = fileno(sink->prerecord);
+
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (sync_file_range(fd, sink->writeback_pos, sink->current_pos - sink->writeback_pos,
+                      SYNC_FILE_RANGE_WRITE) < 0)
+    GST_DEBUG_OBJECT(sink, "sync_file_range failed: %s", g_strerror(errno));
+
+  /* the previous range reached the card or it never will */
+  if (sink->writeback_prev_size > 0 &&
+      sync_file_range(fd, sink->writeback_prev, sink->writeback_prev_size,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+  {
+    if (errno == EIO || errno == ENOSPC)
+      goto writeback_failed;
+    GST_DEBUG_OBJECT(sink, "sync_file_range failed: %s", g_strerror(errno));
+  }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  /* written out, nobody reads it back */
+  if (sink->writeback_prev_size > 0)
+    posix_fadvise(fd, sink->writeback_prev, sink->writeback_prev_size, POSIX_FADV_DONTNEED);
+#endif
+
+  GST_LOG_OBJECT(sink, "writeback of %" G_GUINT64_FORMAT " bytes at %" G_GUINT64_FORMAT
+                       ", waited %" G_GINT64_FORMAT " us for the previous range",
+                 sink->current_pos - sink->writeback_pos, sink->writeback_pos,
+                 g_get_monotonic_time() - now);
+
+  sink->writeback_prev = sink->writeback_pos;
+  sink->writeback_prev_size = sink->current_pos - sink->writeback_pos;
+  sink->writeback_pos = sink->current_pos;
+  sink->writeback_time = now;
+
+  return GST_FLOW_OK;
+
+  /* ERRORS */
+#ifdef SYNC_FILE_RANGE_WRITE
+writeback_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                    GST_ERROR_SYSTEM);
+  return GST_FLOW_ERROR;
+}
+#endif
+}
+
+/*** ASYNCHRONOUS WRITER *****************************************************/
+
+/* Number of slots in the writer ring, a power of two. With the default
+ * 64 KiB lists this holds several seconds of the 16 Mbit/s device stream,
+ * enough to ride out garbage collection stalls of the SD card. */
+#define ASYNC_RING_SIZE 256
+
+/* Queued after the data that has to be on disk before it is handled */
+#define ASYNC_SYNC_MARKER "GstPrerecordSinkSync"
+
+static GstFlowReturn
+gst_prerecord_sink_fsync(GstPrerecordSink *sink)
 {
-  GstPrerecordSink *prerecordsink;
-  GstFlowReturn flow;
-  guint8 n_mem;
-  gboolean sync_after;
   gint fsync_ret;
 
-  prerecordsink = GST_PRERECORD_SINK_CAST(sink);
+  if (gst_prerecord_sink_uring_drain(sink) != GST_FLOW_OK ||
+      gst_prerecord_sink_direct_sync(sink) != GST_FLOW_OK)
+    return GST_FLOW_ERROR;
 
-  sync_after = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_SYNC_AFTER);
+  do
+  {
+    fsync_ret = fsync(fileno(sink->prerecord));
+  } while (fsync_ret < 0 && errno == EINTR);
+  if (fsync_ret)
+  {
+    GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+                      (_("Error while writing to prerecord \"%s\"."), sink->prerecordname),
+                      ("%s", g_strerror(errno)));
+    return GST_FLOW_ERROR;
+  }
 
-  n_mem = gst_buffer_n_memory(buffer);
+  return GST_FLOW_OK;
+}
 
-  if (n_mem > 0 && (sync_after || (!prerecordsink->buffer && !prerecordsink->buffer_list)))
+/* Wakes up whoever waits on the other end of the ring. The lock is only
+ * taken when somebody actually waits, the ring itself is lock-free. */
+static void
+gst_prerecord_sink_async_wake(GstPrerecordSink *sink, gboolean force)
+{
+  if (force || g_atomic_int_get(&sink->async_waiters) > 0)
   {
-    flow = gst_prerecord_sink_flush_buffer(prerecordsink);
-    if (flow == GST_FLOW_OK)
-    {
-      flow = render_buffer(prerecordsink, buffer);
-    }
+    g_mutex_lock(&sink->async_lock);
+    g_cond_broadcast(&sink->async_cond);
+    g_mutex_unlock(&sink->async_lock);
   }
-  else if (n_mem > 0)
+}
+
+static GstFlowReturn
+gst_prerecord_sink_async_write(GstPrerecordSink *sink, GstMiniObject *obj)
+{
+  GstFlowReturn flow;
+  guint64 skip = 0;
+
+  if (gst_prerecord_sink_is_segment_marker(obj))
   {
-    gsize size = gst_buffer_get_size(buffer);
+    const GstStructure *s = gst_event_get_structure(GST_EVENT_CAST(obj));
+    FILE *next = NULL;
 
-    GST_DEBUG_OBJECT(prerecordsink,
-                     "Queueing buffer of %" G_GSIZE_FORMAT " bytes at offset %" G_GUINT64_FORMAT, size,
-                     prerecordsink->current_pos + prerecordsink->current_buffer_size);
+    gst_structure_get(s, "file", G_TYPE_POINTER, &next, NULL);
+    return gst_prerecord_sink_segment_switch(sink, next,
+                                             gst_structure_get_string(s, "location"));
+  }
+  if (GST_IS_EVENT(obj))
+    return gst_prerecord_sink_fsync(sink);
 
-    if (prerecordsink->buffer)
+  if (sink->direct_buf)
+    return gst_prerecord_sink_direct_write(sink, obj);
+  if (sink->uring)
+    return gst_prerecord_sink_uring_write(sink, obj);
+
+  for (;;)
+  {
+    guint64 bytes_written = 0;
+
+    if (GST_IS_BUFFER_LIST(obj))
+      flow =
+          gst_writev_buffer_list(GST_OBJECT_CAST(sink), fileno(sink->prerecord),
+                                 NULL, GST_BUFFER_LIST_CAST(obj), &bytes_written, skip,
+                                 sink->max_transient_error_timeout, sink->current_pos, &sink->flushing);
+    else
+      flow =
+          gst_writev_buffer(GST_OBJECT_CAST(sink), fileno(sink->prerecord),
+                            NULL, GST_BUFFER_CAST(obj), &bytes_written, skip,
+                            sink->max_transient_error_timeout, sink->current_pos, &sink->flushing);
+
+    sink->current_pos += bytes_written;
+    skip += bytes_written;
+
+    if (flow != GST_FLOW_FLUSHING)
+      break;
+
+    /* Interrupted while retrying a transient error, carry on with the rest
+     * of the data once the sink is unlocked again */
+    g_mutex_lock(&sink->async_lock);
+    g_atomic_int_inc(&sink->async_waiters);
+    while (g_atomic_int_get(&sink->flushing) &&
+           !g_atomic_int_get(&sink->async_stop) &&
+           !g_atomic_int_get(&sink->async_discard))
+      g_cond_wait(&sink->async_cond, &sink->async_lock);
+    g_atomic_int_add(&sink->async_waiters, -1);
+    g_mutex_unlock(&sink->async_lock);
+
+    if (g_atomic_int_get(&sink->async_stop) ||
+        g_atomic_int_get(&sink->async_discard))
+      break;
+  }
+
+  if (flow == GST_FLOW_OK)
+    flow = gst_prerecord_sink_writeback(sink, FALSE);
+
+  return flow;
+}
+
+/* Whether the data held since @held is written as a burst now. Events are
+ * not held, they are waited for. */
+static gboolean
+gst_prerecord_sink_burst_ready(GstPrerecordSink *sink, gint tail, gint64 held)
+{
+  return g_atomic_int_get(&sink->async_stop) ||
+         g_atomic_int_get(&sink->async_blocked) ||
+         STATS_GET(sink->stats.queued_bytes) >= sink->burst_size ||
+         g_atomic_int_get(&sink->async_head) - tail >= ASYNC_RING_SIZE ||
+         GST_IS_EVENT(sink->async_ring[tail & (ASYNC_RING_SIZE - 1)]) ||
+         g_get_monotonic_time() - held >= (gint64)sink->burst_time * 1000;
+}
+
+static gpointer
+gst_prerecord_sink_writer_thread(gpointer data)
+{
+  GstPrerecordSink *sink = data;
+  gboolean bursting = FALSE;
+  gint64 held = 0;
+
+  GST_DEBUG_OBJECT(sink, "writer thread started");
+
+  for (;;)
+  {
+    gint tail = sink->async_tail;
+    GstMiniObject *obj;
+    GstFlowReturn flow = GST_FLOW_OK;
+    gsize size;
+
+    if (g_atomic_int_get(&sink->async_head) == tail)
     {
-      if (prerecordsink->current_buffer_size + size >
-          prerecordsink->allocated_buffer_size)
+      /* a burst goes to the card in one go, then it can idle */
+      if (bursting)
       {
-        flow = gst_prerecord_sink_flush_buffer(prerecordsink);
-        if (flow != GST_FLOW_OK)
-          return flow;
+        if (g_atomic_int_get(&sink->async_flow) == GST_FLOW_OK &&
+            gst_prerecord_sink_writeback(sink, TRUE) != GST_FLOW_OK)
+          g_atomic_int_set(&sink->async_flow, GST_FLOW_ERROR);
+        bursting = FALSE;
       }
 
-      if (size > prerecordsink->allocated_buffer_size)
-      {
-        GST_DEBUG_OBJECT(sink,
-                         "writing buffer ( %" G_GSIZE_FORMAT
-                         " bytes) at position %" G_GUINT64_FORMAT,
-                         size, prerecordsink->current_pos);
+      /* everything queued before stopping is written out first */
+      if (g_atomic_int_get(&sink->async_stop))
+        break;
 
-        flow = render_buffer(prerecordsink, buffer);
-      }
-      else
-      {
-        prerecordsink->current_buffer_size +=
-            gst_buffer_extract(buffer, 0,
-                               prerecordsink->buffer + prerecordsink->current_buffer_size, size);
-        flow = GST_FLOW_OK;
-      }
+      g_mutex_lock(&sink->async_lock);
+      g_atomic_int_inc(&sink->async_waiters);
+      while (g_atomic_int_get(&sink->async_head) == tail &&
+             !g_atomic_int_get(&sink->async_stop))
+        g_cond_wait(&sink->async_cond, &sink->async_lock);
+      g_atomic_int_add(&sink->async_waiters, -1);
+      g_mutex_unlock(&sink->async_lock);
+      continue;
     }
-    else
+
+    if (sink->burst_size > 0 && !bursting)
     {
-      prerecordsink->current_buffer_size += gst_buffer_get_size(buffer);
-      gst_buffer_list_add(prerecordsink->buffer_list, gst_buffer_ref(buffer));
+      if (held == 0)
+        held = g_get_monotonic_time();
 
-      if (prerecordsink->current_buffer_size > prerecordsink->buffer_size)
-        flow = gst_prerecord_sink_flush_buffer(prerecordsink);
-      else
-        flow = GST_FLOW_OK;
+      if (!gst_prerecord_sink_burst_ready(sink, tail, held))
+      {
+        g_mutex_lock(&sink->async_lock);
+        g_atomic_int_inc(&sink->async_waiters);
+        g_cond_wait_until(&sink->async_cond, &sink->async_lock,
+                          held + (gint64)sink->burst_time * 1000);
+        g_atomic_int_add(&sink->async_waiters, -1);
+        g_mutex_unlock(&sink->async_lock);
+        continue;
+      }
+
+      GST_LOG_OBJECT(sink, "writing a burst of %" G_GUINT64_FORMAT " bytes held for %"
+                           G_GINT64_FORMAT " us",
+                     STATS_GET(sink->stats.queued_bytes), g_get_monotonic_time() - held);
+      bursting = TRUE;
+      held = 0;
     }
-  }
-  else
-  {
-    flow = GST_FLOW_OK;
-  }
 
-  if (flow == GST_FLOW_OK && sync_after)
-  {
-    do
-    {
-      fsync_ret = fsync(fileno(prerecordsink->prerecord));
-    } while (fsync_ret < 0 && errno == EINTR);
-    if (fsync_ret)
+    obj = sink->async_ring[tail & (ASYNC_RING_SIZE - 1)];
+    sink->async_ring[tail & (ASYNC_RING_SIZE - 1)] = NULL;
+    size = sink->async_sizes[tail & (ASYNC_RING_SIZE - 1)];
+
+    /* let io_uring batch while more data is queued behind this */
+    gst_prerecord_sink_uring_set_batch(sink, g_atomic_int_get(&sink->async_head) - tail > 1);
+
+    /* after an error or on flush the queued data is dropped, segments are
+     * still switched so no file is left behind */
+    if (gst_prerecord_sink_is_segment_marker(obj) ||
+        (!g_atomic_int_get(&sink->async_discard) &&
+         g_atomic_int_get(&sink->async_flow) == GST_FLOW_OK))
+      flow = gst_prerecord_sink_async_write(sink, obj);
+    gst_mini_object_unref(obj);
+
+    g_mutex_lock(&sink->async_lock);
+    sink->async_pos = sink->current_pos;
+    g_mutex_unlock(&sink->async_lock);
+
+    if (flow != GST_FLOW_OK && flow != GST_FLOW_FLUSHING)
     {
-      GST_ELEMENT_ERROR(prerecordsink, RESOURCE, WRITE,
-                        (_("Error while writing to prerecord \"%s\"."), prerecordsink->prerecordname),
-                        ("%s", g_strerror(errno)));
-      flow = GST_FLOW_ERROR;
+      GST_DEBUG_OBJECT(sink, "writer failed: %s", gst_flow_get_name(flow));
+      g_atomic_int_set(&sink->async_flow, flow);
     }
+
+    STATS_SUB(sink->stats.queued_bytes, size);
+    g_atomic_int_set(&sink->async_tail, tail + 1);
+    gst_prerecord_sink_async_wake(sink, FALSE);
   }
 
-  return flow;
+  GST_DEBUG_OBJECT(sink, "writer thread stopped");
+
+  return NULL;
+}
+
+/* Bytes of @obj counted towards the overflow budget */
+static gsize
+gst_prerecord_sink_async_size(GstPrerecordSink *sink, GstMiniObject *obj)
+{
+  if (sink->overflow_exempt)
+    return 0;
+  if (GST_IS_BUFFER_LIST(obj))
+    return gst_buffer_list_calculate_size(GST_BUFFER_LIST_CAST(obj));
+  if (GST_IS_BUFFER(obj))
+    return gst_buffer_get_size(GST_BUFFER_CAST(obj));
+
+  return 0;
 }
 
+/* Whether @size more bytes do not fit in the ring or the overflow budget.
+ * Something larger than the budget still goes in once the writer caught
+ * up. */
 static gboolean
-gst_prerecord_sink_start(GstBaseSink *basesink)
+gst_prerecord_sink_async_full(GstPrerecordSink *sink, gsize size)
 {
-  GstPrerecordSink *prerecordsink;
+  guint64 queued;
 
-  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
+  if (sink->async_head - g_atomic_int_get(&sink->async_tail) >= ASYNC_RING_SIZE)
+    return TRUE;
+  if (sink->overflow_budget == 0 || size == 0)
+    return FALSE;
 
-  g_atomic_int_set(&prerecordsink->flushing, FALSE);
-  return gst_prerecord_sink_open_prerecord(prerecordsink);
+  queued = STATS_GET(sink->stats.queued_bytes);
+  return queued > 0 && queued + size > sink->overflow_budget;
 }
 
-static gboolean
-gst_prerecord_sink_stop(GstBaseSink *basesink)
+/* Takes ownership of @obj. Only blocks when the ring is full or the
+ * overflow budget is used up, errors of the writer are returned on the
+ * next push. */
+static GstFlowReturn
+gst_prerecord_sink_async_push(GstPrerecordSink *sink, GstMiniObject *obj)
 {
-  GstPrerecordSink *prerecordsink;
+  gint head = sink->async_head;
+  gsize size = gst_prerecord_sink_async_size(sink, obj);
+  gint64 stall = 0;
+  GstFlowReturn flow;
 
-  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
+  for (;;)
+  {
+    flow = g_atomic_int_get(&sink->async_flow);
+    if (flow != GST_FLOW_OK)
+      goto writer_error;
 
-  gst_prerecord_sink_close_prerecord(prerecordsink);
-  return TRUE;
+    if (!gst_prerecord_sink_async_full(sink, size))
+      break;
+
+    GST_DEBUG_OBJECT(sink, "writer %" G_GUINT64_FORMAT " bytes behind, waiting",
+                     STATS_GET(sink->stats.queued_bytes));
+    if (stall == 0)
+      stall = g_get_monotonic_time();
+
+    /* a writer holding a burst starts writing */
+    g_atomic_int_set(&sink->async_blocked, TRUE);
+    gst_prerecord_sink_async_wake(sink, FALSE);
+
+    g_mutex_lock(&sink->async_lock);
+    g_atomic_int_inc(&sink->async_waiters);
+    while (gst_prerecord_sink_async_full(sink, size) &&
+           !g_atomic_int_get(&sink->flushing))
+      g_cond_wait(&sink->async_cond, &sink->async_lock);
+    g_atomic_int_add(&sink->async_waiters, -1);
+    g_mutex_unlock(&sink->async_lock);
+    g_atomic_int_set(&sink->async_blocked, FALSE);
+
+    if (g_atomic_int_get(&sink->flushing))
+    {
+      flow = gst_base_sink_wait_preroll(GST_BASE_SINK(sink));
+      if (flow != GST_FLOW_OK)
+        goto writer_error;
+    }
+  }
+
+  sink->async_ring[head & (ASYNC_RING_SIZE - 1)] = obj;
+  sink->async_sizes[head & (ASYNC_RING_SIZE - 1)] = size;
+  STATS_ADD(sink->stats.queued_bytes, size);
+  g_atomic_int_set(&sink->async_head, head + 1);
+  gst_prerecord_sink_async_wake(sink, FALSE);
+
+  if (stall != 0)
+    gst_prerecord_sink_overflow_stalled(sink, g_get_monotonic_time() - stall);
+
+  return GST_FLOW_OK;
+
+writer_error:
+{
+  gst_mini_object_unref(obj);
+  return flow;
+}
 }
 
-static gboolean
-gst_prerecord_sink_unlock(GstBaseSink *basesink)
+static GstFlowReturn
+gst_prerecord_sink_async_sync(GstPrerecordSink *sink)
 {
-  GstPrerecordSink *prerecordsink;
+  return gst_prerecord_sink_async_push(sink,
+                                       GST_MINI_OBJECT_CAST(gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM_OOB,
+                                                                                 gst_structure_new_empty(ASYNC_SYNC_MARKER))));
+}
 
-  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
-  g_atomic_int_set(&prerecordsink->flushing, TRUE);
+/* Waits until the writer has handled everything queued so far */
+static GstFlowReturn
+gst_prerecord_sink_async_wait(GstPrerecordSink *sink)
+{
+  if (sink->writer == NULL)
+    return GST_FLOW_OK;
+
+  g_atomic_int_set(&sink->async_blocked, TRUE);
+  gst_prerecord_sink_async_wake(sink, FALSE);
+
+  /* a flush stops the wait, except for the discard it does itself */
+  g_mutex_lock(&sink->async_lock);
+  g_atomic_int_inc(&sink->async_waiters);
+  while (g_atomic_int_get(&sink->async_tail) != sink->async_head &&
+         (g_atomic_int_get(&sink->async_discard) || !g_atomic_int_get(&sink->flushing)))
+    g_cond_wait(&sink->async_cond, &sink->async_lock);
+  g_atomic_int_add(&sink->async_waiters, -1);
+  g_mutex_unlock(&sink->async_lock);
+  g_atomic_int_set(&sink->async_blocked, FALSE);
+
+  if (g_atomic_int_get(&sink->async_tail) != sink->async_head)
+    return GST_FLOW_FLUSHING;
+
+  return g_atomic_int_get(&sink->async_flow);
+}
 
-  return TRUE;
+/* Drops whatever is still queued, used when flushing */
+static void
+gst_prerecord_sink_async_discard(GstPrerecordSink *sink)
+{
+  if (sink->writer == NULL)
+    return;
+
+  g_atomic_int_set(&sink->async_discard, TRUE);
+  gst_prerecord_sink_async_wake(sink, TRUE);
+  gst_prerecord_sink_async_wait(sink);
+  g_atomic_int_set(&sink->async_discard, FALSE);
+  g_atomic_int_set(&sink->async_flow, GST_FLOW_OK);
 }
 
 static gboolean
-gst_prerecord_sink_unlock_stop(GstBaseSink *basesink)
+gst_prerecord_sink_writer_start(GstPrerecordSink *sink)
+{
+  GError *err = NULL;
+
+  sink->async_ring = g_new0(GstMiniObject *, ASYNC_RING_SIZE);
+  sink->async_sizes = g_new0(gsize, ASYNC_RING_SIZE);
+  sink->async_head = 0;
+  sink->async_tail = 0;
+  sink->async_waiters = 0;
+  sink->async_flow = GST_FLOW_OK;
+  sink->async_stop = FALSE;
+  sink->async_discard = FALSE;
+  sink->async_pos = sink->current_pos;
+  sink->async_blocked = FALSE;
+
+  sink->writer = g_thread_try_new("prerecordsink-writer",
+                                  gst_prerecord_sink_writer_thread, sink, &err);
+  if (sink->writer == NULL)
+    goto thread_failed;
+
+  return TRUE;
+
+  /* ERRORS */
+thread_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, FAILED,
+                    ("Could not start the writer thread."), ("%s", err->message));
+  g_clear_error(&err);
+  g_free(sink->async_ring);
+  sink->async_ring = NULL;
+  g_free(sink->async_sizes);
+  sink->async_sizes = NULL;
+  return FALSE;
+}
+}
+
+/* Position in the prerecord for the streaming thread and queries. While
+ * the writer thread runs it owns current_pos and only the position it
+ * reached after its last write can be read. */
+static guint64
+gst_prerecord_sink_position(GstPrerecordSink *sink)
+{
+  guint64 pos;
+
+  if (sink->writer == NULL)
+    return sink->current_pos;
+
+  g_mutex_lock(&sink->async_lock);
+  pos = sink->async_pos;
+  g_mutex_unlock(&sink->async_lock);
+
+  return pos;
+}
+
+/* Lets the writer finish what is queued and joins it */
+static void
+gst_prerecord_sink_writer_stop(GstPrerecordSink *sink)
+{
+  if (sink->writer == NULL)
+    return;
+
+  g_atomic_int_set(&sink->async_stop, TRUE);
+  gst_prerecord_sink_async_wake(sink, TRUE);
+  g_thread_join(sink->writer);
+  sink->writer = NULL;
+
+  g_free(sink->async_ring);
+  sink->async_ring = NULL;
+  g_free(sink->async_sizes);
+  sink->async_sizes = NULL;
+}
+
+#ifdef HAVE_FSEEKO
+#define __GST_STDIO_SEEK_FUNCTION "fseeko"
+#elif defined(G_OS_UNIX) || defined(G_OS_WIN32)
+#define __GST_STDIO_SEEK_FUNCTION "lseek"
+#else
+#define __GST_STDIO_SEEK_FUNCTION "fseek"
+#endif
+
+static gboolean
+gst_prerecord_sink_do_seek(GstPrerecordSink *prerecordsink, guint64 new_offset)
+{
+  GST_DEBUG_OBJECT(prerecordsink, "Seeking to offset %" G_GUINT64_FORMAT " using " __GST_STDIO_SEEK_FUNCTION, new_offset);
+
+  if (gst_prerecord_sink_flush_buffer(prerecordsink) != GST_FLOW_OK)
+    goto flush_buffer_failed;
+
+  if (gst_prerecord_sink_async_wait(prerecordsink) != GST_FLOW_OK ||
+      gst_prerecord_sink_uring_drain(prerecordsink) != GST_FLOW_OK ||
+      gst_prerecord_sink_direct_stop(prerecordsink) != GST_FLOW_OK)
+    goto flush_buffer_failed;
+
+#ifdef HAVE_FSEEKO
+  if (fseeko(prerecordsink->prerecord, (off_t)new_offset, SEEK_SET) != 0)
+    goto seek_failed;
+#elif defined(G_OS_UNIX) || defined(G_OS_WIN32)
+  if (lseek(fileno(prerecordsink->prerecord), (off_t)new_offset,
+            SEEK_SET) == (off_t)-1)
+    goto seek_failed;
+#else
+  if (fseek(prerecordsink->prerecord, (long)new_offset, SEEK_SET) != 0)
+    goto seek_failed;
+#endif
+
+  /* adjust position reporting after seek;
+   * presumably this should basically yield new_offset */
+  gst_prerecord_sink_get_current_offset(prerecordsink, &prerecordsink->current_pos);
+  gst_prerecord_sink_writeback_reset(prerecordsink);
+
+  return TRUE;
+
+  /* ERRORS */
+flush_buffer_failed:
+{
+  GST_DEBUG_OBJECT(prerecordsink, "Flushing buffer failed");
+  return FALSE;
+}
+seek_failed:
+{
+  GST_DEBUG_OBJECT(prerecordsink, "Seeking failed: %s", g_strerror(errno));
+  return FALSE;
+}
+}
+
+static gboolean
+gst_prerecord_sink_set_caps(GstBaseSink *sink, GstCaps *caps)
+{
+  GstPrerecordSink *prerecordsink = GST_PRERECORD_SINK(sink);
+
+  gst_prerecord_sink_mp4_set_caps(prerecordsink, caps);
+  GST_DEBUG_OBJECT(prerecordsink, "caps %" GST_PTR_FORMAT ", fragmented MP4 %d",
+                   caps, prerecordsink->mp4);
+
+  return TRUE;
+}
+
+/* handle events (search) */
+static gboolean
+gst_prerecord_sink_event(GstBaseSink *sink, GstEvent *event)
+{
+  GstEventType type;
+  GstPrerecordSink *prerecordsink;
+
+  prerecordsink = GST_PRERECORD_SINK(sink);
+
+  type = GST_EVENT_TYPE(event);
+
+  switch (type)
+  {
+  case GST_EVENT_SEGMENT:
+  {
+    const GstSegment *segment;
+
+    gst_event_parse_segment(event, &segment);
+
+    if (segment->format == GST_FORMAT_BYTES)
+    {
+      /* the writer hands current_pos back once it is idle */
+      if (gst_prerecord_sink_async_wait(prerecordsink) != GST_FLOW_OK)
+        goto flush_buffer_failed;
+
+      /* only try to seek and fail when we are going to a different
+       * position */
+      if (prerecordsink->current_pos + prerecordsink->current_buffer_size !=
+          segment->start)
+      {
+        /* FIXME, the seek should be performed on the pos field, start/stop are
+         * just boundaries for valid bytes offsets. We should also fill the prerecord
+         * with zeroes if the new position extends the current EOF (sparse streams
+         * and segment accumulation). */
+        if (!gst_prerecord_sink_do_seek(prerecordsink, (guint64)segment->start))
+          goto seek_failed;
+      }
+      else
+      {
+        GST_DEBUG_OBJECT(prerecordsink, "Ignored SEGMENT, no seek needed");
+      }
+    }
+    else
+    {
+      GST_DEBUG_OBJECT(prerecordsink,
+                       "Ignored SEGMENT event of format %u (%s)", (guint)segment->format,
+                       gst_format_get_name(segment->format));
+    }
+    break;
+  }
+  case GST_EVENT_FLUSH_STOP:
+    gst_prerecord_sink_async_discard(prerecordsink);
+    if (prerecordsink->current_pos != 0 && prerecordsink->seekable)
+    {
+      gst_prerecord_sink_do_seek(prerecordsink, 0);
+      if (ftruncate(fileno(prerecordsink->prerecord), 0))
+        goto truncate_failed;
+      prerecordsink->mp4_header_written = FALSE;
+      gst_prerecord_sink_rebase_reset(prerecordsink);
+      gst_prerecord_sink_index_open(prerecordsink, prerecordsink->segment_location);
+      gst_prerecord_sink_thumbnail_start(prerecordsink, prerecordsink->segment_location);
+    }
+    if (prerecordsink->buffer_list)
+    {
+      gst_buffer_list_unref(prerecordsink->buffer_list);
+      prerecordsink->buffer_list = gst_buffer_list_new();
+    }
+    prerecordsink->current_buffer_size = 0;
+    break;
+  case GST_EVENT_CUSTOM_DOWNSTREAM:
+    if (gst_event_has_name(event, GST_PRERECORD_SINK_TRIGGER))
+    {
+      GstClockTime running_time;
+      gint buffering;
+
+      if (!prerecord_trigger_parse_event(event, &buffering, &running_time))
+        goto bad_trigger;
+      gst_prerecord_sink_trigger_set(prerecordsink, buffering, running_time);
+    }
+    break;
+  case GST_EVENT_EOS:
+    if (gst_prerecord_sink_flush_buffer(prerecordsink) != GST_FLOW_OK)
+      goto flush_buffer_failed;
+    /* EOS is only posted once the writer has the clip on disk */
+    if (prerecordsink->writer &&
+        (gst_prerecord_sink_async_sync(prerecordsink) != GST_FLOW_OK ||
+         gst_prerecord_sink_async_wait(prerecordsink) != GST_FLOW_OK))
+      goto flush_buffer_failed;
+    if (gst_prerecord_sink_uring_drain(prerecordsink) != GST_FLOW_OK ||
+        gst_prerecord_sink_direct_sync(prerecordsink) != GST_FLOW_OK)
+      goto flush_buffer_failed;
+    break;
+  default:
+    break;
+  }
+
+  return GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
+
+  /* ERRORS */
+seek_failed:
+{
+  GST_ELEMENT_ERROR(prerecordsink, RESOURCE, SEEK,
+                    (_("Error while seeking in prerecord \"%s\"."), prerecordsink->prerecordname),
+                    GST_ERROR_SYSTEM);
+  gst_event_unref(event);
+  return FALSE;
+}
+flush_buffer_failed:
+{
+  GST_ELEMENT_ERROR(prerecordsink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), prerecordsink->prerecordname), NULL);
+  gst_event_unref(event);
+  return FALSE;
+}
+truncate_failed:
+{
+  GST_ELEMENT_ERROR(prerecordsink, RESOURCE, WRITE,
+                    (_("Error while writing to prerecord \"%s\"."), prerecordsink->prerecordname),
+                    GST_ERROR_SYSTEM);
+  gst_event_unref(event);
+  return FALSE;
+}
+bad_trigger:
+{
+  GST_WARNING_OBJECT(prerecordsink, "trigger without a buffering state: %" GST_PTR_FORMAT,
+                     event);
+  gst_event_unref(event);
+  return FALSE;
+}
+}
+
+static GstFlowReturn
+render_buffer(GstPrerecordSink *prerecordsink, GstBuffer *buffer)
+{
+  GstFlowReturn flow;
+  guint64 bytes_written = 0;
+  guint64 skip = 0;
+
+  if (prerecordsink->writer)
+    return gst_prerecord_sink_async_push(prerecordsink,
+                                         GST_MINI_OBJECT_CAST(gst_buffer_ref(buffer)));
+  if (prerecordsink->direct_buf)
+    return gst_prerecord_sink_direct_write(prerecordsink, GST_MINI_OBJECT_CAST(buffer));
+  if (prerecordsink->uring)
+    return gst_prerecord_sink_uring_write(prerecordsink, GST_MINI_OBJECT_CAST(buffer));
+
+  for (;;)
+  {
+    flow =
+        gst_writev_buffer(GST_OBJECT_CAST(prerecordsink),
+                          fileno(prerecordsink->prerecord), NULL, buffer, &bytes_written, skip,
+                          prerecordsink->max_transient_error_timeout, prerecordsink->current_pos,
+                          &prerecordsink->flushing);
+
+    prerecordsink->current_pos += bytes_written;
+    skip += bytes_written;
+
+    if (flow != GST_FLOW_FLUSHING)
+      break;
+
+    flow = gst_base_sink_wait_preroll(GST_BASE_SINK(prerecordsink));
+
+    if (flow != GST_FLOW_OK)
+      break;
+  }
+
+  if (flow == GST_FLOW_OK)
+    flow = gst_prerecord_sink_writeback(prerecordsink, FALSE);
+
+  return flow;
+}
+
+static GstFlowReturn
+render_mem(GstPrerecordSink *prerecordsink, const guint8 *data, gsize size)
+{
+  GstFlowReturn flow;
+  guint64 skip = 0;
+
+  if (prerecordsink->writer)
+  {
+    /* the memory is reused as soon as this returns */
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+
+    gst_buffer_fill(buffer, 0, data, size);
+    return gst_prerecord_sink_async_push(prerecordsink, GST_MINI_OBJECT_CAST(buffer));
+  }
+  if (prerecordsink->direct_buf)
+    return gst_prerecord_sink_direct_stage(prerecordsink, data, size);
+  if (prerecordsink->uring)
+    return gst_prerecord_sink_uring_write_mem(prerecordsink, data, size);
+
+  for (;;)
+  {
+    guint64 bytes_written = 0;
+
+    flow =
+        gst_writev_mem(GST_OBJECT_CAST(prerecordsink),
+                       fileno(prerecordsink->prerecord), NULL, data, size, &bytes_written,
+                       skip, prerecordsink->max_transient_error_timeout,
+                       prerecordsink->current_pos, &prerecordsink->flushing);
+
+    prerecordsink->current_pos += bytes_written;
+    skip += bytes_written;
+
+    if (flow != GST_FLOW_FLUSHING)
+      break;
+
+    flow = gst_base_sink_wait_preroll(GST_BASE_SINK(prerecordsink));
+    if (flow != GST_FLOW_OK)
+      break;
+  }
+
+  if (flow == GST_FLOW_OK)
+    flow = gst_prerecord_sink_writeback(prerecordsink, FALSE);
+
+  return flow;
+}
+
+static gboolean
+gst_prerecord_sink_get_current_offset(GstPrerecordSink *prerecordsink, guint64 *p_pos)
+{
+  off_t ret = -1;
+
+  /* no need to flush internal buffer here as this is only called right
+   * after a seek. If this changes then the buffer should be flushed here
+   * too
+   */
+
+#ifdef HAVE_FTELLO
+  ret = ftello(prerecordsink->prerecord);
+#elif defined(G_OS_UNIX) || defined(G_OS_WIN32)
+  ret = lseek(fileno(prerecordsink->prerecord), 0, SEEK_CUR);
+#else
+  ret = (off_t)ftell(prerecordsink->prerecord);
+#endif
+
+  if (ret != (off_t)-1)
+    *p_pos = (guint64)ret;
+
+  return (ret != (off_t)-1);
+}
+
+static GstFlowReturn
+gst_file_sink_render_list_internal(GstPrerecordSink *sink,
+                                   GstBufferList *buffer_list)
+{
+  GstFlowReturn flow;
+  guint num_buffers;
+  guint64 skip = 0;
+
+  num_buffers = gst_buffer_list_length(buffer_list);
+  if (num_buffers == 0)
+    goto no_data;
+
+  if (sink->writer)
+    return gst_prerecord_sink_async_push(sink,
+                                         GST_MINI_OBJECT_CAST(gst_buffer_list_ref(buffer_list)));
+  if (sink->direct_buf)
+    return gst_prerecord_sink_direct_write(sink, GST_MINI_OBJECT_CAST(buffer_list));
+  if (sink->uring)
+    return gst_prerecord_sink_uring_write(sink, GST_MINI_OBJECT_CAST(buffer_list));
+
+  GST_DEBUG_OBJECT(sink,
+                   "writing %u buffers at position %" G_GUINT64_FORMAT, num_buffers,
+                   sink->current_pos);
+
+  for (;;)
+  {
+    guint64 bytes_written = 0;
+
+    flow =
+        gst_writev_buffer_list(GST_OBJECT_CAST(sink), fileno(sink->prerecord),
+                               NULL, buffer_list, &bytes_written, skip,
+                               sink->max_transient_error_timeout, sink->current_pos, &sink->flushing);
+
+    sink->current_pos += bytes_written;
+    skip += bytes_written;
+
+    if (flow != GST_FLOW_FLUSHING)
+      break;
+
+    flow = gst_base_sink_wait_preroll(GST_BASE_SINK(sink));
+
+    if (flow != GST_FLOW_OK)
+      return flow;
+  }
+
+  if (flow == GST_FLOW_OK)
+    flow = gst_prerecord_sink_writeback(sink, FALSE);
+
+  return flow;
+
+no_data:
+{
+  GST_LOG_OBJECT(sink, "empty buffer list");
+  return GST_FLOW_OK;
+}
+}
+
+
+
+/* Running time of @ts in the current segment */
+static GstClockTime
+gst_prerecord_sink_running_time(GstPrerecordSink *sink, GstClockTime ts)
+{
+  return prerecord_running_time(GST_ELEMENT_CAST(sink), &GST_BASE_SINK(sink)->segment, ts);
+}
+
+/* Running time span covered by the whole of @buffer_list */
+static void
+gst_prerecord_sink_list_running_time(GstPrerecordSink *sink,
+                                     GstBufferList *buffer_list, GstClockTime *start, GstClockTime *end)
+{
+  GstClockTime pts, dts, ts, duration;
+  gsize size;
+  guint flags;
+
+  prerecord_list_meta(buffer_list, 0, gst_buffer_list_length(buffer_list),
+                               &pts, &dts, &ts, &duration, &size, &flags);
+
+  *start = gst_prerecord_sink_running_time(sink, ts);
+  *end = *start;
+  if (duration != GST_CLOCK_TIME_NONE)
+    *end += duration;
+}
+
+/* Delta units can never start a GOP, everything else is checked in the
+ * MPEG-TS payload when there is one. Fragmented MP4 starts a GOP with a
+ * moof whose video starts with a sync sample. */
+static gboolean
+gst_prerecord_sink_buffer_is_keyframe(GstPrerecordSink *sink, GstBuffer *buffer)
+{
+  if (sink->mp4)
+    return prerecord_mp4_is_keyframe(&sink->mp4_info, buffer);
+
+  return prerecord_buffer_is_keyframe(buffer);
+}
+
+/*** FRAGMENTED MP4 **********************************************************/
+
+/* The ftyp and moov header of fragmented MP4 is written at the start of
+ * every prerecord (see gstprerecordmp4.h). An mfra index is added when a
+ * prerecord is closed so it can be seeked without reading all
+ * fragments. */
+#define MP4_MAX_MOOF_SIZE (1024 * 1024)
+
+typedef struct _Mp4FragmentEntry
+{
+  guint32 track_id;
+  guint64 time;
+  guint64 moof_offset;
+  guint8 traf_number;
+  guint32 trun_number;
+  guint32 sample_number;
+} Mp4FragmentEntry;
+
+static void
+gst_prerecord_sink_mp4_set_caps(GstPrerecordSink *sink, GstCaps *caps)
+{
+  sink->mp4 = prerecord_mp4_set_caps(&sink->mp4_header, &sink->mp4_info, caps);
+}
+
+/* Starts the prerecord with the header if it was not written yet */
+static GstFlowReturn
+gst_prerecord_sink_mp4_write_header(GstPrerecordSink *sink)
+{
+  if (!sink->mp4 || sink->mp4_header == NULL || sink->mp4_header_written)
+    return GST_FLOW_OK;
+
+  sink->mp4_header_written = TRUE;
+  sink->index_offset += gst_buffer_list_calculate_size(sink->mp4_header);
+  return gst_file_sink_render_list_internal(sink, sink->mp4_header);
+}
+
+/* Collects the track and the first sync sample with its decode time of
+ * every traf in a moof, trafs without one are not random access points */
+static void
+gst_prerecord_sink_mp4_parse_moof(PrerecordMp4Info *info, const guint8 *data, gsize size,
+                                  guint64 offset, GArray *entries)
+{
+  gsize pos = 8;
+  guint8 traf_number = 0;
+
+  while (pos + 8 <= size)
+  {
+    gsize traf_size = GST_READ_UINT32_BE(data + pos);
+    gsize child;
+    Mp4FragmentEntry entry = {0, 0, offset, 0, 0, 0};
+    gboolean have_track = FALSE;
+    guint64 time_offset;
+
+    if (traf_size < 8 || pos + traf_size > size)
+      return;
+
+    if (GST_READ_UINT32_LE(data + pos + 4) != GST_MAKE_FOURCC('t', 'r', 'a', 'f'))
+    {
+      pos += traf_size;
+      continue;
+    }
+
+    entry.traf_number = ++traf_number;
+    for (child = pos + 8; child + 8 <= pos + traf_size;)
+    {
+      gsize child_size = GST_READ_UINT32_BE(data + child);
+      guint32 type = GST_READ_UINT32_LE(data + child + 4);
+
+      if (child_size < 8 || child + child_size > pos + traf_size)
+        break;
+
+      if (type == GST_MAKE_FOURCC('t', 'f', 'h', 'd') && child_size >= 16)
+      {
+        entry.track_id = GST_READ_UINT32_BE(data + child + 12);
+        have_track = TRUE;
+      }
+      else if (type == GST_MAKE_FOURCC('t', 'f', 'd', 't') && child_size >= 16)
+      {
+        if (data[child + 8] == 1 && child_size >= 20)
+          entry.time = GST_READ_UINT64_BE(data + child + 12);
+        else
+          entry.time = GST_READ_UINT32_BE(data + child + 12);
+      }
+      child += child_size;
+    }
+
+    if (have_track &&
+        prerecord_mp4_traf_sync_sample(info, data + pos + 8, traf_size - 8,
+                                       &entry.trun_number, &entry.sample_number,
+                                       &time_offset))
+    {
+      entry.time += time_offset;
+      g_array_append_val(entries, entry);
+    }
+    pos += traf_size;
+  }
+}
+
+static void
+gst_prerecord_sink_mp4_put32(GByteArray *box, guint32 value)
+{
+  guint8 data[4];
+
+  GST_WRITE_UINT32_BE(data, value);
+  g_byte_array_append(box, data, 4);
+}
+
+static void
+gst_prerecord_sink_mp4_put64(GByteArray *box, guint64 value)
+{
+  guint8 data[8];
+
+  GST_WRITE_UINT64_BE(data, value);
+  g_byte_array_append(box, data, 8);
+}
+
+/* Builds the mfra box, one tfra per track in the order they appear */
+static GByteArray *
+gst_prerecord_sink_mp4_build_mfra(GArray *entries)
+{
+  GByteArray *mfra = g_byte_array_new();
+  GArray *tracks = g_array_new(FALSE, FALSE, sizeof(guint32));
+  guint i, j, t;
+
+  for (i = 0; i < entries->len; i++)
+  {
+    guint32 track_id = g_array_index(entries, Mp4FragmentEntry, i).track_id;
+
+    for (t = 0; t < tracks->len; t++)
+    {
+      if (g_array_index(tracks, guint32, t) == track_id)
+        break;
+    }
+    if (t == tracks->len)
+      g_array_append_val(tracks, track_id);
+  }
+
+  gst_prerecord_sink_mp4_put32(mfra, 0);
+  g_byte_array_append(mfra, (const guint8 *)"mfra", 4);
+
+  for (t = 0; t < tracks->len; t++)
+  {
+    guint32 track_id = g_array_index(tracks, guint32, t);
+    guint start = mfra->len, count_pos, count = 0;
+
+    gst_prerecord_sink_mp4_put32(mfra, 0);
+    g_byte_array_append(mfra, (const guint8 *)"tfra", 4);
+    /* version 1 for 64 bit times and offsets */
+    gst_prerecord_sink_mp4_put32(mfra, 0x01000000);
+    gst_prerecord_sink_mp4_put32(mfra, track_id);
+    /* one byte traf numbers, four byte trun and sample numbers */
+    gst_prerecord_sink_mp4_put32(mfra, 0x0f);
+    count_pos = mfra->len;
+    gst_prerecord_sink_mp4_put32(mfra, 0);
+
+    for (j = 0; j < entries->len; j++)
+    {
+      Mp4FragmentEntry *entry = &g_array_index(entries, Mp4FragmentEntry, j);
+
+      if (entry->track_id != track_id)
+        continue;
+      gst_prerecord_sink_mp4_put64(mfra, entry->time);
+      gst_prerecord_sink_mp4_put64(mfra, entry->moof_offset);
+      g_byte_array_append(mfra, &entry->traf_number, 1);
+      gst_prerecord_sink_mp4_put32(mfra, entry->trun_number);
+      gst_prerecord_sink_mp4_put32(mfra, entry->sample_number);
+      count++;
+    }
+
+    GST_WRITE_UINT32_BE(mfra->data + count_pos, count);
+    GST_WRITE_UINT32_BE(mfra->data + start, mfra->len - start);
+  }
+
+  gst_prerecord_sink_mp4_put32(mfra, 16);
+  g_byte_array_append(mfra, (const guint8 *)"mfro", 4);
+  gst_prerecord_sink_mp4_put32(mfra, 0);
+  gst_prerecord_sink_mp4_put32(mfra, mfra->len + 4);
+  GST_WRITE_UINT32_BE(mfra->data, mfra->len);
+
+  g_array_free(tracks, TRUE);
+
+  return mfra;
+}
+
+/* Adds the mfra index to a closed prerecord. Only the box headers, the
+ * moov and the moofs are read back, a file that does not end on a complete
+ * box is left alone. */
+static void
+gst_prerecord_sink_mp4_finish(GstPrerecordSink *sink, const gchar *location)
+{
+  PrerecordMp4Info info = {{{0}}};
+  GArray *entries;
+  GByteArray *mfra = NULL;
+  struct stat st;
+  guint64 offset = 0;
+  gint fd;
+
+  fd = g_open(location, O_RDWR, 0);
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    GST_WARNING_OBJECT(sink, "could not open %s to index it: %s", location,
+                       g_strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  entries = g_array_new(FALSE, FALSE, sizeof(Mp4FragmentEntry));
+
+  while (offset + 8 <= (guint64)st.st_size)
+  {
+    guint8 head[16];
+    guint64 box_size;
+    guint32 type;
+    gsize head_size = MIN(sizeof(head), (guint64)st.st_size - offset);
+
+    if (pread(fd, head, head_size, offset) != (gssize)head_size)
+      break;
+
+    box_size = GST_READ_UINT32_BE(head);
+    type = GST_READ_UINT32_LE(head + 4);
+    if (box_size == 1 && head_size == 16)
+      box_size = GST_READ_UINT64_BE(head + 8);
+    else if (box_size == 0)
+      box_size = st.st_size - offset;
+    if (box_size < 8 || offset + box_size > (guint64)st.st_size)
+      break;
+
+    /* already indexed */
+    if (type == GST_MAKE_FOURCC('m', 'f', 'r', 'a'))
+      goto done;
+
+    if ((type == GST_MAKE_FOURCC('m', 'o', 'o', 'f') ||
+         type == GST_MAKE_FOURCC('m', 'o', 'o', 'v')) && box_size <= MP4_MAX_MOOF_SIZE)
+    {
+      guint8 *box = g_malloc(box_size);
+
+      if (pread(fd, box, box_size, offset) == (gssize)box_size)
+      {
+        if (type == GST_MAKE_FOURCC('m', 'o', 'o', 'v'))
+          prerecord_mp4_parse_moov(&info, box + 8, box_size - 8);
+        else
+          gst_prerecord_sink_mp4_parse_moof(&info, box, box_size, offset, entries);
+      }
+      g_free(box);
+    }
+
+    offset += box_size;
+  }
+
+  if (offset != (guint64)st.st_size || entries->len == 0)
+  {
+    GST_DEBUG_OBJECT(sink, "not indexing %s, %u fragments up to %" G_GUINT64_FORMAT
+                     " of %" G_GUINT64_FORMAT " bytes", location, entries->len,
+                     offset, (guint64)st.st_size);
+    goto done;
+  }
+
+  mfra = gst_prerecord_sink_mp4_build_mfra(entries);
+  if (lseek(fd, 0, SEEK_END) == (off_t)-1 ||
+      !gst_prerecord_sink_write_all(fd, mfra->data, mfra->len) || fsync(fd) != 0)
+    GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                        ("Could not write the fragment index of \"%s\".", location),
+                        GST_ERROR_SYSTEM);
+  else
+    GST_DEBUG_OBJECT(sink, "indexed %u fragments of %s", entries->len, location);
+
+done:
+  if (mfra)
+    g_byte_array_unref(mfra);
+  g_array_free(entries, TRUE);
+  prerecord_mp4_info_clear(&info);
+  close(fd);
+}
+
+/*** TIMESTAMP REBASE ********************************************************/
+
+/* The timestamps inside the stream are rewritten while it is written so
+ * that every prerecord starts close to zero and stays continuous across the
+ * pre-record, record and post-record phases. Only the MPEG-TS packets
+ * carrying a PCR or a PES header and the moof boxes are copied to be
+ * patched, the rest of a buffer stays shared. Pre-recorded data in the
+ * arena is patched in place right before it is drained. */
+#define TS_TIMESTAMP_MASK ((G_GUINT64_CONSTANT(1) << 33) - 1)
+#define TS_MAX_TIMESTAMPS 3
+/* Lead of the PTS over the PCR assumed when no PCR was seen, the most
+ * the T-STD allows outside of still pictures */
+#define TS_REBASE_LEAD 90000
+
+typedef struct _TsTimestamp
+{
+  guint offset;
+  gboolean pcr;
+} TsTimestamp;
+
+/* Copies @size bytes at @offset out of the arena, across its end if needed */
+static void
+gst_prerecord_sink_arena_peek(PrerecordArena *arena, gsize offset, guint8 *dest,
+                              gsize size)
+{
+  gsize first_part = MIN(size, arena->size - offset);
+
+  memcpy(dest, arena->data + offset, first_part);
+  memcpy(dest + first_part, arena->data, size - first_part);
+}
+
+static void
+gst_prerecord_sink_arena_poke(PrerecordArena *arena, gsize offset, const guint8 *src,
+                              gsize size)
+{
+  gsize first_part = MIN(size, arena->size - offset);
+
+  memcpy(arena->data + offset, src, first_part);
+  memcpy(arena->data, src + first_part, size - first_part);
+}
+
+static gboolean
+gst_prerecord_sink_rebasing(GstPrerecordSink *sink)
+{
+  return sink->rebase_timestamps && !sink->append;
+}
+
+static void
+gst_prerecord_sink_rebase_reset(GstPrerecordSink *sink)
+{
+  sink->rebase_ts_base = G_MAXUINT64;
+  sink->rebase_ts_pcr = G_MAXUINT64;
+  sink->rebase_ts_lead = G_MAXUINT64;
+  sink->rebase_mp4_base = GST_CLOCK_TIME_NONE;
+}
+
+/* Finds the PCR and the PES PTS and DTS of a packet */
+static guint
+gst_prerecord_sink_ts_timestamps(const guint8 *packet, TsTimestamp *ts)
+{
+  const guint8 *end = packet + PRERECORD_TS_PACKET_SIZE;
+  const guint8 *payload = packet + 4;
+  guint n = 0;
+  guint afc;
+
+  afc = (packet[3] >> 4) & 0x3;
+  if (afc & 0x2)
+  {
+    /* PCR_flag */
+    if (packet[4] >= 7 && (packet[5] & 0x10))
+    {
+      ts[n].offset = 6;
+      ts[n++].pcr = TRUE;
+    }
+    payload = packet + 5 + packet[4];
+  }
+
+  /* payload_unit_start_indicator */
+  if (!(packet[1] & 0x40) || !(afc & 0x1) || payload + 9 > end)
+    return n;
+
+  /* PES start code prefix followed by the optional PES header */
+  if (payload[0] != 0x00 || payload[1] != 0x00 || payload[2] != 0x01 ||
+      (payload[6] & 0xc0) != 0x80)
+    return n;
+
+  /* PTS_DTS_flags */
+  if ((payload[7] & 0x80) && payload + 14 <= end)
+  {
+    ts[n].offset = payload + 9 - packet;
+    ts[n++].pcr = FALSE;
+  }
+  if ((payload[7] & 0xc0) == 0xc0 && payload + 19 <= end)
+  {
+    ts[n].offset = payload + 14 - packet;
+    ts[n++].pcr = FALSE;
+  }
+
+  return n;
+}
+
+/* 33 bit PCR base or PTS/DTS at @data */
+static guint64
+gst_prerecord_sink_ts_read(const guint8 *data, gboolean pcr)
+{
+  if (pcr)
+    return ((guint64)data[0] << 25) | (data[1] << 17) | (data[2] << 9) |
+           (data[3] << 1) | (data[4] >> 7);
+
+  return ((guint64)(data[0] & 0x0e) << 29) | (data[1] << 22) |
+         ((data[2] & 0xfe) << 14) | (data[3] << 7) | (data[4] >> 1);
+}
+
+/* Keeps the PCR extension, the PES prefix bits and the marker bits */
+static void
+gst_prerecord_sink_ts_write(guint8 *data, gboolean pcr, guint64 value)
+{
+  if (pcr)
+  {
+    data[0] = value >> 25;
+    data[1] = value >> 17;
+    data[2] = value >> 9;
+    data[3] = value >> 1;
+    data[4] = (data[4] & 0x7f) | ((value & 1) << 7);
+    return;
+  }
+
+  data[0] = (data[0] & 0xf1) | ((value >> 29) & 0x0e);
+  data[1] = value >> 22;
+  data[2] = ((value >> 14) & 0xfe) | 0x01;
+  data[3] = value >> 7;
+  data[4] = ((value << 1) & 0xfe) | 0x01;
+}
+
+/* The base is the earliest timestamp of the first data written. The PTS
+ * and DTS lead the PCR they arrive with, their largest lead is kept for
+ * ts_scan_finish. */
+static void
+gst_prerecord_sink_ts_scan(GstPrerecordSink *sink, const guint8 *data, gsize size)
+{
+  gsize pos;
+
+  for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= size; pos += PRERECORD_TS_PACKET_SIZE)
+  {
+    TsTimestamp ts[TS_MAX_TIMESTAMPS];
+    guint i, n;
+
+    if (data[pos] != PRERECORD_TS_SYNC_BYTE)
+      return;
+
+    n = gst_prerecord_sink_ts_timestamps(data + pos, ts);
+    for (i = 0; i < n; i++)
+    {
+      guint64 value = gst_prerecord_sink_ts_read(data + pos + ts[i].offset, ts[i].pcr);
+
+      if (ts[i].pcr)
+      {
+        sink->rebase_ts_pcr = value;
+      }
+      else if (sink->rebase_ts_pcr != G_MAXUINT64)
+      {
+        guint64 lead = (value - sink->rebase_ts_pcr) & TS_TIMESTAMP_MASK;
+
+        if (lead < TS_TIMESTAMP_MASK / 2 &&
+            (sink->rebase_ts_lead == G_MAXUINT64 || lead > sink->rebase_ts_lead))
+          sink->rebase_ts_lead = lead;
+      }
+
+      /* earlier modulo 2^33, the timestamps may wrap around in between */
+      if (sink->rebase_ts_base == G_MAXUINT64 ||
+          ((sink->rebase_ts_base - value) & TS_TIMESTAMP_MASK) < TS_TIMESTAMP_MASK / 2)
+        sink->rebase_ts_base = value;
+    }
+  }
+}
+
+/* Moves the base found by ts_scan back by the largest lead seen, so that
+ * the audio muxed ahead of the first keyframe, which is only a little
+ * ahead of the PCR, does not end up before it */
+static void
+gst_prerecord_sink_ts_scan_finish(GstPrerecordSink *sink)
+{
+  guint64 lead;
+
+  if (sink->rebase_ts_base == G_MAXUINT64)
+    return;
+
+  lead = sink->rebase_ts_lead != G_MAXUINT64 ? sink->rebase_ts_lead : TS_REBASE_LEAD;
+  sink->rebase_ts_base = (sink->rebase_ts_base - lead) & TS_TIMESTAMP_MASK;
+
+  GST_DEBUG_OBJECT(sink, "rebasing MPEG-TS timestamps by %" G_GUINT64_FORMAT
+                   ", %" G_GUINT64_FORMAT " ahead of them", sink->rebase_ts_base, lead);
+}
+
+/* Returns whether @packet had timestamps to rebase */
+static gboolean
+gst_prerecord_sink_ts_rebase_packet(GstPrerecordSink *sink, guint8 *packet)
+{
+  TsTimestamp ts[TS_MAX_TIMESTAMPS];
+  guint i, n;
+
+  n = gst_prerecord_sink_ts_timestamps(packet, ts);
+  for (i = 0; i < n; i++)
+  {
+    guint8 *data = packet + ts[i].offset;
+    guint64 value = (gst_prerecord_sink_ts_read(data, ts[i].pcr) -
+                     sink->rebase_ts_base) & TS_TIMESTAMP_MASK;
+
+    /* only broken timestamps are that far before the base */
+    if (value > TS_TIMESTAMP_MASK / 2)
+      value = 0;
+    gst_prerecord_sink_ts_write(data, ts[i].pcr, value);
+  }
+
+  return n > 0;
+}
+
+/* Finds the next traf of the moof in @data from @pos on that has a track id
+ * and a tfdt, returns the offset of the tfdt */
+static gsize
+gst_prerecord_sink_mp4_next_tfdt(const guint8 *data, gsize size, gsize *pos,
+                                 guint32 *track_id)
+{
+  while (*pos + 8 <= size)
+  {
+    gsize traf = *pos, traf_size = GST_READ_UINT32_BE(data + traf);
+    gsize child, tfdt = 0;
+    gboolean have_track = FALSE;
+
+    if (traf_size < 8 || traf + traf_size > size)
+      return 0;
+    *pos += traf_size;
+
+    if (GST_READ_UINT32_LE(data + traf + 4) != GST_MAKE_FOURCC('t', 'r', 'a', 'f'))
+      continue;
+
+    for (child = traf + 8; child + 8 <= traf + traf_size;)
+    {
+      gsize child_size = GST_READ_UINT32_BE(data + child);
+      guint32 type = GST_READ_UINT32_LE(data + child + 4);
+
+      if (child_size < 8 || child + child_size > traf + traf_size)
+        break;
+
+      if (type == GST_MAKE_FOURCC('t', 'f', 'h', 'd') && child_size >= 16)
+      {
+        *track_id = GST_READ_UINT32_BE(data + child + 12);
+        have_track = TRUE;
+      }
+      else if (type == GST_MAKE_FOURCC('t', 'f', 'd', 't') && child_size >= 16 &&
+               (data[child + 8] != 1 || child_size >= 20))
+      {
+        tfdt = child;
+      }
+      child += child_size;
+    }
+
+    if (have_track && tfdt != 0)
+      return tfdt;
+  }
+
+  return 0;
+}
+
+/* Rebases the decode time of every traf by a base common to all tracks, the
+ * earliest decode time of the first moof rebased. The times are converted
+ * with the mdhd timescale of each track, tracks the moov did not have are
+ * left alone. */
+static void
+gst_prerecord_sink_mp4_rebase_moof(GstPrerecordSink *sink, guint8 *data, gsize size)
+{
+  PrerecordMp4Track *track;
+  guint32 track_id = 0;
+  gsize pos, tfdt;
+
+  if (sink->rebase_mp4_base == GST_CLOCK_TIME_NONE)
+  {
+    for (pos = 8; (tfdt = gst_prerecord_sink_mp4_next_tfdt(data, size, &pos, &track_id)) != 0;)
+    {
+      GstClockTime time;
+
+      track = prerecord_mp4_track(&sink->mp4_info, track_id);
+      if (track == NULL || track->timescale == 0)
+        continue;
+
+      time = data[tfdt + 8] == 1 ? GST_READ_UINT64_BE(data + tfdt + 12)
+                                 : GST_READ_UINT32_BE(data + tfdt + 12);
+      time = gst_util_uint64_scale(time, GST_SECOND, track->timescale);
+      if (sink->rebase_mp4_base == GST_CLOCK_TIME_NONE || time < sink->rebase_mp4_base)
+        sink->rebase_mp4_base = time;
+    }
+
+    if (sink->rebase_mp4_base == GST_CLOCK_TIME_NONE)
+      return;
+
+    GST_DEBUG_OBJECT(sink, "rebasing fMP4 decode times by %" GST_TIME_FORMAT,
+                     GST_TIME_ARGS(sink->rebase_mp4_base));
+  }
+
+  for (pos = 8; (tfdt = gst_prerecord_sink_mp4_next_tfdt(data, size, &pos, &track_id)) != 0;)
+  {
+    guint64 time, base;
+
+    track = prerecord_mp4_track(&sink->mp4_info, track_id);
+    if (track == NULL || track->timescale == 0)
+      continue;
+
+    /* rounded up so the track that set the base starts at exactly 0 */
+    base = gst_util_uint64_scale_ceil(sink->rebase_mp4_base, track->timescale, GST_SECOND);
+    if (data[tfdt + 8] == 1)
+      time = GST_READ_UINT64_BE(data + tfdt + 12);
+    else
+      time = GST_READ_UINT32_BE(data + tfdt + 12);
+
+    time = time > base ? time - base : 0;
+    if (data[tfdt + 8] == 1)
+      GST_WRITE_UINT64_BE(data + tfdt + 12, time);
+    else
+      GST_WRITE_UINT32_BE(data + tfdt + 12, time);
+  }
+}
+
+/* Appends what @buffer has before @offset to @rebased followed by a copy
+ * of the @size bytes at @offset, the copy is returned to be patched */
+static guint8 *
+gst_prerecord_sink_rebase_copy(GstBuffer **rebased, GstBuffer *buffer, gsize *last,
+                               const guint8 *data, gsize offset, gsize size)
+{
+  guint8 *copy;
+
+  if (*rebased == NULL)
+  {
+    *rebased = gst_buffer_new();
+    gst_buffer_copy_into(*rebased, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+  }
+  if (offset > *last)
+    gst_buffer_copy_into(*rebased, buffer, GST_BUFFER_COPY_MEMORY, *last,
+                         offset - *last);
+
+  copy = g_malloc(size);
+  memcpy(copy, data + offset, size);
+  gst_buffer_append_memory(*rebased,
+                           gst_memory_new_wrapped(0, copy, size, 0, size, copy, g_free));
+  *last = offset + size;
+
+  return copy;
+}
+
+/* Returns @buffer with its timestamps rebased, NULL when it has none */
+static GstBuffer *
+gst_prerecord_sink_rebase_buffer(GstPrerecordSink *sink, GstBuffer *buffer)
+{
+  GstBuffer *rebased = NULL;
+  GstMapInfo map;
+  gsize pos, last = 0;
+
+  if (!sink->mp4 && sink->rebase_ts_base == G_MAXUINT64)
+    return NULL;
+
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+    return NULL;
+
+  if (sink->mp4)
+  {
+    gsize size = map.size >= 8 ? GST_READ_UINT32_BE(map.data) : 0;
+
+    if (size >= 8 && size <= map.size &&
+        GST_READ_UINT32_LE(map.data + 4) == GST_MAKE_FOURCC('m', 'o', 'o', 'f'))
+      gst_prerecord_sink_mp4_rebase_moof(sink,
+                                         gst_prerecord_sink_rebase_copy(&rebased, buffer, &last,
+                                                                        map.data, 0, size),
+                                         size);
+  }
+  else
+  {
+    for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= map.size; pos += PRERECORD_TS_PACKET_SIZE)
+    {
+      TsTimestamp ts[TS_MAX_TIMESTAMPS];
+
+      if (map.data[pos] != PRERECORD_TS_SYNC_BYTE)
+        break;
+      if (gst_prerecord_sink_ts_timestamps(map.data + pos, ts) == 0)
+        continue;
+
+      gst_prerecord_sink_ts_rebase_packet(sink,
+                                          gst_prerecord_sink_rebase_copy(&rebased, buffer, &last,
+                                                                         map.data, pos,
+                                                                         PRERECORD_TS_PACKET_SIZE));
+    }
+  }
+
+  if (rebased && last < map.size)
+    gst_buffer_copy_into(rebased, buffer, GST_BUFFER_COPY_MEMORY, last,
+                         map.size - last);
+  gst_buffer_unmap(buffer, &map);
+
+  return rebased;
+}
+
+/* Returns a list with the timestamps of @buffer_list rebased, NULL when
+ * nothing in it had to be rebased */
+static GstBufferList *
+gst_prerecord_sink_rebase_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  GstBufferList *rebased = NULL;
+  guint i, j, num_buffers = gst_buffer_list_length(buffer_list);
+
+  if (!sink->mp4 && sink->rebase_ts_base == G_MAXUINT64)
+  {
+    for (i = 0; i < num_buffers; i++)
+    {
+      GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+      GstMapInfo map;
+
+      if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        continue;
+      gst_prerecord_sink_ts_scan(sink, map.data, map.size);
+      gst_buffer_unmap(buffer, &map);
+    }
+
+    gst_prerecord_sink_ts_scan_finish(sink);
+  }
+
+  for (i = 0; i < num_buffers; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+    GstBuffer *patched = gst_prerecord_sink_rebase_buffer(sink, buffer);
+
+    if (patched == NULL && rebased == NULL)
+      continue;
+
+    if (rebased == NULL)
+    {
+      rebased = gst_buffer_list_new_sized(num_buffers);
+      for (j = 0; j < i; j++)
+        gst_buffer_list_add(rebased, gst_buffer_ref(gst_buffer_list_get(buffer_list, j)));
+    }
+    gst_buffer_list_add(rebased, patched ? patched : gst_buffer_ref(buffer));
+  }
+
+  return rebased;
+}
+
+/*** SEEK INDEX **************************************************************/
+
+static void
+gst_prerecord_sink_index_close(GstPrerecordSink *sink)
+{
+  if (sink->index_file && fclose(sink->index_file) != 0)
+    GST_ELEMENT_WARNING(sink, RESOURCE, CLOSE,
+                        ("Error closing seek index \"%s\".", sink->index_location),
+                        GST_ERROR_SYSTEM);
+  sink->index_file = NULL;
+  g_free(sink->index_location);
+  sink->index_location = NULL;
+}
+
+/* Starts the index of the prerecord at @location, which is empty */
+static void
+gst_prerecord_sink_index_open(GstPrerecordSink *sink, const gchar *location)
+{
+  guint8 header[PRERECORD_INDEX_HEADER_SIZE];
+
+  gst_prerecord_sink_index_close(sink);
+  sink->index_offset = 0;
+  sink->index_start = GST_CLOCK_TIME_NONE;
+
+  if (!sink->seek_index || sink->append)
+    return;
+
+  sink->index_location = g_strconcat(location, PRERECORD_INDEX_SUFFIX, NULL);
+  sink->index_file = g_fopen(sink->index_location, "wb");
+  if (sink->index_file == NULL)
+    goto open_failed;
+
+  prerecord_index_write_header(header);
+  if (fwrite(header, sizeof(header), 1, sink->index_file) != 1)
+    goto write_failed;
+
+  return;
+
+  /* ERRORS */
+open_failed:
+{
+  GST_ELEMENT_WARNING(sink, RESOURCE, OPEN_WRITE,
+                      ("Could not open seek index \"%s\" for writing.", sink->index_location),
+                      GST_ERROR_SYSTEM);
+  g_free(sink->index_location);
+  sink->index_location = NULL;
+  return;
+}
+write_failed:
+{
+  GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                      ("Error while writing to seek index \"%s\".", sink->index_location),
+                      GST_ERROR_SYSTEM);
+  gst_prerecord_sink_index_close(sink);
+  return;
+}
+}
+
+/* Adds a keyframe at @running_time that is written at the current offset.
+ * Every record is flushed so that the index of a prerecord that was cut
+ * short is as complete as the prerecord itself. */
+static void
+gst_prerecord_sink_index_add(GstPrerecordSink *sink, GstClockTime running_time)
+{
+  guint8 record[PRERECORD_INDEX_RECORD_SIZE];
+
+  if (sink->index_start == GST_CLOCK_TIME_NONE)
+    sink->index_start = running_time;
+
+  prerecord_index_write_record(record,
+                               running_time > sink->index_start ? running_time - sink->index_start : 0,
+                               sink->index_offset);
+  if (fwrite(record, sizeof(record), 1, sink->index_file) != 1 ||
+      fflush(sink->index_file) != 0)
+  {
+    GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                        ("Error while writing to seek index \"%s\".", sink->index_location),
+                        GST_ERROR_SYSTEM);
+    gst_prerecord_sink_index_close(sink);
+  }
+}
+
+/* Indexes the keyframes of @buffer_list, which is written next */
+static void
+gst_prerecord_sink_index_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  guint i, num_buffers = gst_buffer_list_length(buffer_list);
+
+  for (i = 0; i < num_buffers; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+
+    if (sink->index_file && gst_prerecord_sink_buffer_is_keyframe(sink, buffer))
+      gst_prerecord_sink_index_add(sink,
+                                   gst_prerecord_sink_running_time(sink,
+                                                                   GST_BUFFER_DTS_OR_PTS(buffer)));
+    sink->index_offset += gst_buffer_get_size(buffer);
+  }
+}
+
+/* The arena keeps whether an entry starts with a keyframe and its running
+ * time, nothing has to be looked at again to index it */
+static void
+gst_prerecord_sink_index_arena(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  guint i;
+
+  for (i = 0; i < arena->n_entries; i++)
+  {
+    ArenaEntry *entry = &arena->entries[(arena->first + i) % arena->n_entries_max];
+
+    if (sink->index_file && entry->keyframe)
+      gst_prerecord_sink_index_add(sink, entry->running_time);
+    sink->index_offset += entry->size;
+  }
+}
+
+/*** THUMBNAIL ***************************************************************/
+
+/* The first keyframe of a prerecord is picked up while it is written, so
+ * the gallery never has to open the prerecord itself. From MPEG-TS the
+ * payload of the video PES is already an Annex B access unit, from fMP4
+ * the first video sample is converted with the SPS and PPS of the avcC in
+ * the header. A keyframe larger than THUMBNAIL_MAX_SIZE is not saved. */
+#define THUMBNAIL_SUFFIX ".thumb.h264"
+#define THUMBNAIL_MAX_SIZE (4 * 1024 * 1024)
+
+static void
+gst_prerecord_sink_thumbnail_stop(GstPrerecordSink *sink)
+{
+  g_free(sink->thumbnail_prerecord);
+  sink->thumbnail_prerecord = NULL;
+  g_byte_array_set_size(sink->thumbnail_data, 0);
+}
+
+static void
+gst_prerecord_sink_thumbnail_start(GstPrerecordSink *sink, const gchar *location)
+{
+  gst_prerecord_sink_thumbnail_stop(sink);
+
+  if (!sink->thumbnail)
+    return;
+
+  sink->thumbnail_prerecord = g_strdup(location);
+  sink->thumbnail_pid = -1;
+  sink->thumbnail_need = 0;
+}
+
+/* Keyframe saved by the thumbnail pool, next to @prerecord */
+typedef struct _PrerecordThumbnailJob
+{
+  gchar *prerecord;
+  GBytes *data;
+} PrerecordThumbnailJob;
+
+static void
+gst_prerecord_sink_thumbnail_job(gpointer data, gpointer user_data)
+{
+  PrerecordThumbnailJob *job = data;
+  GstPrerecordSink *sink = user_data;
+  gchar *path = g_strconcat(job->prerecord, THUMBNAIL_SUFFIX, NULL);
+  GError *err = NULL;
+  gsize size;
+  const gchar *contents = g_bytes_get_data(job->data, &size);
+
+  /* written to a temporary file and renamed, the gallery never sees half
+   * a thumbnail */
+  if (!g_file_set_contents(path, contents, size, &err))
+  {
+    GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                        ("Could not write the thumbnail \"%s\".", path),
+                        ("%s", err->message));
+    g_clear_error(&err);
+  }
+  else
+  {
+    GST_DEBUG_OBJECT(sink, "saved a %" G_GSIZE_FORMAT " bytes keyframe to %s",
+                     size, path);
+    gst_element_post_message(GST_ELEMENT_CAST(sink),
+                             gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                     gst_structure_new("GstPrerecordSinkThumbnail",
+                                                                       "location", G_TYPE_STRING, path,
+                                                                       "prerecord", G_TYPE_STRING, job->prerecord,
+                                                                       NULL)));
+  }
+
+  g_free(path);
+  g_bytes_unref(job->data);
+  g_free(job->prerecord);
+  g_free(job);
+}
+
+/* Hands the keyframe to the thumbnail pool, the streaming thread never
+ * waits for the file system */
+static void
+gst_prerecord_sink_thumbnail_save(GstPrerecordSink *sink, const guint8 *data,
+                                  gsize size)
+{
+  PrerecordThumbnailJob *job = g_new0(PrerecordThumbnailJob, 1);
+  GError *err = NULL;
+
+  job->prerecord = g_strdup(sink->thumbnail_prerecord);
+  job->data = g_bytes_new(data, size);
+  gst_prerecord_sink_thumbnail_stop(sink);
+
+  if (sink->thumbnail_pool == NULL)
+    sink->thumbnail_pool = g_thread_pool_new(gst_prerecord_sink_thumbnail_job, sink, 1,
+                                             FALSE, &err);
+  if (sink->thumbnail_pool == NULL)
+  {
+    GST_WARNING_OBJECT(sink, "no thumbnail thread, saving it here: %s", err->message);
+    g_clear_error(&err);
+    gst_prerecord_sink_thumbnail_job(job, sink);
+    return;
+  }
+
+  g_thread_pool_push(sink->thumbnail_pool, job, NULL);
+}
+
+/* Waits for the thumbnails being saved */
+static void
+gst_prerecord_sink_thumbnail_flush(GstPrerecordSink *sink)
+{
+  if (sink->thumbnail_pool == NULL)
+    return;
+
+  g_thread_pool_free(sink->thumbnail_pool, FALSE, TRUE);
+  sink->thumbnail_pool = NULL;
+}
+
+static void
+gst_prerecord_sink_thumbnail_too_large(GstPrerecordSink *sink)
+{
+  GST_WARNING_OBJECT(sink, "keyframe of %s is larger than %d bytes, no thumbnail",
+                     sink->thumbnail_prerecord, THUMBNAIL_MAX_SIZE);
+  gst_prerecord_sink_thumbnail_stop(sink);
+}
+
+/* Collects the video PES that starts with the first keyframe, it is
+ * complete once the next PES on the same PID starts */
+static void
+gst_prerecord_sink_thumbnail_ts(GstPrerecordSink *sink, const guint8 *packet)
+{
+  const guint8 *end = packet + PRERECORD_TS_PACKET_SIZE;
+  const guint8 *payload = packet + 4;
+  gint pid = ((packet[1] & 0x1f) << 8) | packet[2];
+  guint afc;
+
+  if (sink->thumbnail_pid < 0)
+  {
+    if (!prerecord_ts_is_keyframe(packet, PRERECORD_TS_PACKET_SIZE))
+      return;
+    sink->thumbnail_pid = pid;
+  }
+  else if (pid != sink->thumbnail_pid)
+  {
+    return;
+  }
+  else if (packet[1] & 0x40)
+  {
+    gst_prerecord_sink_thumbnail_save(sink, sink->thumbnail_data->data,
+                                      sink->thumbnail_data->len);
+    return;
+  }
+
+  afc = (packet[3] >> 4) & 0x3;
+  if (afc & 0x2)
+    payload = packet + 5 + packet[4];
+  if (!(afc & 0x1) || payload >= end)
+    return;
+
+  /* the keyframe check made sure the PES header is in this packet */
+  if (packet[1] & 0x40)
+    payload += 9 + payload[8];
+  if (payload < end)
+    g_byte_array_append(sink->thumbnail_data, payload, end - payload);
+
+  if (sink->thumbnail_data->len > THUMBNAIL_MAX_SIZE)
+    gst_prerecord_sink_thumbnail_too_large(sink);
+}
+
+/* Finds where the first sample of @track_id is relative to the start of
+ * @moof, which is @moof_offset bytes into the prerecord */
+static gboolean
+gst_prerecord_sink_mp4_first_sample(const guint8 *moof, gsize moof_size,
+                                    guint32 track_id, guint64 moof_offset,
+                                    guint64 *offset, gsize *size)
+{
+  gsize pos, box_size;
+  gboolean first_traf = TRUE;
+
+  for (pos = 8; pos + 8 <= moof_size; pos += box_size)
+  {
+    const guint8 *traf = moof + pos + 8;
+    const guint8 *tfhd, *trun, *field, *end;
+    gsize traf_size, tfhd_size, trun_size;
+    guint32 flags, sample_size = 0;
+    guint64 base = moof_offset;
+    gint32 data_offset = 0;
+
+    box_size = GST_READ_UINT32_BE(moof + pos);
+    if (box_size < 8 || pos + box_size > moof_size)
+      return FALSE;
+    if (GST_READ_UINT32_LE(moof + pos + 4) != GST_MAKE_FOURCC('t', 'r', 'a', 'f'))
+      continue;
+    traf_size = box_size - 8;
+
+    tfhd = prerecord_mp4_find(traf, traf_size,
+                              GST_MAKE_FOURCC('t', 'f', 'h', 'd'), &tfhd_size);
+    if (tfhd == NULL || tfhd_size < 8)
+      return FALSE;
+    if (GST_READ_UINT32_BE(tfhd + 4) != track_id)
+    {
+      first_traf = FALSE;
+      continue;
+    }
+
+    flags = GST_READ_UINT32_BE(tfhd) & 0xffffff;
+    field = tfhd + 8;
+    end = tfhd + tfhd_size;
+    /* base-data-offset-present */
+    if (flags & 0x000001)
+    {
+      if (field + 8 > end)
+        return FALSE;
+      base = GST_READ_UINT64_BE(field);
+      field += 8;
+    }
+    /* without it or default-base-is-moof only the first traf is based at
+     * the moof */
+    else if (!(flags & 0x020000) && !first_traf)
+    {
+      return FALSE;
+    }
+    if (flags & 0x000002)
+      field += 4;
+    if (flags & 0x000008)
+      field += 4;
+    if ((flags & 0x000010) && field + 4 <= end)
+      sample_size = GST_READ_UINT32_BE(field);
+
+    trun = prerecord_mp4_find(traf, traf_size,
+                              GST_MAKE_FOURCC('t', 'r', 'u', 'n'), &trun_size);
+    if (trun == NULL || trun_size < 8 || GST_READ_UINT32_BE(trun + 4) == 0)
+      return FALSE;
+
+    flags = GST_READ_UINT32_BE(trun) & 0xffffff;
+    field = trun + 8;
+    end = trun + trun_size;
+    if (flags & 0x000001)
+    {
+      if (field + 4 > end)
+        return FALSE;
+      data_offset = GST_READ_UINT32_BE(field);
+      field += 4;
+    }
+    if (flags & 0x000004)
+      field += 4;
+    if (flags & 0x000100)
+      field += 4;
+    if (flags & 0x000200)
+    {
+      if (field + 4 > end)
+        return FALSE;
+      sample_size = GST_READ_UINT32_BE(field);
+    }
+
+    if (sample_size == 0 || (gint64)(base - moof_offset) + data_offset < (gint64)moof_size)
+      return FALSE;
+
+    *offset = base - moof_offset + data_offset;
+    *size = sample_size;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Replaces the length prefixes of the NAL units in @sample by start codes
+ * and puts the SPS and PPS of @avcc in front */
+static GByteArray *
+gst_prerecord_sink_mp4_annexb(const guint8 *avcc, gsize avcc_size,
+                              const guint8 *sample, gsize sample_size)
+{
+  static const guint8 start_code[4] = {0x00, 0x00, 0x00, 0x01};
+  const guint8 *field = avcc + 5, *end = avcc + avcc_size;
+  GByteArray *annexb;
+  guint nal_length_size, set, i, n;
+  gsize pos;
+
+  if (avcc_size < 7)
+    return NULL;
+
+  annexb = g_byte_array_sized_new(sample_size + 256);
+  nal_length_size = (avcc[4] & 0x3) + 1;
+
+  /* the SPS then the PPS */
+  for (set = 0; set < 2; set++)
+  {
+    if (field >= end)
+      goto invalid;
+    n = set == 0 ? (*field++ & 0x1f) : *field++;
+    for (i = 0; i < n; i++)
+    {
+      gsize nal_size;
+
+      if (field + 2 > end)
+        goto invalid;
+      nal_size = GST_READ_UINT16_BE(field);
+      field += 2;
+      if (field + nal_size > end)
+        goto invalid;
+      g_byte_array_append(annexb, start_code, sizeof(start_code));
+      g_byte_array_append(annexb, field, nal_size);
+      field += nal_size;
+    }
+  }
+
+  for (pos = 0; pos + nal_length_size <= sample_size;)
+  {
+    gsize nal_size = 0;
+
+    for (i = 0; i < nal_length_size; i++)
+      nal_size = (nal_size << 8) | sample[pos++];
+    if (pos + nal_size > sample_size)
+      goto invalid;
+    g_byte_array_append(annexb, start_code, sizeof(start_code));
+    g_byte_array_append(annexb, sample + pos, nal_size);
+    pos += nal_size;
+  }
+
+  return annexb;
+
+invalid:
+  g_byte_array_unref(annexb);
+  return NULL;
+}
+
+/* Collects the first fragment with a video sample, @data is written
+ * @offset bytes into the prerecord. Once the moof is complete
+ * @thumbnail_offset is where the sample starts in the fragment and
+ * @thumbnail_need where it ends. */
+static void
+gst_prerecord_sink_thumbnail_mp4(GstPrerecordSink *sink, const guint8 *data,
+                                 gsize size, gboolean keyframe, guint64 offset)
+{
+  GByteArray *fragment = sink->thumbnail_data;
+  GBytes *avcc = sink->mp4_info.avcc;
+  GByteArray *annexb;
+  guint64 sample_offset;
+  gsize sample_size;
+
+  if (fragment->len == 0)
+  {
+    if (!keyframe)
+      return;
+    sink->thumbnail_offset = offset;
+    sink->thumbnail_need = 0;
+  }
+  g_byte_array_append(fragment, data, size);
+
+  if (sink->thumbnail_need == 0)
+  {
+    if (fragment->len < 8 || fragment->len < GST_READ_UINT32_BE(fragment->data))
+      goto check_size;
+
+    if (avcc == NULL)
+    {
+      GST_DEBUG_OBJECT(sink, "no H.264 track in the header, no thumbnail");
+      gst_prerecord_sink_thumbnail_stop(sink);
+      return;
+    }
+
+    if (!gst_prerecord_sink_mp4_first_sample(fragment->data,
+                                             GST_READ_UINT32_BE(fragment->data),
+                                             sink->mp4_info.video_track,
+                                             sink->thumbnail_offset,
+                                             &sample_offset, &sample_size))
+    {
+      /* e.g. an audio fragment, wait for the next one */
+      g_byte_array_set_size(fragment, 0);
+      return;
+    }
+    if (sample_offset + sample_size > THUMBNAIL_MAX_SIZE)
+    {
+      gst_prerecord_sink_thumbnail_too_large(sink);
+      return;
+    }
+    sink->thumbnail_offset = sample_offset;
+    sink->thumbnail_need = sample_offset + sample_size;
+  }
+
+  if (fragment->len < sink->thumbnail_need)
+    goto check_size;
+
+  annexb = gst_prerecord_sink_mp4_annexb(g_bytes_get_data(avcc, NULL), g_bytes_get_size(avcc),
+                                         fragment->data + sink->thumbnail_offset,
+                                         sink->thumbnail_need - sink->thumbnail_offset);
+  if (annexb == NULL)
+  {
+    GST_WARNING_OBJECT(sink, "could not convert the keyframe of %s",
+                       sink->thumbnail_prerecord);
+    gst_prerecord_sink_thumbnail_stop(sink);
+    return;
+  }
+
+  gst_prerecord_sink_thumbnail_save(sink, annexb->data, annexb->len);
+  g_byte_array_unref(annexb);
+  return;
+
+check_size:
+  if (fragment->len > THUMBNAIL_MAX_SIZE)
+    gst_prerecord_sink_thumbnail_too_large(sink);
+}
+
+/* Looks for the thumbnail in @buffer_list, which is written next */
+static void
+gst_prerecord_sink_thumbnail_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  guint i, num_buffers = gst_buffer_list_length(buffer_list);
+  guint64 offset = sink->index_offset;
+
+  for (i = 0; i < num_buffers && sink->thumbnail_prerecord; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+    GstMapInfo map;
+    gsize pos;
+
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+      continue;
+
+    if (sink->mp4)
+    {
+      gst_prerecord_sink_thumbnail_mp4(sink, map.data, map.size,
+                                       gst_prerecord_sink_buffer_is_keyframe(sink, buffer),
+                                       offset);
+    }
+    else
+    {
+      for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= map.size && sink->thumbnail_prerecord;
+           pos += PRERECORD_TS_PACKET_SIZE)
+      {
+        if (map.data[pos] != PRERECORD_TS_SYNC_BYTE)
+          break;
+        gst_prerecord_sink_thumbnail_ts(sink, map.data + pos);
+      }
+    }
+
+    offset += map.size;
+    gst_buffer_unmap(buffer, &map);
+  }
+}
+
+/* Looks for the thumbnail in the pre-recorded data about to be drained */
+static void
+gst_prerecord_sink_thumbnail_arena(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  guint64 offset = sink->index_offset;
+  guint8 copy[PRERECORD_TS_PACKET_SIZE];
+  guint i;
+
+  for (i = 0; i < arena->n_entries && sink->thumbnail_prerecord; i++)
+  {
+    ArenaEntry *entry = &arena->entries[(arena->first + i) % arena->n_entries_max];
+    gsize first_part = MIN(entry->size, arena->size - entry->offset);
+    gsize pos;
+
+    if (sink->mp4)
+    {
+      /* an entry may wrap around the end of the arena */
+      gst_prerecord_sink_thumbnail_mp4(sink, arena->data + entry->offset, first_part,
+                                       entry->keyframe, offset);
+      if (first_part < entry->size && sink->thumbnail_prerecord &&
+          sink->thumbnail_data->len > 0)
+        gst_prerecord_sink_thumbnail_mp4(sink, arena->data, entry->size - first_part,
+                                         FALSE, offset + first_part);
+    }
+    else
+    {
+      for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= entry->size && sink->thumbnail_prerecord;
+           pos += PRERECORD_TS_PACKET_SIZE)
+      {
+        gsize packet_offset = (entry->offset + pos) % arena->size;
+        const guint8 *packet = arena->data + packet_offset;
+
+        if (packet_offset + PRERECORD_TS_PACKET_SIZE > arena->size)
+        {
+          gst_prerecord_sink_arena_peek(arena, packet_offset, copy, PRERECORD_TS_PACKET_SIZE);
+          packet = copy;
+        }
+        if (packet[0] != PRERECORD_TS_SYNC_BYTE)
+          break;
+        gst_prerecord_sink_thumbnail_ts(sink, packet);
+      }
+    }
+
+    offset += entry->size;
+  }
+}
+
+/*** TRIGGER *****************************************************************/
+
+/* Queues a switch to @buffering at @running_time, replacing one that is
+ * still pending */
+static void
+gst_prerecord_sink_trigger_set(GstPrerecordSink *sink, gint buffering,
+                               GstClockTime running_time)
+{
+  if (prerecord_trigger_set(GST_OBJECT_CAST(sink), &sink->trigger, buffering, running_time))
+    GST_DEBUG_OBJECT(sink, "replaced a pending trigger");
+
+  gst_prerecord_sink_trace_trigger(sink, buffering, running_time);
+
+  GST_DEBUG_OBJECT(sink, "buffering %d requested at %" GST_TIME_FORMAT, buffering,
+                   GST_TIME_ARGS(running_time));
+}
+
+/* Queues @buffering unless the sink is or will be in it already, or @from
+ * is set and it is not in that */
+static gboolean
+gst_prerecord_sink_trigger_request(GstPrerecordSink *sink, gint buffering,
+                                   const gint *from, GstClockTime running_time)
+{
+  gint current = prerecord_trigger_target(GST_OBJECT_CAST(sink), &sink->trigger,
+                                          &sink->buffering);
+
+  if (current == buffering || (from != NULL && current != *from))
+    return FALSE;
+
+  gst_prerecord_sink_trigger_set(sink, buffering, running_time);
+
+  return TRUE;
+}
+
+static gboolean
+gst_prerecord_sink_start_recording(GstPrerecordSink *sink, guint64 running_time)
+{
+  return gst_prerecord_sink_trigger_request(sink, GST_PRERECORD_SINK_BUFFERING_RECORDING,
+                                            NULL, running_time);
+}
+
+static gboolean
+gst_prerecord_sink_stop_recording(GstPrerecordSink *sink, guint64 running_time)
+{
+  const gint recording = GST_PRERECORD_SINK_BUFFERING_RECORDING;
+
+  return gst_prerecord_sink_trigger_request(sink, GST_PRERECORD_SINK_BUFFERING_POSTRECORD,
+                                            &recording, running_time);
+}
+
+/* Index of the first buffer of @buffer_list the pending trigger applies
+ * to, the length of the list when there is none */
+static guint
+gst_prerecord_sink_trigger_find(GstPrerecordSink *sink, GstBufferList *buffer_list,
+                                GstClockTime *running_time)
+{
+  return prerecord_trigger_find(GST_ELEMENT_CAST(sink), &sink->trigger,
+                                &GST_BASE_SINK(sink)->segment, buffer_list, 0,
+                                running_time);
+}
+
+/* Switches to the pending buffering state before the buffer at
+ * @running_time. What was queued before it is handled in the old state. */
+static GstFlowReturn
+gst_prerecord_sink_trigger_apply(GstPrerecordSink *sink, GstClockTime running_time)
+{
+  GstClockTime requested_time;
+  GstFlowReturn flow;
+  gint64 requested;
+  gint buffering;
+
+  buffering = prerecord_trigger_take(GST_OBJECT_CAST(sink), &sink->trigger,
+                                     &requested_time, &requested);
+
+  flow = gst_prerecord_sink_flush_buffer(sink);
+
+  GST_OBJECT_LOCK(sink);
+  sink->buffering = buffering;
+  GST_OBJECT_UNLOCK(sink);
+
+  GST_INFO_OBJECT(sink, "buffering %d at %" GST_TIME_FORMAT ", %" G_GINT64_FORMAT
+                        " us after the request",
+                  buffering, GST_TIME_ARGS(running_time), g_get_monotonic_time() - requested);
+
+  prerecord_trigger_post(GST_ELEMENT_CAST(sink), buffering, requested_time, running_time,
+                         requested);
+
+  return flow;
+}
+
+/*** WRITING *****************************************************************/
+
+/* Writes @buffer_list with its timestamps rebased and its keyframes
+ * indexed, the thumbnail is looked for first */
+static GstFlowReturn
+gst_prerecord_sink_write_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  GstBufferList *rebased = NULL;
+  GstFlowReturn flow;
+  gint64 start;
+
+  if (sink->thumbnail_prerecord)
+    gst_prerecord_sink_thumbnail_list(sink, buffer_list);
+  gst_prerecord_sink_index_list(sink, buffer_list);
+
+  if (gst_prerecord_sink_rebasing(sink))
+    rebased = gst_prerecord_sink_rebase_list(sink, buffer_list);
+
+  start = g_get_monotonic_time();
+  flow = gst_file_sink_render_list_internal(sink, rebased ? rebased : buffer_list);
+  if (flow == GST_FLOW_OK)
+    gst_prerecord_sink_stats_write(sink, gst_buffer_list_calculate_size(buffer_list),
+                                   start);
+  if (rebased)
+    gst_buffer_list_unref(rebased);
+
+  return flow;
+}
+
+/*** PRE-RECORD JOURNAL ******************************************************/
+
+#ifdef HAVE_MMAP
+
+/* The journal ring file starts with a header, followed by the on-disk
+ * copy of the arena index, room for the fMP4 header and the page aligned
+ * arena. Records are written in native byte order, the file is only read
+ * back on the same device. Every start bumps @generation so records of an
+ * earlier run are never taken for current ones, and @clean is only set on
+ * an orderly stop. */
+#define JOURNAL_MAGIC 0x50524a4c /* "PRJL" */
+#define JOURNAL_VERSION 2
+#define JOURNAL_MP4_HEADER_MAX (64 * 1024)
+
+typedef struct _PrerecordJournalHeader
+{
+  guint32 magic;
+  guint32 version;
+  guint32 generation;
+  guint32 clean;
+  guint64 records_offset;
+  guint64 mp4_header_offset;
+  guint64 data_offset;
+  guint64 data_size;
+  guint32 n_records;
+  guint32 crc;
+} PrerecordJournalHeader;
+
+typedef struct _PrerecordJournalRecord
+{
+  guint32 generation;
+  guint32 payload_crc;
+  guint64 sequence;
+  guint64 offset;
+  guint64 size;
+  guint64 pts;
+  guint64 dts;
+  guint64 duration;
+  guint32 keyframe;
+  guint32 crc;
+} PrerecordJournalRecord;
+
+/* In front of the ftyp and moov a fragmented MP4 recovery starts with */
+typedef struct _PrerecordJournalMp4Header
+{
+  guint32 generation;
+  guint32 size;
+  guint32 payload_crc;
+  guint32 crc;
+} PrerecordJournalMp4Header;
+
+#define JOURNAL_HEADER(arena) \
+  ((PrerecordJournalHeader *)((arena)->data - (arena)->data_offset))
+#define JOURNAL_RECORDS(header) \
+  ((PrerecordJournalRecord *)((guint8 *)(header) + (header)->records_offset))
+#define JOURNAL_MP4_HEADER(header) \
+  ((PrerecordJournalMp4Header *)((guint8 *)(header) + (header)->mp4_header_offset))
+
+static guint32
+gst_prerecord_sink_crc32(guint32 crc, const guint8 *data, gsize size)
+{
+  static guint32 table[256];
+  static gsize table_init = 0;
+
+  if (g_once_init_enter(&table_init))
+  {
+    guint32 i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+      guint32 c = i;
+
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    g_once_init_leave(&table_init, 1);
+  }
+
+  crc = ~crc;
+  while (size--)
+    crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+/* CRC of a payload that may wrap around the end of the arena */
+static guint32
+gst_prerecord_sink_journal_payload_crc(const guint8 *data, gsize data_size,
+                                       gsize offset, gsize size)
+{
+  gsize first_part = MIN(size, data_size - offset);
+  guint32 crc;
+
+  crc = gst_prerecord_sink_crc32(0, data + offset, first_part);
+  return gst_prerecord_sink_crc32(crc, data, size - first_part);
+}
+
+static gboolean
+gst_prerecord_sink_journal_header_valid(const PrerecordJournalHeader *header)
+{
+  return header->magic == JOURNAL_MAGIC && header->version == JOURNAL_VERSION &&
+         header->crc == gst_prerecord_sink_crc32(0, (const guint8 *)header,
+                                                 G_STRUCT_OFFSET(PrerecordJournalHeader, crc)) &&
+         header->n_records > 0 && header->data_size > 0 &&
+         header->records_offset >= sizeof(PrerecordJournalHeader) &&
+         header->records_offset + (guint64)header->n_records * sizeof(PrerecordJournalRecord) <=
+             header->mp4_header_offset &&
+         header->mp4_header_offset + sizeof(PrerecordJournalMp4Header) + JOURNAL_MP4_HEADER_MAX <=
+             header->data_offset;
+}
+
+static void
+gst_prerecord_sink_journal_write_header(GstPrerecordSink *sink, gboolean clean)
+{
+  PrerecordArena *arena = &sink->arena;
+  PrerecordJournalHeader *header = JOURNAL_HEADER(arena);
+
+  header->magic = JOURNAL_MAGIC;
+  header->version = JOURNAL_VERSION;
+  header->generation = arena->generation;
+  header->clean = clean;
+  header->records_offset = sizeof(PrerecordJournalHeader);
+  header->mp4_header_offset = header->records_offset +
+                              (guint64)arena->n_records * sizeof(PrerecordJournalRecord);
+  header->data_offset = arena->data_offset;
+  header->data_size = arena->size;
+  header->n_records = arena->n_records;
+  header->crc = gst_prerecord_sink_crc32(0, (const guint8 *)header,
+                                         G_STRUCT_OFFSET(PrerecordJournalHeader, crc));
+}
+
+/* Bytes in front of the arena in the journal file, page aligned so the
+ * arena can be advised and written back on its own */
+static gsize
+gst_prerecord_sink_journal_layout(guint n_records, gsize page_size)
+{
+  gsize size = sizeof(PrerecordJournalHeader) +
+               (gsize)n_records * sizeof(PrerecordJournalRecord) +
+               sizeof(PrerecordJournalMp4Header) + JOURNAL_MP4_HEADER_MAX;
+
+  return ((size + page_size - 1) / page_size) * page_size;
+}
+
+static gint
+gst_prerecord_sink_journal_compare(gconstpointer a, gconstpointer b)
+{
+  const PrerecordJournalRecord *ra = *(const PrerecordJournalRecord *const *)a;
+  const PrerecordJournalRecord *rb = *(const PrerecordJournalRecord *const *)b;
+
+  return ra->sequence < rb->sequence ? -1 : ra->sequence > rb->sequence;
+}
+
+/* Path of the recovered clip, next to the prerecord with ".recovered"
+ * before its extension */
+static gchar *
+gst_prerecord_sink_journal_recovery_path(GstPrerecordSink *sink)
+{
+  const gchar *name = sink->prerecordname;
+  const gchar *dot = strrchr(name, '.');
+
+  if (dot == NULL || strchr(dot, G_DIR_SEPARATOR) != NULL)
+    return g_strdup_printf("%s.recovered", name);
+
+  return g_strdup_printf("%.*s.recovered%s", (gint)(dot - name), name, dot);
+}
+
+/* The fMP4 header journaled by the run of @header, NULL if there is none
+ * or it is torn */
+static const guint8 *
+gst_prerecord_sink_journal_mp4_header_valid(const PrerecordJournalHeader *header,
+                                            const guint8 *base, gsize *size)
+{
+  const PrerecordJournalMp4Header *mp4_header =
+      (const PrerecordJournalMp4Header *)(base + header->mp4_header_offset);
+  const guint8 *data = (const guint8 *)(mp4_header + 1);
+
+  if (mp4_header->generation != header->generation || mp4_header->size == 0 ||
+      mp4_header->size > JOURNAL_MP4_HEADER_MAX ||
+      mp4_header->crc != gst_prerecord_sink_crc32(0, (const guint8 *)mp4_header,
+                                                  G_STRUCT_OFFSET(PrerecordJournalMp4Header, crc)) ||
+      mp4_header->payload_crc != gst_prerecord_sink_crc32(0, data, mp4_header->size))
+    return NULL;
+
+  *size = mp4_header->size;
+  return data;
+}
+
+/* Called with the journal file of a previous run. When that run did not
+ * stop cleanly, the longest run of consecutive records whose payloads are
+ * still intact is written out as a clip starting on a keyframe, newest data
+ * first since torn writes can only be at the end. A fragmented MP4 clip
+ * gets the journaled header in front and its fragment index at the end. */
+static void
+gst_prerecord_sink_journal_recover(GstPrerecordSink *sink, gint fd)
+{
+  PrerecordJournalHeader header;
+  PrerecordJournalRecord *records, **valid;
+  const guint8 *mp4_header;
+  gsize mp4_header_size = 0;
+  struct stat st;
+  guint8 *base, *data;
+  gsize map_size;
+  guint64 total = 0;
+  guint i, n_valid = 0, start, first;
+  gchar *path;
+  gint out;
+
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      !gst_prerecord_sink_journal_header_valid(&header) || header.clean)
+    return;
+
+  map_size = header.data_offset + header.data_size;
+  if (fstat(fd, &st) != 0 || (guint64)st.st_size < map_size)
+    return;
+
+  GST_WARNING_OBJECT(sink, "pre-record journal generation %u was not closed "
+                     "cleanly, recovering it", header.generation);
+
+  base = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+    return;
+  records = (PrerecordJournalRecord *)(base + header.records_offset);
+  data = base + header.data_offset;
+
+  valid = g_new(PrerecordJournalRecord *, header.n_records);
+  for (i = 0; i < header.n_records; i++)
+  {
+    PrerecordJournalRecord *record = &records[i];
+
+    if (record->generation != header.generation || record->size == 0 ||
+        record->size > header.data_size || record->offset >= header.data_size ||
+        record->crc != gst_prerecord_sink_crc32(0, (const guint8 *)record,
+                                                G_STRUCT_OFFSET(PrerecordJournalRecord, crc)))
+      continue;
+    valid[n_valid++] = record;
+  }
+  qsort(valid, n_valid, sizeof(PrerecordJournalRecord *),
+        gst_prerecord_sink_journal_compare);
+
+  start = n_valid;
+  for (i = n_valid; i > 0; i--)
+  {
+    PrerecordJournalRecord *record = valid[i - 1];
+
+    if (start < n_valid && record->sequence + 1 != valid[start]->sequence)
+      break;
+    if (total + record->size > header.data_size)
+      break;
+    if (record->payload_crc != gst_prerecord_sink_journal_payload_crc(data,
+                                                                      header.data_size, record->offset, record->size))
+    {
+      if (start == n_valid)
+        continue;
+      break;
+    }
+    total += record->size;
+    start = i - 1;
+  }
+
+  for (first = start; first < n_valid && !valid[first]->keyframe; first++)
+    ;
+  if (first == n_valid)
+    first = start;
+
+  if (first == n_valid)
+  {
+    GST_INFO_OBJECT(sink, "nothing to recover from the pre-record journal");
+    goto done;
+  }
+
+  path = gst_prerecord_sink_journal_recovery_path(sink);
+  out = g_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0)
+  {
+    GST_ELEMENT_WARNING(sink, RESOURCE, OPEN_WRITE,
+                        ("Could not open \"%s\" to recover the pre-record journal.", path),
+                        GST_ERROR_SYSTEM);
+    g_free(path);
+    goto done;
+  }
+
+  mp4_header = gst_prerecord_sink_journal_mp4_header_valid(&header, base, &mp4_header_size);
+  total = 0;
+  if (mp4_header && gst_prerecord_sink_write_all(out, mp4_header, mp4_header_size))
+    total = mp4_header_size;
+  for (i = first; i < n_valid; i++)
+  {
+    PrerecordJournalRecord *record = valid[i];
+    gsize first_part = MIN(record->size, header.data_size - record->offset);
+
+    if (!gst_prerecord_sink_write_all(out, data + record->offset, first_part) ||
+        !gst_prerecord_sink_write_all(out, data, record->size - first_part))
+      break;
+    total += record->size;
+  }
+  if (i < n_valid || fdatasync(out) != 0)
+    GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                        ("Could not write the recovered clip \"%s\".", path),
+                        GST_ERROR_SYSTEM);
+  close(out);
+
+  if (mp4_header && i == n_valid)
+    gst_prerecord_sink_mp4_finish(sink, path);
+
+  GST_WARNING_OBJECT(sink, "recovered %" G_GUINT64_FORMAT " bytes of pre-record "
+                     "into %s", total, path);
+  gst_element_post_message(GST_ELEMENT_CAST(sink),
+                           gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                   gst_structure_new("GstPrerecordSinkRecovered",
+                                                                     "location", G_TYPE_STRING, path,
+                                                                     "size", G_TYPE_UINT64, total,
+                                                                     NULL)));
+  g_free(path);
+
+done:
+  g_free(valid);
+  munmap(base, map_size);
+}
+
+/* The journal file is named after the element path so that it is found
+ * again by the same sink after a restart */
+static gint
+gst_prerecord_sink_journal_open(GstPrerecordSink *sink)
+{
+  const gchar *dir = sink->temp_location ? sink->temp_location : g_get_tmp_dir();
+  gchar *element_path, *name, *path;
+  gint fd;
+
+  element_path = gst_object_get_path_string(GST_OBJECT_CAST(sink));
+  g_strdelimit(element_path, "/:", '_');
+  name = g_strdup_printf("prerecordsink%s.ring", element_path);
+  path = g_build_filename(dir, name, NULL);
+
+  fd = g_open(path, O_RDWR | O_CREAT, 0600);
+  if (fd >= 0)
+  {
+    GST_DEBUG_OBJECT(sink, "pre-record journal in %s", path);
+    if (sink->prerecordname != NULL)
+      gst_prerecord_sink_journal_recover(sink, fd);
+  }
+
+  g_free(path);
+  g_free(name);
+  g_free(element_path);
+
+  return fd;
+}
+
+/* Starts a new generation, called with an empty arena */
+static void
+gst_prerecord_sink_journal_reset(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  PrerecordJournalHeader *header = JOURNAL_HEADER(arena);
+
+  if (arena->generation == 0 && gst_prerecord_sink_journal_header_valid(header))
+    arena->generation = header->generation + 1;
+  else if (arena->generation == 0)
+    arena->generation = g_random_int();
+  else
+    arena->generation++;
+  if (arena->generation == 0)
+    arena->generation = 1;
+  arena->sequence = 0;
+  if (arena->mp4_header)
+  {
+    gst_buffer_list_unref(arena->mp4_header);
+    arena->mp4_header = NULL;
+  }
+
+  gst_prerecord_sink_journal_write_header(sink, FALSE);
+  if (fdatasync(arena->fd) != 0)
+    GST_WARNING_OBJECT(sink, "could not flush the pre-record journal: %s",
+                       g_strerror(errno));
+  arena->last_sync = g_get_monotonic_time();
+}
+
+/* Journals the fMP4 header of this generation, done again whenever it is
+ * replaced. Any change to the header list makes it a new list since the
+ * arena keeps a ref to the one it journaled. */
+static void
+gst_prerecord_sink_journal_mp4_header(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  PrerecordJournalMp4Header *mp4_header = JOURNAL_MP4_HEADER(JOURNAL_HEADER(arena));
+  guint8 *data = (guint8 *)(mp4_header + 1);
+  gsize size = gst_buffer_list_calculate_size(sink->mp4_header);
+  guint i;
+
+  if (arena->mp4_header)
+    gst_buffer_list_unref(arena->mp4_header);
+  arena->mp4_header = gst_buffer_list_ref(sink->mp4_header);
+
+  /* a torn header is never taken, whatever is left of an old one */
+  mp4_header->size = 0;
+  if (size == 0 || size > JOURNAL_MP4_HEADER_MAX)
+  {
+    GST_WARNING_OBJECT(sink, "fMP4 header of %" G_GSIZE_FORMAT " bytes does not "
+                       "fit in the journal, it is not recovered", size);
+    return;
+  }
+
+  size = 0;
+  for (i = 0; i < gst_buffer_list_length(sink->mp4_header); i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(sink->mp4_header, i);
+
+    size += gst_buffer_extract(buffer, 0, data + size, gst_buffer_get_size(buffer));
+  }
+
+  mp4_header->generation = arena->generation;
+  mp4_header->size = size;
+  mp4_header->payload_crc = gst_prerecord_sink_crc32(0, data, size);
+  mp4_header->crc = gst_prerecord_sink_crc32(0, (const guint8 *)mp4_header,
+                                             G_STRUCT_OFFSET(PrerecordJournalMp4Header, crc));
+}
+
+static void
+gst_prerecord_sink_journal_sync_job(gpointer data, gpointer user_data)
+{
+  GstPrerecordSink *sink = user_data;
+  PrerecordArena *arena = data;
+
+  if (fdatasync(arena->fd) != 0)
+    GST_WARNING_OBJECT(sink, "could not flush the pre-record journal: %s",
+                       g_strerror(errno));
+  g_atomic_int_set(&arena->syncing, 0);
+}
+
+/* Starts a flush of the journal on the sync pool unless one is running
+ * already, the streaming thread never waits for a stalled card */
+static void
+gst_prerecord_sink_journal_sync(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  GError *err = NULL;
+
+  if (g_atomic_int_get(&arena->syncing))
+    return;
+
+  if (arena->sync_pool == NULL)
+    arena->sync_pool = g_thread_pool_new(gst_prerecord_sink_journal_sync_job, sink, 1,
+                                         FALSE, &err);
+  if (arena->sync_pool == NULL)
+  {
+    GST_WARNING_OBJECT(sink, "no journal sync thread, flushing here: %s", err->message);
+    g_clear_error(&err);
+    gst_prerecord_sink_journal_sync_job(arena, sink);
+    return;
+  }
+
+  g_atomic_int_set(&arena->syncing, 1);
+  g_thread_pool_push(arena->sync_pool, arena, NULL);
+}
+
+/* Waits for the flush started by journal_sync */
+static void
+gst_prerecord_sink_journal_sync_stop(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+
+  if (arena->sync_pool == NULL)
+    return;
+
+  g_thread_pool_free(arena->sync_pool, FALSE, TRUE);
+  arena->sync_pool = NULL;
+}
+
+/* Records the newest arena entry, its payload has just been copied in with
+ * @payload_crc. Records go round the journal by sequence, there are as many
+ * as the arena can ever hold entries so the in-memory index can grow and
+ * move without them. The file is flushed every sync-interval off the
+ * streaming thread, the writeback started by arena_advise keeps that flush
+ * short. */
+static void
+gst_prerecord_sink_journal_record(GstPrerecordSink *sink, const ArenaEntry *entry,
+                                  guint32 payload_crc)
+{
+  PrerecordArena *arena = &sink->arena;
+  PrerecordJournalRecord *record =
+      &JOURNAL_RECORDS(JOURNAL_HEADER(arena))[arena->sequence % arena->n_records];
+  gint64 now;
+
+  if (sink->mp4 && sink->mp4_header && sink->mp4_header != arena->mp4_header)
+    gst_prerecord_sink_journal_mp4_header(sink);
+
+  record->generation = arena->generation;
+  record->payload_crc = payload_crc;
+  record->sequence = arena->sequence++;
+  record->offset = entry->offset;
+  record->size = entry->size;
+  record->pts = entry->pts;
+  record->dts = entry->dts;
+  record->duration = entry->duration;
+  record->keyframe = entry->keyframe;
+  record->crc = gst_prerecord_sink_crc32(0, (const guint8 *)record,
+                                         G_STRUCT_OFFSET(PrerecordJournalRecord, crc));
+
+  if (sink->sync_interval <= 0)
+    return;
+
+  now = g_get_monotonic_time();
+  if (now - arena->last_sync >= (gint64)sink->sync_interval * 1000)
+  {
+    gst_prerecord_sink_journal_sync(sink);
+    arena->last_sync = now;
+  }
+}
+
+/* Marks the journal as closed cleanly so it is not recovered */
+static void
+gst_prerecord_sink_journal_close(GstPrerecordSink *sink)
+{
+  gst_prerecord_sink_journal_sync_stop(sink);
+  gst_prerecord_sink_journal_write_header(sink, TRUE);
+  if (fdatasync(sink->arena.fd) != 0)
+    GST_WARNING_OBJECT(sink, "could not flush the pre-record journal: %s",
+                       g_strerror(errno));
+}
+
+#endif /* HAVE_MMAP */
+
+static void
+gst_prerecord_sink_arena_free(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+
+  if (arena->data)
+  {
+#ifdef HAVE_MMAP
+    if (arena->data_offset > 0)
+      gst_prerecord_sink_journal_close(sink);
+    munmap(arena->data - arena->data_offset, arena->size + arena->data_offset);
+#else
+    g_free(arena->data);
+#endif
+  }
+  if (arena->fd >= 0)
+    close(arena->fd);
+  if (arena->mp4_header)
+    gst_buffer_list_unref(arena->mp4_header);
+  g_free(arena->entries);
+  prerecord_keyframes_free(&arena->keyframes);
+  memset(arena, 0, sizeof(PrerecordArena));
+  arena->fd = -1;
+}
+
+#ifdef HAVE_MMAP
+/* Creates the file the mmap, memfd and journal rings are mapped from */
+static gint
+gst_prerecord_sink_arena_open_file(GstPrerecordSink *sink, gsize size)
+{
+  gint fd = -1;
+
+  if (sink->ring_storage == GST_PRERECORD_SINK_RING_STORAGE_JOURNAL)
+  {
+    fd = gst_prerecord_sink_journal_open(sink);
+  }
+  else if (sink->ring_storage == GST_PRERECORD_SINK_RING_STORAGE_MEMFD)
+  {
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("prerecordsink", MFD_CLOEXEC);
+#else
+    errno = ENOSYS;
+#endif
+  }
+  else
+  {
+    const gchar *dir = sink->temp_location ? sink->temp_location : g_get_tmp_dir();
+    gchar *path = g_build_filename(dir, "prerecordsink-XXXXXX", NULL);
+
+    fd = g_mkstemp_full(path, O_RDWR, 0600);
+    if (fd >= 0)
+      g_unlink(path);
+    g_free(path);
+  }
+
+  if (fd >= 0 && ftruncate(fd, size) != 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+
+  return fd;
+}
+#endif
+
+static gboolean
+gst_prerecord_sink_arena_alloc(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  gsize page_size = 4096;
+  gsize size, data_offset = 0;
+  guint64 n_entries;
+
+  if (sink->max_bytes > 0)
+  {
+    size = sink->max_bytes;
+  }
+  else
+  {
+    GstClockTime window = sink->max_time;
+
+    if (window == 0)
+      window = (GstClockTime)MAX(sink->pre_record, 1) * GST_SECOND;
+    size = gst_util_uint64_scale(window, ARENA_SIZING_BITRATE / 8, GST_SECOND);
+  }
+
+#if defined(G_OS_UNIX) && defined(_SC_PAGESIZE)
+  page_size = sysconf(_SC_PAGESIZE);
+#endif
+  size = ((size + page_size - 1) / page_size) * page_size;
+
+  /* the index starts at what the window takes at the sizing bitrate and
+   * grows up to one entry per smallest list the arena can hold */
+  arena->n_entries_limit = MIN(size / ARENA_MIN_ENTRY_SIZE + 1, G_MAXUINT / 2);
+  n_entries = gst_util_uint64_scale_ceil(size, ARENA_SIZING_LISTS * 8,
+                                         ARENA_SIZING_BITRATE) + 1;
+  arena->n_entries_max = MIN(n_entries, arena->n_entries_limit);
+  arena->n_records = arena->n_entries_limit;
+
+#ifdef HAVE_MMAP
+  if (sink->ring_storage == GST_PRERECORD_SINK_RING_STORAGE_ARENA)
+  {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_POPULATE
+    /* fault everything in now so the streaming thread never does */
+    flags |= MAP_POPULATE;
+#endif
+    arena->data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (arena->data == MAP_FAILED)
+      arena->data = NULL;
+  }
+  else
+  {
+    guint8 *map;
+
+    /* long windows live in a file, the kernel pages them out instead of
+     * them taking up RAM */
+    if (sink->ring_storage == GST_PRERECORD_SINK_RING_STORAGE_JOURNAL)
+      data_offset = gst_prerecord_sink_journal_layout(arena->n_records, page_size);
+    arena->fd = gst_prerecord_sink_arena_open_file(sink, data_offset + size);
+    if (arena->fd < 0)
+      goto open_failed;
+
+    map = mmap(NULL, data_offset + size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               arena->fd, 0);
+    if (map != MAP_FAILED)
+    {
+      arena->data = map + data_offset;
+      arena->data_offset = data_offset;
+#ifdef MADV_SEQUENTIAL
+      madvise(arena->data, size, MADV_SEQUENTIAL);
+#endif
+    }
+  }
+#else
+  if (sink->ring_storage != GST_PRERECORD_SINK_RING_STORAGE_ARENA)
+    GST_WARNING_OBJECT(sink, "file backed rings need mmap, using the heap");
+  if (sink->memory_limit > 0 || sink->memory_pressure > 0.0)
+    GST_WARNING_OBJECT(sink, "without mmap the arena memory is not released, "
+                       "memory-limit and memory-pressure only shorten the window");
+  arena->data = g_try_malloc(size);
+#endif
+  if (arena->data == NULL)
+    goto alloc_failed;
+
+  arena->size = size;
+  arena->page_size = page_size;
+  arena->entries = g_try_new0(ArenaEntry, arena->n_entries_max);
+  if (arena->entries == NULL)
+    goto alloc_failed;
+
+  arena->read = arena->used = 0;
+  arena->first = arena->n_entries = 0;
+  arena->n_keyframes = 0;
+  arena->dropping = FALSE;
+  prerecord_keyframes_init(&arena->keyframes, arena->n_entries_max);
+  arena->advised = 0;
+
+#ifdef HAVE_MMAP
+  if (arena->data_offset > 0)
+    gst_prerecord_sink_journal_reset(sink);
+#endif
+
+  GST_DEBUG_OBJECT(sink, "allocated pre-record arena of %" G_GSIZE_FORMAT
+                   " bytes, %u index entries", size, arena->n_entries_max);
+
+  return TRUE;
+
+  /* ERRORS */
+#ifdef HAVE_MMAP
+open_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, OPEN_WRITE,
+                    ("Could not create the %" G_GSIZE_FORMAT " bytes pre-record ring file.", size),
+                    GST_ERROR_SYSTEM);
+  gst_prerecord_sink_arena_free(sink);
+  return FALSE;
+}
+#endif
+alloc_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, NO_SPACE_LEFT,
+                    ("Could not allocate %" G_GSIZE_FORMAT " bytes for pre-recording.", size),
+                    GST_ERROR_SYSTEM);
+  gst_prerecord_sink_arena_free(sink);
+  return FALSE;
+}
+}
+
+/* Doubles the index when it is full before the payloads are, unwrapped so
+ * the oldest entry is first again. Returns FALSE when it is at its limit or
+ * the memory is not there, the oldest entry is evicted instead. */
+static gboolean
+gst_prerecord_sink_arena_grow(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  guint n_entries_max, first_part;
+  ArenaEntry *entries;
+
+  if (arena->n_entries_max >= arena->n_entries_limit)
+    return FALSE;
+
+  n_entries_max = MIN(arena->n_entries_max * 2, arena->n_entries_limit);
+  entries = g_try_new(ArenaEntry, n_entries_max);
+  if (entries == NULL)
+    return FALSE;
+
+  first_part = MIN(arena->n_entries, arena->n_entries_max - arena->first);
+  memcpy(entries, arena->entries + arena->first, first_part * sizeof(ArenaEntry));
+  memcpy(entries + first_part, arena->entries,
+         (arena->n_entries - first_part) * sizeof(ArenaEntry));
+
+  g_free(arena->entries);
+  arena->entries = entries;
+  arena->n_entries_max = n_entries_max;
+  arena->first = 0;
+
+  GST_DEBUG_OBJECT(sink, "pre-record arena index grown to %u entries",
+                   n_entries_max);
+
+  return TRUE;
+}
+
+static void
+gst_prerecord_sink_arena_pop(PrerecordArena *arena)
+{
+  ArenaEntry *entry;
+
+  if (arena->n_entries == 0)
+    return;
+
+  entry = &arena->entries[arena->first];
+  if (entry->keyframe)
+  {
+    prerecord_keyframes_pop(&arena->keyframes);
+    arena->n_keyframes--;
+  }
+  arena->read = (entry->offset + entry->size) % arena->size;
+  arena->used -= entry->size;
+  arena->first = (arena->first + 1) % arena->n_entries_max;
+  arena->n_entries--;
+}
+
+/* Every chunk of a file backed arena that has been written completely is
+ * cold until a trigger, so it is marked as such and its writeback started
+ * early. The chunks being written stay resident. */
+static void
+gst_prerecord_sink_arena_advise(GstPrerecordSink *sink, gsize write)
+{
+  PrerecordArena *arena = &sink->arena;
+
+  for (;;)
+  {
+    gsize end = MIN(arena->advised + ARENA_ADVISE_CHUNK, arena->size);
+    gsize written = (write + arena->size - arena->advised) % arena->size;
+
+    if (written < end - arena->advised)
+      break;
+
+#if defined(HAVE_MMAP) && defined(MADV_COLD)
+    madvise(arena->data + arena->advised, end - arena->advised, MADV_COLD);
+#endif
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (sink->ring_storage != GST_PRERECORD_SINK_RING_STORAGE_MEMFD)
+      sync_file_range(arena->fd, arena->data_offset + arena->advised,
+                      end - arena->advised, SYNC_FILE_RANGE_WRITE);
+#endif
+
+    arena->advised = end % arena->size;
+  }
+}
+
+/* Whether writing @size bytes at @offset would overwrite arena bytes a
+ * clip is still writing out */
+static gboolean
+gst_prerecord_sink_arena_pinned(PrerecordArena *arena, gsize offset, gsize size)
+{
+  if (g_atomic_int_get(&arena->pins) == 0)
+    return FALSE;
+
+  return (offset + arena->size - arena->pin_offset) % arena->size < arena->pin_size ||
+         (arena->pin_offset + arena->size - offset) % arena->size < size;
+}
+
+/* Waits for the clips to let go of the arena before it is patched in place */
+static void
+gst_prerecord_sink_arena_wait_unpinned(GstPrerecordSink *sink)
+{
+  g_mutex_lock(&sink->pin_lock);
+  if (g_atomic_int_get(&sink->arena.pins) > 0)
+    GST_DEBUG_OBJECT(sink, "waiting for clips to write out the pre-record arena");
+  while (g_atomic_int_get(&sink->arena.pins) > 0)
+    g_cond_wait(&sink->pin_cond, &sink->pin_lock);
+  g_mutex_unlock(&sink->pin_lock);
+}
+
+static void
+gst_prerecord_sink_arena_push(GstPrerecordSink *sink, GstBufferList *buffer_list,
+                              guint first, guint last, gboolean keyframe)
+{
+  PrerecordArena *arena = &sink->arena;
+  ArenaEntry *entry;
+  gsize write;
+  guint i;
+  GstClockTime pts, dts, ts, duration;
+  gsize size;
+  guint flags;
+  guint index;
+  guint32 crc = 0;
+  gboolean evicted = FALSE;
+
+  prerecord_list_meta(buffer_list, first, last, &pts, &dts, &ts,
+                               &duration, &size, &flags);
+  if (size == 0)
+    return;
+
+  if (size > arena->size)
+  {
+    GST_WARNING_OBJECT(sink, "buffer list of %" G_GSIZE_FORMAT " bytes does not "
+                       "fit the pre-record arena, dropping the arena", size);
+    while (arena->n_entries > 0)
+      gst_prerecord_sink_arena_pop(arena);
+    return;
+  }
+
+  /* the index may let go of entries a clip is writing out, their bytes
+   * stay as they are until the clip is done. Nothing is evicted for a list
+   * that cannot be stored, and the rest of its GOP goes with it so the
+   * arena holds no GOP with a hole. */
+  write = (arena->read + arena->used) % arena->size;
+  if (keyframe)
+    arena->dropping = FALSE;
+  if (arena->dropping || gst_prerecord_sink_arena_pinned(arena, write, size))
+  {
+    GST_LOG_OBJECT(sink, "not keeping %" G_GSIZE_FORMAT " bytes, %s", size,
+                   arena->dropping ? "their GOP was cut" : "the arena is pinned by a clip");
+    arena->dropping = TRUE;
+    STATS_ADD(sink->stats.evictions, 1);
+    return;
+  }
+
+  if (arena->n_entries == arena->n_entries_max &&
+      arena->used + size <= arena->size)
+    gst_prerecord_sink_arena_grow(sink);
+
+  /* make room by dropping the oldest payloads, then the rest of the GOP
+   * that was cut into so the arena still starts on a keyframe */
+  while (arena->n_entries == arena->n_entries_max ||
+         arena->used + size > arena->size)
+  {
+    gst_prerecord_sink_arena_pop(arena);
+    evicted = TRUE;
+  }
+  while (evicted && arena->n_keyframes > 0 &&
+         !arena->entries[arena->first].keyframe)
+    gst_prerecord_sink_arena_pop(arena);
+
+  index = (arena->first + arena->n_entries) % arena->n_entries_max;
+  entry = &arena->entries[index];
+  entry->offset = write;
+  entry->size = size;
+  entry->flags = flags;
+  entry->keyframe = keyframe;
+  entry->pts = pts;
+  entry->dts = dts;
+  entry->duration = duration;
+  entry->running_time = gst_prerecord_sink_running_time(sink, ts);
+  prerecord_ring_extend(&sink->ring, entry->running_time, duration);
+
+  for (i = first; i < last; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+    gsize buffer_size = gst_buffer_get_size(buffer);
+    gsize done = 0;
+
+    while (done < buffer_size)
+    {
+      gsize chunk = MIN(buffer_size - done, arena->size - write);
+
+      gst_buffer_extract(buffer, done, arena->data + write, chunk);
+#ifdef HAVE_MMAP
+      if (arena->data_offset > 0)
+        crc = gst_prerecord_sink_crc32(crc, arena->data + write, chunk);
+#endif
+      done += chunk;
+      write = (write + chunk) % arena->size;
+    }
+  }
+
+  arena->used += size;
+  arena->n_entries++;
+  if (keyframe)
+  {
+    prerecord_keyframes_push(&arena->keyframes, arena->pushed);
+    arena->n_keyframes++;
+  }
+  arena->pushed++;
+
+#ifdef HAVE_MMAP
+  if (arena->data_offset > 0)
+    gst_prerecord_sink_journal_record(sink, entry, crc);
+#endif
+  if (arena->fd >= 0)
+    gst_prerecord_sink_arena_advise(sink, write);
+}
+
+/* File backed arenas are copied in the kernel when the prerecord is
+ * written synchronously, without passing through the mapping */
+static GstFlowReturn
+gst_prerecord_sink_arena_write(GstPrerecordSink *sink, gsize offset, gsize size)
+{
+  PrerecordArena *arena = &sink->arena;
+
+#ifdef SYS_copy_file_range
+  if (arena->fd >= 0 && !arena->no_copy_range && !sink->append &&
+      !sink->writer && !sink->uring && !sink->direct_buf)
+  {
+    loff_t off_in = arena->data_offset + offset;
+
+    while (size > 0)
+    {
+      ssize_t ret;
+
+      /* through syscall(), the libc wrapper is newer than the kernel call */
+      ret = syscall(SYS_copy_file_range, arena->fd, &off_in,
+                    fileno(sink->prerecord), NULL, size, 0);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                      errno == EOPNOTSUPP))
+      {
+        GST_DEBUG_OBJECT(sink, "copy_file_range not usable: %s", g_strerror(errno));
+        arena->no_copy_range = TRUE;
+        break;
+      }
+      if (ret <= 0)
+      {
+        if (ret == 0)
+          errno = ENOSPC;
+        return gst_prerecord_sink_write_error(sink);
+      }
+
+      sink->current_pos += ret;
+      offset += ret;
+      size -= ret;
+    }
+
+    if (size == 0)
+      return GST_FLOW_OK;
+  }
+#endif
+
+  return render_mem(sink, arena->data + offset, size);
+}
+
+/* Scans or rebases the MPEG-TS packets of an entry, a packet wrapping
+ * around the end of the arena is patched in a copy */
+static void
+gst_prerecord_sink_arena_rebase_ts(GstPrerecordSink *sink, const ArenaEntry *entry,
+                                   gboolean scan)
+{
+  PrerecordArena *arena = &sink->arena;
+  guint8 copy[PRERECORD_TS_PACKET_SIZE];
+  gsize pos;
+
+  for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= entry->size; pos += PRERECORD_TS_PACKET_SIZE)
+  {
+    gsize offset = (entry->offset + pos) % arena->size;
+    gboolean wraps = offset + PRERECORD_TS_PACKET_SIZE > arena->size;
+    guint8 *packet = arena->data + offset;
+
+    if (wraps)
+    {
+      gst_prerecord_sink_arena_peek(arena, offset, copy, PRERECORD_TS_PACKET_SIZE);
+      packet = copy;
+    }
+    if (packet[0] != PRERECORD_TS_SYNC_BYTE)
+      return;
+
+    if (scan)
+      gst_prerecord_sink_ts_scan(sink, packet, PRERECORD_TS_PACKET_SIZE);
+    else if (gst_prerecord_sink_ts_rebase_packet(sink, packet) && wraps)
+      gst_prerecord_sink_arena_poke(arena, offset, copy, PRERECORD_TS_PACKET_SIZE);
+  }
+}
+
+/* Rebases every moof of the arena, walking its boxes from the oldest
+ * entry on. That is a keyframe entry starting with a moof by now, the
+ * moofs without video are in the middle of entries. */
+static void
+gst_prerecord_sink_arena_rebase_mp4(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  guint64 pos = 0, box_size;
+
+  for (; pos + 8 <= arena->used; pos += box_size)
+  {
+    gsize offset = (arena->read + pos) % arena->size;
+    guint8 head[16];
+    guint8 *moof;
+
+    gst_prerecord_sink_arena_peek(arena, offset, head, 8);
+    box_size = GST_READ_UINT32_BE(head);
+    if (box_size == 1 && pos + 16 <= arena->used)
+    {
+      gst_prerecord_sink_arena_peek(arena, offset, head, 16);
+      box_size = GST_READ_UINT64_BE(head + 8);
+    }
+    if (box_size < 8 || pos + box_size > arena->used)
+      return;
+
+    if (GST_READ_UINT32_LE(head + 4) != PRERECORD_MP4_MOOF || box_size > MP4_MAX_MOOF_SIZE)
+      continue;
+
+    if (offset + box_size <= arena->size)
+    {
+      gst_prerecord_sink_mp4_rebase_moof(sink, arena->data + offset, box_size);
+      continue;
+    }
+
+    moof = g_malloc(box_size);
+    gst_prerecord_sink_arena_peek(arena, offset, moof, box_size);
+    gst_prerecord_sink_mp4_rebase_moof(sink, moof, box_size);
+    gst_prerecord_sink_arena_poke(arena, offset, moof, box_size);
+    g_free(moof);
+  }
+}
+
+/* Rebases the pre-recorded data in place, it is only read again to be
+ * drained */
+static void
+gst_prerecord_sink_arena_rebase(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  guint i;
+
+  if (sink->mp4)
+  {
+    gst_prerecord_sink_arena_rebase_mp4(sink);
+    return;
+  }
+
+  /* until a PTS or DTS after a PCR tells their lead */
+  if (sink->rebase_ts_base == G_MAXUINT64)
+  {
+    for (i = 0; i < arena->n_entries && (sink->rebase_ts_base == G_MAXUINT64 ||
+                                         sink->rebase_ts_lead == G_MAXUINT64); i++)
+      gst_prerecord_sink_arena_rebase_ts(sink,
+                                         &arena->entries[(arena->first + i) % arena->n_entries_max],
+                                         TRUE);
+    gst_prerecord_sink_ts_scan_finish(sink);
+  }
+
+  if (sink->rebase_ts_base == G_MAXUINT64)
+    return;
+
+  for (i = 0; i < arena->n_entries; i++)
+    gst_prerecord_sink_arena_rebase_ts(sink,
+                                       &arena->entries[(arena->first + i) % arena->n_entries_max],
+                                       FALSE);
+}
+
+static GstFlowReturn
+gst_prerecord_sink_arena_drain(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  GstFlowReturn flow = GST_FLOW_OK;
+
+  if (arena->used > 0)
+  {
+    if (gst_prerecord_sink_rebasing(sink))
+    {
+      gst_prerecord_sink_arena_wait_unpinned(sink);
+      gst_prerecord_sink_arena_rebase(sink);
+    }
+    if (sink->thumbnail_prerecord)
+      gst_prerecord_sink_thumbnail_arena(sink);
+    gst_prerecord_sink_index_arena(sink);
+
+    /* at most two sequential writes, the second one after a wrap around */
+    gsize first_part = MIN(arena->used, arena->size - arena->read);
+    gint64 start = g_get_monotonic_time();
+
+    flow = gst_prerecord_sink_arena_write(sink, arena->read, first_part);
+    if (flow == GST_FLOW_OK && first_part < arena->used)
+      flow = gst_prerecord_sink_arena_write(sink, 0, arena->used - first_part);
+    if (flow == GST_FLOW_OK)
+      gst_prerecord_sink_stats_write(sink, arena->used, start);
+  }
+
+  arena->read = arena->used = 0;
+  arena->first = arena->n_entries = 0;
+  arena->n_keyframes = 0;
+  arena->dropping = FALSE;
+  prerecord_keyframes_clear(&arena->keyframes);
+
+#ifdef HAVE_MMAP
+  /* the drained data is in the prerecord now, recovering it again after a
+   * crash would only duplicate it */
+  if (arena->data_offset > 0)
+    gst_prerecord_sink_journal_reset(sink);
+#endif
+
+  return flow;
+}
+
+/* Dispatch to the storage selected with the ring-storage property */
+static void
+gst_prerecord_sink_ring_push_range(GstBufferList *buffer_list, guint first, guint last,
+                                   gboolean keyframe, gpointer user_data)
+{
+  GstPrerecordSink *sink = user_data;
+
+  if (sink->arena.data)
+    gst_prerecord_sink_arena_push(sink, buffer_list, first, last, keyframe);
+  else
+    prerecord_ring_push_range(&sink->ring, GST_ELEMENT_CAST(sink),
+                              &GST_BASE_SINK(sink)->segment, buffer_list, first, last,
+                              keyframe);
+}
+
+static gboolean
+gst_prerecord_sink_ring_is_keyframe(GstBuffer *buffer, gpointer user_data)
+{
+  return gst_prerecord_sink_buffer_is_keyframe(user_data, buffer);
+}
+
+static guint
+gst_prerecord_sink_ring_keyframes(GstPrerecordSink *sink)
+{
+  if (sink->arena.data)
+    return sink->arena.n_keyframes;
+
+  return sink->ring.fifo->n_keyframes;
+}
+
+static gboolean
+gst_prerecord_sink_ring_head_is_keyframe(GstPrerecordSink *sink)
+{
+  if (sink->arena.data)
+    return sink->arena.n_entries > 0 &&
+           sink->arena.entries[sink->arena.first].keyframe;
+
+  return prerecord_ring_head_is_keyframe(&sink->ring);
+}
+
+/* Pushes @buffer_list split at every keyframe so each GOP starts its own
+ * ring entry. Returns TRUE if a new GOP started in @buffer_list. */
+static gboolean
+gst_prerecord_sink_ring_push(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  return prerecord_list_split_gops(buffer_list, 0, gst_buffer_list_length(buffer_list),
+                                   gst_prerecord_sink_ring_is_keyframe,
+                                   gst_prerecord_sink_ring_push_range, sink);
+}
+
+/* Drops whatever precedes the oldest keyframe in the ring */
+static void
+gst_prerecord_sink_ring_trim_to_keyframe(GstPrerecordSink *sink)
+{
+  if (!sink->arena.data)
+  {
+    prerecord_ring_trim_to_keyframe(&sink->ring);
+    return;
+  }
+
+  while (sink->arena.n_keyframes > 0 && !gst_prerecord_sink_ring_head_is_keyframe(sink))
+    gst_prerecord_sink_arena_pop(&sink->arena);
+}
+
+/* Drops the oldest GOP of the arena. Streams without any detected keyframe
+ * drop a single entry instead. */
+static void
+gst_prerecord_sink_arena_evict_gop(GstPrerecordSink *sink)
+{
+  do
+  {
+    gst_prerecord_sink_arena_pop(&sink->arena);
+  } while (sink->arena.n_keyframes > 0 && !gst_prerecord_sink_ring_head_is_keyframe(sink));
+}
+
+/* Running time the GOP after the oldest one in the arena starts at, or the
+ * second entry when there are no keyframes */
+static GstClockTime
+gst_prerecord_sink_arena_next_gop_start(GstPrerecordSink *sink)
+{
+  PrerecordArena *arena = &sink->arena;
+  gint next = prerecord_keyframes_next_gop(&arena->keyframes,
+                                           arena->pushed - arena->n_entries,
+                                           arena->n_entries);
+
+  if (next < 0)
+    return GST_CLOCK_TIME_NONE;
+
+  return arena->entries[(arena->first + next) % arena->n_entries_max].running_time;
+}
+
+/* Drops everything in the ring */
+static void
+gst_prerecord_sink_ring_clear(GstPrerecordSink *sink)
+{
+  if (sink->arena.data)
+  {
+    while (sink->arena.n_entries > 0)
+      gst_prerecord_sink_arena_pop(&sink->arena);
+  }
+  prerecord_ring_clear(&sink->ring, FALSE);
+}
+
+/* Duration of media currently buffered in the ring */
+static GstClockTime
+gst_prerecord_sink_ring_duration(GstPrerecordSink *sink)
+{
+  GstClockTime head;
+
+  if (!sink->arena.data)
+    return prerecord_ring_duration(&sink->ring);
+
+  if (sink->arena.n_entries == 0)
+    return 0;
+
+  head = sink->arena.entries[sink->arena.first].running_time;
+  if (head == GST_CLOCK_TIME_NONE || sink->ring.end == GST_CLOCK_TIME_NONE ||
+      sink->ring.end < head)
+    return 0;
+
+  return sink->ring.end - head;
+}
+
+/* Entries currently held by the ring */
+static guint
+gst_prerecord_sink_ring_lists(GstPrerecordSink *sink)
+{
+  if (sink->arena.data)
+    return sink->arena.n_entries;
+
+  return prerecord_fifo_length(sink->ring.fifo);
+}
+
+/* Bytes currently held by the ring */
+static guint64
+gst_prerecord_sink_ring_bytes(GstPrerecordSink *sink)
+{
+  if (sink->arena.data)
+    return sink->arena.used;
+
+  return sink->ring.fifo->bytes;
+}
+
+/* Gives the whole pages in the @size bytes at @offset of the arena back
+ * to the system. The anonymous mapping of a heap arena is simply dropped,
+ * a memfd or file has the range punched out, or at least its clean page
+ * cache dropped. The pages are faulted in again once the arena wraps
+ * around to them. */
+static void
+gst_prerecord_sink_arena_release_range(GstPrerecordSink *sink, gsize offset, gsize size)
+{
+#ifdef HAVE_MMAP
+  PrerecordArena *arena = &sink->arena;
+  gsize start = (offset + arena->page_size - 1) / arena->page_size * arena->page_size;
+  gsize end = (offset + size) / arena->page_size * arena->page_size;
+
+  if (end <= start || gst_prerecord_sink_arena_pinned(arena, start, end - start))
+    return;
+
+#ifdef MADV_DONTNEED
+  madvise(arena->data + start, end - start, MADV_DONTNEED);
+#endif
+  if (arena->fd < 0)
+    return;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                arena->data_offset + start, end - start) == 0)
+    return;
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(arena->fd, arena->data_offset + start, end - start, POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+/* Releases what was evicted from the arena since it started at @read */
+static void
+gst_prerecord_sink_arena_release(GstPrerecordSink *sink, gsize read)
+{
+  PrerecordArena *arena = &sink->arena;
+  gsize size = (arena->read + arena->size - read) % arena->size;
+
+  if (arena->n_entries == 0)
+    size = arena->size;
+  gst_prerecord_sink_arena_release_range(sink, read, MIN(size, arena->size - read));
+  if (size > arena->size - read)
+    gst_prerecord_sink_arena_release_range(sink, 0, size - (arena->size - read));
+}
+
+/* Drops whole GOPs from the front of the arena as long as what remains
+ * still covers @window, and then as long as it holds more than the
+ * memory-limit. What a window shortened by the memory pressure or the
+ * memory-limit evicted is released. */
+static guint
+gst_prerecord_sink_arena_trim_window(GstPrerecordSink *sink, GstClockTime window)
+{
+  gsize read = sink->arena.read;
+  gboolean release = window < (GstClockTime)MAX(sink->pre_record, 0) * GST_SECOND;
+  guint evicted = 0;
+
+  for (;;)
+  {
+    GstClockTime next = gst_prerecord_sink_arena_next_gop_start(sink);
+
+    if (next == GST_CLOCK_TIME_NONE || sink->ring.end < next + window)
+      break;
+
+    gst_prerecord_sink_arena_evict_gop(sink);
+    evicted++;
+  }
+
+  while (sink->memory_limit > 0 && sink->arena.used > sink->memory_limit &&
+         gst_prerecord_sink_arena_next_gop_start(sink) != GST_CLOCK_TIME_NONE)
+  {
+    gst_prerecord_sink_arena_evict_gop(sink);
+    sink->window_limited = TRUE;
+    release = TRUE;
+    evicted++;
+  }
+
+  if (evicted > 0 && release)
+    gst_prerecord_sink_arena_release(sink, read);
+
+  return evicted;
+}
+
+/* Trims the ring to the pre-record window in effect and the memory-limit */
+static void
+gst_prerecord_sink_ring_trim_window(GstPrerecordSink *sink)
+{
+  guint evicted;
+
+  gst_prerecord_sink_pressure_poll(sink);
+
+  if (sink->arena.data)
+    evicted = gst_prerecord_sink_arena_trim_window(sink, sink->pre_record_window);
+  else
+    evicted = prerecord_ring_trim_window(&sink->ring, sink->pre_record_window,
+                                         sink->memory_limit, &sink->window_limited);
+
+  if (evicted > 0)
+    STATS_ADD(sink->stats.evictions, evicted);
+}
+
+/* Reserves room for the rest of the clip once the bitrate is known from
+ * the pre-recorded data, the card then hands out contiguous clusters */
+static void
+gst_prerecord_sink_preallocate(GstPrerecordSink *sink)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+  GstClockTime duration = gst_prerecord_sink_ring_duration(sink);
+  guint64 bytes = gst_prerecord_sink_ring_bytes(sink);
+  guint64 byterate, size;
+  gint seconds;
+
+  sink->preallocated = TRUE;
+
+  if (duration >= GST_SECOND && bytes > 0)
+    byterate = gst_util_uint64_scale(bytes, GST_SECOND, duration);
+  else
+    byterate = ARENA_SIZING_BITRATE / 8;
+
+  seconds = MAX(sink->pre_record, 0) + MAX(sink->post_record, 0) +
+            sink->record_duration;
+  size = gst_prerecord_sink_position(sink) + byterate * seconds;
+
+  GST_DEBUG_OBJECT(sink, "preallocating %" G_GUINT64_FORMAT " bytes for %d s at %"
+                   G_GUINT64_FORMAT " bytes/s", size, seconds, byterate);
+
+  if (fallocate(fileno(sink->prerecord), FALLOC_FL_KEEP_SIZE, 0, (off_t)size) != 0)
+    GST_DEBUG_OBJECT(sink, "fallocate failed: %s", g_strerror(errno));
+#else
+  sink->preallocated = TRUE;
+#endif
+}
+
+/*** SEGMENTS ****************************************************************/
+
+/* Work for the segment thread pool, handled in the order it is queued */
+typedef enum
+{
+  SEGMENT_JOB_OPEN,
+  SEGMENT_JOB_RENAME,
+  SEGMENT_JOB_CLOSE
+} PrerecordSegmentJobType;
+
+typedef struct _PrerecordSegmentJob
+{
+  PrerecordSegmentJobType type;
+  FILE *file;
+  gchar *location;
+  gchar *target;
+  guint index;
+  guint64 size;
+  gboolean truncate;
+} PrerecordSegmentJob;
+
+/* Queued to the writer thread, the switch has to happen in order with the
+ * data written before and after it */
+#define SEGMENT_MARKER "GstPrerecordSinkSegment"
+
+static gboolean
+gst_prerecord_sink_segmenting(GstPrerecordSink *sink)
+{
+  return (sink->max_segment_time > 0 || sink->max_segment_bytes > 0) &&
+         !sink->append;
+}
+
+/* Expands the location template for segment @index */
+static gchar *
+gst_prerecord_sink_segment_name(GstPrerecordSink *sink, guint index)
+{
+  return gst_prerecord_sink_expand_name(sink, sink->prerecordname, index);
+}
+
+/* Expands @template for file @index. printf conversions with a width
+ * (%05d) take the index, the rest goes through strftime. Without any
+ * conversion the index is added before the extension. */
+static gchar *
+gst_prerecord_sink_expand_name(GstPrerecordSink *sink, const gchar *template,
+                               guint index)
+{
+  GString *name;
+  GDateTime *now;
+  gchar *location;
+  const gchar *p;
+
+  if (strchr(template, '%') == NULL)
+  {
+    const gchar *dot = strrchr(template, '.');
+
+    if (index == 0)
+      return g_strdup(template);
+    if (dot == NULL || strchr(dot, G_DIR_SEPARATOR) != NULL)
+      return g_strdup_printf("%s-%05u", template, index);
+    return g_strdup_printf("%.*s-%05u%s", (gint)(dot - template), template,
+                           index, dot);
+  }
+
+  name = g_string_new(NULL);
+  for (p = template; *p != '\0'; p++)
+  {
+    gsize digits = 0;
+
+    if (p[0] == '%' && p[1] == '%')
+    {
+      g_string_append(name, "%%");
+      p++;
+      continue;
+    }
+    if (p[0] == '%')
+      digits = strspn(p + 1, "0123456789");
+    if (digits > 0 && strchr("diu", p[1 + digits]) != NULL && p[1 + digits] != '\0')
+    {
+      gint width = atoi(p + 1);
+
+      if (p[1] == '0')
+        g_string_append_printf(name, "%0*u", width, index);
+      else
+        g_string_append_printf(name, "%*u", width, index);
+      p += digits + 1;
+      continue;
+    }
+    g_string_append_c(name, p[0]);
+  }
+
+  now = g_date_time_new_now_local();
+  location = g_date_time_format(now, name->str);
+  g_date_time_unref(now);
+  if (location == NULL)
+  {
+    GST_WARNING_OBJECT(sink, "invalid location template %s", template);
+    location = g_string_free(name, FALSE);
+  }
+  else
+  {
+    g_string_free(name, TRUE);
+  }
+
+  return location;
+}
+
+static void
+gst_prerecord_sink_segment_job_free(PrerecordSegmentJob *job)
+{
+  g_free(job->location);
+  g_free(job->target);
+  g_free(job);
+}
+
+static void
+gst_prerecord_sink_segment_queue(GstPrerecordSink *sink, PrerecordSegmentJobType type,
+                                 FILE *file, gchar *location, gchar *target)
+{
+  PrerecordSegmentJob *job = g_new0(PrerecordSegmentJob, 1);
+
+  job->type = type;
+  job->file = file;
+  job->location = location;
+  job->target = target;
+  job->index = sink->segment_index + 1;
+
+  g_thread_pool_push(sink->segment_pool, job, NULL);
+}
+
+/* Opens the file of the next segment under a hidden name in the directory
+ * it will end up in, it is renamed when the segment starts */
+static void
+gst_prerecord_sink_segment_open(GstPrerecordSink *sink, PrerecordSegmentJob *job)
+{
+  gchar *next, *dir, *base, *location;
+  FILE *file;
+
+  g_mutex_lock(&sink->segment_lock);
+  file = sink->segment_next;
+  g_mutex_unlock(&sink->segment_lock);
+  if (file != NULL)
+    return;
+
+  next = gst_prerecord_sink_segment_name(sink, job->index);
+  dir = g_path_get_dirname(next);
+  base = g_strdup_printf(".prerecordsink-%u.part", job->index);
+  location = g_build_filename(dir, base, NULL);
+  g_free(base);
+  g_free(dir);
+  g_free(next);
+
+  file = gst_fopen(location, "wb", sink->o_sync, sink->direct_buf != NULL);
+  if (file == NULL)
+  {
+    GST_WARNING_OBJECT(sink, "could not open %s ahead: %s", location,
+                       g_strerror(errno));
+    g_free(location);
+    return;
+  }
+
+  GST_DEBUG_OBJECT(sink, "opened %s for segment %u", location, job->index);
+
+  g_mutex_lock(&sink->segment_lock);
+  sink->segment_next = file;
+  sink->segment_next_location = location;
+  g_mutex_unlock(&sink->segment_lock);
+}
+
+/* Puts a finished segment on disk and closes it, then deletes the oldest
+ * segments beyond max-files */
+static void
+gst_prerecord_sink_segment_close(GstPrerecordSink *sink, PrerecordSegmentJob *job)
+{
+  gint fd = fileno(job->file);
+
+  if (job->truncate && ftruncate(fd, job->size))
+    GST_DEBUG_OBJECT(sink, "truncating failed: %s", g_strerror(errno));
+  if (fsync(fd) != 0)
+    GST_WARNING_OBJECT(sink, "could not sync %s: %s", job->location,
+                       g_strerror(errno));
+  if (fclose(job->file) != 0)
+    GST_ELEMENT_WARNING(sink, RESOURCE, CLOSE,
+                        (_("Error closing prerecord \"%s\"."), job->location),
+                        GST_ERROR_SYSTEM);
+  if (sink->mp4)
+    gst_prerecord_sink_mp4_finish(sink, job->location);
+
+  GST_DEBUG_OBJECT(sink, "closed segment %s of %" G_GUINT64_FORMAT " bytes",
+                   job->location, job->size);
+  gst_element_post_message(GST_ELEMENT_CAST(sink),
+                           gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                   gst_structure_new("GstPrerecordSinkSegmentClosed",
+                                                                     "location", G_TYPE_STRING, job->location,
+                                                                     "size", G_TYPE_UINT64, job->size,
+                                                                     NULL)));
+
+  g_queue_push_tail(&sink->segment_files, g_strdup(job->location));
+  while (sink->max_files > 0 &&
+         g_queue_get_length(&sink->segment_files) >= sink->max_files)
+  {
+    gchar *oldest = g_queue_pop_head(&sink->segment_files);
+
+    gchar *index = g_strconcat(oldest, PRERECORD_INDEX_SUFFIX, NULL);
+    gchar *thumbnail = g_strconcat(oldest, THUMBNAIL_SUFFIX, NULL);
+
+    GST_INFO_OBJECT(sink, "loop recording, deleting %s", oldest);
+    if (g_unlink(oldest) != 0)
+      GST_WARNING_OBJECT(sink, "could not delete %s: %s", oldest, g_strerror(errno));
+    g_unlink(index);
+    g_unlink(thumbnail);
+    g_free(thumbnail);
+    g_free(index);
+    g_free(oldest);
+  }
+}
+
+static void
+gst_prerecord_sink_segment_job(gpointer data, gpointer user_data)
+{
+  PrerecordSegmentJob *job = data;
+  GstPrerecordSink *sink = user_data;
+
+  switch (job->type)
+  {
+  case SEGMENT_JOB_OPEN:
+    gst_prerecord_sink_segment_open(sink, job);
+    break;
+  case SEGMENT_JOB_RENAME:
+    if (g_rename(job->location, job->target) != 0)
+      GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                          ("Could not rename \"%s\" to \"%s\".", job->location, job->target),
+                          GST_ERROR_SYSTEM);
+    break;
+  case SEGMENT_JOB_CLOSE:
+    gst_prerecord_sink_segment_close(sink, job);
+    break;
+  }
+
+  gst_prerecord_sink_segment_job_free(job);
+}
+
+/* Runs on the thread that writes, after everything before the split is
+ * written. Takes ownership of @next. */
+static GstFlowReturn
+gst_prerecord_sink_segment_switch(GstPrerecordSink *sink, FILE *next,
+                                  const gchar *location)
+{
+  GstFlowReturn flow;
+  PrerecordSegmentJob *job;
+
+  flow = gst_prerecord_sink_uring_drain(sink);
+  if (flow == GST_FLOW_OK)
+    flow = gst_prerecord_sink_direct_sync(sink);
+
+  job = g_new0(PrerecordSegmentJob, 1);
+  job->type = SEGMENT_JOB_CLOSE;
+  job->file = sink->prerecord;
+  job->location = sink->segment_location;
+  job->size = sink->current_pos;
+  /* preallocation and the padded direct-io tail both leave the file
+   * longer than what was written */
+  job->truncate = sink->preallocated || sink->direct_buf != NULL;
+
+  sink->prerecord = next;
+  sink->segment_location = g_strdup(location);
+  sink->current_pos = 0;
+  gst_prerecord_sink_writeback_reset(sink);
+  sink->preallocated = FALSE;
+  sink->direct_fill = 0;
+  sink->direct_offset = 0;
+
+  GST_INFO_OBJECT(sink, "writing segment %s", location);
+
+  g_thread_pool_push(sink->segment_pool, job, NULL);
+
+  return flow;
+}
+
+static gboolean
+gst_prerecord_sink_is_segment_marker(GstMiniObject *obj)
+{
+  return GST_IS_EVENT(obj) &&
+         gst_event_has_name(GST_EVENT_CAST(obj), SEGMENT_MARKER);
+}
+
+/* Starts the next segment at @running_time, with the file opened ahead
+ * when it is ready */
+static GstFlowReturn
+gst_prerecord_sink_segment_next(GstPrerecordSink *sink, GstClockTime running_time)
+{
+  gchar *location, *opened, *dir, *opened_dir;
+  FILE *next;
+  GstFlowReturn flow;
+
+  sink->segment_index++;
+  location = gst_prerecord_sink_segment_name(sink, sink->segment_index);
+
+  g_mutex_lock(&sink->segment_lock);
+  next = sink->segment_next;
+  opened = sink->segment_next_location;
+  sink->segment_next = NULL;
+  sink->segment_next_location = NULL;
+  g_mutex_unlock(&sink->segment_lock);
+
+  if (next != NULL)
+  {
+    /* renaming only works within the directory it was opened in */
+    dir = g_path_get_dirname(location);
+    opened_dir = g_path_get_dirname(opened);
+    if (strcmp(dir, opened_dir) == 0)
+    {
+      gst_prerecord_sink_segment_queue(sink, SEGMENT_JOB_RENAME, NULL, opened,
+                                       g_strdup(location));
+    }
+    else
+    {
+      g_unlink(opened);
+      g_free(opened);
+      fclose(next);
+      next = NULL;
+    }
+    g_free(opened_dir);
+    g_free(dir);
+  }
+
+  if (next == NULL)
+  {
+    GST_DEBUG_OBJECT(sink, "segment %u was not opened ahead", sink->segment_index);
+    next = gst_fopen(location, "wb", sink->o_sync, sink->direct_buf != NULL);
+    if (next == NULL)
+      goto open_failed;
+  }
+
+  if (sink->writer)
+    flow = gst_prerecord_sink_async_push(sink,
+                                         GST_MINI_OBJECT_CAST(gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM_OOB,
+                                                                                   gst_structure_new(SEGMENT_MARKER,
+                                                                                                     "file", G_TYPE_POINTER, next,
+                                                                                                     "location", G_TYPE_STRING, location,
+                                                                                                     NULL))));
+  else
+    flow = gst_prerecord_sink_segment_switch(sink, next, location);
+
+  sink->segment_start = running_time;
+  sink->segment_bytes = 0;
+  sink->mp4_header_written = FALSE;
+  gst_prerecord_sink_rebase_reset(sink);
+  gst_prerecord_sink_index_open(sink, location);
+  gst_prerecord_sink_thumbnail_start(sink, location);
+  g_free(location);
+
+  gst_prerecord_sink_segment_queue(sink, SEGMENT_JOB_OPEN, NULL, NULL, NULL);
+
+  if (flow == GST_FLOW_OK)
+    flow = gst_prerecord_sink_mp4_write_header(sink);
+
+  return flow;
+
+  /* ERRORS */
+open_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, OPEN_WRITE,
+                    (_("Could not open prerecord \"%s\" for writing."), location),
+                    GST_ERROR_SYSTEM);
+  g_free(location);
+  return GST_FLOW_ERROR;
+}
+}
+
+/* Writes @buffer_list, splitting it at its first keyframe into a new
+ * segment once the current one is full */
+static GstFlowReturn
+gst_prerecord_sink_segment_render_list(GstPrerecordSink *sink,
+                                       GstBufferList *buffer_list)
+{
+  GstClockTime pts, dts, ts, duration, start, end;
+  GstBufferList *head;
+  GstFlowReturn flow;
+  guint i, num_buffers;
+  gsize size;
+  guint flags;
+
+  flow = gst_prerecord_sink_mp4_write_header(sink);
+  if (flow != GST_FLOW_OK)
+    return flow;
+
+  if (sink->segment_pool == NULL)
+    return gst_prerecord_sink_write_list(sink, buffer_list);
+
+  num_buffers = gst_buffer_list_length(buffer_list);
+  prerecord_list_meta(buffer_list, 0, num_buffers, &pts, &dts, &ts,
+                               &duration, &size, &flags);
+  start = gst_prerecord_sink_running_time(sink, ts);
+  end = start;
+  if (duration != GST_CLOCK_TIME_NONE && end != GST_CLOCK_TIME_NONE)
+    end += duration;
+  if (sink->segment_start == GST_CLOCK_TIME_NONE)
+    sink->segment_start = start;
+
+  if (sink->segment_bytes == 0 ||
+      !((sink->max_segment_time > 0 && end != GST_CLOCK_TIME_NONE &&
+         sink->segment_start != GST_CLOCK_TIME_NONE &&
+         end >= sink->segment_start + sink->max_segment_time) ||
+        (sink->max_segment_bytes > 0 &&
+         sink->segment_bytes + size > sink->max_segment_bytes)))
+    goto write;
+
+  for (i = 0; i < num_buffers; i++)
+  {
+    if (gst_prerecord_sink_buffer_is_keyframe(sink, gst_buffer_list_get(buffer_list, i)))
+      break;
+  }
+  /* no keyframe yet, the segment grows until the next one */
+  if (i == num_buffers)
+    goto write;
+
+  if (i > 0)
+  {
+    guint j;
+
+    head = gst_buffer_list_new_sized(i);
+    for (j = 0; j < i; j++)
+      gst_buffer_list_add(head, gst_buffer_ref(gst_buffer_list_get(buffer_list, j)));
+    flow = gst_prerecord_sink_write_list(sink, head);
+    gst_buffer_list_unref(head);
+    if (flow != GST_FLOW_OK)
+      return flow;
+
+    buffer_list = gst_buffer_list_copy(buffer_list);
+    gst_buffer_list_remove(buffer_list, 0, i);
+  }
+  else
+  {
+    gst_buffer_list_ref(buffer_list);
+  }
+
+  prerecord_list_meta(buffer_list, 0, gst_buffer_list_length(buffer_list),
+                               &pts, &dts, &ts, &duration, &size, &flags);
+  flow = gst_prerecord_sink_segment_next(sink, gst_prerecord_sink_running_time(sink, ts));
+  if (flow == GST_FLOW_OK)
+  {
+    sink->segment_bytes += size;
+    flow = gst_prerecord_sink_write_list(sink, buffer_list);
+  }
+  gst_buffer_list_unref(buffer_list);
+
+  return flow;
+
+write:
+  sink->segment_bytes += size;
+  return gst_prerecord_sink_write_list(sink, buffer_list);
+}
+
+/* Accounts the pre-recorded data about to be drained to the segment */
+static void
+gst_prerecord_sink_segment_add_ring(GstPrerecordSink *sink, GstClockTime duration,
+                                    guint64 bytes)
+{
+  if (sink->segment_pool == NULL)
+    return;
+
+  if (sink->segment_start == GST_CLOCK_TIME_NONE &&
+      sink->ring.end != GST_CLOCK_TIME_NONE && sink->ring.end >= duration)
+    sink->segment_start = sink->ring.end - duration;
+  sink->segment_bytes += bytes;
+}
+
+static gboolean
+gst_prerecord_sink_segment_start(GstPrerecordSink *sink)
+{
+  GError *err = NULL;
+
+  sink->segment_start = GST_CLOCK_TIME_NONE;
+  sink->segment_bytes = 0;
+
+  if (!gst_prerecord_sink_segmenting(sink))
+    return TRUE;
+
+  sink->segment_pool = g_thread_pool_new(gst_prerecord_sink_segment_job, sink, 1,
+                                         FALSE, &err);
+  if (sink->segment_pool == NULL)
+    goto pool_failed;
+
+  gst_prerecord_sink_segment_queue(sink, SEGMENT_JOB_OPEN, NULL, NULL, NULL);
+
+  return TRUE;
+
+  /* ERRORS */
+pool_failed:
+{
+  GST_ELEMENT_ERROR(sink, RESOURCE, FAILED,
+                    ("Could not start the segment thread."), ("%s", err->message));
+  g_clear_error(&err);
+  return FALSE;
+}
+}
+
+/* Waits for the finished segments to be closed and drops the file that
+ * was opened ahead */
+static void
+gst_prerecord_sink_segment_stop(GstPrerecordSink *sink)
+{
+  if (sink->segment_pool == NULL)
+    return;
+
+  g_thread_pool_free(sink->segment_pool, FALSE, TRUE);
+  sink->segment_pool = NULL;
+
+  if (sink->segment_next)
+  {
+    fclose(sink->segment_next);
+    g_unlink(sink->segment_next_location);
+    sink->segment_next = NULL;
+  }
+  g_free(sink->segment_next_location);
+  sink->segment_next_location = NULL;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_ring_drain(GstPrerecordSink *sink)
+{
+  GstFlowReturn flow = GST_FLOW_OK;
+
+  /* start the clip on the oldest keyframe in the window */
+  gst_prerecord_sink_ring_trim_to_keyframe(sink);
+  sink->ring.end = GST_CLOCK_TIME_NONE;
+
+  flow = gst_prerecord_sink_mp4_write_header(sink);
+  if (flow != GST_FLOW_OK)
+    return flow;
+
+  if (sink->arena.data)
+    return gst_prerecord_sink_arena_drain(sink);
+
+  /* the writer thread batches on its own */
+  if (!sink->writer)
+    gst_prerecord_sink_uring_set_batch(sink, TRUE);
+
+  while (!prerecord_fifo_is_empty(sink->ring.fifo))
+  {
+    GstBufferList *poppedBufferList = prerecord_fifo_pop(sink->ring.fifo);
+
+    GST_LOG_OBJECT(sink, "copying pre-recorded list of %u buffers",
+                   gst_buffer_list_length(poppedBufferList));
+
+    flow = gst_prerecord_sink_write_list(sink, poppedBufferList);
+    gst_buffer_list_unref(poppedBufferList);
+
+    if (flow != GST_FLOW_OK)
+    {
+      GST_WARNING_OBJECT(sink, "failed to write a pre-recorded list: %s",
+                         gst_flow_get_name(flow));
+      break;
+    }
+  }
+
+  if (!sink->writer)
+    gst_prerecord_sink_uring_set_batch(sink, FALSE);
+
+  return flow;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_render_list_internal(GstPrerecordSink *sink,
+                                        GstBufferList *buffer_list)
+{
+  GstFlowReturn flow = GST_FLOW_OK;
+
+  if (!GST_IS_BUFFER_LIST(buffer_list))
+  {
+    // It's not a valid GstBufferList
+    GST_ERROR_OBJECT(sink, "not a valid buffer list");
+    return GST_FLOW_ERROR;
+  }
+
+  GST_LOG_OBJECT(sink, "handling list of %u buffers in buffering state %d",
+                 gst_buffer_list_length(buffer_list), sink->buffering);
+
+  gst_prerecord_sink_clip_feed(sink, buffer_list);
+    
+  if (sink->buffering==0)
+    {
+      // Buffering disabled
+      // Process each buffered GstBufferList
+
+      if (!sink->ring_drained)
+      {
+        GST_DEBUG_OBJECT(sink, "recording, writing the pre-recorded data");
+        if (!sink->preallocated && sink->record_duration > 0)
+          gst_prerecord_sink_preallocate(sink);
+        gst_prerecord_sink_segment_add_ring(sink, gst_prerecord_sink_ring_duration(sink),
+                                            gst_prerecord_sink_ring_bytes(sink));
+        /* the window is already in memory, it does not use up the budget */
+        sink->overflow_exempt = TRUE;
+        flow = gst_prerecord_sink_ring_drain(sink);
+        sink->overflow_exempt = FALSE;
+        if (flow != GST_FLOW_OK)
+          return flow;
+        sink->ring_drained = TRUE;
+      }
+
+      
+      flow = gst_prerecord_sink_overflow_render_list(sink, buffer_list);
+        
+    }
+    else if (sink->buffering==1)
+    {
+        if ((sink->post_record) > 0)
+      {
+          GstClockTime running_time, running_end;
+
+          // Post-recording is measured in running time of the media
+          gst_prerecord_sink_list_running_time(sink, buffer_list, &running_time,
+                                               &running_end);
+
+          if(!sink->post_record_started)
+          {
+          sink->post_record_start = running_time;
+          sink->post_record_started=TRUE;
+          }
+
+          flow = gst_prerecord_sink_overflow_render_list(sink, buffer_list);
+
+          GST_LOG_OBJECT(sink, "post-recording time %" GST_TIME_FORMAT,
+                         GST_TIME_ARGS(running_end - sink->post_record_start));
+
+          if (running_end >= sink->post_record_start + (GstClockTime)sink->post_record * GST_SECOND)
+          {
+            GST_DEBUG_OBJECT(sink, "post-recording of %" GST_TIME_FORMAT " done",
+                             GST_TIME_ARGS(running_end - sink->post_record_start));
+            return GST_FLOW_EOS;     // Exit the function
+          }
+          sink->first_buffers_written=FALSE;
+          sink->num_first_buffers=0;
+      }
+    }
+    else
+    {
+      /* what the ring kept while recording is in the prerecord already */
+      if (sink->ring_drained)
+      {
+        gst_prerecord_sink_ring_clear(sink);
+        sink->ring_drained = FALSE;
+      }
+    
+      if (!sink->first_buffers_written)
+  {
+	sink->num_first_buffers++;
+	
+    // Write each buffer list individually
+    flow = gst_prerecord_sink_segment_render_list(sink, buffer_list);
+    if(sink->num_first_buffers > 1)
+    {
+    sink->first_buffers_written = TRUE; // Update the flag after writing the first 10 buffer lists
+    sink->post_record_started = FALSE;
+  }
+  }
+  else
+  {
+  
+   
+      // Push the incoming buffer_list to the FIFO and drop the oldest GOPs
+      // that are no longer needed to cover the pre-record window
+      gst_prerecord_sink_ring_push(sink, buffer_list);
+      gst_prerecord_sink_ring_trim_window(sink);
+
+      GST_LOG_OBJECT(sink, "pre-recorded %" GST_TIME_FORMAT,
+                     GST_TIME_ARGS(gst_prerecord_sink_ring_duration(sink)));
+  }
+    }
+
+  gst_prerecord_sink_stats_update(sink);
+ 
+  return flow;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_flush_buffer(GstPrerecordSink *prerecordsink)
+{
+  GstFlowReturn flow_ret = GST_FLOW_OK;
+
+  if (prerecordsink->buffer && prerecordsink->current_buffer_size)
+  {
+    flow_ret = render_mem(prerecordsink, prerecordsink->buffer,
+                          prerecordsink->current_buffer_size);
+  }
+  else if (prerecordsink->buffer_list && prerecordsink->current_buffer_size)
+  {
+    guint length;
+
+    length = gst_buffer_list_length(prerecordsink->buffer_list);
+
+    GST_LOG_OBJECT(prerecordsink, "flushing list of %u buffers", length);
+
+    if (length > 0)
+    {
+      flow_ret =
+          gst_prerecord_sink_render_list_internal(prerecordsink, prerecordsink->buffer_list);
+      /* Remove all buffers from the list but keep the list. This ensures that
+       * we don't re-allocate the array storing the buffers all the time */
+      if (gst_buffer_list_is_writable(prerecordsink->buffer_list))
+      {
+        gst_buffer_list_remove(prerecordsink->buffer_list, 0, length);
+      }
+      else
+      {
+        /* still queued for the writer thread */
+        gst_buffer_list_unref(prerecordsink->buffer_list);
+        prerecordsink->buffer_list = gst_buffer_list_new_sized(length);
+      }
+    }
+  }
+
+  prerecordsink->current_buffer_size = 0;
+
+  return flow_ret;
+}
+
+static gboolean
+has_sync_after_buffer(GstBuffer **buffer, guint idx, gpointer user_data)
+{
+  if (GST_BUFFER_FLAG_IS_SET(*buffer, GST_BUFFER_FLAG_SYNC_AFTER))
+  {
+    gboolean *sync_after = user_data;
+
+    *sync_after = TRUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+accumulate_size(GstBuffer **buffer, guint idx, gpointer user_data)
+{
+  guint *size = user_data;
+
+  *size += gst_buffer_get_size(*buffer);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_prerecord_sink_queue_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  GstFlowReturn flow;
+  GstClockTime running_time;
+  guint i, num_buffers;
+  gboolean sync_after = FALSE;
+
+  num_buffers = gst_buffer_list_length(buffer_list);
+  if (num_buffers == 0)
+    goto no_data;
+
+  /* the MP4 header is kept aside and written at the start of each prerecord */
+  if (sink->mp4 && prerecord_mp4_has_header(buffer_list))
+  {
+    GstBufferList *media = prerecord_mp4_take_header(&sink->mp4_header, &sink->mp4_info, buffer_list);
+
+    flow = gst_prerecord_sink_queue_list(sink, media);
+    gst_buffer_list_unref(media);
+    return flow;
+  }
+
+  /* a pending trigger splits the list at the buffer it applies to */
+  i = gst_prerecord_sink_trigger_find(sink, buffer_list, &running_time);
+  if (i > 0 && i < num_buffers)
+  {
+    GstBufferList *head = gst_buffer_list_new_sized(i);
+    GstBufferList *tail;
+    guint j;
+
+    for (j = 0; j < i; j++)
+      gst_buffer_list_add(head, gst_buffer_ref(gst_buffer_list_get(buffer_list, j)));
+    tail = gst_buffer_list_copy(buffer_list);
+    gst_buffer_list_remove(tail, 0, i);
+
+    flow = gst_prerecord_sink_queue_list(sink, head);
+    if (flow == GST_FLOW_OK)
+      flow = gst_prerecord_sink_queue_list(sink, tail);
+    gst_buffer_list_unref(head);
+    gst_buffer_list_unref(tail);
+    return flow;
+  }
+  if (i == 0)
+  {
+    flow = gst_prerecord_sink_trigger_apply(sink, running_time);
+    if (flow != GST_FLOW_OK)
+      return flow;
+  }
+
+  gst_buffer_list_foreach(buffer_list, has_sync_after_buffer, &sync_after);
+
+  if (sync_after || (!sink->buffer && !sink->buffer_list))
+  {
+    flow = gst_prerecord_sink_flush_buffer(sink);
+    if (flow == GST_FLOW_OK)
+      flow = gst_prerecord_sink_render_list_internal(sink, buffer_list);
+  }
+  else
+  {
+    guint size = 0;
+    gst_buffer_list_foreach(buffer_list, accumulate_size, &size);
+
+    if (sink->buffer)
+    {
+      flow = GST_FLOW_OK;
+      for (i = 0; i < num_buffers && flow == GST_FLOW_OK; i++)
+      {
+        GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+        gsize buffer_size = gst_buffer_get_size(buffer);
+
+        if (sink->current_buffer_size + buffer_size >
+            sink->allocated_buffer_size)
+        {
+          flow = gst_prerecord_sink_flush_buffer(sink);
+          if (flow != GST_FLOW_OK)
+            return flow;
+        }
+
+        if (buffer_size > sink->allocated_buffer_size)
+        {
+          GST_DEBUG_OBJECT(sink,
+                           "writing buffer ( %" G_GSIZE_FORMAT
+                           " bytes) at position %" G_GUINT64_FORMAT,
+                           buffer_size, gst_prerecord_sink_position(sink));
+
+          flow = render_buffer(sink, buffer);
+        }
+        else
+        {
+          sink->current_buffer_size +=
+              gst_buffer_extract(buffer, 0,
+                                 sink->buffer + sink->current_buffer_size, buffer_size);
+          flow = GST_FLOW_OK;
+        }
+      }
+    }
+    else
+    {
+      for (i = 0; i < num_buffers; ++i)
+        gst_buffer_list_add(sink->buffer_list,
+                            gst_buffer_ref(gst_buffer_list_get(buffer_list, i)));
+      sink->current_buffer_size += size;
+
+      if (sink->current_buffer_size > sink->buffer_size)
+        flow = gst_prerecord_sink_flush_buffer(sink);
+      else
+        flow = GST_FLOW_OK;
+    }
+  }
+
+  if (flow == GST_FLOW_OK && sync_after)
+  {
+    if (sink->writer)
+      flow = gst_prerecord_sink_async_sync(sink);
+    else
+      flow = gst_prerecord_sink_fsync(sink);
+  }
+
+  return flow;
+
+no_data:
+{
+  GST_LOG_OBJECT(sink, "empty buffer list");
+  return GST_FLOW_OK;
+}
+}
+
+static GstFlowReturn
+gst_prerecord_sink_render_list(GstBaseSink *bsink, GstBufferList *buffer_list)
+{
+  GstPrerecordSink *sink = GST_PRERECORD_SINK_CAST(bsink);
+
+  /* traced as it arrived, before it is split at a trigger */
+  if (sink->trace_file)
+    gst_prerecord_sink_trace_list(sink, buffer_list);
+
+  return gst_prerecord_sink_queue_list(sink, buffer_list);
+}
+
+static GstFlowReturn
+gst_prerecord_sink_render(GstBaseSink *sink, GstBuffer *buffer)
+{
+  GstPrerecordSink *prerecordsink;
+  GstClockTime running_time;
+  GstFlowReturn flow;
+  guint8 n_mem;
+  gboolean sync_after;
+
+  prerecordsink = GST_PRERECORD_SINK_CAST(sink);
+
+  if (prerecordsink->trace_file)
+    gst_prerecord_sink_trace_buffer(prerecordsink, buffer);
+
+  if (prerecordsink->mp4 && prerecord_mp4_is_header(buffer))
+  {
+    prerecord_mp4_header_add(&prerecordsink->mp4_header, &prerecordsink->mp4_info, buffer);
+    return GST_FLOW_OK;
+  }
+
+  if (prerecord_trigger_due(GST_ELEMENT_CAST(prerecordsink), &prerecordsink->trigger,
+                            &sink->segment, buffer, &running_time))
+  {
+    flow = gst_prerecord_sink_trigger_apply(prerecordsink, running_time);
+    if (flow != GST_FLOW_OK)
+      return flow;
+  }
+
+  sync_after = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_SYNC_AFTER);
+
+  n_mem = gst_buffer_n_memory(buffer);
+
+  if (n_mem > 0 && (sync_after || (!prerecordsink->buffer && !prerecordsink->buffer_list)))
+  {
+    flow = gst_prerecord_sink_flush_buffer(prerecordsink);
+    if (flow == GST_FLOW_OK)
+    {
+      flow = render_buffer(prerecordsink, buffer);
+    }
+  }
+  else if (n_mem > 0)
+  {
+    gsize size = gst_buffer_get_size(buffer);
+
+    GST_DEBUG_OBJECT(prerecordsink,
+                     "Queueing buffer of %" G_GSIZE_FORMAT " bytes at offset %" G_GUINT64_FORMAT, size,
+                     gst_prerecord_sink_position(prerecordsink) + prerecordsink->current_buffer_size);
+
+    if (prerecordsink->buffer)
+    {
+      if (prerecordsink->current_buffer_size + size >
+          prerecordsink->allocated_buffer_size)
+      {
+        flow = gst_prerecord_sink_flush_buffer(prerecordsink);
+        if (flow != GST_FLOW_OK)
+          return flow;
+      }
+
+      if (size > prerecordsink->allocated_buffer_size)
+      {
+        GST_DEBUG_OBJECT(sink,
+                         "writing buffer ( %" G_GSIZE_FORMAT
+                         " bytes) at position %" G_GUINT64_FORMAT,
+                         size, gst_prerecord_sink_position(prerecordsink));
+
+        flow = render_buffer(prerecordsink, buffer);
+      }
+      else
+      {
+        prerecordsink->current_buffer_size +=
+            gst_buffer_extract(buffer, 0,
+                               prerecordsink->buffer + prerecordsink->current_buffer_size, size);
+        flow = GST_FLOW_OK;
+      }
+    }
+    else
+    {
+      prerecordsink->current_buffer_size += gst_buffer_get_size(buffer);
+      gst_buffer_list_add(prerecordsink->buffer_list, gst_buffer_ref(buffer));
+
+      if (prerecordsink->current_buffer_size > prerecordsink->buffer_size)
+        flow = gst_prerecord_sink_flush_buffer(prerecordsink);
+      else
+        flow = GST_FLOW_OK;
+    }
+  }
+  else
+  {
+    flow = GST_FLOW_OK;
+  }
+
+  if (flow == GST_FLOW_OK && sync_after)
+  {
+    if (prerecordsink->writer)
+      flow = gst_prerecord_sink_async_sync(prerecordsink);
+    else
+      flow = gst_prerecord_sink_fsync(prerecordsink);
+  }
+
+  return flow;
+}
+
+static gboolean
+gst_prerecord_sink_start(GstBaseSink *basesink)
+{
+  GstPrerecordSink *prerecordsink;
+
+  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
+
+  g_atomic_int_set(&prerecordsink->flushing, FALSE);
+  prerecordsink->ring.end = GST_CLOCK_TIME_NONE;
+  prerecordsink->first_buffers_written = FALSE;
+  prerecordsink->num_first_buffers = 0;
+  prerecordsink->post_record_started = FALSE;
+  prerecordsink->post_record_start = GST_CLOCK_TIME_NONE;
+  prerecordsink->ring_drained = FALSE;
+  memset(&prerecordsink->stats, 0, sizeof(prerecordsink->stats));
+  prerecordsink->stats_posted = 0;
+  gst_prerecord_sink_trace_open(prerecordsink);
+  gst_prerecord_sink_pressure_open(prerecordsink);
+
+  if (prerecordsink->ring_storage != GST_PRERECORD_SINK_RING_STORAGE_REFS &&
+      !gst_prerecord_sink_arena_alloc(prerecordsink))
+    return FALSE;
+
+  if (!gst_prerecord_sink_open_prerecord(prerecordsink))
+    return FALSE;
+
+  if (!gst_prerecord_sink_segment_start(prerecordsink))
+  {
+    gst_prerecord_sink_close_prerecord(prerecordsink);
+    return FALSE;
+  }
+
+  if (prerecordsink->direct_io && !prerecordsink->append)
+    gst_prerecord_sink_direct_start(prerecordsink);
+
+  if (prerecordsink->io_engine == GST_PRERECORD_SINK_IO_ENGINE_IO_URING)
+  {
+    if (prerecordsink->direct_buf)
+      GST_INFO_OBJECT(prerecordsink, "writing with direct I/O instead of io_uring");
+    else
+      gst_prerecord_sink_uring_open(prerecordsink);
+  }
+
+  prerecordsink->overflow_dropping = FALSE;
+  prerecordsink->overflow_pid = -1;
+  if ((prerecordsink->async_write || prerecordsink->overflow_budget > 0 ||
+       prerecordsink->burst_size > 0) &&
+      !gst_prerecord_sink_writer_start(prerecordsink))
+  {
+    gst_prerecord_sink_close_prerecord(prerecordsink);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_prerecord_sink_stop(GstBaseSink *basesink)
+{
+  GstPrerecordSink *prerecordsink;
+
+  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
+
+  gst_prerecord_sink_close_prerecord(prerecordsink);
+  gst_prerecord_sink_thumbnail_flush(prerecordsink);
+  gst_prerecord_sink_clip_stop(prerecordsink);
+  gst_prerecord_sink_trace_close(prerecordsink);
+  gst_prerecord_sink_pressure_close(prerecordsink);
+
+  prerecord_ring_clear(&prerecordsink->ring, TRUE);
+  gst_prerecord_sink_arena_free(prerecordsink);
+  if (prerecordsink->mp4_header)
+  {
+    gst_buffer_list_unref(prerecordsink->mp4_header);
+    prerecordsink->mp4_header = NULL;
+  }
+  prerecord_mp4_info_clear(&prerecordsink->mp4_info);
+  prerecordsink->mp4 = FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+gst_prerecord_sink_unlock(GstBaseSink *basesink)
+{
+  GstPrerecordSink *prerecordsink;
+
+  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
+  g_atomic_int_set(&prerecordsink->flushing, TRUE);
+  gst_prerecord_sink_async_wake(prerecordsink, TRUE);
+
+  return TRUE;
+}
+
+static gboolean
+gst_prerecord_sink_unlock_stop(GstBaseSink *basesink)
 {
   GstPrerecordSink *prerecordsink;
 
-  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
-  g_atomic_int_set(&prerecordsink->flushing, FALSE);
+  prerecordsink = GST_PRERECORD_SINK_CAST(basesink);
+  g_atomic_int_set(&prerecordsink->flushing, FALSE);
+  gst_prerecord_sink_async_wake(prerecordsink, TRUE);
+
+  return TRUE;
+}
+
+/*** OVERFLOW ****************************************************************/
+
+/* Element message posted after recorded data had to wait for the writer */
+#define OVERFLOW_MESSAGE "GstPrerecordSinkOverflow"
+
+static void
+gst_prerecord_sink_overflow_stalled(GstPrerecordSink *sink, gint64 stall)
+{
+  guint64 queued = STATS_GET(sink->stats.queued_bytes);
+
+  STATS_ADD(sink->stats.overflow_stalls, 1);
+  GST_DEBUG_OBJECT(sink, "waited %" G_GINT64_FORMAT " us for the writer, %" G_GUINT64_FORMAT
+                         " bytes queued",
+                   stall, queued);
+
+  gst_element_post_message(GST_ELEMENT_CAST(sink),
+                           gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                   gst_structure_new(OVERFLOW_MESSAGE,
+                                                                     "queued-bytes", G_TYPE_UINT64, queued,
+                                                                     "stall", G_TYPE_UINT64, (guint64)stall * GST_USECOND,
+                                                                     NULL)));
+}
+
+/* Looks for the start of an H.264 frame in the TS packets of @buffer.
+ * Returns 0 when a frame no other frame refers to (nal_ref_idc 0) starts
+ * with the first packet, 1 when another frame starts in the buffer and -1
+ * when the buffer only continues a frame. @pid is set to the PID of the
+ * first packet, -1 for anything but TS. */
+static gint
+gst_prerecord_sink_overflow_frame(GstBuffer *buffer, gint *pid)
+{
+  GstMapInfo map;
+  gint frame = -1;
+  gsize pos;
+
+  *pid = -1;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+    return -1;
+
+  for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= map.size; pos += PRERECORD_TS_PACKET_SIZE)
+  {
+    const guint8 *packet = map.data + pos;
+    const guint8 *end = packet + PRERECORD_TS_PACKET_SIZE;
+    const guint8 *payload = packet + 4;
+    guint afc;
+
+    if (packet[0] != PRERECORD_TS_SYNC_BYTE)
+      break;
+    if (pos == 0)
+      *pid = GST_READ_UINT16_BE(packet + 1) & 0x1fff;
+
+    /* payload_unit_start_indicator */
+    if (!(packet[1] & 0x40))
+      continue;
+
+    afc = (packet[3] >> 4) & 0x3;
+    if (afc & 0x2)
+      payload = packet + 5 + packet[4];
+    if (!(afc & 0x1) || payload + 9 > end)
+      continue;
+
+    /* PES start code prefix followed by a video stream id */
+    if (payload[0] != 0x00 || payload[1] != 0x00 || payload[2] != 0x01 ||
+        (payload[3] & 0xf0) != 0xe0)
+      continue;
+
+    /* only the first packet can start a frame that is dropped as a whole,
+     * the slice has to follow the SPS, PPS and SEI in that packet */
+    frame = 1;
+    if (pos > 0)
+      break;
+
+    for (payload += 9 + payload[8]; payload + 4 <= end; payload++)
+    {
+      if (payload[0] == 0x00 && payload[1] == 0x00 && payload[2] == 0x01)
+      {
+        guint nal_type = payload[3] & 0x1f;
+
+        if (nal_type == 1 || nal_type == 5)
+        {
+          frame = (payload[3] & 0x60) ? 1 : 0;
+          break;
+        }
+      }
+    }
+  }
+
+  gst_buffer_unmap(buffer, &map);
+
+  return frame;
+}
+
+/* Whether @buffer is dropped, @fits tells if it fits in the budget */
+static gboolean
+gst_prerecord_sink_overflow_drop(GstPrerecordSink *sink, GstBuffer *buffer, gboolean fits)
+{
+  gint frame, pid;
+
+  if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
+    return FALSE;
+
+  if (sink->overflow_policy == GST_PRERECORD_SINK_OVERFLOW_DROP_GOP && sink->mp4)
+  {
+    gboolean keyframe;
+
+    /* decided once per fragment at its moof, the rest of the fragment
+     * follows. Moofs with only audio keep what was decided. */
+    if (prerecord_mp4_box_type(buffer) == PRERECORD_MP4_MOOF &&
+        prerecord_mp4_buffer_video(&sink->mp4_info, buffer, &keyframe))
+    {
+      if (keyframe)
+        sink->overflow_dropping = !fits;
+      else if (!fits)
+        sink->overflow_dropping = TRUE;
+    }
+    return sink->overflow_dropping;
+  }
+
+  if (sink->overflow_policy == GST_PRERECORD_SINK_OVERFLOW_DROP_GOP)
+  {
+    /* a GOP is dropped from the first frame that does not fit, the next
+     * one is written again if its keyframe fits */
+    if (gst_prerecord_sink_buffer_is_keyframe(sink, buffer))
+      sink->overflow_dropping = !fits;
+    else if (!fits)
+      sink->overflow_dropping = TRUE;
+    return sink->overflow_dropping;
+  }
+
+  if (sink->mp4)
+    return FALSE;
+
+  /* a non-reference frame is dropped as a whole or not at all, together
+   * with the packets continuing it on its PID */
+  frame = gst_prerecord_sink_overflow_frame(buffer, &pid);
+  if (frame >= 0)
+  {
+    sink->overflow_pid = pid;
+    sink->overflow_dropping = frame == 0 && !fits;
+  }
+  else if (pid != sink->overflow_pid)
+  {
+    return FALSE;
+  }
+
+  return sink->overflow_dropping;
+}
+
+/* Applies the overflow policy to the recorded @buffer_list before it is
+ * written. Returns what is left of it, NULL when everything was dropped. */
+static GstBufferList *
+gst_prerecord_sink_overflow_filter(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  guint num_buffers = gst_buffer_list_length(buffer_list);
+  GstBufferList *kept;
+  GstBuffer *first_dropped = NULL;
+  guint64 queued, kept_bytes = 0, dropped_bytes = 0;
+  guint i, dropped = 0;
+  gboolean ring_full;
+
+  if (sink->writer == NULL || sink->overflow_policy == GST_PRERECORD_SINK_OVERFLOW_BLOCK)
+    return gst_buffer_list_ref(buffer_list);
+
+  queued = STATS_GET(sink->stats.queued_bytes);
+  ring_full = sink->async_head - g_atomic_int_get(&sink->async_tail) >= ASYNC_RING_SIZE;
+  if (!sink->overflow_dropping && !ring_full &&
+      (sink->overflow_budget == 0 ||
+       queued + gst_buffer_list_calculate_size(buffer_list) <= sink->overflow_budget))
+    return gst_buffer_list_ref(buffer_list);
+
+  kept = gst_buffer_list_new_sized(num_buffers);
+  for (i = 0; i < num_buffers; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get(buffer_list, i);
+    gsize size = gst_buffer_get_size(buffer);
+    gsize needed = size;
+    gboolean fits;
+
+    /* a moof only fits with the rest of its fragment in this list */
+    if (sink->mp4 && prerecord_mp4_box_type(buffer) == PRERECORD_MP4_MOOF)
+    {
+      guint j;
+
+      for (j = i + 1; j < num_buffers; j++)
+      {
+        GstBuffer *next = gst_buffer_list_get(buffer_list, j);
+
+        if (prerecord_mp4_box_type(next) == PRERECORD_MP4_MOOF)
+          break;
+        needed += gst_buffer_get_size(next);
+      }
+    }
+
+    fits = !ring_full &&
+           (sink->overflow_budget == 0 || queued + kept_bytes + needed <= sink->overflow_budget);
+
+    if (gst_prerecord_sink_overflow_drop(sink, buffer, fits))
+    {
+      if (first_dropped == NULL)
+        first_dropped = buffer;
+      dropped_bytes += size;
+      dropped++;
+    }
+    else
+    {
+      gst_buffer_list_add(kept, gst_buffer_ref(buffer));
+      kept_bytes += size;
+    }
+  }
+
+  if (dropped > 0)
+  {
+    GstClockTime ts = GST_BUFFER_DTS_OR_PTS(first_dropped);
+    GstMessage *qos;
+
+    STATS_ADD(sink->stats.dropped_bytes, dropped_bytes);
+    STATS_ADD(sink->stats.dropped_buffers, dropped);
+    GST_DEBUG_OBJECT(sink, "writer %" G_GUINT64_FORMAT " bytes behind, dropped %u of %u buffers",
+                     queued, dropped, num_buffers);
+
+    qos = gst_message_new_qos(GST_OBJECT_CAST(sink), TRUE, gst_prerecord_sink_running_time(sink, ts),
+                              gst_segment_to_stream_time(&GST_BASE_SINK(sink)->segment,
+                                                         GST_FORMAT_TIME, ts),
+                              ts, GST_BUFFER_DURATION(first_dropped));
+    gst_message_set_qos_stats(qos, GST_FORMAT_BYTES,
+                              STATS_GET(sink->stats.bytes_written),
+                              STATS_GET(sink->stats.dropped_bytes));
+    gst_element_post_message(GST_ELEMENT_CAST(sink), qos);
+  }
+
+  if (gst_buffer_list_length(kept) == 0)
+  {
+    gst_buffer_list_unref(kept);
+    return NULL;
+  }
+  if (dropped == 0)
+  {
+    gst_buffer_list_unref(kept);
+    return gst_buffer_list_ref(buffer_list);
+  }
+
+  return kept;
+}
+
+/* Writes recorded data, what is left of it after the overflow policy */
+static GstFlowReturn
+gst_prerecord_sink_overflow_render_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  GstFlowReturn flow;
+
+  buffer_list = gst_prerecord_sink_overflow_filter(sink, buffer_list);
+  if (buffer_list == NULL)
+    return GST_FLOW_OK;
+
+  flow = gst_prerecord_sink_segment_render_list(sink, buffer_list);
+  if (flow == GST_FLOW_OK)
+    gst_prerecord_sink_clip_keep(sink, buffer_list);
+  gst_buffer_list_unref(buffer_list);
+
+  return flow;
+}
+
+/*** MEMORY PRESSURE *********************************************************/
+
+#define WINDOW_MESSAGE "GstPrerecordSinkWindow"
+
+/* memory.pressure of the cgroup v2 the process runs in, NULL in the root
+ * cgroup, which has none, or without cgroup v2 */
+static gchar *
+gst_prerecord_sink_pressure_cgroup(void)
+{
+  gchar *contents = NULL, *file = NULL;
+  gchar **lines;
+  guint i;
+
+  if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+    return NULL;
+
+  /* the unified hierarchy is the "0::/path" line */
+  lines = g_strsplit(contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+  {
+    if (g_str_has_prefix(lines[i], "0::/") && lines[i][4] != '\0')
+    {
+      file = g_build_filename("/sys/fs/cgroup", lines[i] + 4, "memory.pressure", NULL);
+      break;
+    }
+  }
+  g_strfreev(lines);
+  g_free(contents);
+
+  if (file && !g_file_test(file, G_FILE_TEST_EXISTS))
+  {
+    g_free(file);
+    file = NULL;
+  }
+
+  return file;
+}
+
+static void
+gst_prerecord_sink_pressure_close(GstPrerecordSink *sink)
+{
+  g_free(sink->pressure_file);
+  sink->pressure_file = NULL;
+}
+
+/* Starts with the whole pre-record window and finds the PSI file when the
+ * memory pressure is watched, a missing one is not fatal */
+static void
+gst_prerecord_sink_pressure_open(GstPrerecordSink *sink)
+{
+  gst_prerecord_sink_pressure_close(sink);
+
+  sink->pre_record_window = (GstClockTime)MAX(sink->pre_record, 0) * GST_SECOND;
+  sink->window_limited = FALSE;
+  sink->pressure_polled = 0;
+
+  if (sink->memory_pressure <= 0.0)
+    return;
+
+  if (sink->pressure_location)
+    sink->pressure_file = g_strdup(sink->pressure_location);
+  else
+    sink->pressure_file = gst_prerecord_sink_pressure_cgroup();
+
+  if (sink->pressure_file == NULL &&
+      g_file_test("/proc/pressure/memory", G_FILE_TEST_EXISTS))
+    sink->pressure_file = g_strdup("/proc/pressure/memory");
+
+  if (sink->pressure_file == NULL)
+  {
+    GST_ELEMENT_WARNING(sink, RESOURCE, NOT_FOUND,
+                        ("No memory pressure information, the pre-record window is not adapted to it."),
+                        ("PSI needs Linux 4.20 with CONFIG_PSI"));
+    return;
+  }
+
+  GST_DEBUG_OBJECT(sink, "watching the memory pressure in %s", sink->pressure_file);
+}
+
+/* The "some avg10" percentage of the PSI file, -1 when it is not known.
+ * The pressure is no longer watched once it cannot be read. */
+static gdouble
+gst_prerecord_sink_pressure_read(GstPrerecordSink *sink)
+{
+  GError *err = NULL;
+  gchar *contents = NULL, *avg10;
+  gdouble pressure = -1.0;
+
+  if (sink->pressure_file == NULL)
+    return -1.0;
+
+  if (!g_file_get_contents(sink->pressure_file, &contents, NULL, &err))
+    goto read_failed;
+
+  /* "some avg10=1.23 avg60=0.45 avg300=0.06 total=123456" comes first */
+  avg10 = strstr(contents, "avg10=");
+  if (g_str_has_prefix(contents, "some ") && avg10 != NULL)
+    pressure = g_ascii_strtod(avg10 + strlen("avg10="), NULL);
+  g_free(contents);
+
+  if (pressure < 0.0)
+    goto read_failed;
+
+  return pressure;
+
+  /* ERRORS */
+read_failed:
+{
+  GST_ELEMENT_WARNING(sink, RESOURCE, READ,
+                      ("Could not read the memory pressure from \"%s\".", sink->pressure_file),
+                      ("%s", err ? err->message : "not a PSI file"));
+  g_clear_error(&err);
+  gst_prerecord_sink_pressure_close(sink);
+  return -1.0;
+}
+}
+
+/* Whether a ring covering @window is expected to stay below the
+ * memory-limit at the bitrate it holds now */
+static gboolean
+gst_prerecord_sink_pressure_fits(GstPrerecordSink *sink, GstClockTime window)
+{
+  GstClockTime duration = gst_prerecord_sink_ring_duration(sink);
+
+  if (sink->memory_limit == 0 || duration == 0)
+    return TRUE;
+
+  return gst_util_uint64_scale(gst_prerecord_sink_ring_bytes(sink), window,
+                               duration) <= sink->memory_limit;
+}
+
+/* Adapts the pre-record window in effect every PRESSURE_POLL_INTERVAL ms.
+ * It is halved while the pressure is at memory-pressure, cut to what
+ * the ring still covered when the memory-limit evicted and grown back by
+ * PRESSURE_GROW_STEP once the pressure is below half of memory-pressure
+ * and the ring is expected to stay below the limit. */
+static void
+gst_prerecord_sink_pressure_poll(GstPrerecordSink *sink)
+{
+  GstClockTime full = (GstClockTime)MAX(sink->pre_record, 0) * GST_SECOND;
+  GstClockTime window = sink->pre_record_window, min_window;
+  gdouble pressure;
+  gint64 now;
+
+  if (window == GST_CLOCK_TIME_NONE)
+    window = full;
+
+  if (sink->memory_pressure <= 0.0 && sink->memory_limit == 0)
+  {
+    sink->pre_record_window = full;
+    return;
+  }
+
+  now = g_get_monotonic_time();
+  if (sink->pressure_polled != 0 &&
+      now - sink->pressure_polled < (gint64)PRESSURE_POLL_INTERVAL * 1000)
+  {
+    sink->pre_record_window = MIN(window, full);
+    return;
+  }
+  sink->pressure_polled = now;
+
+  min_window = MIN((GstClockTime)MAX(sink->min_pre_record, 0) * GST_SECOND, full);
+  pressure = gst_prerecord_sink_pressure_read(sink);
+
+  if (pressure >= 0.0 && pressure >= sink->memory_pressure)
+  {
+    if (window > min_window)
+      window = MAX(window / 2, min_window);
+  }
+  else if (sink->window_limited)
+  {
+    GstClockTime duration = gst_prerecord_sink_ring_duration(sink);
+
+    window = MIN(window, duration - duration % GST_SECOND);
+  }
+  else if (pressure < sink->memory_pressure / 2 &&
+           gst_prerecord_sink_pressure_fits(sink, window + PRESSURE_GROW_STEP))
+  {
+    window += PRESSURE_GROW_STEP;
+  }
+  window = MIN(window, full);
+  sink->window_limited = FALSE;
+
+  if (window == sink->pre_record_window)
+    return;
+
+  GST_INFO_OBJECT(sink, "pre-record window %" GST_TIME_FORMAT " of %" GST_TIME_FORMAT
+                        ", memory pressure %.2f",
+                  GST_TIME_ARGS(window), GST_TIME_ARGS(full), pressure);
+  sink->pre_record_window = window;
+
+  gst_element_post_message(GST_ELEMENT_CAST(sink),
+                           gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                   gst_structure_new(WINDOW_MESSAGE,
+                                                                     "window", G_TYPE_UINT64, (guint64)window,
+                                                                     "pre-record", G_TYPE_UINT64, (guint64)full,
+                                                                     "pressure", G_TYPE_DOUBLE, pressure,
+                                                                     NULL)));
+}
+
+/*** TRACE *******************************************************************/
+
+/* Stops tracing, messages are posted outside of the object lock */
+static void
+gst_prerecord_sink_trace_close(GstPrerecordSink *sink)
+{
+  FILE *file;
+
+  GST_OBJECT_LOCK(sink);
+  file = sink->trace_file;
+  sink->trace_file = NULL;
+  GST_OBJECT_UNLOCK(sink);
+
+  if (file && fclose(file) != 0)
+    GST_ELEMENT_WARNING(sink, RESOURCE, CLOSE,
+                        ("Error closing trace \"%s\".", sink->trace_location),
+                        GST_ERROR_SYSTEM);
+}
+
+/* Starts a new trace at the trace-location, which is replaced. A trace
+ * that cannot be written is not fatal for the recording. */
+static void
+gst_prerecord_sink_trace_open(GstPrerecordSink *sink)
+{
+  guint8 header[PRERECORD_TRACE_HEADER_SIZE];
+  FILE *file;
+
+  gst_prerecord_sink_trace_close(sink);
+
+  if (sink->trace_location == NULL)
+    return;
+
+  file = g_fopen(sink->trace_location, "wb");
+  if (file == NULL)
+    goto open_failed;
+
+  /* the events are small, they are only written out in large blocks */
+  setvbuf(file, NULL, _IOFBF, 256 * 1024);
+
+  prerecord_trace_write_header(header);
+  if (fwrite(header, sizeof(header), 1, file) != 1)
+    goto write_failed;
+
+  GST_OBJECT_LOCK(sink);
+  sink->trace_file = file;
+  sink->trace_start = g_get_monotonic_time();
+  GST_OBJECT_UNLOCK(sink);
+
+  return;
+
+  /* ERRORS */
+open_failed:
+{
+  GST_ELEMENT_WARNING(sink, RESOURCE, OPEN_WRITE,
+                      ("Could not open trace \"%s\" for writing.", sink->trace_location),
+                      GST_ERROR_SYSTEM);
+  return;
+}
+write_failed:
+{
+  GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                      ("Error while writing to trace \"%s\".", sink->trace_location),
+                      GST_ERROR_SYSTEM);
+  fclose(file);
+  return;
+}
+}
+
+/* Fills in the event header at the start of @data and writes the @size
+ * bytes of the event as having arrived now. The lock keeps the events of
+ * the streaming thread and of trigger requests apart. */
+static void
+gst_prerecord_sink_trace_write(GstPrerecordSink *sink, guint8 *data, gsize size,
+                               guint8 type, guint32 count, GstClockTime running_time)
+{
+  PrerecordTraceEvent event;
+  FILE *file;
+
+  GST_OBJECT_LOCK(sink);
+  file = sink->trace_file;
+  if (file == NULL)
+    goto done;
+
+  event.time = (guint64)MAX(g_get_monotonic_time() - sink->trace_start, 0) * GST_USECOND;
+  event.type = type;
+  event.count = count;
+  event.running_time = running_time;
+  prerecord_trace_write_event(data, &event);
+
+  if (fwrite(data, size, 1, file) != 1)
+    goto write_failed;
+
+done:
+  GST_OBJECT_UNLOCK(sink);
+  return;
+
+  /* ERRORS */
+write_failed:
+{
+  sink->trace_file = NULL;
+  GST_OBJECT_UNLOCK(sink);
+  GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                      ("Error while writing to trace \"%s\".", sink->trace_location),
+                      GST_ERROR_SYSTEM);
+  fclose(file);
+  return;
+}
+}
+
+static void
+gst_prerecord_sink_trace_record(GstPrerecordSink *sink, guint8 *data, GstBuffer *buffer)
+{
+  PrerecordTraceBuffer record;
+
+  record.size = gst_buffer_get_size(buffer);
+  record.flags = GST_BUFFER_FLAGS(buffer) & ~PRERECORD_TRACE_KEYFRAME;
+  if (gst_prerecord_sink_buffer_is_keyframe(sink, buffer))
+    record.flags |= PRERECORD_TRACE_KEYFRAME;
+  record.pts = GST_BUFFER_PTS(buffer);
+  record.dts = GST_BUFFER_DTS(buffer);
+  record.duration = GST_BUFFER_DURATION(buffer);
+  prerecord_trace_write_buffer(data, &record);
+}
+
+static void
+gst_prerecord_sink_trace_list(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  guint num_buffers = gst_buffer_list_length(buffer_list);
+  gsize size = PRERECORD_TRACE_EVENT_SIZE + num_buffers * PRERECORD_TRACE_BUFFER_SIZE;
+  guint8 *data = g_malloc(size);
+  guint i;
+
+  for (i = 0; i < num_buffers; i++)
+    gst_prerecord_sink_trace_record(sink,
+                                    data + PRERECORD_TRACE_EVENT_SIZE + i * PRERECORD_TRACE_BUFFER_SIZE,
+                                    gst_buffer_list_get(buffer_list, i));
+  gst_prerecord_sink_trace_write(sink, data, size, PRERECORD_TRACE_LIST, num_buffers,
+                                 GST_CLOCK_TIME_NONE);
+
+  g_free(data);
+}
+
+static void
+gst_prerecord_sink_trace_buffer(GstPrerecordSink *sink, GstBuffer *buffer)
+{
+  guint8 data[PRERECORD_TRACE_EVENT_SIZE + PRERECORD_TRACE_BUFFER_SIZE];
+
+  gst_prerecord_sink_trace_record(sink, data + PRERECORD_TRACE_EVENT_SIZE, buffer);
+  gst_prerecord_sink_trace_write(sink, data, sizeof(data), PRERECORD_TRACE_LIST, 1,
+                                 GST_CLOCK_TIME_NONE);
+}
+
+static void
+gst_prerecord_sink_trace_trigger(GstPrerecordSink *sink, gint buffering,
+                                 GstClockTime running_time)
+{
+  guint8 data[PRERECORD_TRACE_EVENT_SIZE];
+
+  gst_prerecord_sink_trace_write(sink, data, sizeof(data), PRERECORD_TRACE_TRIGGER, buffering,
+                                 running_time);
+}
+
+/*** STATISTICS **************************************************************/
+
+/* Accounts a write of @bytes that started at the monotonic time @start */
+static void
+gst_prerecord_sink_stats_write(GstPrerecordSink *sink, guint64 bytes, gint64 start)
+{
+  PrerecordStats *stats = &sink->stats;
+  guint64 stall = MAX(g_get_monotonic_time() - start, 0);
+  guint bucket = MIN(g_bit_storage(MIN(stall, G_MAXUINT32)), PRERECORD_STATS_LATENCY_BUCKETS - 1);
+
+  STATS_ADD(stats->bytes_written, bytes);
+  STATS_ADD(stats->writes, 1);
+  g_atomic_int_inc(&stats->latency[bucket]);
+  /* only the streaming thread writes it */
+  if (stall * GST_USECOND > STATS_GET(stats->max_stall))
+    STATS_SET(stats->max_stall, stall * GST_USECOND);
+}
+
+/* Upper bound in ns of the latency @percent percent of the writes took */
+static guint64
+gst_prerecord_sink_stats_percentile(PrerecordStats *stats, guint percent)
+{
+  gint counts[PRERECORD_STATS_LATENCY_BUCKETS];
+  guint64 total = 0, count = 0, target;
+  guint i;
+
+  for (i = 0; i < PRERECORD_STATS_LATENCY_BUCKETS; i++)
+  {
+    counts[i] = g_atomic_int_get(&stats->latency[i]);
+    total += counts[i];
+  }
+  if (total == 0)
+    return 0;
+
+  target = (total * percent + 99) / 100;
+  for (i = 0; i < PRERECORD_STATS_LATENCY_BUCKETS - 1; i++)
+  {
+    count += counts[i];
+    if (count >= target)
+      break;
+  }
+
+  return ((guint64)1 << i) * GST_USECOND;
+}
+
+static GstStructure *
+gst_prerecord_sink_create_stats(GstPrerecordSink *sink)
+{
+  PrerecordStats *stats = &sink->stats;
+  GstStructure *s;
+
+  s = gst_base_sink_get_stats(GST_BASE_SINK(sink));
+  gst_structure_set_name(s, "GstPrerecordSinkStats");
+  gst_structure_set(s,
+                    "ring-bytes", G_TYPE_UINT64, STATS_GET(stats->ring_bytes),
+                    "ring-duration", G_TYPE_UINT64, STATS_GET(stats->ring_duration),
+                    "ring-gops", G_TYPE_INT, g_atomic_int_get(&stats->ring_gops),
+                    "ring-lists", G_TYPE_INT, g_atomic_int_get(&stats->ring_lists),
+                    "evictions", G_TYPE_UINT64, STATS_GET(stats->evictions),
+                    "bytes-written", G_TYPE_UINT64, STATS_GET(stats->bytes_written),
+                    "writes", G_TYPE_UINT64, STATS_GET(stats->writes),
+                    "write-latency-p50", G_TYPE_UINT64, gst_prerecord_sink_stats_percentile(stats, 50),
+                    "write-latency-p95", G_TYPE_UINT64, gst_prerecord_sink_stats_percentile(stats, 95),
+                    "write-latency-p99", G_TYPE_UINT64, gst_prerecord_sink_stats_percentile(stats, 99),
+                    "max-stall", G_TYPE_UINT64, STATS_GET(stats->max_stall),
+                    "queued-bytes", G_TYPE_UINT64, STATS_GET(stats->queued_bytes),
+                    "dropped-bytes", G_TYPE_UINT64, STATS_GET(stats->dropped_bytes),
+                    "dropped-buffers", G_TYPE_UINT64, STATS_GET(stats->dropped_buffers),
+                    "overflow-stalls", G_TYPE_UINT64, STATS_GET(stats->overflow_stalls),
+                    NULL);
+
+  return s;
+}
+
+/* Publishes the fill of the ring after the streaming thread handled a
+ * list and posts the stats when the interval is over */
+static void
+gst_prerecord_sink_stats_update(GstPrerecordSink *sink)
+{
+  gint64 now;
+
+  STATS_SET(sink->stats.ring_bytes, gst_prerecord_sink_ring_bytes(sink));
+  STATS_SET(sink->stats.ring_duration, gst_prerecord_sink_ring_duration(sink));
+  g_atomic_int_set(&sink->stats.ring_gops, gst_prerecord_sink_ring_keyframes(sink));
+  g_atomic_int_set(&sink->stats.ring_lists, gst_prerecord_sink_ring_lists(sink));
+
+  if (sink->stats_interval == 0)
+    return;
+
+  now = g_get_monotonic_time();
+  if (sink->stats_posted != 0 &&
+      now - sink->stats_posted < (gint64)sink->stats_interval * 1000)
+    return;
+  sink->stats_posted = now;
+
+  gst_element_post_message(GST_ELEMENT_CAST(sink),
+                           gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                   gst_prerecord_sink_create_stats(sink)));
+}
+
+/*** CLIPS *******************************************************************/
+
+/* Live data a clip may have queued on top of its window before it is cut
+ * short, its thread is not keeping up with the stream then */
+#define CLIP_MAX_QUEUED (64 * 1024 * 1024)
+
+/* Template of the clip names, "-clip" added before the extension of the
+ * location unless clip-location is set. Called with the object lock. */
+static gchar *
+gst_prerecord_sink_clip_template(GstPrerecordSink *sink)
+{
+  const gchar *dot;
+
+  if (sink->clip_location)
+    return g_strdup(sink->clip_location);
+
+  dot = strrchr(sink->prerecordname, '.');
+  if (dot == NULL || strchr(dot, G_DIR_SEPARATOR) != NULL)
+    return g_strconcat(sink->prerecordname, "-clip", NULL);
+
+  return g_strdup_printf("%.*s-clip%s", (gint)(dot - sink->prerecordname),
+                         sink->prerecordname, dot);
+}
+
+static void
+gst_prerecord_sink_clip_free(PrerecordClip *clip)
+{
+  if (clip->queue)
+    g_async_queue_unref(clip->queue);
+  g_free(clip->location);
+  g_free(clip);
+}
+
+/* Names a clip and leaves it to the streaming thread to start it at the
+ * next buffer */
+static gchar *
+gst_prerecord_sink_save_clip(GstPrerecordSink *sink)
+{
+  PrerecordClip *clip;
+  gchar *template;
+
+  GST_OBJECT_LOCK(sink);
+  if (sink->n_clips >= sink->max_clips || sink->prerecordname == NULL)
+    goto no_clip;
+
+  template = gst_prerecord_sink_clip_template(sink);
+  clip = g_new0(PrerecordClip, 1);
+  clip->sink = sink;
+  clip->location = gst_prerecord_sink_expand_name(sink, template, ++sink->clip_index);
+  sink->clip_requests = g_list_append(sink->clip_requests, clip);
+  sink->n_clips++;
+  GST_OBJECT_UNLOCK(sink);
+  g_free(template);
+
+  GST_DEBUG_OBJECT(sink, "saving clip %s", clip->location);
+
+  return g_strdup(clip->location);
+
+no_clip:
+{
+  GST_OBJECT_UNLOCK(sink);
+  GST_WARNING_OBJECT(sink, "not saving a clip, %u of %u clips in progress",
+                     sink->n_clips, sink->max_clips);
+  return NULL;
+}
+}
+
+/* Queues a reference to @buffer_list to be written to @clip */
+static void
+gst_prerecord_sink_clip_queue(PrerecordClip *clip, GstBufferList *buffer_list)
+{
+  g_atomic_pointer_add(&clip->queued, gst_buffer_list_calculate_size(buffer_list));
+  g_async_queue_push(clip->queue, gst_buffer_list_ref(buffer_list));
+}
+
+/* Writes everything queued for @clip until its end, the file is only
+ * touched by this thread */
+static gpointer
+gst_prerecord_sink_clip_thread(gpointer data)
+{
+  PrerecordClip *clip = data;
+  GstPrerecordSink *sink = clip->sink;
+  GstFlowReturn flow = GST_FLOW_OK;
+  GstMiniObject *obj;
+  FILE *file;
+
+  file = gst_fopen(clip->location, "wb", FALSE, FALSE);
+  if (file == NULL)
+  {
+    GST_ELEMENT_WARNING(sink, RESOURCE, OPEN_WRITE,
+                        ("Could not open clip \"%s\" for writing.", clip->location),
+                        GST_ERROR_SYSTEM);
+    flow = GST_FLOW_ERROR;
+  }
+
+  while (GST_IS_BUFFER_LIST(obj = g_async_queue_pop(clip->queue)))
+  {
+    guint64 bytes_written = 0;
+
+    /* keep taking the references off the queue after an error */
+    if (flow == GST_FLOW_OK)
+    {
+      flow = gst_writev_buffer_list(GST_OBJECT_CAST(sink), fileno(file), NULL,
+                                    GST_BUFFER_LIST_CAST(obj), &bytes_written, 0,
+                                    sink->max_transient_error_timeout, clip->bytes,
+                                    &sink->flushing);
+      clip->bytes += bytes_written;
+    }
+    g_atomic_pointer_add(&clip->queued,
+                         -(gssize)gst_buffer_list_calculate_size(GST_BUFFER_LIST_CAST(obj)));
+    gst_mini_object_unref(obj);
+  }
+  gst_mini_object_unref(obj);
+
+  if (file)
+  {
+    if (flow == GST_FLOW_OK && (fflush(file) != 0 || fsync(fileno(file)) != 0))
+      flow = GST_FLOW_ERROR;
+    if (fclose(file) != 0)
+      flow = GST_FLOW_ERROR;
+    if (flow != GST_FLOW_OK)
+      GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                          ("Error while writing clip \"%s\".", clip->location),
+                          ("%s", gst_flow_get_name(flow)));
+  }
+
+  GST_DEBUG_OBJECT(sink, "clip %s closed, %" G_GUINT64_FORMAT " bytes",
+                   clip->location, clip->bytes);
+
+  if (flow == GST_FLOW_OK)
+    gst_element_post_message(GST_ELEMENT_CAST(sink),
+                             gst_message_new_element(GST_OBJECT_CAST(sink),
+                                                     gst_structure_new("GstPrerecordSinkClip",
+                                                                       "location", G_TYPE_STRING, clip->location,
+                                                                       "bytes", G_TYPE_UINT64, clip->bytes,
+                                                                       "truncated", G_TYPE_BOOLEAN, clip->truncated,
+                                                                       NULL)));
+
+  g_atomic_int_set(&clip->done, TRUE);
+
+  return NULL;
+}
+
+static void
+gst_prerecord_sink_arena_unpin(gpointer data)
+{
+  GstPrerecordSink *sink = data;
+
+  if (g_atomic_int_dec_and_test(&sink->arena.pins))
+  {
+    g_mutex_lock(&sink->pin_lock);
+    g_cond_broadcast(&sink->pin_cond);
+    g_mutex_unlock(&sink->pin_lock);
+  }
+}
+
+/* Read-only memory of @size bytes of the arena at @offset, the arena is
+ * pinned until it is freed */
+static GstMemory *
+gst_prerecord_sink_arena_pin(GstPrerecordSink *sink, gsize offset, gsize size)
+{
+  g_atomic_int_inc(&sink->arena.pins);
+
+  return gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY, sink->arena.data + offset,
+                                size, 0, size, sink, gst_prerecord_sink_arena_unpin);
+}
+
+/* Queues the pre-record window from the keyframe it starts in on, looked
+ * up by running time in the FIFO. FIFO entries are shared by reference,
+ * arena entries are wrapped in place and the arena pinned from the start
+ * of the window on until the clip has written them. */
+static void
+gst_prerecord_sink_clip_snapshot(GstPrerecordSink *sink, PrerecordClip *clip)
+{
+  if (sink->arena.data)
+  {
+    PrerecordArena *arena = &sink->arena;
+    gsize write = (arena->read + arena->used) % arena->size;
+    guint i;
+
+    i = prerecord_keyframes_gop_start(&arena->keyframes,
+                                      arena->pushed - arena->n_entries, 0);
+    if (i >= arena->n_entries)
+      return;
+
+    /* an older clip still pinning the arena pins from further back */
+    if (g_atomic_int_get(&arena->pins) == 0)
+      arena->pin_offset = arena->entries[(arena->first + i) % arena->n_entries_max].offset;
+    arena->pin_size = (write + arena->size - arena->pin_offset) % arena->size;
+    if (arena->pin_size == 0)
+      arena->pin_size = arena->size;
+
+    for (; i < arena->n_entries; i++)
+    {
+      ArenaEntry *entry = &arena->entries[(arena->first + i) % arena->n_entries_max];
+      gsize first_part = MIN(entry->size, arena->size - entry->offset);
+      GstBufferList *list;
+      GstBuffer *buffer;
+
+      buffer = gst_buffer_new();
+      gst_buffer_append_memory(buffer, gst_prerecord_sink_arena_pin(sink, entry->offset,
+                                                                    first_part));
+      if (first_part < entry->size)
+        gst_buffer_append_memory(buffer, gst_prerecord_sink_arena_pin(sink, 0,
+                                                                      entry->size - first_part));
+      clip->max_queued += entry->size;
+
+      list = gst_buffer_list_new_sized(1);
+      gst_buffer_list_add(list, buffer);
+      g_async_queue_push(clip->queue, list);
+      g_atomic_pointer_add(&clip->queued, entry->size);
+    }
+  }
+  else
+  {
+    BufferListNode *node;
+    gint start = 0;
+    guint i;
+
+    /* the GOP holding the start of the window, the ring may hold more */
+    if (sink->ring.end != GST_CLOCK_TIME_NONE && sink->ring.end > sink->pre_record_window)
+      start = MAX(prerecord_fifo_search(sink->ring.fifo,
+                                        sink->ring.end - sink->pre_record_window), 0);
+
+    for (i = prerecord_fifo_gop_start(sink->ring.fifo, start);
+         (node = prerecord_fifo_peek_nth(sink->ring.fifo, i)) != NULL; i++)
+      gst_prerecord_sink_clip_queue(clip, node->buffer_list);
+    clip->max_queued += g_atomic_pointer_get(&clip->queued);
+  }
+}
+
+/* Starts writing @clip with the data up to now, its post-record runs
+ * from @running_time */
+static gboolean
+gst_prerecord_sink_clip_start(GstPrerecordSink *sink, PrerecordClip *clip,
+                              GstClockTime running_time)
+{
+  GError *err = NULL;
+
+  clip->end = running_time + (GstClockTime)MAX(sink->post_record, 0) * GST_SECOND;
+  clip->queue = g_async_queue_new_full((GDestroyNotify)gst_mini_object_unref);
+  clip->max_queued = CLIP_MAX_QUEUED;
+
+  if (sink->mp4 && sink->mp4_header)
+    gst_prerecord_sink_clip_queue(clip, sink->mp4_header);
+  gst_prerecord_sink_clip_snapshot(sink, clip);
+
+  clip->thread = g_thread_try_new("prerecordclip", gst_prerecord_sink_clip_thread,
+                                  clip, &err);
+  if (clip->thread == NULL)
+    goto thread_failed;
+
+  GST_INFO_OBJECT(sink, "clip %s started at %" GST_TIME_FORMAT ", %d entries from the ring",
+                  clip->location, GST_TIME_ARGS(running_time),
+                  g_async_queue_length(clip->queue));
 
   return TRUE;
+
+  /* ERRORS */
+thread_failed:
+{
+  GST_ELEMENT_WARNING(sink, RESOURCE, FAILED,
+                      ("Could not start writing clip \"%s\".", clip->location),
+                      ("%s", err->message));
+  g_clear_error(&err);
+  return FALSE;
+}
+}
+
+/* Joins the clips whose thread is done, all of them with @wait */
+static void
+gst_prerecord_sink_clip_reap(GstPrerecordSink *sink, gboolean wait)
+{
+  GList *l, *next;
+
+  for (l = sink->clips_closing; l != NULL; l = next)
+  {
+    PrerecordClip *clip = l->data;
+
+    next = l->next;
+    if (!wait && !g_atomic_int_get(&clip->done))
+      continue;
+
+    g_thread_join(clip->thread);
+    sink->clips_closing = g_list_delete_link(sink->clips_closing, l);
+    gst_prerecord_sink_clip_free(clip);
+
+    GST_OBJECT_LOCK(sink);
+    sink->n_clips--;
+    GST_OBJECT_UNLOCK(sink);
+  }
+}
+
+static void
+gst_prerecord_sink_clip_close(GstPrerecordSink *sink, PrerecordClip *clip)
+{
+  g_async_queue_push(clip->queue, gst_event_new_eos());
+  sink->clips = g_list_remove(sink->clips, clip);
+  sink->clips_closing = g_list_prepend(sink->clips_closing, clip);
+}
+
+/* Starts the requested clips and queues @buffer_list, which is about to
+ * be handled, to every clip that is being written */
+static void
+gst_prerecord_sink_clip_feed(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  GstClockTime start, end;
+  GList *requests, *l, *next;
+
+  gst_prerecord_sink_clip_reap(sink, FALSE);
+
+  if (sink->clips == NULL && g_atomic_pointer_get(&sink->clip_requests) == NULL)
+    return;
+
+  gst_prerecord_sink_list_running_time(sink, buffer_list, &start, &end);
+
+  GST_OBJECT_LOCK(sink);
+  requests = sink->clip_requests;
+  sink->clip_requests = NULL;
+  GST_OBJECT_UNLOCK(sink);
+
+  for (l = requests; l != NULL; l = l->next)
+  {
+    PrerecordClip *clip = l->data;
+
+    if (gst_prerecord_sink_clip_start(sink, clip, start))
+    {
+      sink->clips = g_list_append(sink->clips, clip);
+      continue;
+    }
+
+    gst_prerecord_sink_clip_free(clip);
+    GST_OBJECT_LOCK(sink);
+    sink->n_clips--;
+    GST_OBJECT_UNLOCK(sink);
+  }
+  g_list_free(requests);
+
+  for (l = sink->clips; l != NULL; l = next)
+  {
+    PrerecordClip *clip = l->data;
+
+    next = l->next;
+    gst_prerecord_sink_clip_queue(clip, buffer_list);
+    if (end >= clip->end)
+    {
+      gst_prerecord_sink_clip_close(sink, clip);
+    }
+    else if ((gsize)g_atomic_pointer_get(&clip->queued) > clip->max_queued)
+    {
+      GST_ELEMENT_WARNING(sink, RESOURCE, WRITE,
+                          ("Clip \"%s\" is not written fast enough, it ends here.",
+                           clip->location),
+                          ("%" G_GSSIZE_FORMAT " bytes queued",
+                           (gssize)g_atomic_pointer_get(&clip->queued)));
+      clip->truncated = TRUE;
+      gst_prerecord_sink_clip_close(sink, clip);
+    }
+  }
+}
+
+/* Keeps @buffer_list in the ring after it was recorded so that clips
+ * saved while recording still get their pre-record window */
+static void
+gst_prerecord_sink_clip_keep(GstPrerecordSink *sink, GstBufferList *buffer_list)
+{
+  if (sink->max_clips == 0)
+    return;
+
+  gst_prerecord_sink_ring_push(sink, buffer_list);
+  gst_prerecord_sink_ring_trim_window(sink);
+}
+
+/* Ends every clip with what was queued so far and waits for them, the
+ * ones that were not started are dropped */
+static void
+gst_prerecord_sink_clip_stop(GstPrerecordSink *sink)
+{
+  GList *requests;
+
+  GST_OBJECT_LOCK(sink);
+  requests = sink->clip_requests;
+  sink->clip_requests = NULL;
+  sink->n_clips -= g_list_length(requests);
+  GST_OBJECT_UNLOCK(sink);
+  g_list_free_full(requests, (GDestroyNotify)gst_prerecord_sink_clip_free);
+
+  while (sink->clips)
+    gst_prerecord_sink_clip_close(sink, sink->clips->data);
+  gst_prerecord_sink_clip_reap(sink, TRUE);
 }
 
 /*** GSTURIHANDLER INTERFACE *************************************************/
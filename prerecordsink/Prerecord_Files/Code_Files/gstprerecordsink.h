@@ -29,6 +29,9 @@
 #include <gst/gst.h>
 #include <gst/base/gstbasesink.h>
 
+#include "gstprerecordmp4.h"
+#include "gstprerecordring.h"
+
 G_BEGIN_DECLS
 
 
@@ -48,6 +51,10 @@ G_BEGIN_DECLS
 typedef struct _GstPrerecordSink GstPrerecordSink;
 typedef struct _GstPrerecordSinkClass GstPrerecordSinkClass;
 
+/* Name of the custom downstream event that switches the buffering state at
+ * a given running time and of the element message posted once it did */
+#define GST_PRERECORD_SINK_TRIGGER PRERECORD_TRIGGER_NAME
+
 /**
  * GstPrerecordSinkBufferMode:
  * @GST_PRERECORD_SINK_BUFFER_MODE_DEFAULT: Default buffering
@@ -74,149 +81,160 @@ typedef enum {
 
 
 /**
- * GstPrerecordSink:
+ * GstPrerecordSinkRingStorage:
+ * @GST_PRERECORD_SINK_RING_STORAGE_REFS: Hold references to the upstream buffers
+ * @GST_PRERECORD_SINK_RING_STORAGE_ARENA: Copy into a preallocated byte arena
+ * @GST_PRERECORD_SINK_RING_STORAGE_MMAP: Arena in a memory mapped file in the
+ *   temp-location directory
+ * @GST_PRERECORD_SINK_RING_STORAGE_MEMFD: Arena in a memfd of at most max-bytes
+ * @GST_PRERECORD_SINK_RING_STORAGE_JOURNAL: Arena in a journaled file in the
+ *   temp-location directory that is recovered after an unclean shutdown
  *
- * Opaque #GstPrerecordSink structure.
+ * Where the pre-recorded data is kept until it is written out.
  */
+typedef enum {
+  GST_PRERECORD_SINK_RING_STORAGE_REFS,
+  GST_PRERECORD_SINK_RING_STORAGE_ARENA,
+  GST_PRERECORD_SINK_RING_STORAGE_MMAP,
+  GST_PRERECORD_SINK_RING_STORAGE_MEMFD,
+  GST_PRERECORD_SINK_RING_STORAGE_JOURNAL
+} GstPrerecordSinkRingStorage;
 
+/**
+ * GstPrerecordSinkIoEngine:
+ * @GST_PRERECORD_SINK_IO_ENGINE_WRITEV: Blocking writev from the writing thread
+ * @GST_PRERECORD_SINK_IO_ENGINE_IO_URING: Batched asynchronous writes through io_uring
+ *
+ * Interface used to write to the prerecord.
+ */
+typedef enum {
+  GST_PRERECORD_SINK_IO_ENGINE_WRITEV,
+  GST_PRERECORD_SINK_IO_ENGINE_IO_URING
+} GstPrerecordSinkIoEngine;
+
+/**
+ * GstPrerecordSinkOverflowPolicy:
+ * @GST_PRERECORD_SINK_OVERFLOW_BLOCK: Wait for the writer
+ * @GST_PRERECORD_SINK_OVERFLOW_DROP_NON_REFERENCE: Drop frames no other
+ *   frame refers to, wait for the writer with the others
+ * @GST_PRERECORD_SINK_OVERFLOW_DROP_GOP: Drop the rest of the GOP
+ *
+ * What happens to recorded data that does not fit in the overflow budget
+ * of the writer.
+ */
+typedef enum {
+  GST_PRERECORD_SINK_OVERFLOW_BLOCK,
+  GST_PRERECORD_SINK_OVERFLOW_DROP_NON_REFERENCE,
+  GST_PRERECORD_SINK_OVERFLOW_DROP_GOP
+} GstPrerecordSinkOverflowPolicy;
 
 
-typedef struct _BufferListNode {
-    GstBufferList *buffer_list;
-    struct _BufferListNode *next;
-} BufferListNode;
-
-typedef struct _BufferListFIFO {
-    BufferListNode *front;
-    BufferListNode *rear;
-} BufferListFIFO;
-
-// Function to initialize an empty FIFO
-BufferListFIFO *initializeFIFO() {
-    BufferListFIFO *fifo = (BufferListFIFO *)malloc(sizeof(BufferListFIFO));
-    if (fifo == NULL) {
-        fprintf(stderr, "Memory allocation error for FIFO initialization\n");
-        exit(EXIT_FAILURE);
-    }
-
-    fifo->front = fifo->rear = NULL;
-    return fifo;
-}
-
-
-
-guint getFIFOSize(BufferListFIFO *fifo) {
-    guint size = 0;
-    BufferListNode *current = fifo->front;
-
-    while (current != NULL) {
-        size++;
-        current = current->next;
-    }
-
-    return size;
-}
-
-
-// Function to check if the FIFO is empty
-int is_fifo_empty(BufferListFIFO *fifo) {
-    return fifo->front == NULL;
-}
-
-
-// Function to push a GstBufferList onto the FIFO
-void push(BufferListFIFO *fifo, GstBufferList *buffer_list) {
-    BufferListNode *new_node = (BufferListNode *)malloc(sizeof(BufferListNode));
-    if (new_node == NULL) {
-        fprintf(stderr, "Memory allocation error for new node\n");
-        exit(EXIT_FAILURE);
-    }
-
-    new_node->buffer_list = buffer_list;
-    new_node->next = NULL;
-
-    if (is_fifo_empty(fifo)) {  // If the FIFO is empty
-        fifo->front = fifo->rear = new_node;
-    } else {
-        fifo->rear->next = new_node;  // Append to the existing FIFO
-        fifo->rear = new_node;
-    }
-}
-
-// Function to pop a GstBufferList from the FIFO
-GstBufferList *pop(BufferListFIFO *fifo) {
-    if (is_fifo_empty(fifo)) {
-        return NULL;  // FIFO is empty
-    } else {
-        BufferListNode *temp = fifo->front;
-        GstBufferList *buffer_list = temp->buffer_list;  // Store the buffer_list
-
-        fifo->front = fifo->front->next;
-        if (fifo->front == NULL) {  // If the FIFO becomes empty
-            fifo->rear = NULL;
-        }
-
-        free(temp);  // Free the node memory
-        return buffer_list;  // Return the buffer_list
-    }
-}
-
-
-
-GstBufferList *popNth(BufferListFIFO *fifo, guint n) {
-    if (is_fifo_empty(fifo)) {
-        return NULL;  // FIFO is empty
-    } else {
-        BufferListNode *current = fifo->front;
-        BufferListNode *prev = NULL;
-        guint count = 0;
-
-        // Traverse the FIFO to find the nth element
-        while (current != NULL && count != n) {
-            prev = current;
-            current = current->next;
-            count++;
-        }
-
-        // If nth element is found
-        if (current != NULL) {
-            GstBufferList *buffer_list = current->buffer_list;
-            
-            // Remove the nth element from the FIFO
-            if (prev != NULL) {
-                prev->next = current->next;
-            } else {
-                fifo->front = current->next;
-            }
-            
-            // If the removed element is the last element, update the rear pointer
-            if (current == fifo->rear) {
-                fifo->rear = prev;
-            }
-
-            // Free the node memory
-            free(current);
-            
-            return buffer_list; // Return the buffer_list
-        } else {
-            return NULL; // nth element not found
-        }
-    }
-}
-
-
-
-
-// Function to free the memory occupied by the FIFO
-void freeFIFO(BufferListFIFO *fifo) {
-    while (!is_fifo_empty(fifo)) {
-        pop(fifo);
-    }
-    free(fifo);
-}
+/**
+ * GstPrerecordSink:
+ *
+ * Opaque #GstPrerecordSink structure.
+ */
 
 
 
+/* Side index entry of the arena, the payload lives at @offset in the arena
+ * and may wrap around its end. */
+typedef struct _ArenaEntry {
+    gsize offset;
+    gsize size;
+    guint flags;
+    gboolean keyframe;
+    GstClockTime pts;
+    GstClockTime dts;
+    GstClockTime duration;
+    GstClockTime running_time;
+} ArenaEntry;
+
+/* Clip saved with the save-clip action. Its own thread writes the lists
+ * queued in @queue, references to the ring window first and then to the
+ * live data up to the running time @end, and stops at an event. @queued
+ * bytes are waiting in @queue, the clip is cut short beyond @max_queued.
+ * @truncated is set then. */
+typedef struct _PrerecordClip {
+    GstPrerecordSink *sink;
+    gchar *location;
+    GstClockTime end;
+    GAsyncQueue *queue;
+    GThread *thread;
+    guint64 bytes;
+    gssize queued;
+    gsize max_queued;
+    gboolean truncated;
+    gint done;
+} PrerecordClip;
+
+/* Write latencies are counted in power of two buckets, bucket @i holds the
+ * writes that took less than 2^i us */
+#define PRERECORD_STATS_LATENCY_BUCKETS 24
+
+/* Counters behind the stats property. The streaming thread updates them
+ * with atomics only, so any thread can read them without a lock and
+ * without slowing the data flow. Times are in ns. */
+typedef struct _PrerecordStats {
+    guint64 ring_bytes;
+    guint64 ring_duration;
+    gint ring_gops;
+    gint ring_lists;
+    guint64 evictions;
+    guint64 bytes_written;
+    guint64 writes;
+    guint64 max_stall;
+    guint64 queued_bytes;
+    guint64 dropped_bytes;
+    guint64 dropped_buffers;
+    guint64 overflow_stalls;
+    gint latency[PRERECORD_STATS_LATENCY_BUCKETS];
+} PrerecordStats;
+
+/* Fixed size circular byte arena, allocated once when the sink starts.
+ * Payloads are stored back to back starting at @read, the index is a
+ * circular array of @n_entries_max entries starting at @first that grows
+ * up to @n_entries_limit. A journal has @n_records records. File backed
+ * arenas have the @fd they are mapped from, -1 otherwise. A journaled
+ * arena starts @data_offset bytes into its file, after the journal header
+ * and the on-disk copy of the index. @keyframes holds the positions of the
+ * keyframe entries counted in pushes, @pushed is the next one.
+ * @mp4_header is the fMP4 header last written to the journal, which
+ * @sync_pool flushes every sync-interval, @syncing while it does. Evicted
+ * pages of @page_size are released under memory pressure. While clips hold
+ * @pins memories wrapping the arena, the @pin_size bytes from @pin_offset
+ * are never written, a list that would have is dropped and @dropping
+ * drops the rest of its GOP. */
+typedef struct _PrerecordArena {
+    guint8 *data;
+    gsize size;
+    gsize page_size;
+    gint fd;
+    gsize advised;
+    gboolean no_copy_range;
+    gsize data_offset;
+    guint32 generation;
+    guint64 sequence;
+    gint64 last_sync;
+    GThreadPool *sync_pool;
+    gint syncing;
+    gsize read;
+    gsize used;
+    ArenaEntry *entries;
+    guint n_entries_max;
+    guint n_entries_limit;
+    guint n_records;
+    guint first;
+    guint n_entries;
+    guint n_keyframes;
+    guint pushed;
+    PrerecordKeyframes keyframes;
+    GstBufferList *mp4_header;
+    gint pins;
+    gsize pin_offset;
+    gsize pin_size;
+    gboolean dropping;
+} PrerecordArena;
 
 struct _GstPrerecordSink {
   GstBaseSink parent;
@@ -245,17 +263,203 @@ struct _GstPrerecordSink {
   gboolean append;
   gboolean o_sync;
   gint max_transient_error_timeout;
+  gchar *temp_location;
+  gint sync_interval;
   gint pre_record;
   gint post_record;
   gint buffering;
   gboolean flushing;
-  BufferListFIFO *fifo;
-
-  
+  PrerecordRing ring;
+
+  gint ring_storage;
+  guint64 max_bytes;
+  guint64 max_time;
+  PrerecordArena arena;
+
+  /* Recording state machine, the first lists of a clip are written
+   * straight to the prerecord before pre-recording starts */
+  gboolean first_buffers_written;
+  guint num_first_buffers;
+  gboolean post_record_started;
+  GstClockTime post_record_start;
+  /* the ring was written to the prerecord when recording started, it only
+   * keeps filling after that for clips */
+  gboolean ring_drained;
+
+  /* Pending change of @buffering */
+  PrerecordTrigger trigger;
+
+  /* Asynchronous writer, the streaming thread only queues references in a
+   * single producer / single consumer ring that the writer thread empties.
+   * @async_head is only written by the streaming thread, @async_tail only
+   * by the writer, the lock and cond are just for waiting on either end.
+   * The writer owns current_pos and publishes it in @async_pos under the
+   * lock. */
+  gboolean async_write;
+  GThread *writer;
+  GstMiniObject **async_ring;
+  gint async_head;
+  gint async_tail;
+  gint async_waiters;
+  gint async_flow;
+  gboolean async_stop;
+  gboolean async_discard;
+  guint64 async_pos;
+  GMutex async_lock;
+  GCond async_cond;
+
+  /* Overflow region: the bytes of every slot in @async_sizes count
+   * towards the queued-bytes stat, which may grow to @overflow_budget
+   * before @overflow_policy applies. Data queued while
+   * @overflow_exempt is set is not counted. @overflow_dropping is set
+   * while the rest of a frame or GOP is dropped, the frame being the one
+   * on the TS PID @overflow_pid. */
+  guint64 overflow_budget;
+  GstPrerecordSinkOverflowPolicy overflow_policy;
+  gsize *async_sizes;
+  gboolean overflow_exempt;
+  gboolean overflow_dropping;
+  gint overflow_pid;
+
+  /* Writeback pacing: every @writeback_bytes or @writeback_interval ms
+   * the range written since @writeback_pos is handed to the kernel, the
+   * range handed over before it (@writeback_prev_size bytes at
+   * @writeback_prev) is waited for and dropped from the page cache.
+   * Only touched by the thread that writes. */
+  guint64 writeback_bytes;
+  guint writeback_interval;
+  guint64 writeback_pos;
+  guint64 writeback_prev;
+  guint64 writeback_prev_size;
+  gint64 writeback_time;
+
+  /* Burst mode of the writer thread, which holds the data until
+   * @burst_size bytes are queued or the oldest was held @burst_time ms.
+   * @async_blocked is set while the streaming thread waits for it. */
+  guint64 burst_size;
+  guint burst_time;
+  gint async_blocked;
+
+  /* io_uring state while the io-uring engine is in use */
+  gint io_engine;
+  struct _PrerecordUring *uring;
+
+  /* O_DIRECT writes go through an aligned staging buffer, @direct_offset
+   * is the file offset of its start */
+  gboolean direct_io;
+  guint8 *direct_buf;
+  gsize direct_fill;
+  guint64 direct_offset;
+
+  /* clip preallocation once the bitrate is known */
+  gint record_duration;
+  gboolean preallocated;
+
+  /* Segmenting, @segment_location is the file written now. A single
+   * thread pool opens the next segment ahead as @segment_next and syncs
+   * and closes finished ones, keeping at most @max_files of them. */
+  guint64 max_segment_time;
+  guint64 max_segment_bytes;
+  guint max_files;
+  gchar *segment_location;
+  guint segment_index;
+  GstClockTime segment_start;
+  guint64 segment_bytes;
+  GThreadPool *segment_pool;
+  GMutex segment_lock;
+  FILE *segment_next;
+  gchar *segment_next_location;
+  GQueue segment_files;
+
+  /* Fragmented MP4 input, @mp4_header is the ftyp and moov every
+   * prerecord starts with */
+  gboolean mp4;
+  GstBufferList *mp4_header;
+  PrerecordMp4Info mp4_info;
+  gboolean mp4_header_written;
+
+  /* Timestamps written into the prerecord are rebased so that it starts
+   * at zero: @rebase_ts_base is the MPEG-TS base in 90 kHz units,
+   * G_MAXUINT64 until it is known, moved back by @rebase_ts_lead, the
+   * largest lead of a PTS or DTS over the last PCR @rebase_ts_pcr seen
+   * while looking for it. @rebase_mp4_base is the fMP4 base in ns common
+   * to all tracks, GST_CLOCK_TIME_NONE until it is known */
+  gboolean rebase_timestamps;
+  guint64 rebase_ts_base;
+  guint64 rebase_ts_pcr;
+  guint64 rebase_ts_lead;
+  GstClockTime rebase_mp4_base;
+
+  /* Keyframe seek index written next to the prerecord, @index_offset is
+   * where the next byte written ends up in the prerecord and @index_start
+   * the running time of its first keyframe */
+  gboolean seek_index;
+  FILE *index_file;
+  gchar *index_location;
+  guint64 index_offset;
+  GstClockTime index_start;
+
+  /* Thumbnail of every prerecord: the first keyframe written to
+   * @thumbnail_prerecord is collected in @thumbnail_data, from the TS
+   * packets of @thumbnail_pid or from the fMP4 fragment at
+   * @thumbnail_offset of which the first @thumbnail_need bytes are
+   * needed, and saved next to it as H.264 by @thumbnail_pool */
+  gboolean thumbnail;
+  GThreadPool *thumbnail_pool;
+  gchar *thumbnail_prerecord;
+  GByteArray *thumbnail_data;
+  gint thumbnail_pid;
+  guint64 thumbnail_offset;
+  gsize thumbnail_need;
+
+  /* Clips saved with the save-clip action: @clip_requests are named but
+   * not started yet and protected by the object lock, @clips are being
+   * written and @clips_closing have their end queued. At most @max_clips
+   * of them exist at the same time. */
+  guint max_clips;
+  gchar *clip_location;
+  guint clip_index;
+  GList *clip_requests;
+  GList *clips;
+  GList *clips_closing;
+  guint n_clips;
+  GMutex pin_lock;
+  GCond pin_cond;
+
+  PrerecordStats stats;
+  guint stats_interval;
+  gint64 stats_posted;
+
+  /* Memory pressure: @pre_record_window is the pre-record window in
+   * effect, cut below pre-record while the PSI "some avg10" read from
+   * @pressure_file is at @memory_pressure or the ring would hold more
+   * than @memory_limit bytes, and grown back once that clears.
+   * @window_limited is set when the limit evicted since the last poll.
+   * Only touched by the streaming thread. */
+  guint64 memory_limit;
+  gdouble memory_pressure;
+  gint min_pre_record;
+  gchar *pressure_location;
+  gchar *pressure_file;
+  GstClockTime pre_record_window;
+  gboolean window_limited;
+  gint64 pressure_polled;
+
+  /* Trace of the arriving buffers and buffering requests, @trace_file is
+   * protected by the object lock and @trace_start is the monotonic time
+   * the arrival times are relative to */
+  gchar *trace_location;
+  FILE *trace_file;
+  gint64 trace_start;
 };
 
 struct _GstPrerecordSinkClass {
   GstBaseSinkClass parent_class;
+
+  /* actions */
+  gboolean (*start_recording) (GstPrerecordSink *sink, guint64 running_time);
+  gboolean (*stop_recording) (GstPrerecordSink *sink, guint64 running_time);
+  gchar *(*save_clip) (GstPrerecordSink *sink);
 };
 
 G_GNUC_INTERNAL GType gst_prerecord_sink_get_type (void);
@@ -0,0 +1,160 @@
+/* GStreamer
+ *
+ * gstprerecordtrace.h: trace of the data arriving at a prerecordsink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_PRERECORD_TRACE_H__
+#define __GST_PRERECORD_TRACE_H__
+
+#include <string.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A trace starts with a header of the magic "PRTR", a 32 bit version and
+ * 8 reserved bytes, followed by one event per buffer list or buffering
+ * request in the order they reached the sink. An event is the arrival
+ * time in ns since the sink started, a type byte, 3 reserved bytes, a 32
+ * bit count and a running time. For a list the count is the number of
+ * buffer records that follow, for a trigger it is the requested buffering
+ * state and the running time the one it was requested for, or
+ * GST_CLOCK_TIME_NONE for the next buffer. A buffer record is the size,
+ * the buffer flags with PRERECORD_TRACE_KEYFRAME set when the sink took
+ * it for a keyframe, and the PTS, DTS and duration. Only the metadata is
+ * kept, a replay fills the buffers with TS packets that look the same to
+ * the sink. Everything is little endian, a partial event at the end is left
+ * over from a sink that was not stopped and is ignored. */
+#define PRERECORD_TRACE_MAGIC "PRTR"
+#define PRERECORD_TRACE_VERSION 1
+#define PRERECORD_TRACE_HEADER_SIZE 16
+#define PRERECORD_TRACE_EVENT_SIZE 24
+#define PRERECORD_TRACE_BUFFER_SIZE 32
+
+#define PRERECORD_TRACE_KEYFRAME (1u << 31)
+
+typedef enum {
+  PRERECORD_TRACE_LIST = 0,
+  PRERECORD_TRACE_TRIGGER = 1,
+} PrerecordTraceType;
+
+typedef struct _PrerecordTraceEvent {
+  guint64 time;
+  guint8 type;
+  guint32 count;
+  guint64 running_time;
+} PrerecordTraceEvent;
+
+typedef struct _PrerecordTraceBuffer {
+  guint32 size;
+  guint32 flags;
+  guint64 pts;
+  guint64 dts;
+  guint64 duration;
+} PrerecordTraceBuffer;
+
+static inline void
+prerecord_trace_write32(guint8 *data, guint32 value)
+{
+  guint i;
+
+  for (i = 0; i < 4; i++)
+    data[i] = value >> (8 * i);
+}
+
+static inline void
+prerecord_trace_write64(guint8 *data, guint64 value)
+{
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    data[i] = value >> (8 * i);
+}
+
+static inline guint32
+prerecord_trace_read32(const guint8 *data)
+{
+  return (guint32)data[0] | (guint32)data[1] << 8 | (guint32)data[2] << 16 |
+         (guint32)data[3] << 24;
+}
+
+static inline guint64
+prerecord_trace_read64(const guint8 *data)
+{
+  return (guint64)prerecord_trace_read32(data) |
+         (guint64)prerecord_trace_read32(data + 4) << 32;
+}
+
+static inline void
+prerecord_trace_write_header(guint8 *header)
+{
+  memset(header, 0, PRERECORD_TRACE_HEADER_SIZE);
+  memcpy(header, PRERECORD_TRACE_MAGIC, 4);
+  header[4] = PRERECORD_TRACE_VERSION;
+}
+
+/* Whether @header starts a trace this reader understands */
+static inline gboolean
+prerecord_trace_check_header(const guint8 *header)
+{
+  return memcmp(header, PRERECORD_TRACE_MAGIC, 4) == 0 &&
+         prerecord_trace_read32(header + 4) == PRERECORD_TRACE_VERSION;
+}
+
+static inline void
+prerecord_trace_write_event(guint8 *data, const PrerecordTraceEvent *event)
+{
+  memset(data, 0, PRERECORD_TRACE_EVENT_SIZE);
+  prerecord_trace_write64(data, event->time);
+  data[8] = event->type;
+  prerecord_trace_write32(data + 12, event->count);
+  prerecord_trace_write64(data + 16, event->running_time);
+}
+
+static inline void
+prerecord_trace_read_event(const guint8 *data, PrerecordTraceEvent *event)
+{
+  event->time = prerecord_trace_read64(data);
+  event->type = data[8];
+  event->count = prerecord_trace_read32(data + 12);
+  event->running_time = prerecord_trace_read64(data + 16);
+}
+
+static inline void
+prerecord_trace_write_buffer(guint8 *data, const PrerecordTraceBuffer *buffer)
+{
+  prerecord_trace_write32(data, buffer->size);
+  prerecord_trace_write32(data + 4, buffer->flags);
+  prerecord_trace_write64(data + 8, buffer->pts);
+  prerecord_trace_write64(data + 16, buffer->dts);
+  prerecord_trace_write64(data + 24, buffer->duration);
+}
+
+static inline void
+prerecord_trace_read_buffer(const guint8 *data, PrerecordTraceBuffer *buffer)
+{
+  buffer->size = prerecord_trace_read32(data);
+  buffer->flags = prerecord_trace_read32(data + 4);
+  buffer->pts = prerecord_trace_read64(data + 8);
+  buffer->dts = prerecord_trace_read64(data + 16);
+  buffer->duration = prerecord_trace_read64(data + 24);
+}
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_TRACE_H__ */
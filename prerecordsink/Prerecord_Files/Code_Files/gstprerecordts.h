@@ -0,0 +1,94 @@
+/* GStreamer
+ *
+ * gstprerecordts.h: MPEG-TS helpers shared by prerecordsink and
+ * prerecordqueue
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_PRERECORD_TS_H__
+#define __GST_PRERECORD_TS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define PRERECORD_TS_PACKET_SIZE 188
+#define PRERECORD_TS_SYNC_BYTE 0x47
+
+/* Looks for the start of a video access unit that can be decoded on its own:
+ * a PES start on a video stream that is flagged as random access point in
+ * the adaptation field or that carries an H.264 SPS or IDR NAL unit. */
+static inline gboolean
+prerecord_ts_is_keyframe(const guint8 *data, gsize size)
+{
+  gsize pos;
+
+  for (pos = 0; pos + PRERECORD_TS_PACKET_SIZE <= size; pos += PRERECORD_TS_PACKET_SIZE)
+  {
+    const guint8 *packet = data + pos;
+    const guint8 *end = packet + PRERECORD_TS_PACKET_SIZE;
+    const guint8 *payload = packet + 4;
+    gboolean random_access = FALSE;
+    guint afc;
+
+    if (packet[0] != PRERECORD_TS_SYNC_BYTE)
+      return FALSE;
+
+    /* payload_unit_start_indicator */
+    if (!(packet[1] & 0x40))
+      continue;
+
+    afc = (packet[3] >> 4) & 0x3;
+    if (afc & 0x2)
+    {
+      if (packet[4] > 0)
+        random_access = (packet[5] & 0x40) != 0;
+      payload = packet + 5 + packet[4];
+    }
+
+    if (!(afc & 0x1) || payload + 9 > end)
+      continue;
+
+    /* PES start code prefix followed by a video stream id */
+    if (payload[0] != 0x00 || payload[1] != 0x00 || payload[2] != 0x01 ||
+        (payload[3] & 0xf0) != 0xe0)
+      continue;
+
+    if (random_access)
+      return TRUE;
+
+    for (payload += 9 + payload[8]; payload + 4 <= end; payload++)
+    {
+      if (payload[0] == 0x00 && payload[1] == 0x00 && payload[2] == 0x01)
+      {
+        guint nal_type = payload[3] & 0x1f;
+
+        if (nal_type == 5 || nal_type == 7)
+          return TRUE;
+        /* non-IDR slice */
+        if (nal_type == 1)
+          break;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+G_END_DECLS
+
+#endif /* __GST_PRERECORD_TS_H__ */
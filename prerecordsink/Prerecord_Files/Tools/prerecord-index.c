@@ -0,0 +1,118 @@
+/* GStreamer
+ *
+ * prerecord-index.c: look up keyframes in the seek index of a prerecord
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Reads the ".idx" sidecar prerecordsink writes with seek-index=true.
+ * Without a time every keyframe is listed, with -t the keyframe to start
+ * playback from is looked up with a binary search and its time and byte
+ * offset are printed, which is all a player needs to seek without parsing
+ * the prerecord. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "../Code_Files/gstprerecordindex.h"
+
+static gdouble seek_time = -1;
+
+static GOptionEntry entries[] = {
+  {"time", 't', 0, G_OPTION_ARG_DOUBLE, &seek_time,
+   "Print the keyframe to start from to play at this many seconds", "S"},
+  {NULL}
+};
+
+int
+main(int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gchar *path, *data;
+  gsize size;
+  gssize n_records, i;
+
+  ctx = g_option_context_new("PRERECORD - look up keyframes in a prerecord seek index");
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &err))
+  {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+  g_option_context_free(ctx);
+
+  if (argc != 2)
+  {
+    g_printerr("usage: %s [-t SECONDS] PRERECORD\n", argv[0]);
+    return 1;
+  }
+
+  /* both the prerecord and its index are accepted */
+  if (g_str_has_suffix(argv[1], PRERECORD_INDEX_SUFFIX))
+    path = g_strdup(argv[1]);
+  else
+    path = g_strconcat(argv[1], PRERECORD_INDEX_SUFFIX, NULL);
+
+  if (!g_file_get_contents(path, &data, &size, &err))
+  {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+
+  n_records = prerecord_index_n_records((const guint8 *)data, size);
+  if (n_records < 0)
+  {
+    g_printerr("%s is not a prerecord seek index\n", path);
+    return 1;
+  }
+
+  if (seek_time < 0)
+  {
+    for (i = 0; i < n_records; i++)
+    {
+      const guint8 *record = prerecord_index_record((const guint8 *)data, i);
+
+      g_print("%.3f %" G_GUINT64_FORMAT "\n",
+              prerecord_index_read64(record) / 1e9, prerecord_index_read64(record + 8));
+    }
+  }
+  else
+  {
+    const guint8 *record;
+
+    i = prerecord_index_lookup((const guint8 *)data, n_records,
+                               (guint64)(seek_time * 1e9));
+    /* before the first keyframe the prerecord is played from its start */
+    if (i < 0 && n_records > 0)
+      i = 0;
+    if (i < 0)
+    {
+      g_printerr("%s has no keyframes\n", path);
+      return 1;
+    }
+
+    record = prerecord_index_record((const guint8 *)data, i);
+    g_print("%.3f %" G_GUINT64_FORMAT "\n",
+            prerecord_index_read64(record) / 1e9, prerecord_index_read64(record + 8));
+  }
+
+  g_free(data);
+  g_free(path);
+
+  return 0;
+}